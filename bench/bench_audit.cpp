@@ -0,0 +1,136 @@
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include <boost/program_options.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <rapidjson/document.h>
+
+#include "connection.h"
+
+namespace po = boost::program_options;
+
+using namespace std;
+
+
+//                              A U D I T  B E N C H M A R K
+
+// Measures the cost of auditing: runs the same point lookup against the
+// employees database without an audit observer, and then with audit
+// observers writing one record per insert and writing batches of various
+// sizes. For each run, reports executions per second on the audited
+// connection, and the time to drain the audit connection at teardown.
+
+struct BenchOptions
+{
+    string          database;
+    string          sqlDir;
+    string          auditTable;
+    string          user;
+    string          password;
+    string          host;
+    int             port;
+    int             iterations;
+    vector<int>     batchSizes;
+    string          durability;
+    string          mode;
+    string          spoolDirectory;
+};
+
+static void
+runBench(const BenchOptions & options, int batchSize)
+{
+    string employeesSql = options.sqlDir + "/employees.json";
+    string auditSql = options.sqlDir + "/audit.json";
+    posix_time::ptime startTime = posix_time::microsec_clock::universal_time();
+    posix_time::ptime endTime;
+    int errors = 0;
+    {
+        unique_ptr<MySqlConnection> conn = MySqlConnection::createConnection("bench",
+                                                                             options.database.c_str(),
+                                                                             employeesSql.c_str(),
+                                                                             options.user.c_str(),
+                                                                             options.password.c_str(),
+                                                                             options.host.c_str(),
+                                                                             options.port);
+        if (batchSize > 0)
+        {
+            rapidjson::Document auditParams;
+            auditParams.SetObject();
+            rapidjson::Document::AllocatorType & allocator = auditParams.GetAllocator();
+            auditParams.AddMember("database", Value(options.database.c_str(), allocator).Move(), allocator);
+            auditParams.AddMember("table_name", Value(options.auditTable.c_str(), allocator).Move(), allocator);
+            auditParams.AddMember("sql", Value(auditSql.c_str(), allocator).Move(), allocator);
+            auditParams.AddMember("batch_size", batchSize, allocator);
+            auditParams.AddMember("durability", Value(options.durability.c_str(), allocator).Move(), allocator);
+            auditParams.AddMember("mode", Value(options.mode.c_str(), allocator).Move(), allocator);
+            if (!options.spoolDirectory.empty())
+                auditParams.AddMember("spool_directory", Value(options.spoolDirectory.c_str(), allocator).Move(), allocator);
+            conn->addObserver("audit", AUDIT_OBS, &auditParams);
+        }
+
+        startTime = posix_time::microsec_clock::universal_time();
+        for (int i = 0; i < options.iterations; i++)
+        {
+            conn->execute("get_employee_by_emp_no", "audit benchmark", "emp_no", 10001 + i % 1000);
+            if (conn->getReturnCode() != 0) errors++;
+        }
+        endTime = posix_time::microsec_clock::universal_time();
+    }  // audit observer flushes, audit connection drains
+    posix_time::ptime drainedTime = posix_time::microsec_clock::universal_time();
+
+    double seconds = (endTime - startTime).total_microseconds() / 1e6;
+    double drainSeconds = (drainedTime - endTime).total_microseconds() / 1e6;
+    cout << (batchSize == 0 ? "unaudited" : "audited") << "\t"
+         << batchSize << "\t"
+         << options.iterations << "\t"
+         << (seconds > 0 ? options.iterations / seconds : 0) << "\t"
+         << drainSeconds << "\t"
+         << errors << endl;
+}
+
+int
+main(int argc, char ** argv)
+{
+    BenchOptions options;
+    string batchSizes;
+
+    po::options_description desc("Audit benchmark options");
+    desc.add_options()
+        ("help", "Show options")
+        ("database", po::value<string>(&options.database)->default_value("employees"), "Database containing the employees sample")
+        ("sql_dir", po::value<string>(&options.sqlDir)->default_value("."), "Directory containing employees.json and audit.json")
+        ("audit_table", po::value<string>(&options.auditTable)->default_value("audit_bench"), "Audit table to write")
+        ("user", po::value<string>(&options.user)->default_value(""), "MySQL user")
+        ("password", po::value<string>(&options.password)->default_value(""), "MySQL password")
+        ("host", po::value<string>(&options.host)->default_value("localhost"), "MySQL host")
+        ("port", po::value<int>(&options.port)->default_value(3306), "MySQL port")
+        ("iterations", po::value<int>(&options.iterations)->default_value(10000), "Executions per run")
+        ("batch_sizes", po::value<string>(&batchSizes)->default_value("1,10,100"), "Comma-separated audit batch sizes to compare")
+        ("durability", po::value<string>(&options.durability)->default_value("async"), "Audit durability: async, commit or sync")
+        ("mode", po::value<string>(&options.mode)->default_value("shared"), "Audit mode: shared, connection or spool")
+        ("spool_directory", po::value<string>(&options.spoolDirectory)->default_value(""), "Audit spool directory (spool mode)")
+    ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if (vm.count("help"))
+    {
+        cout << desc << endl;
+        return 0;
+    }
+
+    vector<string> batchSizeStrings;
+    boost::split(batchSizeStrings, batchSizes, boost::is_any_of(","));
+    for (vector<string>::const_iterator itr = batchSizeStrings.begin(); itr != batchSizeStrings.end(); ++itr)
+        options.batchSizes.push_back(atoi((*itr).c_str()));
+
+    cout << "mode\tbatch\texecutions\texec/sec\tdrain secs\terrors" << endl;
+    runBench(options, 0);
+    for (vector<int>::const_iterator itr = options.batchSizes.begin(); itr != options.batchSizes.end(); ++itr)
+        runBench(options, *itr);
+    return 0;
+}
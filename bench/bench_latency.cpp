@@ -0,0 +1,298 @@
+#include <climits>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include <boost/program_options.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <rapidjson/document.h>
+
+#include "connection.h"
+
+namespace po = boost::program_options;
+
+using namespace std;
+
+
+//                            L A T E N C Y  B E N C H M A R K
+
+// Measures how much of a server's latency the framework hides: runs point
+// lookups and salary inserts against a latency-injecting backend, which
+// delays each statement by a draw from a configurable distribution (and
+// can cap throughput and inject errors), in front of the loopback backend
+// or a MySQL server. Compares one synchronous connection, one async
+// connection, a pool of synchronous connections each on its own thread, a
+// pool of async connections driven by one thread, and batches of inserts.
+// For each run, reports rows per second, the seconds the calling thread was
+// busy submitting (all of the run, unless the connection is async), and
+// the total seconds.
+
+struct BenchOptions
+{
+    string          database;
+    string          sqlDir;
+    string          user;
+    string          password;
+    string          host;
+    int             port;
+    string          inner;
+    string          distribution;
+    double          meanUs;
+    double          stddevUs;
+    double          jitterUs;
+    double          errorRate;
+    double          maxQps;
+    int             maxConcurrent;
+    int             iterations;
+    vector<int>     poolSizes;
+    vector<int>     batchSizes;
+};
+
+// Sizes divide the iterations, so each must be a whole number of at least 1
+static bool
+parseSizes(const char * optionName, const string & sizes, vector<int> & result)
+{
+    vector<string> sizeStrings;
+    boost::split(sizeStrings, sizes, boost::is_any_of(","));
+    for (vector<string>::const_iterator itr = sizeStrings.begin(); itr != sizeStrings.end(); ++itr)
+    {
+        char * end = NULL;
+        long size = strtol(itr->c_str(), &end, 10);
+        if (itr->empty() || *end != '\0' || size < 1 || size > INT_MAX)
+        {
+            cerr << "Invalid size '" << *itr << "' in --" << optionName << ": sizes must be at least 1" << endl;
+            return false;
+        }
+        result.push_back(static_cast<int>(size));
+    }
+    return true;
+}
+
+static unique_ptr<MySqlConnection>
+openConnection(const BenchOptions & options, bool async)
+{
+    string employeesSql = options.sqlDir + "/employees.json";
+    unique_ptr<MySqlConnection> conn = MySqlConnection::createConnection("bench",
+                                                                         options.database.c_str(),
+                                                                         employeesSql.c_str(),
+                                                                         options.user.c_str(),
+                                                                         options.password.c_str(),
+                                                                         options.host.c_str(),
+                                                                         options.port,
+                                                                         NULL,
+                                                                         0,
+                                                                         async);
+    rapidjson::Document backendParams;
+    backendParams.SetObject();
+    rapidjson::Document::AllocatorType & allocator = backendParams.GetAllocator();
+    backendParams.AddMember("inner", Value(options.inner.c_str(), allocator).Move(), allocator);
+    backendParams.AddMember("distribution", Value(options.distribution.c_str(), allocator).Move(), allocator);
+    backendParams.AddMember("mean_us", options.meanUs, allocator);
+    backendParams.AddMember("stddev_us", options.stddevUs, allocator);
+    backendParams.AddMember("jitter_us", options.jitterUs, allocator);
+    backendParams.AddMember("error_rate", options.errorRate, allocator);
+    backendParams.AddMember("max_qps", options.maxQps, allocator);
+    backendParams.AddMember("max_concurrent", options.maxConcurrent, allocator);
+    conn->setBackend(LATENCY_BACKEND, &backendParams);
+    return boost::move(conn);
+}
+
+static void
+report(const char *            scenario,
+       int                     connections,
+       int                     batchSize,
+       int                     rows,
+       const posix_time::ptime & startTime,
+       const posix_time::ptime & submittedTime,
+       const posix_time::ptime & endTime,
+       int                     errors)
+{
+    double seconds = (endTime - startTime).total_microseconds() / 1e6;
+    double callerSeconds = (submittedTime - startTime).total_microseconds() / 1e6;
+    cout << scenario << "\t"
+         << connections << "\t"
+         << batchSize << "\t"
+         << rows << "\t"
+         << (seconds > 0 ? rows / seconds : 0) << "\t"
+         << callerSeconds << "\t"
+         << seconds << "\t"
+         << errors << endl;
+}
+
+static void
+runLookups(MySqlConnection * conn, int first, int count, int * errors)
+{
+    for (int i = first; i < first + count; i++)
+    {
+        conn->execute("get_employee_by_emp_no", "latency benchmark", "emp_no", 10001 + i % 1000);
+        if (conn->getReturnCode() != 0) (*errors)++;
+    }
+}
+
+static void
+runSync(const BenchOptions & options)
+{
+    unique_ptr<MySqlConnection> conn = openConnection(options, false);
+    int errors = 0;
+    posix_time::ptime startTime = posix_time::microsec_clock::universal_time();
+    runLookups(conn.get(), 0, options.iterations, &errors);
+    posix_time::ptime endTime = posix_time::microsec_clock::universal_time();
+    report("sync", 1, 1, options.iterations, startTime, endTime, endTime, errors);
+}
+
+// Every lookup is queued before any result is checked. One connection still
+// runs its statements one at a time, so async mode frees the caller without
+// raising throughput.
+static void
+runAsync(const BenchOptions & options)
+{
+    unique_ptr<MySqlConnection> conn = openConnection(options, true);
+    vector<MySqlConnection::ExecutionHandle> handles;
+    int errors = 0;
+    posix_time::ptime startTime = posix_time::microsec_clock::universal_time();
+    for (int i = 0; i < options.iterations; i++)
+        handles.push_back(conn->execute("get_employee_by_emp_no", "latency benchmark", "emp_no", 10001 + i % 1000));
+    posix_time::ptime submittedTime = posix_time::microsec_clock::universal_time();
+    for (vector<MySqlConnection::ExecutionHandle>::const_iterator itr = handles.begin(); itr != handles.end(); ++itr)
+        if (conn->getReturnCode(*itr) != 0) errors++;
+    posix_time::ptime endTime = posix_time::microsec_clock::universal_time();
+    report("async", 1, 1, options.iterations, startTime, submittedTime, endTime, errors);
+}
+
+// Each connection of the pool gets its own thread and an equal share of the
+// lookups
+static void
+runPool(const BenchOptions & options, int poolSize)
+{
+    vector<boost::shared_ptr<MySqlConnection> > pool;
+    for (int i = 0; i < poolSize; i++)
+        pool.push_back(boost::shared_ptr<MySqlConnection>(openConnection(options, false).release()));
+    vector<int> errors(poolSize, 0);
+    int share = options.iterations / poolSize;
+
+    posix_time::ptime startTime = posix_time::microsec_clock::universal_time();
+    boost::thread_group threads;
+    for (int i = 0; i < poolSize; i++)
+        threads.create_thread(boost::bind(runLookups, pool[i].get(), i * share, share, &errors[i]));
+    threads.join_all();
+    posix_time::ptime endTime = posix_time::microsec_clock::universal_time();
+
+    int totalErrors = 0;
+    for (int i = 0; i < poolSize; i++) totalErrors += errors[i];
+    report("pool", poolSize, 1, share * poolSize, startTime, endTime, endTime, totalErrors);
+}
+
+// One thread deals the lookups out to a pool of async connections
+static void
+runAsyncPool(const BenchOptions & options, int poolSize)
+{
+    vector<boost::shared_ptr<MySqlConnection> > pool;
+    for (int i = 0; i < poolSize; i++)
+        pool.push_back(boost::shared_ptr<MySqlConnection>(openConnection(options, true).release()));
+    vector<MySqlConnection::ExecutionHandle> handles;
+    int errors = 0;
+
+    posix_time::ptime startTime = posix_time::microsec_clock::universal_time();
+    for (int i = 0; i < options.iterations; i++)
+        handles.push_back(pool[i % poolSize]->execute("get_employee_by_emp_no", "latency benchmark", "emp_no", 10001 + i % 1000));
+    posix_time::ptime submittedTime = posix_time::microsec_clock::universal_time();
+    for (int i = 0; i < options.iterations; i++)
+        if (pool[i % poolSize]->getReturnCode(handles[i]) != 0) errors++;
+    posix_time::ptime endTime = posix_time::microsec_clock::universal_time();
+    report("async pool", poolSize, 1, options.iterations, startTime, submittedTime, endTime, errors);
+}
+
+// Inserts salaries in batches, each one statement, in a transaction that is
+// rolled back, so a run against a server leaves the salaries as they were.
+// Salaries start in 2100, a year per 1000 employees, so they don't collide.
+static void
+runBatches(const BenchOptions & options, int batchSize)
+{
+    unique_ptr<MySqlConnection> conn = openConnection(options, false);
+    int batches = options.iterations / batchSize;
+    int errors = 0;
+
+    posix_time::ptime startTime = posix_time::microsec_clock::universal_time();
+    conn->startTransaction("latency benchmark");
+    for (int batch = 0; batch < batches; batch++)
+    {
+        rapidjson::Document rows;
+        rows.SetArray();
+        rapidjson::Document::AllocatorType & allocator = rows.GetAllocator();
+        for (int i = batch * batchSize; i < (batch + 1) * batchSize; i++)
+        {
+            stringstream fromDate;
+            fromDate << 2100 + i / 1000 << "-01-01";
+            Value row(kObjectType);
+            row.AddMember("emp_no", 10001 + i % 1000, allocator);
+            row.AddMember("salary", 50000, allocator);
+            row.AddMember("from_date", Value(fromDate.str().c_str(), allocator).Move(), allocator);
+            row.AddMember("to_date", "9999-01-01", allocator);
+            rows.PushBack(row, allocator);
+        }
+        conn->executeJson("set_employee_salaries", "latency benchmark", &rows);
+        if (conn->getReturnCode() != 0) errors++;
+    }
+    stringstream reason;
+    reason << "latency benchmark";
+    conn->rollbackTransaction(reason);
+    posix_time::ptime endTime = posix_time::microsec_clock::universal_time();
+    report("batch", 1, batchSize, batches * batchSize, startTime, endTime, endTime, errors);
+}
+
+int
+main(int argc, char ** argv)
+{
+    BenchOptions options;
+    string poolSizes;
+    string batchSizes;
+
+    po::options_description desc("Latency benchmark options");
+    desc.add_options()
+        ("help", "Show options")
+        ("database", po::value<string>(&options.database)->default_value("employees"), "Database containing the employees sample")
+        ("sql_dir", po::value<string>(&options.sqlDir)->default_value("."), "Directory containing employees.json")
+        ("user", po::value<string>(&options.user)->default_value(""), "MySQL user")
+        ("password", po::value<string>(&options.password)->default_value(""), "MySQL password")
+        ("host", po::value<string>(&options.host)->default_value("localhost"), "MySQL host")
+        ("port", po::value<int>(&options.port)->default_value(3306), "MySQL port")
+        ("inner", po::value<string>(&options.inner)->default_value("loopback"), "Backend behind the injected latency: loopback or mysql")
+        ("distribution", po::value<string>(&options.distribution)->default_value("lognormal"), "Latency distribution: fixed, uniform, normal, lognormal or exponential")
+        ("mean_us", po::value<double>(&options.meanUs)->default_value(1000), "Mean statement latency, in microseconds")
+        ("stddev_us", po::value<double>(&options.stddevUs)->default_value(300), "Standard deviation of the statement latency, in microseconds")
+        ("jitter_us", po::value<double>(&options.jitterUs)->default_value(0), "Uniform jitter added to each latency, in microseconds")
+        ("error_rate", po::value<double>(&options.errorRate)->default_value(0), "Fraction of statements failing with an injected error")
+        ("max_qps", po::value<double>(&options.maxQps)->default_value(0), "Cap on statements started per second, across connections (0 = none)")
+        ("max_concurrent", po::value<int>(&options.maxConcurrent)->default_value(0), "Cap on statements in flight, across connections (0 = none)")
+        ("iterations", po::value<int>(&options.iterations)->default_value(2000), "Rows per run")
+        ("pool_sizes", po::value<string>(&poolSizes)->default_value("2,4,16"), "Comma-separated pool sizes to compare")
+        ("batch_sizes", po::value<string>(&batchSizes)->default_value("1,10,100"), "Comma-separated insert batch sizes to compare")
+    ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if (vm.count("help"))
+    {
+        cout << desc << endl;
+        return 0;
+    }
+    if (!parseSizes("pool_sizes", poolSizes, options.poolSizes) || !parseSizes("batch_sizes", batchSizes, options.batchSizes))
+        return 1;
+
+    cout << "scenario\tconnections\tbatch\trows\trows/sec\tcaller secs\ttotal secs\terrors" << endl;
+    runSync(options);
+    runAsync(options);
+    for (vector<int>::const_iterator itr = options.poolSizes.begin(); itr != options.poolSizes.end(); ++itr)
+        runPool(options, *itr);
+    for (vector<int>::const_iterator itr = options.poolSizes.begin(); itr != options.poolSizes.end(); ++itr)
+        runAsyncPool(options, *itr);
+    for (vector<int>::const_iterator itr = options.batchSizes.begin(); itr != options.batchSizes.end(); ++itr)
+        runBatches(options, *itr);
+    return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef __audit_codec_h__
+#define __audit_codec_h__
+
+#include <string>
+
+using std::string;
+
+
+//                                      A U D I T  C O D E C
+
+// Audit payloads (parameter settings and results, serialized as JSON) can be
+// stored compressed, in BLOB columns. A compressed payload starts with a codec
+// marker byte and the uncompressed length (4 bytes, little-endian), followed
+// by the compressed data. Payloads that aren't compressed are the JSON itself,
+// which starts with '{', so readers can tell the two apart.
+class AuditCodec
+{
+public:
+    enum Codec
+    {
+        NO_CODEC   = 0,
+        ZLIB_CODEC = 1
+    };
+
+    static const size_t HEADER_SIZE = 5;
+
+public:
+    static bool   getCodec(const string & codecName, Codec & codec);
+    static bool   encode(Codec codec, const char * data, size_t length, string & encoded);
+    static bool   decode(const char * data, size_t length, string & decoded);
+    static bool   isEncoded(const char * data, size_t length);
+};
+
+#endif // __audit_codec_h__
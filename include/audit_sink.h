@@ -0,0 +1,107 @@
+#ifndef __audit_sink_h__
+#define __audit_sink_h__
+
+#include <stdint.h>
+#include <set>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/lockfree/queue.hpp>
+
+#include "connection.h"
+
+
+//                                      A U D I T  S I N K
+
+// The process-wide writer of audit records for one audit database. Audit
+// observers push records onto a lock-free queue; a small, fixed number of
+// writer threads, each with its own connection, drain the queue and write the
+// records as multi-row inserts. Sinks are shared by every observer that audits
+// to the same database, with the same SQL dictionary and credentials, and are
+// closed, after writing what's queued, when the last of those observers goes.
+class AuditSink
+{
+public:
+    // What an observer writes to: its insert statements, the count of its
+    // records queued, and how far through them the writers have got, so that
+    // it can wait for its records
+    struct Target
+    {
+        Target(const string & insertStatement, const string & batchStatement);
+        bool                        isWritten(uint64_t position);
+
+        string                      insertStatement_;
+        string                      batchStatement_;  // empty if records are inserted one at a time
+        boost::atomic<uint64_t>     queued_;
+        uint64_t                    writtenThrough_;  // every record up to this position is written, or failed
+        std::set<uint64_t>          writtenAhead_;    // positions written while an earlier one was not
+        boost::mutex                mutex_;           // guards the two members above
+        boost::condition_variable   writtenCv_;
+    };
+
+    struct Record
+    {
+        Record(const boost::shared_ptr<Target> & target, bool isUrgent)
+        :   target_(target), position_(0), isUrgent_(isUrgent) {}
+
+        boost::shared_ptr<Target>   target_;
+        uint64_t                    position_;  // in the target's records, set when it is queued
+        rapidjson::Document         row_;       // arguments of the insert statement
+        bool                        isUrgent_;  // someone is waiting for it
+    };
+
+    struct Writer
+    {
+        unique_ptr<MySqlConnection> conn_;
+        boost::mutex                mutex_;  // held while the connection is in use
+        boost::thread               thread_;
+    };
+
+    static const int DEFAULT_WRITERS = 2;
+
+public:
+    static boost::shared_ptr<AuditSink> getSink(const char *               databaseName,
+                                                const char *               statementPath,
+                                                MySqlConnection *          conn,
+                                                int                        writers,
+                                                int                        batchSize,
+                                                posix_time::time_duration  flushInterval,
+                                                BackendType                backendType=MYSQL_BACKEND);
+    ~AuditSink();
+
+public:
+    uint64_t                    push(Record * record);
+    void                        waitForWritten(Target & target, uint64_t count);
+    void                        flush();
+    MySqlConnection *           lockSetupConnection(boost::unique_lock<boost::mutex> & lock);
+
+private:
+    AuditSink(int batchSize, posix_time::time_duration flushInterval);
+    int                         open(const char *       databaseName,
+                                     const char *       statementPath,
+                                     MySqlConnection *  conn,
+                                     int                writers,
+                                     BackendType        backendType);
+    void                        close();
+    void                        runWriter(Writer * writer);
+    void                        write(Writer * writer, std::vector<Record *> & records);
+
+private:
+    int                                      batchSize_;
+    posix_time::time_duration                flushInterval_;
+    std::vector<boost::shared_ptr<Writer> >  writers_;
+    boost::lockfree::queue<Record *>         queue_;
+    boost::atomic<int>                       pending_;      // records in the queue
+    boost::atomic<int>                       urgent_;       // records in the queue that someone is waiting for
+    posix_time::ptime                        oldestTime_;   // when the queue last became non-empty
+    bool                                     isFlushing_;   // write what's queued without waiting for a batch
+    bool                                     isRunning_;
+    boost::mutex                             idleMutex_;    // guards the three members above, and the waits on the counts
+    boost::condition_variable                idleCv_;
+};
+
+#endif // __audit_sink_h__
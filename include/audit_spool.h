@@ -0,0 +1,150 @@
+#ifndef __audit_spool_h__
+#define __audit_spool_h__
+
+#include <stdint.h>
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/container/list.hpp>
+
+#include "connection.h"
+
+
+//                                      A U D I T  F I E L D
+
+// One column of an audit record. Strings are not copied: the field points at
+// the caller's data, which must live until the record has been written.
+struct AuditField
+{
+    enum FieldType
+    {
+        NULL_FIELD,
+        INT_FIELD,
+        STRING_FIELD,
+        TIME_FIELD  // microseconds since 1970-01-01
+    };
+
+    AuditField() : type_(NULL_FIELD), data_(NULL), length_(0), value_(0) {}
+
+    void              setInt(int64_t value);
+    void              setString(const char * data, size_t length);
+    void              setTime(const posix_time::ptime & time);
+    bool              isNull() const  {  return type_ == NULL_FIELD; }
+    void              toValue(Value & value, Document::AllocatorType & allocator) const;
+
+    FieldType         type_;
+    const char *      data_;
+    uint32_t          length_;
+    int64_t           value_;
+};
+
+
+//                                      A U D I T  S P O O L
+
+// A local, append-only spool of audit records, so that recording an execution
+// costs a copy into memory instead of a round trip to the audit database.
+// The spool is a sequence of memory-mapped segment files, named
+// <name>.<number>.spool in the spool directory; when a record doesn't fit in
+// the current segment, the segment is sealed and a new one started. A shipper
+// thread reads the segments in order and writes their records to the audit
+// table in multi-row inserts, on the audit connection.
+//
+// Each segment's header holds the offset of the end of the last complete
+// record, and the offset of the end of the last record written to the audit
+// table. Both are in the mapped file, so after a restart the shipper carries
+// on from where it stopped; records are written at least once (a crash
+// between an insert and the header update writes them again). Fully-shipped
+// sealed segments are removed.
+class AuditSpool
+{
+public:
+    typedef std::vector<AuditField>  FieldList;
+
+    struct SegmentHeader
+    {
+        char          magic_[8];
+        uint32_t      fieldCount_;     // fields in each record
+        uint32_t      isSealed_;       // no more records will be appended
+        uint64_t      writeOffset_;    // end of the last complete record
+        uint64_t      shippedOffset_;  // end of the last record in the audit table
+    };
+
+    // A record is a RecordHeader, a FieldSlot per field, and then the field
+    // strings, padded to a multiple of 8 bytes
+    struct RecordHeader
+    {
+        uint32_t      length_;
+        uint32_t      fieldCount_;
+    };
+
+    struct FieldSlot
+    {
+        uint32_t      type_;
+        uint32_t      length_;
+        int64_t       value_;
+    };
+
+    struct Segment
+    {
+        Segment() : number_(0), fd_(-1), base_(NULL), size_(0) {}
+        SegmentHeader *  header() const  {  return reinterpret_cast<SegmentHeader *>(base_); }
+
+        unsigned      number_;
+        string        path_;
+        int           fd_;
+        char *        base_;
+        size_t        size_;
+    };
+    typedef boost::container::list<Segment> SegmentList;
+
+    static const size_t DATA_OFFSET = 64;  // records start after the segment header
+    static const size_t DEFAULT_SEGMENT_SIZE = 16 * 1024 * 1024;
+
+public:
+    AuditSpool(const string &               directory,
+               const string &               name,
+               size_t                       segmentSize,
+               const std::vector<string> &  columnNames,
+               MySqlConnection *            auditConn,
+               const string &               insertStatement,
+               int                          batchSize,
+               posix_time::time_duration    shipInterval);
+    ~AuditSpool();
+
+public:
+    int                         open();
+    int                         append(const FieldList & fields);
+    int                         sync();  // flush the current segment to disk
+    void                        close();
+
+private:
+    int                         openSegment(unsigned number, bool isNew, Segment & segment);
+    void                        closeSegment(Segment & segment, bool isRemove);
+    int                         rotate();  // caller holds mutex_
+    bool                        hasUnshipped() const;  // caller holds mutex_
+    int                         shipOldest();
+    void                        runShipper();
+    int                         reportError(const stringstream & errorMessage);
+
+private:
+    string                      directory_;
+    string                      name_;
+    size_t                      segmentSize_;
+    std::vector<string>         columnNames_;
+    MySqlConnection *           auditConn_;
+    string                      insertStatement_;
+    int                         batchSize_;
+    posix_time::time_duration   shipInterval_;
+
+    int                         lockFd_;         // excludes other processes from the spool
+    SegmentList                 segments_;       // oldest first, the last is being appended to
+    int                         pendingRecords_; // appended since the shipper last woke
+    mutable boost::mutex        mutex_;
+    boost::condition_variable   shipCv_;
+    boost::thread               shipThread_;
+    bool                        isShipperRunning_;
+};
+
+#endif // __audit_spool_h__
@@ -0,0 +1,39 @@
+#ifndef __audit_table_h__
+#define __audit_table_h__
+
+#include <boost/date_time/gregorian/gregorian.hpp>
+
+#include "connection.h"
+
+
+//                                      A U D I T  T A B L E
+
+// Manages the daily partitions of an audit table. create_audit_table makes the
+// table range-partitioned on start time, with a single catch-all partition,
+// p_future. Maintenance splits a partition for each day, named pYYYYMMDD, off
+// p_future, up to 'partitionsAhead' days ahead, and drops the partitions of
+// days more than 'retentionDays' ago (0 keeps them all). Tables created
+// before partitioning are left alone.
+class AuditTable
+{
+public:
+    AuditTable(const string & tableName, int partitionsAhead, int retentionDays);
+
+public:
+    int                maintain(MySqlConnection * auditConn, const gregorian::date & today);
+    bool               isPartitioned() const  {  return isPartitioned_; }
+    static string      getPartitionName(const gregorian::date & day);
+    static gregorian::date getPartitionDay(const string & partitionName);  // not_a_date_time if not a day
+
+private:
+    int                addPartition(MySqlConnection * auditConn, const gregorian::date & day);
+    int                dropPartition(MySqlConnection * auditConn, const string & partitionName);
+
+private:
+    string             tableName_;
+    int                partitionsAhead_;
+    int                retentionDays_;
+    bool               isPartitioned_;
+};
+
+#endif // __audit_table_h__
@@ -0,0 +1,417 @@
+#ifndef __backend_h__
+#define __backend_h__
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/move/unique_ptr.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <mysql.h>
+
+#include <rapidjson/document.h>
+
+#include "connection.h"
+#include "fixture.h"
+#include "result_store.h"
+
+using std::string;
+
+
+//                                B A C K E N D  S T A T E M E N T
+
+// A prepared statement on a backend. MySqlExecution drives it through an
+// execution, with the MYSQL_BIND arrays it sets up for the parameters and
+// the result columns. Methods returning int return 0 on success; after a
+// failure getErrorNo and getError describe it.
+class BackendStatement
+{
+public:
+    virtual                     ~BackendStatement() {}
+
+public:
+    virtual int                 prepare(const char * statementText, size_t length) = 0;
+    virtual unsigned long       getParamCount() = 0;
+    virtual unsigned int        getColumnCount() = 0;       // 0 if the statement returns no rows
+    virtual const MYSQL_FIELD * getColumn(unsigned int icol) = 0;
+    virtual int                 bindParameters(MYSQL_BIND * parameterBinds) = 0;
+    virtual int                 execute() = 0;
+    virtual uint64_t            getAffectedRows() = 0;
+    virtual int                 bindResults(MYSQL_BIND * columnBinds) = 0;
+    virtual int                 fetch() = 0;                // 0, MYSQL_DATA_TRUNCATED, MYSQL_NO_DATA, or 1 on error
+    virtual int                 fetchColumn(MYSQL_BIND * columnBind, unsigned int icol) = 0;
+    virtual void                freeResult() = 0;
+    virtual unsigned int        getErrorNo() = 0;
+    virtual const char *        getError() = 0;
+};
+
+
+//                                   M Y S Q L  B A C K E N D
+
+// What a connection talks to: the session (connect, transaction control,
+// cancelling a query from a side session) and the statements prepared on
+// it. The MySQL backend is libmysqlclient and a server; the loopback
+// backend answers in process, so the framework's own work -- the state
+// machine, binding, building results, observers -- can be run, benchmarked
+// and profiled without a server.
+class MySqlBackend
+{
+public:
+    static unique_ptr<MySqlBackend> createBackend(BackendType                 backendType,
+                                                  const rapidjson::Document * params,
+                                                  MySqlConnection *           conn);
+    virtual                     ~MySqlBackend() {}
+
+public:
+    virtual int                 connect(const char *  host,
+                                        const char *  user,
+                                        const char *  password,
+                                        const char *  databaseName,
+                                        int           port,
+                                        const char *  socket,
+                                        unsigned long flags,
+                                        unsigned int  readTimeout) = 0;
+    virtual void                close() = 0;
+    virtual int                 setAutoCommit(bool isAutoCommit) = 0;
+    virtual int                 commit() = 0;
+    virtual int                 rollback() = 0;
+    virtual unsigned long       getThreadId() = 0;          // the server's id for the session
+    virtual int                 query(const char * sql) = 0;
+    virtual BackendStatement *  createStatement() = 0;      // owned by the caller; NULL on failure
+    virtual unsigned int        getErrorNo() = 0;
+    virtual const char *        getError() = 0;
+};
+
+
+//                            M Y S Q L  C L I E N T  B A C K E N D
+
+class MySqlClientBackend : public MySqlBackend
+{
+public:
+    MySqlClientBackend();
+    virtual ~MySqlClientBackend();
+
+public:
+    virtual int                 connect(const char *  host,
+                                        const char *  user,
+                                        const char *  password,
+                                        const char *  databaseName,
+                                        int           port,
+                                        const char *  socket,
+                                        unsigned long flags,
+                                        unsigned int  readTimeout);
+    virtual void                close();
+    virtual int                 setAutoCommit(bool isAutoCommit);
+    virtual int                 commit();
+    virtual int                 rollback();
+    virtual unsigned long       getThreadId();
+    virtual int                 query(const char * sql);
+    virtual BackendStatement *  createStatement();
+    virtual unsigned int        getErrorNo();
+    virtual const char *        getError();
+
+    // Every thread that uses libmysqlclient has to initialize it
+    static void                 startThread();
+    static void                 endThread();
+
+private:
+    MYSQL *                     db_;
+    MYSQL *                     initialDb_;   // until connect succeeds, for its error
+};
+
+class MySqlClientStatement : public BackendStatement
+{
+public:
+    explicit MySqlClientStatement(MYSQL_STMT * statementHandle);
+    virtual ~MySqlClientStatement();
+
+public:
+    virtual int                 prepare(const char * statementText, size_t length);
+    virtual unsigned long       getParamCount();
+    virtual unsigned int        getColumnCount();
+    virtual const MYSQL_FIELD * getColumn(unsigned int icol);
+    virtual int                 bindParameters(MYSQL_BIND * parameterBinds);
+    virtual int                 execute();
+    virtual uint64_t            getAffectedRows();
+    virtual int                 bindResults(MYSQL_BIND * columnBinds);
+    virtual int                 fetch();
+    virtual int                 fetchColumn(MYSQL_BIND * columnBind, unsigned int icol);
+    virtual void                freeResult();
+    virtual unsigned int        getErrorNo();
+    virtual const char *        getError();
+
+private:
+    MYSQL_STMT *                statementHandle_;
+    MYSQL_RES *                 resultsMetadata_;   // NULL until asked for, or if there are no results
+    bool                        isMetadataFetched_;
+};
+
+
+//                               L O O P B A C K  B A C K E N D
+
+// Answers statements in process. A statement whose SQL text was captured
+// (params "captures": an array of capture files, with "result_store" for
+// captures that refer to stored result sets) gets the captured results,
+// rows affected or error, cycling through the captured executions of the
+// text in order. Any other query (SELECT, SHOW, ...) returns "rows"
+// synthetic rows (default 1) of "columns" (names and MySQL type codes,
+// default id LONG and name VAR_STRING), and any other statement affects
+// "rows_affected" rows (default 1).
+class LoopbackBackend : public MySqlBackend
+{
+public:
+    // One response to a statement, from a captured execution
+    struct Response
+    {
+        Response() : results_(NULL), rowsAffected_(0), errorNo_(0) {}
+
+        const rapidjson::Value * results_;      // NULL if the execution returned no rows
+        uint64_t                 rowsAffected_;
+        unsigned int             errorNo_;
+        string                   errorMessage_;
+    };
+
+    struct Synthetic
+    {
+        Synthetic() : rows_(1), rowsAffected_(1) {}
+
+        std::vector<string>          columnNames_;
+        std::vector<enum_field_types> columnTypes_;
+        int                          rows_;
+        uint64_t                     rowsAffected_;
+    };
+
+public:
+    LoopbackBackend(const rapidjson::Document * params, MySqlConnection * conn);
+    virtual ~LoopbackBackend();
+
+public:
+    virtual int                 connect(const char *  host,
+                                        const char *  user,
+                                        const char *  password,
+                                        const char *  databaseName,
+                                        int           port,
+                                        const char *  socket,
+                                        unsigned long flags,
+                                        unsigned int  readTimeout);
+    virtual void                close();
+    virtual int                 setAutoCommit(bool isAutoCommit);
+    virtual int                 commit();
+    virtual int                 rollback();
+    virtual unsigned long       getThreadId()  {  return threadId_; }
+    virtual int                 query(const char * sql)  {  return 0; }
+    virtual BackendStatement *  createStatement();
+    virtual unsigned int        getErrorNo()  {  return errorNo_; }
+    virtual const char *        getError()  {  return errorMessage_.c_str(); }
+
+    const Response *            getFirstResponse(const string & statementText) const;  // the first with results; NULL if none
+    const Response *            getNextResponse(const string & statementText);         // NULL if none
+    const Synthetic &           getSynthetic() const  {  return synthetic_; }
+    static enum_field_types     getColumnType(int capturedType);
+
+private:
+    void                        loadCapture(const string & path);
+
+private:
+    struct ResponseQueue
+    {
+        ResponseQueue() : next_(0) {}
+
+        std::vector<Response>   responses_;
+        size_t                  next_;
+    };
+    typedef std::map<string, ResponseQueue> ResponseMap;
+
+    MySqlConnection *           conn_;
+    ResponseMap                 responses_;      // by statement text
+    Synthetic                   synthetic_;
+    string                      resultStore_;
+    std::vector<boost::shared_ptr<const CaptureReader> > captures_;        // the responses refer to them
+    std::vector<boost::shared_ptr<const StoredResults> > storedResults_;
+    bool                        isConnected_;
+    bool                        isAutoCommit_;
+    unsigned long               threadId_;
+    unsigned int                errorNo_;
+    string                      errorMessage_;
+};
+
+class LoopbackStatement : public BackendStatement
+{
+public:
+    explicit LoopbackStatement(LoopbackBackend * backend);
+    virtual ~LoopbackStatement() {}
+
+public:
+    virtual int                 prepare(const char * statementText, size_t length);
+    virtual unsigned long       getParamCount()  {  return paramCount_; }
+    virtual unsigned int        getColumnCount()  {  return static_cast<unsigned int>(columns_.size()); }
+    virtual const MYSQL_FIELD * getColumn(unsigned int icol)  {  return &columns_[icol]; }
+    virtual int                 bindParameters(MYSQL_BIND * parameterBinds)  {  return 0; }
+    virtual int                 execute();
+    virtual uint64_t            getAffectedRows()  {  return rowsAffected_; }
+    virtual int                 bindResults(MYSQL_BIND * columnBinds);
+    virtual int                 fetch();
+    virtual int                 fetchColumn(MYSQL_BIND * columnBind, unsigned int icol);
+    virtual void                freeResult();
+    virtual unsigned int        getErrorNo()  {  return errorNo_; }
+    virtual const char *        getError()  {  return errorMessage_.c_str(); }
+
+private:
+    const rapidjson::Value *    getValue(unsigned int icol) const;    // of the current captured row; NULL if null
+    void                        storeValue(unsigned int icol, MYSQL_BIND * columnBind);
+    void                        storeSyntheticValue(unsigned int icol, MYSQL_BIND * columnBind);
+
+private:
+    LoopbackBackend *           backend_;
+    string                      statementText_;
+    unsigned long               paramCount_;
+    std::vector<string>         columnNames_;
+    std::vector<MYSQL_FIELD>    columns_;
+    MYSQL_BIND *                columnBinds_;
+    const rapidjson::Value *    rows_;           // captured rows of the current execution; NULL if synthetic
+    int                         rowCount_;
+    int                         currentRow_;     // -1 before the first fetch
+    std::vector<string>         rowStrings_;     // the current synthetic row's string values
+    uint64_t                    rowsAffected_;
+    unsigned int                errorNo_;
+    string                      errorMessage_;
+};
+
+
+//                                L A T E N C Y  B A C K E N D
+
+// Stands in for a server with a given latency profile, in front of another
+// backend: "inner" is "loopback" (the default) or "mysql", and is given the
+// same params. Each statement execution is delayed by a time drawn from the
+// statement's latency spec, and fails with an injected error at its error
+// rate, so that what async mode, pooling and batching hide can be measured
+// against a known latency.
+//
+// A latency spec is "distribution" (fixed, uniform, normal, lognormal or
+// exponential), "mean_us", "stddev_us", "min_us" and "max_us" (the bounds of
+// a draw, and the range of a uniform one), "jitter_us" (a uniform +/- added
+// to each draw), "error_rate" (0 to 1) and "error_no" (default
+// CR_SERVER_LOST). The spec in the params applies to every statement, except
+// those matched by an entry of "statements": an array of specs, each with a
+// "match" that is a substring of the SQL text, overriding the top-level
+// settings; the first match wins. Backends naming the same "server" share
+// its "max_qps" (executions started per second) and "max_concurrent"
+// (executions in flight) caps, as connections to one server would; the
+// first backend to name a server sets them.
+class LatencyBackend : public MySqlBackend
+{
+public:
+    struct LatencySpec
+    {
+        enum Distribution { FIXED, UNIFORM, NORMAL, LOGNORMAL, EXPONENTIAL };
+
+        LatencySpec();
+        void                    load(const rapidjson::Value & spec);
+
+        string                  match_;
+        Distribution            distribution_;
+        double                  meanUs_;
+        double                  stddevUs_;
+        double                  minUs_;
+        double                  maxUs_;         // 0 = unbounded
+        double                  jitterUs_;
+        double                  errorRate_;
+        unsigned int            errorNo_;
+    };
+
+    // The caps of a stand-in server
+    struct Server
+    {
+        Server() : maxQps_(0), maxConcurrent_(0), inFlight_(0) {}
+
+        boost::mutex              mutex_;
+        boost::condition_variable slotCv_;
+        double                    maxQps_;          // 0 = uncapped
+        int                       maxConcurrent_;   // 0 = uncapped
+        int                       inFlight_;
+        posix_time::ptime         nextStart_;       // the earliest start the qps cap allows
+    };
+
+public:
+    LatencyBackend(const rapidjson::Document * params, MySqlConnection * conn);
+    virtual ~LatencyBackend() {}
+
+public:
+    virtual int                 connect(const char *  host,
+                                        const char *  user,
+                                        const char *  password,
+                                        const char *  databaseName,
+                                        int           port,
+                                        const char *  socket,
+                                        unsigned long flags,
+                                        unsigned int  readTimeout);
+    virtual void                close()  {  inner_->close(); }
+    virtual int                 setAutoCommit(bool isAutoCommit)  {  return inner_->setAutoCommit(isAutoCommit); }
+    virtual int                 commit()  {  return inner_->commit(); }
+    virtual int                 rollback()  {  return inner_->rollback(); }
+    virtual unsigned long       getThreadId()  {  return inner_->getThreadId(); }
+    virtual int                 query(const char * sql)  {  return inner_->query(sql); }
+    virtual BackendStatement *  createStatement();
+    virtual unsigned int        getErrorNo()  {  return inner_->getErrorNo(); }
+    virtual const char *        getError()  {  return inner_->getError(); }
+
+    const LatencySpec &         getSpec(const string & statementText) const;
+    unsigned long               drawLatency(const LatencySpec & spec);          // microseconds
+    bool                        drawError(const LatencySpec & spec);
+    void                        startExecution();   // waits for the server's caps to allow it
+    void                        endExecution();
+
+    static BackendType          getInnerType(const rapidjson::Document * params);
+
+private:
+    static boost::shared_ptr<Server> getServer(const string & name, double maxQps, int maxConcurrent);
+
+private:
+    typedef std::map<string, boost::shared_ptr<Server> > ServerMap;
+
+    unique_ptr<MySqlBackend>    inner_;
+    LatencySpec                 defaultSpec_;
+    std::vector<LatencySpec>    statementSpecs_;
+    boost::shared_ptr<Server>   server_;
+    boost::random::mt19937      generator_;
+
+    static boost::mutex         serversMutex_;
+    static ServerMap            servers_;
+};
+
+class LatencyStatement : public BackendStatement
+{
+public:
+    LatencyStatement(LatencyBackend * backend, BackendStatement * inner);
+    virtual ~LatencyStatement()  {  delete inner_; }
+
+public:
+    virtual int                 prepare(const char * statementText, size_t length);
+    virtual unsigned long       getParamCount()  {  return inner_->getParamCount(); }
+    virtual unsigned int        getColumnCount()  {  return inner_->getColumnCount(); }
+    virtual const MYSQL_FIELD * getColumn(unsigned int icol)  {  return inner_->getColumn(icol); }
+    virtual int                 bindParameters(MYSQL_BIND * parameterBinds)  {  return inner_->bindParameters(parameterBinds); }
+    virtual int                 execute();
+    virtual uint64_t            getAffectedRows()  {  return inner_->getAffectedRows(); }
+    virtual int                 bindResults(MYSQL_BIND * columnBinds)  {  return inner_->bindResults(columnBinds); }
+    virtual int                 fetch()  {  return inner_->fetch(); }
+    virtual int                 fetchColumn(MYSQL_BIND * columnBind, unsigned int icol)  {  return inner_->fetchColumn(columnBind, icol); }
+    virtual void                freeResult()  {  inner_->freeResult(); }
+    virtual unsigned int        getErrorNo()  {  return errorNo_ != 0 ? errorNo_ : inner_->getErrorNo(); }
+    virtual const char *        getError()  {  return errorNo_ != 0 ? errorMessage_.c_str() : inner_->getError(); }
+
+private:
+    LatencyBackend *            backend_;
+    BackendStatement *          inner_;
+    const LatencyBackend::LatencySpec * spec_;   // set by prepare
+    unsigned int                errorNo_;        // of an injected error
+    string                      errorMessage_;
+};
+
+#endif // __backend_h__
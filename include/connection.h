@@ -1,15 +1,22 @@
 #ifndef __connection_h__
 #define __connection_h__
 
+#include <map>
+#include <vector>
+
 #include <rapidjson/document.h>
 
+#include <boost/atomic.hpp>
 #include <boost/function.hpp>
 #include <boost/thread.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/tss.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/container/vector.hpp>
 #include <boost/container/deque.hpp>
 #include <boost/unordered_map.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/move/unique_ptr.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/move/utility_core.hpp>
@@ -20,6 +27,8 @@
 #include <boost/log/sinks/sync_frontend.hpp>
 #include <boost/log/sinks/text_ostream_backend.hpp>
 
+#include "phase_clock.h"
+
 using std::string;
 using std::ostream;
 using std::stringstream;
@@ -49,6 +58,7 @@ class MySqlConnectionImpl;
 class MySqlExecution;
 class MySqlObserver;
 class ExecutionThread;
+class RequestScheduler;
 
 
 //                                   T Y P E D E F S  /  E N U M S
@@ -57,7 +67,27 @@ enum AuditEventType
 {
     AUDIT_EXECUTE = 1,
     AUDIT_COMMIT,
-    AUDIT_ROLLBACK
+    AUDIT_ROLLBACK,
+    AUDIT_START_TRANSACTION
+};
+
+// What's happening to a request for the execution thread, as reported to observers
+enum RequestEvent
+{
+    REQUEST_QUEUED,       // on the caller's thread
+    REQUEST_STARTED,      // on the execution thread, when the request is dequeued
+    REQUEST_COMPLETED
+};
+
+// In async mode, the execution thread serves higher classes first (by weight, see RequestScheduler).
+// A statement can declare its class in the SQL dictionary ("priority" : "interactive"), and a 
+// caller can override it per execution (executeWithPriority)
+enum ExecutionPriority
+{
+    DEFAULT_PRIORITY,     // take the priority from the SQL dictionary, or NORMAL if none
+    INTERACTIVE_PRIORITY,
+    NORMAL_PRIORITY,
+    BACKGROUND_PRIORITY
 };
 
 enum ObserverType
@@ -66,9 +96,97 @@ enum ObserverType
     PERFORMANCE_OBS,
     DEBUG_OBS,
     CAPTURE_OBS,
-    REPLAY_OBS
+    REPLAY_OBS,
+    TRACE_OBS
 };
 
+enum BackendType
+{
+    MYSQL_BACKEND = 1,   // libmysqlclient and a MySQL server
+    LOOPBACK_BACKEND,    // in process: captured or synthetic results
+    LATENCY_BACKEND      // another backend, behind injected latency and errors
+};
+
+
+//                                   E X E C U T I O N  R E G I S T R Y
+
+// The executions created on a connection, in order of creation and indexed
+// by handle. In async mode any number of application threads can add
+// executions while the execution thread looks them up, so lookups take the
+// registry mutex shared and insertions take it exclusive. Lookups hand out
+// shared pointers, so an execution being waited on or read can't be freed
+// by trimming. 
+class ExecutionRegistry
+{
+public:
+    typedef int ExecutionHandle;
+    typedef boost::container::vector<shared_ptr<MySqlExecution> >              ExecutionList;
+    typedef boost::unordered_map<ExecutionHandle, shared_ptr<MySqlExecution> > ExecutionMap;
+    typedef boost::function<bool(const MySqlExecution *)>                      ExecutionMatcher;
+    typedef std::map<boost::thread::id, ExecutionHandle>                       ThreadHandleMap;
+
+public:
+    ExecutionRegistry();
+    ~ExecutionRegistry();
+
+public:
+    void                                  add(MySqlExecution * execution);
+    shared_ptr<MySqlExecution>            find(ExecutionHandle xh) const;
+    shared_ptr<MySqlExecution>            findLast() const;
+    MySqlExecution *                      findLatest(const ExecutionMatcher & matcher) const;
+    size_t                                trim(size_t maxExecutions, const ExecutionMatcher & isRemovable);
+    bool                                  isRetired(ExecutionHandle xh) const;   // removed by trim
+    bool                                  empty() const;
+
+private:
+    ExecutionList                         executions_;
+    ExecutionMap                          index_;
+    mutable boost::shared_mutex           mutex_;
+    ExecutionHandle                       lastHandle_;        // last execution added by any thread
+    ExecutionHandle                       lastRetiredHandle_; // newest execution trim has removed
+    ThreadHandleMap                       threadLastHandles_; // last execution added by each thread; freed with the registry
+    
+};  // ExecutionRegistry
+
+
+//                                   C I R C U I T  B R E A K E R
+
+// Counts consecutive connection failures (can't connect, server gone, connection
+// lost). Past the threshold the breaker opens, and executions fail fast instead
+// of each waiting out a connect or read timeout. After the cool-down one trial
+// execution is let through (half-open): if it succeeds the breaker closes,
+// otherwise it opens again. 
+class CircuitBreaker
+{
+public:
+    enum State
+    {
+        CLOSED,
+        OPEN,
+        HALF_OPEN
+    };
+
+public:
+    CircuitBreaker();
+
+public:
+    void                      configure(int failureThreshold, unsigned int cooldownMs);  // threshold 0: disabled
+    bool                      isOpen() const;          // rejecting work now? (doesn't use up the trial)
+    bool                      allow();                 // may an execution go to the server?
+    bool                      record(int errorNo);     // outcome of an allowed execution; true if this opened the breaker
+    static bool               isConnectionError(int errorNo);
+
+private:
+    mutable boost::mutex      mutex_;
+    State                     state_;
+    int                       failureThreshold_;
+    boost::posix_time::time_duration cooldown_;
+    int                       failures_;
+    boost::posix_time::ptime  openedAt_;
+    bool                      isTrialRunning_;
+
+};  // CircuitBreaker
+
 
 //                                   M Y S Q L  C O N N E C T I O N
 
@@ -80,8 +198,9 @@ class MySqlConnection
     friend class ExecutionThread;
 
 public:
-    typedef int ExecutionHandle;
-    typedef boost::container::vector<shared_ptr<MySqlExecution> > ExecutionList;
+    typedef ExecutionRegistry::ExecutionHandle ExecutionHandle;
+    typedef ExecutionRegistry::ExecutionList ExecutionList;
+    typedef int RequestHandle;
     typedef boost::container::vector<unique_ptr<MySqlObserver> >  ObserverList;
 
     // In async mode, these codes identify requests queued for the execution thread  
@@ -97,6 +216,27 @@ public:
         KILL_THREAD_REQUEST
     };
 
+    // In async mode, what to do with an execution submitted when the queue is full
+    enum OverloadPolicy
+    {
+        BLOCK_WHEN_FULL,       // wait for room (fails fast if called from the execution thread)
+        FAIL_FAST,             // reject with QUEUE_FULL_ERROR
+        DROP_LOWEST_PRIORITY   // shed the newest queued execution of the lowest class below the new one's, else reject
+    };
+
+    // Work turned away under overload
+    struct OverloadStats
+    {
+        unsigned long rejected_;       // queue full
+        unsigned long shed_;           // dropped from the queue to make room for higher-priority work
+        unsigned long circuitOpen_;    // failed fast while the circuit breaker was open
+    };
+
+    static const int QUEUE_FULL_ERROR   = 9001;
+    static const int REQUEST_SHED_ERROR = 9002;
+    static const int CIRCUIT_OPEN_ERROR = 9003;
+    static const int RETIRED_HANDLE_ERROR = 9004;   // the execution was released under setExecutionRetention, or the request's outcome was dropped
+
     // First static to be initialized
     struct ConnInitializer
     {
@@ -141,12 +281,24 @@ public:
     void              startExecutionThread(); // if connection is async
     void              flushExecutionThread(RequestType requestType, int iparam = 0, const char * strparam = NULL);
     bool              isAsync() const {  return async_; }
+    RequestHandle     getLastRequest() const {  return lastRequest_.load(); }  // last transaction/program request queued
+    int               waitForRequest(RequestHandle rh = 0);
+    void              setTenant(const char * tenant);  // fair-queuing flow for executions queued by this thread
+    string            getTenant() const;
+    void              setPriorityWeight(ExecutionPriority priority, double weight);
+    void              setTenantWeight(const char * tenant, double weight);
+    void              setQueueLimit(size_t maxQueueDepth, OverloadPolicy policy = FAIL_FAST);  // async: 0 = unlimited
+    void              setCircuitBreaker(int failureThreshold, unsigned int cooldownMs);       // 0 = disabled
+    void              setExecutionRetention(size_t maxExecutions);                            // 0 = keep all
+    OverloadStats     getOverloadStats() const;
 
     ExecutionHandle   execute(const char * statementName, const char * comment,  ...);  // parameter name/value pairs
+    ExecutionHandle   executeWithPriority(ExecutionPriority priority, const char * statementName, const char * comment,  ...);
+    ExecutionHandle   executeWithTimeout(unsigned int timeoutMs, const char * statementName, const char * comment,  ...);
     ExecutionHandle   executeJson(const char * statementName, const char * comment,  const Document * paramSettings, ...);
     ExecutionHandle   doExecute(MySqlExecution * execution);
-    MySqlExecution *  getCompletedExecution(ExecutionHandle xh = 0);
-    MySqlExecution *  findExecution(ExecutionHandle xh = 0);
+    shared_ptr<MySqlExecution> getCompletedExecution(ExecutionHandle xh = 0);  // NULL, with the error reported, if unknown or retired
+    shared_ptr<MySqlExecution> findExecution(ExecutionHandle xh = 0);
     int               getReturnCode(ExecutionHandle xh = 0);
     const Document *  getResults(ExecutionHandle xh = 0);
     int               getRowCount(ExecutionHandle xh = 0);
@@ -159,7 +311,7 @@ public:
     int               startTransaction(const char * transactionName);
     int               commitTransaction();
     int               rollbackTransaction(const stringstream & reason);
-    const string &    getCurrentTransaction() const { return transactionName_; }
+    string            getCurrentTransaction() const;
     
     void              startProgram(const char * programName);
     void              endProgram(const char * programName);
@@ -167,6 +319,7 @@ public:
 
     void              addObserver(const char * observerName, ObserverType type, const rapidjson::Document * params=NULL);
     void              removeObserver(const char * observerName);
+    MySqlObserver *   getObserver(const char * observerName) const;  // NULL if there's no such observer
     bool              isReplay() const;
 
     int               reportError(const stringstream & errorMessage, int errorNo=1, ExecutionHandle xh=0);
@@ -178,6 +331,8 @@ public:
     int               open();
     bool              isOpen() const;
     void              close();
+    void              setReadTimeout(unsigned int seconds);  // client-side backstop, applied when the connection opens
+    int               setBackend(BackendType type, const rapidjson::Document * params=NULL);  // before the connection opens or queues a request
 
     const char *      getConnectionName() {  return name_.c_str(); }
     const char *      getUser() const;
@@ -192,16 +347,45 @@ public:
     static void                      setFileLog(const char * logPath);
     static loglevel::severity_level  getFileLoglevel() {  return fileLoglevel_; }
     static void                      setFileLoglevel(loglevel::severity_level loglevel);
+
+// transaction and program boundaries, applied by the execution thread in async mode
+private:
+    int               applyStartTransaction(int transactionId, const char * transactionName);
+    int               applyCommitTransaction(int transactionId);
+    int               applyRollbackTransaction(int transactionId, const string & reason);
+    void              applyStartProgram(const char * programName);
+    void              applyEndProgram(const char * programName);
+    int               endSubmittedTransaction();
+    bool              isAbortedTransaction(int transactionId) const;
+
+// overload handling
+private:
+    ExecutionHandle   rejectExecution(MySqlExecution * execution, int errorNo, const char * reason);
+    void              trimExecutions();
       
 private:
     string                           name_;
     string                           databaseName_;
     unique_ptr<MySqlConnectionImpl>  impl_;
-    ExecutionList                    executions_;
+    ExecutionRegistry                executions_;
+    size_t                           maxExecutions_;           // retention limit for executions_, 0 = none
+    CircuitBreaker                   breaker_;
+    boost::atomic<unsigned long>     rejectedCount_;
+    boost::atomic<unsigned long>     shedCount_;
+    boost::atomic<unsigned long>     circuitOpenCount_;
     ObserverList                     observers_;
     unique_ptr<ExecutionThread>      executionThread_;
     std::vector<string>              currentProgram_;
     string                           transactionName_;
+    int                              transactionId_;           // transaction in effect on the server
+    int                              abortedTransactionId_;    // rolled back by the execution thread after an error
+    string                           submittedTransaction_;    // async: transaction as queued by the caller
+    int                              submittedTransactionId_;
+    std::vector<string>              submittedPrograms_;       // async: programs as queued by the caller
+    std::map<boost::thread::id, string> tenants_;             // set by setTenant, by thread
+    int                              nextTransactionId_;
+    boost::atomic<RequestHandle>     lastRequest_;             // written by any submitting thread
+    mutable boost::mutex             contextMutex_;            // guards program, transaction and tenant state
     bool                             isTransactions_;
     bool                             async_;
     int                              errorNo_;
@@ -237,16 +421,24 @@ public:
         RequestSequence        sequence_;
         int                    iparam_;
         string                 strparam_;
+        ExecutionPriority      priority_;
+        string                 tenant_;
+        boost::thread::id      submitter_;   // the thread that queued it
+        bool                   isOrdered_;   // may not be reordered with requests queued before or after it
+        bool                   isShed_;      // dropped under overload: fail it without executing
+        double                 cost_;        // added to its flow's finish tag when it was scheduled
+        PhaseClock::Tick       queueTick_;   // when it was queued
         int                    rc_;
         int                    errorNo_;
         string                 errorMessage_; 
 
-        static RequestSequence nextRequestSequence_;           
+        static boost::atomic<RequestSequence> nextRequestSequence_;           
     };
 
-    typedef boost::container::deque<Request>               RequestQueue;
     typedef boost::unordered_map<RequestSequence, Request> RequestMap;
 
+    static const size_t MAX_COMPLETED_REQUESTS = 1024;  // uncollected transaction and program outcomes kept
+
 public:
     ExecutionThread(MySqlConnection * conn);
     ~ExecutionThread();
@@ -256,26 +448,115 @@ public:
     void                      run();
     void                      kill();
     RequestSequence           putRequest(RequestType type, int iparam=0, const char * strparam=NULL);
+    RequestSequence           putExecutionRequest(const MySqlExecution * execution, const string & tenant);
     Request                   waitForRequest(RequestSequence seq);
-    bool                      isCompleted(RequestSequence seq) { return lastCompletedRequest_ >= seq; }
+    void                      waitForExecution(const MySqlExecution & execution);
+    void                      setPriorityWeight(ExecutionPriority priority, double weight);
+    void                      setTenantWeight(const string & tenant, double weight);
+    void                      setQueueLimit(size_t maxQueueDepth, MySqlConnection::OverloadPolicy policy);
+    bool                      isExecutionThread() const { return boost::this_thread::get_id() == thread_.get_id(); }
 
 private:
+    RequestSequence           queueRequest(Request & request);
     Request                   getRequest();  
+    void                      notifyObservers(const Request & request, RequestEvent event, const MySqlExecution * execution);
 
 private:
     MySqlConnection *         conn_;
     boost::thread             thread_;
-    RequestQueue              requestQueue_;
+    unique_ptr<RequestScheduler> requestQueue_;
     boost::mutex              requestMutex_;
     boost::condition_variable requestCv_;
+    boost::condition_variable spaceCv_;       // BLOCK_WHEN_FULL submitters wait here for room
+    size_t                    maxQueueDepth_;
+    MySqlConnection::OverloadPolicy overloadPolicy_;
     boost::mutex              completionMutex_;
     boost::condition_variable completionCv_;
-    RequestMap                completedRequests_;
-    RequestSequence           lastCompletedRequest_;
+    RequestMap                completedRequests_;  // transaction and program requests only
+    boost::container::deque<RequestSequence> completionOrder_;
+    RequestSequence           retiredThrough_;     // completed requests up to this one have been dropped
     bool                      running_;
     
 };  // ExecutionThread
 
+
+//                                   R E Q U E S T  S C H E D U L E R
+
+// Orders the requests waiting for the execution thread. Executions are served
+// by start-time fair queuing over flows, a flow being one tenant's executions
+// in one priority class. Each request is stamped with a start tag: the later of
+// the current virtual time and the tag its flow last finished at. Serving it
+// advances the flow by 1/weight, the weight being the product of the class
+// weight and the tenant weight, and the smallest start tag is always served
+// next. A busy background flow therefore can't hold up an interactive lookup
+// by more than the request being served.
+//
+// Fair queuing only interleaves independent submitters: an execution is never
+// served before one its own thread queued earlier, so a thread that writes and
+// then reads (at a higher priority) still reads its write. Its start tag is at
+// least that of the thread's previous execution, and ties go to the earlier
+// sequence.
+//
+// Ordered requests (transaction and program boundaries, and executions inside 
+// a transaction) are barriers: one isn't served until everything queued before
+// it has been, and nothing queued after it is served before it. 
+//
+// Under overload (see MySqlConnection::setQueueLimit), executions can be shed:
+// they are moved to a list that is served first, so the execution thread can
+// fail them right away.
+class RequestScheduler
+{
+public:
+    typedef ExecutionThread::Request          Request;
+    typedef ExecutionThread::RequestSequence  RequestSequence;
+    typedef std::pair<double, RequestSequence> StartTag;
+    typedef std::pair<int, string>            FlowKey;
+
+    // executions queued between two barriers, and the barrier that ends them
+    struct Epoch
+    {
+        Epoch();
+
+        std::map<StartTag, Request>  requests_;
+        Request                      barrier_;
+        bool                         hasBarrier_;
+    };
+
+    typedef boost::container::deque<Epoch>         EpochQueue;
+    typedef boost::unordered_map<FlowKey, double> FlowMap;
+    typedef boost::unordered_map<string, double>  WeightMap;
+    typedef std::map<boost::thread::id, double>   SubmitterMap;
+
+public:
+    RequestScheduler();
+    ~RequestScheduler();
+
+public:
+    void                      put(const Request & request);
+    Request                   get();
+    bool                      empty() const { return size_ == 0; }
+    size_t                    size() const { return size_; }
+    size_t                    executionCount() const { return executionCount_; }
+    bool                      shedLowest(ExecutionPriority priority);
+    void                      setPriorityWeight(ExecutionPriority priority, double weight);
+    void                      setTenantWeight(const string & tenant, double weight);
+
+private:
+    double                    getWeight(const Request & request) const;
+
+private:
+    EpochQueue                epochs_;
+    boost::container::deque<Request> shed_;  // served ahead of everything, to be failed
+    FlowMap                   flowFinishTags_;
+    SubmitterMap              submitterStartTags_;   // start tag of each thread's last execution
+    WeightMap                 tenantWeights_;
+    double                    priorityWeights_[BACKGROUND_PRIORITY+1];
+    double                    virtualTime_;
+    size_t                    size_;
+    size_t                    executionCount_;  // executions queued and not shed
+
+};  // RequestScheduler
+
 ostream & operator<<(ostream & o, const ExecutionThread::Request & request);
 
 #endif // __connection_h__
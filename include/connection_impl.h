@@ -4,7 +4,14 @@
 #include <mysql.h>
 #include <rapidjson/document.h>
 
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "backend.h"
 #include "observer.h"
+#include "phase_clock.h"
 
 using namespace rapidjson;
 using namespace std;
@@ -38,12 +45,14 @@ public:
                         unsigned long     flags);
     ~MySqlConnectionImpl();
 
-    MYSQL *           getdb();
+    MySqlBackend *    getBackend();  // opens the connection; NULL if it can't
     const Document &  getStatements();
-    void              startMySqlThread();
+    bool              startMySqlThread();  // true if the thread is to call endMySqlThread
     void              endMySqlThread();
     ExecutionState    changeState(ExecutionState prevState);
     MySqlExecution *  findLivePriorExecution(MySqlExecution * execution) const;
+    static bool       isLivePriorExecution(const MySqlExecution * execution, const MySqlExecution * previousExecution);
+    static bool       isRetiredExecution(const MySqlExecution * execution);
     bool              isAutoCommit() const { return isAutoCommit_; }
     int               setAutoCommit(bool isAutoCommit);
     int               commit();
@@ -53,14 +62,26 @@ public:
     void              close();
     int               reportMySqlError(const stringstream & context);
     static void       printValue(const Value & value, ostream & outputStream);
+    void              setReadTimeout(unsigned int seconds) { readTimeout_ = seconds; }
+    int               setBackend(BackendType type, const rapidjson::Document * params);
+    void              armDeadline(const MySqlExecution * execution);
+    void              disarmDeadline(const MySqlExecution * execution);
+    bool              isCancelled(const MySqlExecution * execution);
 
 private:
     int               loadStatements();
     int               open();
+    bool              isClientBackend() const;   // whether the backend is, or is in front of, libmysqlclient
+    void              runWatchdog();
+    void              stopWatchdog();
+    bool              openKillBackend();
+    int               killQuery(unsigned long threadId);
 
 private:
     MySqlConnection *    conn_;
-    MYSQL *              db_;
+    unique_ptr<MySqlBackend> backend_;   // NULL until the connection opens
+    BackendType          backendType_;
+    Document             backendParams_;
     const char *         databaseName_;
     const char *         statementPath_;
     Document             statementDict_;
@@ -73,6 +94,21 @@ private:
     unsigned long        flags_;
     bool                 isOpen_;
     bool                 isAutoCommit_;
+    unsigned int         readTimeout_;
+
+    // deadline watchdog: cancels the armed execution on the server
+    // (through a side connection) if it runs past its deadline
+    boost::thread              watchdogThread_;
+    boost::mutex               watchdogMutex_;
+    boost::condition_variable  watchdogCv_;
+    bool                       watchdogRunning_;
+    PhaseClock::Tick           deadline_;          // steady clock
+    int                        watchedExecution_;
+    unsigned long              watchedThreadId_;
+    int                        cancelledExecution_;
+    bool                       isKilling_;         // KILL QUERY is being sent for the watched execution
+    boost::condition_variable  killedCv_;          // signalled when it has been
+    unique_ptr<MySqlBackend>   killBackend_;       // used by the watchdog thread only
 
     static MySqlLibrary  library_;
 
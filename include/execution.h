@@ -15,11 +15,13 @@
 #include <rapidjson/document.h>
 
 #include "connection.h"
+#include "phase_clock.h"
 
 using namespace boost;
 using namespace rapidjson;
 
 class MySqlConnectionImpl;
+class BackendStatement;
 
  
 //                                M Y S Q L  E X E C U T I O N
@@ -59,6 +61,8 @@ public:
     typedef boost::unordered_map<ExecutionState, StateFunction> StateFunctionMap;
     typedef ExecutionThread::RequestSequence RequestSequence;
 
+    static const int TIMEOUT_ERROR = 3024;  // same code as MySQL's ER_QUERY_TIMEOUT
+
 public:
     MySqlExecution(const char *          statementName,
 		   const char *          comment,
@@ -68,31 +72,55 @@ public:
     virtual ~MySqlExecution();
 
 public:
-    void              setParameterValues(const Document * args)     { argDoc_ = args; }
+    void              setParameterValues(const Document * args)     { argDoc_ = args; }  // object, or array of rows
+    int               getBatchSize() const                          { return batchSize_; }
     int               getHandle() const                             { return executionHandle_; }
     void              setRequestSequence(RequestSequence seq)       { requestSequence_ = seq; }
     RequestSequence   getRequestSequence() const                    { return requestSequence_; }
+    void              setRequestCompleted()                         { isRequestCompleted_ = true; }
+    bool              isRequestCompleted() const                    { return isRequestCompleted_; }
+    void              setTransactionId(int transactionId)           { transactionId_ = transactionId; }
+    int               getTransactionId() const                      { return transactionId_; }
+    void              setPriority(ExecutionPriority priority)       { priority_ = priority; }
+    ExecutionPriority getPriority() const                           { return priority_; }
+    void              setTimeout(unsigned int timeoutMs)            { timeoutMs_ = timeoutMs; }
+    const PhaseClock::Tick & getDeadline() const                    { return deadline_; }  // steady clock, unset if none
+    bool              isPastDeadline() const;
     int               prepareToExecute();
     int               execute();
     int               crankStateMachine(MySqlExecution::ExecutionState exitState=NO_STATE);
-    int               getReturnCode()                               { return rc_; }
+    int               getReturnCode() const                         { return rc_; }
     void              setState(ExecutionState newState)             { state_ = newState; }
-    bool              isTerminalState(ExecutionState state);
+    bool              isTerminalState(ExecutionState state) const;
+    static const char * getStateName(ExecutionState state);
     const string &    getStatementName() const                      { return statementName_; }
     const string &    getComment() const                            { return comment_; }
     const string &    getStatementText() const                      { return statementText_; } 
     const Document &  getSettings() const                           { return settings_; } 
     int               getRowCount() const                           { return rowCount_; }
     int               getRowsAffected() const                       { return rowsAffected_; }
+    bool              returnsRows() const                           { return returnsRows_; }  // false for writes
+    int               getErrorNo() const                            { return errorNo_; }
+    const string &    getErrorMessage() const                       { return errorMessage_; }
+    posix_time::ptime getStartTime() const                          { return PhaseClock::toLocalTime(startTick_); }
+    posix_time::ptime getExecuteTime() const                        { return PhaseClock::toLocalTime(executeTick_); }
+    posix_time::ptime getRetrieveTime() const                       { return PhaseClock::toLocalTime(retrieveTick_); }
+    posix_time::ptime getCompleteTime() const                       { return PhaseClock::toLocalTime(completeTick_); }
+    PhaseDurations    getPhaseDurations() const;
+    const PhaseClock::Tick & getStartTick() const                   { return startTick_; }
     const Document &  getResults() const                            { return results_; }
     Document &        getResults()                                  { return results_; }          
-    int               reportMySqlError(MYSQL_STMT * statementHandle, const stringstream & context);
+    int               reportMySqlError(const stringstream & context);  // the statement's error
     int               reportError(const stringstream & errorMessage, int errorNo=1);
     int               reportError(const string & errorMessage, int errorNo=1);
+    int               reportTimeout(const char * context);
     const Document &  asJson();
     void              toJson();
     bool              isSameStatementAs(const MySqlExecution * otherExec) const;
     bool              isSameAs(const Value & execDom, stringstream & errorMessage) const;
+    bool              isSameAs(const char * statementName, size_t statementNameLength,
+                               const char * statementText, size_t statementTextLength,
+                               stringstream & errorMessage) const;
     void              moveFrom(MySqlExecution * previousExecution);
     int               close(bool isReusable);
     void              cleanup();
@@ -101,6 +129,8 @@ public:
 private:
     int               validateStatement();       // INITIAL_STATE
     int               createSettings();          // STATEMENT_VALID_STATE
+    int               createBatchSettings();
+    int               setParameterValue(Value & setting, const Value & argValue);
     int               generateStatementText();   // SETTINGS_CREATED_STATE
     int               createPreparedStatement(); // SQL_GENERATED_STATE
     int               prepareToBind();           // MYSQL_STMT_CREATED
@@ -109,7 +139,7 @@ private:
     int               retrieveResults();         // EXECUTION_COMPLETE_STATE
 
     int               bindParameter(const Value & binding, MYSQL_BIND * parameterBind, char *& buffer);
-    int               bindColumn(MYSQL_FIELD * fieldDescriptor, MYSQL_BIND * columnBind, char *& buffer);
+    int               bindColumn(const MYSQL_FIELD * fieldDescriptor, MYSQL_BIND * columnBind, char *& buffer);
     int               storeResultRow();
     char *            getBlobBuffer(int size);
     int               stringToMySqlTime(const char * timeString, enum enum_field_types typeCode, MYSQL_TIME * mysqlTime);
@@ -124,11 +154,17 @@ public:
 private:
     int                   executionHandle_;
     RequestSequence       requestSequence_;  // assigned by execution thread if connection is async
+    bool                  isRequestCompleted_;  // async: the execution thread is done with it; under its completion mutex
+    int                   transactionId_;    // async: transaction the execution was queued in, or 0
+    ExecutionPriority     priority_;         // async: scheduling class on the execution thread
+    unsigned int          timeoutMs_;        // 0: take 'timeout_ms' from the SQL dictionary, if any
+    PhaseClock::Tick      deadline_;         // submission time + timeout, on the steady clock so clock changes don't move it
     string                statementName_;
     string                comment_;
     va_list &             args_;
     const Document *      argDoc_;
-    MYSQL_STMT *          statementHandle_;
+    int                   batchSize_;        // rows in a multi-row execution, 0 if not a batch
+    BackendStatement *    statementHandle_;
     string                statementText_;
     rapidjson::Document   dom_;
     bool                  isAutoCommit_;  // false if part of a transaction
@@ -143,7 +179,7 @@ private:
     char *                paramBuffer_;
     int                   paramBufferLen_;
     
-    MYSQL_RES *           resultsMetadata_;
+    bool                  returnsRows_;
     MYSQL_BIND *          columnBindArray_;
     int                   columnCount_;
     char *                rowBuffer_;
@@ -157,12 +193,13 @@ private:
     MySqlConnection *     conn_;
     MySqlConnectionImpl * connImpl_;
 
-    posix_time::ptime     startTime_;
-    posix_time::ptime     executeTime_;
-    posix_time::ptime     retrieveTime_;
-    posix_time::ptime     completeTime_;
+    // steady-clock ticks; converted to wall-clock time only when needed
+    PhaseClock::Tick      startTick_;
+    PhaseClock::Tick      executeTick_;
+    PhaseClock::Tick      retrieveTick_;
+    PhaseClock::Tick      completeTick_;
 
-    static int            nextExecutionHandle_;
+    static boost::atomic<int> nextExecutionHandle_;
     static my_bool        mysqlTrue_;
     static my_bool        mysqlFalse_;
 }; 
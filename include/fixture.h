@@ -0,0 +1,206 @@
+#ifndef __fixture_h__
+#define __fixture_h__
+
+#include <stdint.h>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <rapidjson/document.h>
+
+using std::string;
+
+
+//                                        F I X T U R E
+
+// A replay fixture is the compact, binary form of a capture file: the
+// executions of one program, keeping only what replay uses (statement name
+// and text, a hash of the parameters, state, return code, row counts,
+// results and error). It starts with a header:
+//
+//     magic "MCATFIX\0", version (uint32), execution count (uint32),
+//     string count (uint32), string table offset (uint64)
+//
+// followed by one length-prefixed record per execution, and a string table
+// at the end. Statement names and texts, column names and the keys of
+// nested objects (such as the parts of a date) are stored once in the
+// string table and referred to by index. Results are stored as a column
+// list followed by the rows, each a typed value per column, so column names
+// aren't repeated in every row; results captured into a ResultStore are
+// stored as their digest instead. Integers are little-endian. Strings are
+// stored with a terminating NUL (not counted in their length), so that a
+// reader can use them where they lie.
+class Fixture
+{
+public:
+    static const char         MAGIC[8];
+    static const uint32_t     VERSION = 4;
+    static const uint32_t     MIN_VERSION = 3;     // the oldest version readers accept
+    static const size_t       HEADER_SIZE = 28;
+
+    // The tag before each value
+    enum ValueTag
+    {
+        NULL_TAG   = 0,
+        FALSE_TAG  = 1,
+        TRUE_TAG   = 2,
+        INT64_TAG  = 3,
+        UINT64_TAG = 4,
+        DOUBLE_TAG = 5,
+        STRING_TAG = 6,
+        ARRAY_TAG  = 7,
+        OBJECT_TAG = 8,
+        ABSENT_TAG = 9     // a column missing from a row
+    };
+
+    // Which optional members an execution record has
+    enum RecordFlags
+    {
+        HAS_ROWS_RETURNED = 0x01,
+        HAS_ROWS_AFFECTED = 0x02,
+        HAS_RESULTS       = 0x04,
+        HAS_ERROR         = 0x08,
+        TABULAR_RESULTS   = 0x10,   // columns and rows; otherwise a generic value
+        RESULTS_REF       = 0x20    // the digest of results in a ResultStore (version 4)
+    };
+};
+
+
+//                                 F I X T U R E  W R I T E R
+
+// Writes a fixture, one execution (in the JSON form of a capture file) at a
+// time. The file is written under a temporary name and renamed by close().
+class FixtureWriter
+{
+public:
+    FixtureWriter();
+    ~FixtureWriter();
+
+public:
+    bool                      open(const string & path, string & errorMessage);
+    bool                      write(const rapidjson::Value & execution, string & errorMessage);
+    bool                      close(string & errorMessage);
+    uint32_t                  getExecutionCount() const  {  return executionCount_; }
+
+private:
+    uint32_t                  internString(const char * str, size_t length);
+    void                      encodeValue(const rapidjson::Value & value, string & record);
+    bool                      encodeResults(const rapidjson::Value & results, string & record);
+    bool                      writeBytes(const char * data, size_t length);
+
+private:
+    FILE *                    file_;
+    string                    path_;
+    string                    tmpPath_;
+    std::map<string, uint32_t> stringIds_;
+    std::vector<const string *> strings_;  // the keys of stringIds_, by id
+    uint32_t                  executionCount_;
+    uint64_t                  offset_;
+};
+
+
+//                                 F I X T U R E  R E A D E R
+
+// The members of an execution record. The strings point into the fixture.
+struct FixtureExecution
+{
+    FixtureExecution();
+
+    const char *              statementName_;
+    size_t                    statementNameLength_;
+    const char *              statementText_;
+    size_t                    statementTextLength_;
+    int                       state_;
+    int                       rc_;
+    uint64_t                  parameterHash_;     // see ReplayKey
+    uint8_t                   flags_;
+    int64_t                   rowsReturned_;
+    int64_t                   rowsAffected_;
+    int                       errorNo_;
+    const char *              errorMessage_;
+    size_t                    errorMessageLength_;
+    size_t                    resultsOffset_;     // in the fixture
+    size_t                    resultsLength_;
+    const char *              resultsRef_;        // a ResultStore digest, or NULL
+    size_t                    resultsRefLength_;
+};
+
+// Maps a fixture into memory (read-only) and indexes its records. Records
+// are decoded on demand, and strings in decoded results are references into
+// the mapping rather than copies, so the reader must outlive them (readers
+// are normally kept by the ReplayCache, for the life of the process).
+class FixtureReader : private boost::noncopyable
+{
+public:
+    FixtureReader();
+    ~FixtureReader();
+
+public:
+    bool                      open(const string & path, string & errorMessage);
+    size_t                    getExecutionCount() const  {  return records_.size(); }
+    bool                      getExecution(size_t executionIndex, FixtureExecution & execution, string & errorMessage) const;
+    bool                      getResults(const FixtureExecution &             execution,
+                                         rapidjson::Value &                   results,
+                                         rapidjson::Document::AllocatorType & allocator,
+                                         string &                             errorMessage) const;
+
+private:
+    void                      close();
+
+private:
+    const char *              data_;      // the mapping
+    size_t                    size_;
+    std::vector<std::pair<const char *, size_t> > strings_;            // the string table
+    std::vector<std::pair<size_t, size_t> > records_;  // offset and length of each record
+};
+
+
+//                                 C A P T U R E  R E A D E R
+
+// A capture file, parsed in place (rapidjson's in-situ parse) in a buffer
+// that holds the whole file, so its strings aren't copied; as with a
+// FixtureReader, the strings of results copied from it refer to the buffer.
+class CaptureReader : private boost::noncopyable
+{
+public:
+    bool                      open(const string & path, string & errorMessage);
+    size_t                    getExecutionCount() const  {  return getExecutions().Size(); }
+    const rapidjson::Value &  getExecutions() const  {  return document_["executions"]; }
+
+    static bool               readFile(const string & path, std::vector<char> & buffer, string & errorMessage);
+
+private:
+    std::vector<char>         buffer_;
+    rapidjson::Document       document_;
+};
+
+
+//                                   R E P L A Y  C A C H E
+
+// The fixtures and capture files opened for replay, kept for the life of the
+// process so that a test binary reads each only once, however many tests
+// replay it, and so that results referring to them stay valid. A file is
+// read again if its size or modification time has changed.
+class ReplayCache
+{
+public:
+    static boost::shared_ptr<const FixtureReader> getFixture(const string & path, string & errorMessage);
+    static boost::shared_ptr<const CaptureReader> getCapture(const string & path, string & errorMessage);
+
+private:
+    typedef std::map<string, boost::shared_ptr<const FixtureReader> > FixtureMap;
+    typedef std::map<string, boost::shared_ptr<const CaptureReader> > CaptureMap;
+
+    static bool               getKey(const string & path, string & key);
+
+    static boost::mutex       mutex_;
+    static FixtureMap         fixtures_;  // by path, size and modification time
+    static CaptureMap         captures_;
+};
+
+#endif // __fixture_h__
@@ -1,21 +1,184 @@
 #ifndef __mysql_gtest_h__
 #define __mysql_gtest_h__
 
+#include <cstdlib>
 #include <iostream>
+#include <map>
+#include <new>
+#include <vector>
 
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <boost/atomic.hpp>
 #include <boost/program_options.hpp>
 
 #include <rapidjson/document.h>
+#include <rapidjson/filewritestream.h>
+#include <rapidjson/writer.h>
 
 #include "mysql_client_at/include/connection.h"
+#include "mysql_client_at/include/observer.h"
 
 namespace po = boost::program_options;
 
 using std::cerr;
 
+
+//                          A L L O C A T I O N  C O U N T E R
+
+// Counts the allocations made through operator new, for the benchmark
+// report. Replacing operator new affects the whole binary, so it's opt-in:
+// define MYSQL_GTEST_ALLOCATION_COUNT before including this header (which a
+// test binary includes once, so the replacements are defined once).
+static boost::atomic<uint64_t> mysqlGtestAllocations(0);
+
+#ifdef MYSQL_GTEST_ALLOCATION_COUNT
+void *
+operator new(std::size_t size)
+{
+    mysqlGtestAllocations.fetch_add(1, boost::memory_order_relaxed);
+    void * p = malloc(size == 0 ? 1 : size);
+    if (p == NULL) throw std::bad_alloc();
+    return p;
+}
+
+void
+operator delete(void * p) throw()
+{
+    free(p);
+}
+#endif
+
+
+//                         M Y S Q L  B E N C H M A R K
+
+// With --benchmark N, gtest runs every test N times (as with
+// --gtest_repeat), in unit mode (replay: the client's own overhead) or
+// integration mode (end to end). This listener times each run of each test,
+// including its SetUp and TearDown, and counts its allocations (if they're
+// counted); MySqlGtest adds a performance observer to the connection and
+// hands its per-statement stats to the listener after each test. Only the
+// first run of an integration test is captured. When the tests are done, the
+// listener writes a JSON report (sorted by name, so reports of two builds
+// can be diffed) to the --benchmark_out file.
+class MySqlBenchmark : public ::testing::EmptyTestEventListener
+{
+public:
+    MySqlBenchmark(const string & reportPath, const string & testType, int runs)
+    :   reportPath_(reportPath), testType_(testType), runs_(runs), iteration_(0), allocationsAtStart_(0) {}
+
+public:
+    virtual void          OnTestIterationStart(const ::testing::UnitTest & unitTest, int iteration)
+    {
+        iteration_ = iteration;
+    }
+
+    virtual void          OnTestStart(const ::testing::TestInfo & testInfo)
+    {
+        allocationsAtStart_ = mysqlGtestAllocations.load(boost::memory_order_relaxed);
+        startTick_ = PhaseClock::now();
+    }
+
+    virtual void          OnTestEnd(const ::testing::TestInfo & testInfo)
+    {
+        PhaseClock::Tick endTick = PhaseClock::now();
+        uint64_t allocations = mysqlGtestAllocations.load(boost::memory_order_relaxed) - allocationsAtStart_;
+        TestStats & stats = tests_[string(testInfo.test_case_name()) + "." + testInfo.name()];
+        int64_t microseconds = PhaseClock::getMicroseconds(startTick_, endTick);
+        stats.latency_.record(microseconds);
+        stats.totalUs_ += microseconds;
+        stats.allocations_ += allocations;
+        if (testInfo.result() != NULL && testInfo.result()->Failed()) stats.failures_++;
+    }
+
+    virtual void          OnTestProgramEnd(const ::testing::UnitTest & unitTest)
+    {
+        writeReport();
+    }
+
+    void                  recordStatements(const PerformanceSnapshot & snapshot)
+    {
+        statements_.merge(snapshot);
+    }
+
+    bool                  isFirstRun() const  {  return iteration_ == 0; }
+
+private:
+    struct TestStats
+    {
+        TestStats() : failures_(0), allocations_(0), totalUs_(0) {}
+
+        LatencyHistogram  latency_;
+        uint64_t          failures_;
+        uint64_t          allocations_;
+        int64_t           totalUs_;
+    };
+    typedef std::map<string, TestStats> TestStatsMap;
+
+    void                  writeReport() const
+    {
+        rapidjson::Document report;
+        statements_.toJson(report);
+        rapidjson::Document::AllocatorType & allocator = report.GetAllocator();
+        report.AddMember("test_type", rapidjson::Value(testType_.c_str(), testType_.size(), allocator).Move(), allocator);
+        report.AddMember("runs", runs_, allocator);
+
+        rapidjson::Value tests(rapidjson::kObjectType);
+        for (TestStatsMap::const_iterator itr = tests_.begin(); itr != tests_.end(); ++itr)
+        {
+            const TestStats & stats = itr->second;
+            uint64_t runs = stats.latency_.getCount();
+            rapidjson::Value test(rapidjson::kObjectType);
+            rapidjson::Value latency;
+            stats.latency_.toJson(latency, allocator);
+            test.AddMember("runs", runs, allocator);
+            test.AddMember("failures", stats.failures_, allocator);
+            test.AddMember("runs_per_sec", stats.totalUs_ > 0 ? runs * 1000000.0 / stats.totalUs_ : 0.0, allocator);
+#ifdef MYSQL_GTEST_ALLOCATION_COUNT
+            test.AddMember("allocations_per_run", runs > 0 ? static_cast<double>(stats.allocations_) / runs : 0.0, allocator);
+#endif
+            test.AddMember("latency", latency, allocator);
+            tests.AddMember(rapidjson::Value(itr->first.c_str(), itr->first.size(), allocator).Move(), test, allocator);
+        }
+        report.AddMember("tests", tests, allocator);
+
+        FILE * fp = fopen(reportPath_.c_str(), "w");
+        if (!fp)
+        {
+            perror(("Unable to open " + reportPath_).c_str());
+            return;
+        }
+        char writeBuffer[65536];
+        rapidjson::FileWriteStream os(fp, writeBuffer, sizeof(writeBuffer));
+        rapidjson::Writer<rapidjson::FileWriteStream> writer(os);
+        report.Accept(writer);
+        os.Flush();
+        fclose(fp);
+        cout << "Benchmark report written to " << reportPath_ << endl;
+    }
+
+private:
+    string                reportPath_;
+    string                testType_;
+    int                   runs_;
+    int                   iteration_;       // of gtest's repeats, from 0
+    TestStatsMap          tests_;
+    PerformanceSnapshot   statements_;
+    PhaseClock::Tick      startTick_;
+    uint64_t              allocationsAtStart_;
+};
+
 //                              M Y S Q L  G T E S T
 
-// Derive 
+// Derive a test fixture from MySqlGtest (and ::testing::Test). Each test
+// gets its own connection, with its own capture or replay observer, which
+// tearDownMySqlTest closes, so tests share nothing but the (read-only) test
+// input and fixtures. That lets gtest sharding (GTEST_TOTAL_SHARDS,
+// GTEST_SHARD_INDEX) split a suite across processes or machines, and
+// --parallel N runs a unit test binary as N worker processes, one shard
+// each.
 class MySqlGtest
 {
 public:
@@ -24,24 +187,34 @@ public:
     static void                        tearDownMySqlTestCase();
     virtual void                       setUpMySqlTest();
     virtual void                       tearDownMySqlTest();
+    static string                      getWorkerPath(const string & path);
+
+private:
+    void                               openConnection();
+    static int                         runWorkers(char ** argv, int workers);
 
 public:
     static string                      testType_;
     static string                      testInputPath_;
     static rapidjson::Document         testInputDoc_;
     static string                      logPath_;
-    static string                      currentProgram_;
+    static string                      fixtureDir_;     // of capture files and fixtures, "" for the current directory
+    static string                      testCaseName_;
     static bool                        debug_;
-    static unique_ptr<MySqlConnection> conn_;
+    static MySqlBenchmark *            benchmark_;      // NULL unless --benchmark; owned by gtest
+
+    unique_ptr<MySqlConnection>        conn_;           // the test's connection
+    string                             currentProgram_;
 }; 
 
 string                      MySqlGtest::testType_;
 string                      MySqlGtest::testInputPath_;
 rapidjson::Document         MySqlGtest::testInputDoc_;
 string                      MySqlGtest::logPath_;
-string                      MySqlGtest::currentProgram_;
+string                      MySqlGtest::fixtureDir_;
+string                      MySqlGtest::testCaseName_;
 bool                        MySqlGtest::debug_ = false;
-unique_ptr<MySqlConnection> MySqlGtest::conn_;
+MySqlBenchmark *            MySqlGtest::benchmark_ = NULL;
 
 template<typename T>
 void
@@ -49,10 +222,14 @@ MySqlGtest::analyzeProgramOptions(int argc, char ** argv)
 {
     po::options_description desc("Test options");
     desc.add_options()
-        ("test_type", po::value<string>()->default_value("integration"), "either \'integration\' (connects to database) or \'unit\'")
+        ("test_type", po::value<string>()->default_value("integration"), "\'integration\' (connects to database), \'unit\' (replays captures) or \'loopback\' (captures served by the loopback backend)")
         ("test_input", po::value<string>(), "JSON file containing test inputs")
         ("log_file", po::value<string>(), "Path of log file")
+        ("fixture_dir", po::value<string>(), "Directory of capture files and fixtures (default: the current directory)")
         ("debug", "Generate trace")
+        ("parallel", po::value<int>(), "Unit and loopback tests: run the tests in N worker processes, 0 for one per core")
+        ("benchmark", po::value<int>(), "Run each test N times, and report latency, allocations and throughput")
+        ("benchmark_out", po::value<string>()->default_value("benchmark.json"), "JSON file for the benchmark report")
     ;
 
     po::variables_map vm;
@@ -62,7 +239,7 @@ MySqlGtest::analyzeProgramOptions(int argc, char ** argv)
     if (vm.count("test_type")) 
     {
         const string & testType = vm["test_type"].as<string>();
-        if (testType != "integration" && testType != "unit")
+        if (testType != "integration" && testType != "unit" && testType != "loopback")
         {
             cerr << "Invalid test_type \'" << testType << "\'" << endl;
             exit(1);
@@ -79,30 +256,111 @@ MySqlGtest::analyzeProgramOptions(int argc, char ** argv)
     if (vm.count("log_file"))
     {
         const string & logPath = vm["log_file"].as<string>();
-        T::logPath_ = logPath;      
+        T::logPath_ = getWorkerPath(logPath);
+    }
+
+    if (vm.count("fixture_dir"))
+    {
+        T::fixtureDir_ = vm["fixture_dir"].as<string>();
     }
 
     if (vm.count("debug"))
     {
         T::debug_ = true;      
     }
+
+    // A worker started by --parallel has its shard in the environment, and
+    // runs it rather than starting workers of its own
+    if (vm.count("parallel") && getenv("GTEST_SHARD_INDEX") == NULL)
+    {
+        int workers = vm["parallel"].as<int>();
+        if (T::testType_ == "integration")
+        {
+            cerr << "--parallel needs test_type unit or loopback: integration tests share the database" << endl;
+            exit(1);
+        }
+        if (workers == 0) workers = boost::thread::hardware_concurrency();
+        if (workers < 1)
+        {
+            cerr << "Invalid parallel worker count " << workers << endl;
+            exit(1);
+        }
+        if (workers > 1) exit(runWorkers(argv, workers));
+    }
+
+    if (vm.count("benchmark"))
+    {
+        int runs = vm["benchmark"].as<int>();
+        if (runs < 1)
+        {
+            cerr << "Invalid benchmark run count " << runs << endl;
+            exit(1);
+        }
+        ::testing::GTEST_FLAG(repeat) = runs;
+        T::benchmark_ = new MySqlBenchmark(getWorkerPath(vm["benchmark_out"].as<string>()), T::testType_, runs);
+        ::testing::UnitTest::GetInstance()->listeners().Append(T::benchmark_);
+    }
 }
 
-// Load the test-input JSON doc, and set up a connection using
-// information from doc. This connection will be used for the
-// duration for the test case, and will be closed at test-case
-// tear-down.
-//
-// Add an observer to the connection depending on the test type
-// (i.e. the 'test_type' command argument). If it's integration,
-// add a capture observer, which will serialize the results of
-// every statement execution to a json doc. If it's unit, add a
-// playback observer, which will use the captured json docs to
-// provide statement results without connecting to MySQL.
+// Run this binary, with the same arguments, as `workers` processes, each
+// running one gtest shard of the tests, and wait for them. Returns the
+// exit code for the whole run: 0 if every worker passed, else 1. The gtest
+// flags InitGoogleTest has taken from argv reach the workers through the
+// environment.
+int
+MySqlGtest::runWorkers(char ** argv, int workers)
+{
+    setenv("GTEST_FILTER", ::testing::GTEST_FLAG(filter).c_str(), 1);
+    std::vector<pid_t> pids;
+    for (int i = 0; i < workers; i++)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("Unable to start test worker");
+            break;
+        }
+        if (pid == 0)
+        {
+            stringstream totalShards, shardIndex;
+            totalShards << workers;
+            shardIndex << i;
+            setenv("GTEST_TOTAL_SHARDS", totalShards.str().c_str(), 1);
+            setenv("GTEST_SHARD_INDEX", shardIndex.str().c_str(), 1);
+            execv(argv[0], argv);
+            perror("Unable to run test worker");
+            _exit(1);
+        }
+        pids.push_back(pid);
+    }
+
+    int rc = static_cast<int>(pids.size()) == workers ? 0 : 1;
+    for (size_t i = 0; i < pids.size(); i++)
+    {
+        int status;
+        if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            rc = 1;
+    }
+    return rc;
+}
+
+// Shards write their own log and benchmark report: <path>.<shard index>
+string
+MySqlGtest::getWorkerPath(const string & path)
+{
+    const char * totalShards = getenv("GTEST_TOTAL_SHARDS");
+    const char * shardIndex = getenv("GTEST_SHARD_INDEX");
+    if (totalShards == NULL || shardIndex == NULL || atoi(totalShards) < 2) return path;
+    return path + "." + shardIndex;
+}
+
+// Load the test-input JSON doc, which holds the connection information
+// for the tests of the test case.
 void
 MySqlGtest::setUpMySqlTestCase(const char * testCaseName)
 {
     stringstream errorMessage;
+    testCaseName_ = testCaseName;
 
     FILE* fp = fopen(testInputPath_.c_str(), "r"); 
     if (fp)
@@ -125,6 +383,34 @@ MySqlGtest::setUpMySqlTestCase(const char * testCaseName)
         perror(errorMessage.str().c_str());
         return;
     }
+}
+
+void
+MySqlGtest::tearDownMySqlTestCase()
+{
+    testCaseName_.clear();
+}
+
+// Set up the test's connection, using the connection information from
+// the test-input doc. The connection is closed at test tear-down.
+//
+// Add an observer to the connection depending on the test type
+// (i.e. the 'test_type' command argument). If it's integration,
+// add a capture observer, which will serialize the results of
+// every statement execution to a json doc. If it's unit, add a
+// playback observer, which will use the captured json docs to
+// provide statement results without connecting to MySQL. Both are
+// named for the test case, so the files of a test are
+// <test case>.<test>.json (or .fix) in the fixture directory.
+//
+// If it's loopback, there's no observer: the connection's backend is
+// the loopback backend, which answers the statements with the test's
+// captured results, so every execution runs the whole state machine
+// (binding, fetching, building results) without MySQL.
+void
+MySqlGtest::openConnection()
+{
+    if (!testInputDoc_.IsObject()) return;
 
     if (!testInputDoc_.HasMember("connection"))
     {
@@ -165,7 +451,7 @@ MySqlGtest::setUpMySqlTestCase(const char * testCaseName)
     if (connectionInfo.HasMember("port"))
       port = connectionInfo["port"].GetInt();
      
-    conn_ = MySqlConnection::createConnection(testCaseName,
+    conn_ = MySqlConnection::createConnection(testCaseName_.c_str(),
 					      databaseName,
  				              sqlDict,
 					      user,
@@ -175,25 +461,50 @@ MySqlGtest::setUpMySqlTestCase(const char * testCaseName)
     if (!logPath_.empty())
         conn_->setFileLog(logPath_.c_str());
 
+    rapidjson::Document observerParams;
+    observerParams.SetObject();
+    if (!fixtureDir_.empty())
+        observerParams.AddMember("working_directory", rapidjson::StringRef(fixtureDir_.c_str()), observerParams.GetAllocator());
+
+    if (testType_ == "loopback")
+    {
+        const string fixtureDir = fixtureDir_.empty() ? "." : fixtureDir_;
+        const string capturePath = fixtureDir + "/" + testCaseName_ + "." + currentProgram_ + ".json";
+        const string resultStore = fixtureDir + "/results";
+        rapidjson::Document backendParams;
+        backendParams.SetObject();
+        rapidjson::Value captures(rapidjson::kArrayType);
+        captures.PushBack(rapidjson::Value(capturePath.c_str(), capturePath.size(), backendParams.GetAllocator()).Move(),
+                          backendParams.GetAllocator());
+        backendParams.AddMember("captures", captures, backendParams.GetAllocator());
+        backendParams.AddMember("result_store", 
+                                rapidjson::Value(resultStore.c_str(), resultStore.size(), backendParams.GetAllocator()).Move(),
+                                backendParams.GetAllocator());
+        conn_->setBackend(LOOPBACK_BACKEND, &backendParams);
+    }
+
     if (!testType_.empty())
     {
         if (testType_ == "integration")
         {
-            conn_->addObserver(testCaseName, CAPTURE_OBS); 
+            // a benchmark's later runs would overwrite the capture of the first
+            if (benchmark_ == NULL || benchmark_->isFirstRun())
+                conn_->addObserver(testCaseName_.c_str(), CAPTURE_OBS, &observerParams); 
         }
         else if (testType_ == "unit")
         {
-            conn_->addObserver(testCaseName, REPLAY_OBS); 
+            conn_->addObserver(testCaseName_.c_str(), REPLAY_OBS, &observerParams); 
         }
     }
 
-    conn_->startProgram(testCaseName);
-}
-
-void
-MySqlGtest::tearDownMySqlTestCase()
-{
-    if (conn_) conn_->close();
+    if (benchmark_ != NULL)
+    {
+        rapidjson::Document benchmarkParams;
+        benchmarkParams.SetObject();
+        benchmarkParams.AddMember("record_replay", true, benchmarkParams.GetAllocator());
+        benchmarkParams.AddMember("dump_file", "", benchmarkParams.GetAllocator());
+        conn_->addObserver("benchmark", PERFORMANCE_OBS, &benchmarkParams);
+    }
 }
 
 void
@@ -202,12 +513,13 @@ MySqlGtest::setUpMySqlTest()
     if (!testInputPath_.empty())
         ASSERT_TRUE(testInputDoc_.IsObject() && !testInputDoc_.ObjectEmpty()) << "No test-input file supplied";
 
+    const ::testing::TestInfo* const test_info = ::testing::UnitTest::GetInstance()->current_test_info();
+    currentProgram_ = test_info->name();
+    openConnection();
     if (conn_)
-    {
-        const ::testing::TestInfo* const test_info = ::testing::UnitTest::GetInstance()->current_test_info();
-        currentProgram_ = test_info->name();
         conn_->startProgram(currentProgram_.c_str());
-    }
+    else
+        currentProgram_.clear();
 }
 
 void
@@ -220,6 +532,18 @@ MySqlGtest::tearDownMySqlTest()
             conn_->endProgram(currentProgram_.c_str());
             currentProgram_.clear();
         }
+
+        MySqlObserver * observer = conn_->getObserver("benchmark");
+        if (benchmark_ != NULL && observer != NULL && observer->getObserverType() == PERFORMANCE_OBS)
+        {
+            PerformanceObserver * performanceObserver = static_cast<PerformanceObserver *>(observer);
+            PerformanceSnapshot snapshot;
+            performanceObserver->getSnapshot(snapshot);
+            benchmark_->recordStatements(snapshot);
+        }
+
+        conn_->close();
+        conn_.reset();
     }
 }
 
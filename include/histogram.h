@@ -0,0 +1,53 @@
+#ifndef __histogram_h__
+#define __histogram_h__
+
+#include <stdint.h>
+
+#include <rapidjson/document.h>
+
+
+//                                L A T E N C Y  H I S T O G R A M
+
+// A log-linear histogram of durations in microseconds, in the style of HDR
+// histograms. Values below 2^SUB_BUCKET_BITS get a bucket each; above that,
+// each power of two is split into 2^(SUB_BUCKET_BITS-1) equal buckets, so a
+// percentile is accurate to within about 3% (half a bucket) whatever the
+// magnitude. Values of 2^MAX_VALUE_BITS and more (19 hours) share the last
+// bucket. Recording is a few shifts and an increment, with no allocation.
+// Histograms aren't thread-safe; the owner serializes access.
+class LatencyHistogram
+{
+public:
+    static const int      SUB_BUCKET_BITS = 5;
+    static const int      MAX_VALUE_BITS = 36;
+    static const size_t   SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+    static const size_t   HALF_BUCKET_COUNT = SUB_BUCKET_COUNT / 2;
+    static const size_t   BUCKET_COUNT = SUB_BUCKET_COUNT + (MAX_VALUE_BITS - SUB_BUCKET_BITS) * HALF_BUCKET_COUNT;
+
+public:
+    LatencyHistogram();
+
+public:
+    void                  record(uint64_t value);
+    void                  merge(const LatencyHistogram & other);
+    void                  reset();
+
+    uint64_t              getCount() const  {  return count_; }
+    uint64_t              getMin() const    {  return count_ == 0 ? 0 : min_; }
+    uint64_t              getMax() const    {  return max_; }
+    double                getMean() const   {  return count_ == 0 ? 0.0 : static_cast<double>(sum_) / count_; }
+    uint64_t              getValueAtPercentile(double percentile) const;
+    void                  toJson(rapidjson::Value & json, rapidjson::Document::AllocatorType & allocator) const;
+
+    static size_t         getBucketIndex(uint64_t value);
+    static uint64_t       getBucketLimit(size_t index);  // the highest value in the bucket
+
+private:
+    uint64_t              counts_[BUCKET_COUNT];
+    uint64_t              count_;
+    uint64_t              min_;
+    uint64_t              max_;
+    uint64_t              sum_;
+};
+
+#endif // __histogram_h__
@@ -1,10 +1,25 @@
 #ifndef __observer_h__
 #define __observer_h__
 
+#include <cstdio>
+#include <vector>
+
 #include <boost/move/unique_ptr.hpp>
 
+#include <rapidjson/filewritestream.h>
+#include <rapidjson/writer.h>
+
 #include "connection.h"
 #include "execution.h"
+#include "audit_spool.h"
+#include "audit_sink.h"
+#include "audit_table.h"
+#include "audit_codec.h"
+#include "fixture.h"
+#include "replay_index.h"
+#include "result_store.h"
+#include "performance.h"
+#include "trace.h"
 
 using namespace boost;
 using namespace boost::movelib;
@@ -33,12 +48,16 @@ public:
     virtual void            startProgram(const char * programName);
     virtual ExecutionState  onEvent(MySqlExecution * execution, ExecutionState newState) = 0;
     virtual void            onEvent(AuditEventType event, const char * comment = NULL, MySqlExecution * execution = NULL) {};
+    virtual void            onRequest(const ExecutionThread::Request & request,
+                                      RequestEvent                     event,
+                                      const MySqlExecution *           execution) {};  // execution requests only
     virtual void            endProgram(const char * programName);
     virtual ObserverType    getObserverType() const = 0;
+    const char *            getName() const  {  return name_; }
 
 protected:
     void                    getWorkingDirectory(const rapidjson::Document * params);
-    string                  getProgramPath();
+    string                  getProgramPath(const char * extension = "json");
     
 protected:
     const char *            name_;
@@ -50,8 +69,78 @@ protected:
 
 //                                     A U D I T  O B S E R V E R
 
+// Records are buffered and written as multi-row INSERTs (the 'batch_statement'
+// dictionary entry, by default insert_audit_records). A batch is flushed when it
+// reaches 'batch_size' records, when its oldest record is 'flush_interval_ms'
+// old, and on commit, rollback and end of program. 'durability' says when the
+// observed connection waits for audit records to be written: never ("async"),
+// at commit and rollback ("commit"), or for every record ("sync").
+//
+// 'mode' says where records go. By default ("shared") they are queued on the
+// process's AuditSink for the audit database, which batches the records of
+// all the observers that audit there, and writes them on 'writers' connections.
+// With "connection", the observer batches its own records and writes them on
+// its own asynchronous connection. With "spool", records are appended to a
+// memory-mapped spool in 'spool_directory' (see AuditSpool), and shipped from
+// there on the observer's own connection; durability then says when the spool
+// is flushed to disk.
+//
+// Rules say which executions are audited (commits and rollbacks always are).
+// Errors and writes are unless 'audit_errors' or 'audit_writes' is false, and
+// so are executions that take at least 'slower_than_ms'. The rest are sampled:
+// 'sample_rates' maps statement names to the fraction audited, and
+// 'sample_rate' applies to other statements. The default rate is 1, or 0 if
+// there is a 'slower_than_ms' threshold.
+//
+// The audit table is partitioned by day (see AuditTable). Partitions are made
+// 'partitions_ahead' days ahead, and those older than 'retention_days' are
+// dropped, when the observer starts and hourly after that.
 class AuditObserver : public MySqlObserver
 {
+public:
+    enum AuditMode
+    {
+        SHARED_MODE,      // records queued on the process's audit sink
+        CONNECTION_MODE,  // batches written on the observer's audit connection
+        SPOOL_MODE        // records appended to a local spool, and shipped
+    };
+
+    enum Durability
+    {
+        ASYNC_DURABILITY,
+        COMMIT_DURABILITY,
+        SYNC_DURABILITY
+    };
+
+    // What an insert-statement parameter holds. Resolved once, from the
+    // parameter names, so that a record is built straight from the execution
+    enum AuditColumn
+    {
+        UNKNOWN_COLUMN,
+        TABLE_NAME_COLUMN,
+        EVENT_COLUMN,
+        STATEMENT_NAME_COLUMN,
+        PROGRAM_COLUMN,
+        COMMENT_COLUMN,
+        TRANSACTION_COLUMN,
+        STATEMENT_TEXT_COLUMN,
+        PARAMETERS_COLUMN,
+        RESULTS_COLUMN,
+        STATE_COLUMN,
+        RC_COLUMN,
+        ROWS_RETURNED_COLUMN,
+        ROWS_AFFECTED_COLUMN,
+        ERROR_NO_COLUMN,
+        ERROR_MESSAGE_COLUMN,
+        START_TIME_COLUMN,
+        EXECUTE_TIME_COLUMN,
+        RETRIEVE_TIME_COLUMN,
+        COMPLETE_TIME_COLUMN,
+        USER_COLUMN,
+        HOST_COLUMN
+    };
+    typedef std::vector<std::pair<string, AuditColumn> > AuditColumnList;
+
 public:
     AuditObserver(const char *                name,
                   const rapidjson::Document * params,
@@ -66,24 +155,182 @@ public:
     virtual ObserverType         getObserverType() const  {  return AUDIT_OBS; }
 
 private:
-    bool                         prepareToAudit();
+    bool                         prepareToAudit(MySqlConnection * auditConn);
+    void                         getAuditRules(const rapidjson::Document * params);
+    bool                         isAudited(const MySqlExecution * execution, ExecutionState newState) const;
+    void                         scheduleMaintenance();
+    void                         maintainTable();
     void                         insertRecord(const char *                event,
-					      const rapidjson::Document * executionDom = NULL,
-					      const char *                comment = NULL);
+					      const MySqlExecution *      execution = NULL,
+					      const char *                comment = NULL,
+                                              bool                        isEndOfTransaction = false);
+    void                         toInsertArgs(const AuditSpool::FieldList & fields,
+                                              Value &                       insertArgs,
+                                              Document::AllocatorType &     allocator) const;
+    static AuditColumn           getAuditColumn(const string & paramName);
+    void                         startSpool();
+    MySqlConnection::ExecutionHandle flush();  // caller holds batchMutex_
+    void                         runFlusher();
+    void                         stopFlusher();
 
 private:
     string                       auditDatabaseName_;
     string                       auditTableName_;
     string                       auditSqlPath_;
-    unique_ptr<MySqlConnection>  auditConn_;  // connection for reading and writing audit records
+    unique_ptr<MySqlConnection>  auditConn_;  // connection for reading and writing audit records, if not shared
+    string                       createStatement_;
     string                       insertStatement_;
+    string                       batchStatement_;  // empty if records are inserted one at a time
+    AuditColumnList              auditColumns_;    // the insert statement's parameters, in order
     bool                         isAuditing_;
+    AuditCodec::Codec            payloadCodec_;    // for the parameters and results columns
+    size_t                       compressMinBytes_; // shorter payloads are stored as they are
+
+    double                       sampleRate_;      // fraction of other executions audited
+    boost::unordered_map<string, double> sampleRates_;  // by statement name
+    bool                         isAuditingErrors_;
+    bool                         isAuditingWrites_;
+    int                          slowerThanMs_;    // 0 if executions aren't audited for being slow
+    boost::atomic<unsigned long> auditedCount_;
+    boost::atomic<unsigned long> skippedCount_;
+
+    static const long            MAINTENANCE_INTERVAL = 3600;  // seconds
+    int                          partitionsAhead_;
+    int                          retentionDays_;   // 0 to keep all records
+    unique_ptr<AuditTable>       table_;           // NULL if the table isn't partitioned
+    boost::atomic<long>          nextMaintenance_; // time_t
+    boost::thread                maintenanceThread_;
+
+    int                          batchSize_;
+    posix_time::time_duration    flushInterval_;
+    Durability                   durability_;
+    rapidjson::Document          batch_;           // buffered records: the rows of the next batch insert
+    posix_time::ptime            batchStartTime_;  // when the oldest buffered record was added
+    boost::mutex                 batchMutex_;
+    boost::condition_variable    flushCv_;
+    boost::thread                flushThread_;
+    bool                         isFlusherRunning_;
+
+    AuditMode                    mode_;
+    int                          writers_;         // writer connections, if this observer creates the sink
+    boost::shared_ptr<AuditSink> sink_;            // shared mode only
+    boost::shared_ptr<AuditSink::Target> target_;
+    string                       spoolDirectory_;
+    size_t                       spoolSegmentSize_;
+    unique_ptr<AuditSpool>       spool_;           // spool mode only; uses auditConn_, so declared after it
+};
+
+
+
+//                             P E R F O R M A N C E  O B S E R V E R
+
+// Records latency histograms for the prepare, execute and fetch phases of
+// every execution, with row and error counts, by statement and by program.
+// The stats are cumulative; getSnapshot copies them (snapshots of several
+// connections can be merged). Every 'dump_interval_s' seconds (default 60, 0
+// for never), and when the observer is removed, the stats are written as JSON
+// to 'dump_file' (default <working directory>/<observer name>.performance.json,
+// "" for no dumps), replacing the previous dump. Replayed executions are only
+// recorded with "record_replay": true (to measure the client's own overhead).
+// The cost per execution is a lock and a few increments.
+class PerformanceObserver : public MySqlObserver
+{
+public:
+    PerformanceObserver(const char *                name,
+                        const rapidjson::Document * params,
+                        MySqlConnection *           conn); 
+    virtual ~PerformanceObserver();
+
+public:
+    virtual ExecutionState    onEvent(MySqlExecution * execution, ExecutionState newState);
+    virtual ObserverType      getObserverType() const  {  return PERFORMANCE_OBS; }
+    void                      getSnapshot(PerformanceSnapshot & snapshot) const;
+    void                      reset();
+    int                       dump();
+
+private:
+    mutable boost::mutex      mutex_;
+    PerformanceSnapshot       snapshot_;
+    bool                      isRecording_;
+    string                    dumpPath_;
+    int                       dumpIntervalSec_;
+    time_t                    nextDump_;
 };
 
 
 
+//                                     T R A C E  O B S E R V E R
+
+// Records a timeline of the connection in Chrome trace-event format, for
+// chrome://tracing or Perfetto: a slice for each execution, containing a
+// slice for each state transition; the time each request waited in the
+// execution thread's queue (an asynchronous span from the caller's thread to
+// the execution thread) and the time it took to serve; and slices for
+// transactions and programs. Each thread records into its own buffer, of at
+// most 'max_events' events (default 1,000,000). The trace is written to
+// 'trace_file' (default <working directory>/<observer name>.trace.json) when
+// the observer is removed, or by writeTrace. Timestamps are microseconds from
+// a process-wide origin, so traces of several connections can be combined.
+class TraceObserver : public MySqlObserver
+{
+public:
+    TraceObserver(const char *                name,
+                  const rapidjson::Document * params,
+                  MySqlConnection *           conn); 
+    virtual ~TraceObserver();
+
+public:
+    virtual void              startProgram(const char * programName);
+    virtual ExecutionState    onEvent(MySqlExecution * execution, ExecutionState newState);
+    virtual void              onEvent(AuditEventType event, const char * comment = NULL, MySqlExecution * execution = NULL);
+    virtual void              onRequest(const ExecutionThread::Request & request,
+                                        RequestEvent                     event,
+                                        const MySqlExecution *           execution);
+    virtual void              endProgram(const char * programName);
+    virtual ObserverType      getObserverType() const  {  return TRACE_OBS; }
+    int                       writeTrace();
+
+private:
+    // an execution in progress: its last transition, and the start of its
+    // slice on the thread it's on
+    struct ExecutionTicks
+    {
+        PhaseClock::Tick      stateTick_;
+        PhaseClock::Tick      sliceTick_;
+    };
+    typedef boost::unordered_map<int, ExecutionTicks> ExecutionTickMap;
+    typedef std::vector<std::pair<string, PhaseClock::Tick> > ProgramStack;
+
+    TraceBuffer *             getThreadBuffer();
+    void                      addSlice(const char * category, const string & name, const PhaseClock::Tick & startTick,
+                                       const PhaseClock::Tick & endTick, int handle = 0, const string & detail = string());
+    static int64_t            getTimestamp(const PhaseClock::Tick & tick);
+    static void               keepThreadBuffer(TraceBuffer *) {}  // the buffers outlive their threads
+
+private:
+    boost::thread_specific_ptr<TraceBuffer> threadBuffer_;
+    boost::mutex              mutex_;           // for everything below
+    std::vector<boost::shared_ptr<TraceBuffer> > buffers_;
+    size_t                    maxEvents_;
+    string                    tracePath_;
+    ExecutionTickMap          executions_;      // by handle
+    ProgramStack              programs_;        // the programs in progress, outermost first
+    string                    transactionName_;
+    PhaseClock::Tick          transactionTick_;
+    PhaseClock::Tick          requestTick_;     // when the execution thread dequeued its current request
+};
+
+
 //                                   C A P T U R E  O B S E R V E R
 
+// Streams each execution of a program, as it completes, to the program's
+// capture file (<working directory>/<observer name>.<program>.json), through
+// a write buffer of 'buffer_size' bytes (default 64K), so memory use doesn't
+// grow with the length of the run. The file is written under a temporary
+// name and renamed when the program ends, so a capture file is always
+// complete. A program with no executions leaves no file. With a
+// 'result_store' directory, each execution's results are stored there by
+// digest (see ResultStore), and the capture file refers to them.
 class CaptureObserver : public MySqlObserver
 {
 public:
@@ -99,12 +346,34 @@ public:
     virtual ObserverType      getObserverType() const  {  return CAPTURE_OBS; }
 
 private:
-    rapidjson::Document       capturedExecutions_;
+    bool                      openCapture();
+    void                      closeCapture();
+    void                      writeExecution(const rapidjson::Value & execution);
+
+private:
+    std::vector<char>         writeBuffer_;
+    string                    resultStore_;     // empty if results are written inline
+    string                    capturePath_;     // of the program being captured
+    string                    captureTempPath_; // written until the program ends: per process, so shards don't collide
+    FILE *                    captureFile_;     // NULL until the program's first execution
+    unique_ptr<FileWriteStream> captureStream_;
+    unique_ptr<Writer<FileWriteStream> > captureWriter_;
 };
 
 
 //                                   R E P L A Y  O B S E R V E R
 
+// Replays the program's replay fixture (<working directory>/<observer
+// name>.<program>.fix) if there is one, decoding each execution as it is
+// reached, and otherwise the program's capture file. Both are opened through
+// the ReplayCache, and results are built with references to their strings.
+// By default the n'th execution of the program is replayed from the n'th
+// captured execution. With "match": "keyed", it is replayed from the next
+// captured execution of the same statement, SQL text and parameters (see
+// ReplayIndex), so the order of executions doesn't matter and executions
+// can be replayed from several threads. Results captured by reference are
+// read from the 'result_store' directory (by default <working
+// directory>/results), each once per process.
 class ReplayObserver : public MySqlObserver
 {
 public:
@@ -120,8 +389,20 @@ public:
     virtual ObserverType      getObserverType() const {  return REPLAY_OBS; }
 
 private:
-    rapidjson::Document       replayExecutions_;
+    int                       findKeyedExecution(MySqlExecution * execution);
+    bool                      copyStoredResults(MySqlExecution * execution, const string & digest);
+    ExecutionState            replayCaptureExecution(MySqlExecution * execution, size_t replayIndex);
+    ExecutionState            replayFixtureExecution(MySqlExecution * execution, size_t replayIndex);
+
+private:
+    boost::shared_ptr<const FixtureReader> fixture_;   // the program's fixture, or
+    boost::shared_ptr<const CaptureReader> capture_;   // its capture file
+    string                    loadError_;       // why neither could be read
     int                       executionNumber_;
+    bool                      isKeyed_;
+    string                    resultStore_;
+    boost::mutex              indexMutex_;      // for index_
+    ReplayIndex               index_;
 };
 
 
@@ -0,0 +1,72 @@
+#ifndef __performance_h__
+#define __performance_h__
+
+#include <stdint.h>
+#include <map>
+#include <string>
+
+#include <rapidjson/document.h>
+
+#include "histogram.h"
+#include "phase_clock.h"
+
+using std::string;
+
+
+//                               P E R F O R M A N C E  S T A T S
+
+// What one execution contributes: the duration of each phase, and its outcome
+struct PerformanceSample
+{
+    PerformanceSample();
+
+    PhaseDurations        durations_;
+    int                   rowsReturned_;
+    int                   rowsAffected_;
+    bool                  isError_;
+};
+
+// Latency histograms for each phase, and counts, for a statement or program
+struct PerformanceStats
+{
+    PerformanceStats();
+
+    void                  record(const PerformanceSample & sample);
+    void                  merge(const PerformanceStats & other);
+    void                  toJson(rapidjson::Value & json, rapidjson::Document::AllocatorType & allocator) const;
+
+    LatencyHistogram      prepare_;
+    LatencyHistogram      execute_;
+    LatencyHistogram      fetch_;
+    LatencyHistogram      total_;
+    uint64_t              executions_;
+    uint64_t              errors_;
+    uint64_t              rowsReturned_;
+    uint64_t              rowsAffected_;
+};
+
+
+//                            P E R F O R M A N C E  S N A P S H O T
+
+// Stats by statement name and by program. Snapshots from several observers
+// (connections) can be merged into one.
+class PerformanceSnapshot
+{
+public:
+    typedef std::map<string, PerformanceStats> StatsMap;
+
+public:
+    void                  record(const string & statementName, const string & programName, const PerformanceSample & sample);
+    void                  merge(const PerformanceSnapshot & other);
+    void                  clear();
+    void                  toJson(rapidjson::Document & json) const;
+
+    const StatsMap &      getStatementStats() const  {  return statements_; }
+    const StatsMap &      getProgramStats() const    {  return programs_; }
+
+private:
+    StatsMap              statements_;
+    StatsMap              programs_;    // executions outside a program aren't included
+};
+
+#endif // __performance_h__
@@ -0,0 +1,44 @@
+#ifndef __phase_clock_h__
+#define __phase_clock_h__
+
+#include <stdint.h>
+
+#include <boost/chrono.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+
+//                                    P H A S E  C L O C K
+
+// Times the phases of an execution with the steady (monotonic) clock, which
+// is cheap to read and isn't moved by clock adjustments. Ticks are converted
+// to local wall-clock time only when a timestamp is needed (for the JSON of
+// an execution, or an audit record), by offsetting them from an anchor: a
+// reading of both clocks, taken again when it is ANCHOR_REFRESH_SEC old so
+// that the conversion follows adjustments to the wall clock.
+class PhaseClock
+{
+public:
+    typedef boost::chrono::steady_clock::time_point Tick;
+
+    static const int      ANCHOR_REFRESH_SEC = 10;
+
+public:
+    static Tick           now()  {  return boost::chrono::steady_clock::now(); }
+    static bool           isSet(const Tick & tick)  {  return tick != Tick(); }
+    static int64_t        getMicroseconds(const Tick & from, const Tick & to);  // -1 if either isn't set
+    static boost::posix_time::ptime toLocalTime(const Tick & tick);            // not_a_date_time if not set
+};
+
+// The duration of each phase of an execution in microseconds, -1 for a phase
+// the execution didn't reach
+struct PhaseDurations
+{
+    PhaseDurations() : prepareUs_(-1), executeUs_(-1), fetchUs_(-1), totalUs_(-1) {}
+
+    int64_t               prepareUs_;   // start to execute: SQL generation, prepare and bind
+    int64_t               executeUs_;   // execute to retrieve (or complete, for writes): the server's execution
+    int64_t               fetchUs_;     // retrieve to complete: fetching the rows
+    int64_t               totalUs_;     // start to complete
+};
+
+#endif // __phase_clock_h__
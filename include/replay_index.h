@@ -0,0 +1,73 @@
+#ifndef __replay_index_h__
+#define __replay_index_h__
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <rapidjson/document.h>
+
+#include "fixture.h"
+
+using std::string;
+
+
+//                                     R E P L A Y  K E Y
+
+// Identifies the executions a live execution may be replayed from: the
+// statement name, a hash of the generated SQL text, and a hash of the
+// parameter settings (names, types and values, as in the "parameters" of a
+// capture file). Hashes are 64-bit FNV-1a; a match is still confirmed by
+// comparing statement name and text.
+struct ReplayKey
+{
+    ReplayKey() : textHash_(0), parameterHash_(0) {}
+    ReplayKey(const string & statementName, uint64_t textHash, uint64_t parameterHash)
+    :   statementName_(statementName), textHash_(textHash), parameterHash_(parameterHash) {}
+
+    bool                  operator<(const ReplayKey & other) const;
+
+    static const uint64_t HASH_SEED = 14695981039346656037ULL;
+
+    static uint64_t       hashBytes(const char * data, size_t length, uint64_t hash = HASH_SEED);
+    static uint64_t       hashValue(const rapidjson::Value & value, uint64_t hash = HASH_SEED);
+    static uint64_t       hashParameters(const rapidjson::Value * parameters);  // NULL or empty if none
+
+    string                statementName_;
+    uint64_t              textHash_;
+    uint64_t              parameterHash_;
+};
+
+
+//                                   R E P L A Y  I N D E X
+
+// The executions of a fixture or capture file, by key, each list in the
+// order they were captured. Executions with the same key are replayed first
+// in, first out, so a program whose statements are issued in a different
+// order, or concurrently, still gets the results each statement had.
+class ReplayIndex
+{
+public:
+    void                  build(const FixtureReader & fixture);
+    void                  build(const CaptureReader & capture);
+    void                  clear();
+
+    // The next execution for the key, or -1 if there are no more
+    int                   take(const ReplayKey & key);
+    bool                  empty() const  {  return executions_.empty(); }
+
+private:
+    struct Queue
+    {
+        Queue() : next_(0) {}
+
+        std::vector<size_t> executions_;
+        size_t            next_;
+    };
+    typedef std::map<ReplayKey, Queue> QueueMap;
+
+    QueueMap              executions_;
+};
+
+#endif // __replay_index_h__
@@ -0,0 +1,64 @@
+#ifndef __result_store_h__
+#define __result_store_h__
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <rapidjson/document.h>
+
+using std::string;
+
+
+//                                   S T O R E D  R E S U L T S
+
+// A result set read from a result store, parsed in place, so that results
+// copied from it keep references to its strings
+class StoredResults : private boost::noncopyable
+{
+public:
+    bool                      open(const string & path, string & errorMessage);
+    const rapidjson::Value &  getResults() const  {  return document_; }
+
+private:
+    std::vector<char>         buffer_;
+    rapidjson::Document       document_;
+};
+
+
+//                                    R E S U L T  S T O R E
+
+// A content-addressed store of captured result sets: a directory of files
+// named by the SHA-1 digest of their content (the results, serialized as
+// JSON), <directory>/<first two digits>/<digest>.json. The capture observer
+// stores each execution's results once, and refers to them by digest
+// ("results_ref"), so a result set that many tests capture is kept once.
+// Result sets read for replay are kept, by path, for the life of the
+// process.
+class ResultStore
+{
+public:
+    static bool               put(const string &           directory,
+                                  const rapidjson::Value & results,
+                                  string &                 digest,
+                                  string &                 errorMessage);
+    static boost::shared_ptr<const StoredResults> get(const string & directory,
+                                                      const string & digest,
+                                                      string &       errorMessage);
+    static string             getDigest(const char * data, size_t length);
+    static string             getPath(const string & directory, const string & digest);
+
+private:
+    typedef std::map<string, boost::shared_ptr<const StoredResults> > ResultsMap;
+
+    static boost::mutex       mutex_;           // for everything below
+    static std::set<string>   stored_;          // the paths this process has stored or found
+    static ResultsMap         results_;         // by path
+};
+
+#endif // __result_store_h__
@@ -0,0 +1,122 @@
+#ifndef __trace_h__
+#define __trace_h__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+using std::string;
+
+
+//                                     T R A C E  E V E N T
+
+// An event in Chrome trace-event format (also read by Perfetto): a complete
+// slice ('X', with a duration), an instant ('i'), or the start or end of an
+// asynchronous span ('b', 'e'), which may be on different threads and is
+// matched by category, name and id. Times are microseconds since the trace
+// started.
+struct TraceEvent
+{
+    TraceEvent();
+    TraceEvent(char phase, const char * category, const string & name, int64_t timestamp);
+
+    char                  phase_;
+    const char *          category_;    // a literal
+    string                name_;
+    int64_t               timestamp_;
+    int64_t               duration_;    // complete slices only
+    uint64_t              id_;          // asynchronous spans only
+    int                   handle_;      // the execution's, or 0
+    string                detail_;
+};
+
+
+//                                    T R A C E  B U F F E R
+
+// The events recorded on one thread. Only that thread adds events, so the
+// lock is only contended while the trace is being written. Once the buffer
+// holds 'maxEvents', further events are counted and dropped.
+class TraceBuffer
+{
+public:
+    TraceBuffer(int threadId, const string & threadName, size_t maxEvents);
+
+public:
+    void                  add(const TraceEvent & event);
+    void                  setThreadName(const string & threadName);
+
+    // Append the events, and a metadata event naming the thread, to a JSON
+    // array being written with a rapidjson Writer
+    template <typename Writer>
+    void                  write(Writer & writer, int processId);
+
+private:
+    boost::mutex          mutex_;
+    std::vector<TraceEvent> events_;
+    int                   threadId_;
+    string                threadName_;
+    size_t                maxEvents_;
+    uint64_t              dropped_;
+};
+
+template <typename Writer>
+void
+TraceBuffer::write(Writer & writer, int processId)
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    writer.StartObject();
+    writer.Key("name");  writer.String("thread_name");
+    writer.Key("ph");    writer.String("M");
+    writer.Key("pid");   writer.Int(processId);
+    writer.Key("tid");   writer.Int(threadId_);
+    writer.Key("args");
+    writer.StartObject();
+    writer.Key("name");  writer.String(threadName_.c_str(), threadName_.size());
+    writer.Key("dropped_events");  writer.Uint64(dropped_);
+    writer.EndObject();
+    writer.EndObject();
+
+    for (std::vector<TraceEvent>::const_iterator itr = events_.begin(); itr != events_.end(); ++itr)
+    {
+        const char phase[] = { itr->phase_, '\0' };
+        writer.StartObject();
+        writer.Key("name");  writer.String(itr->name_.c_str(), itr->name_.size());
+        writer.Key("cat");   writer.String(itr->category_);
+        writer.Key("ph");    writer.String(phase);
+        writer.Key("ts");    writer.Int64(itr->timestamp_);
+        if (itr->phase_ == 'X')
+        {
+            writer.Key("dur");  writer.Int64(itr->duration_);
+        }
+        else if (itr->phase_ == 'b' || itr->phase_ == 'e')
+        {
+            writer.Key("id");  writer.Uint64(itr->id_);
+        }
+        else if (itr->phase_ == 'i')
+        {
+            writer.Key("s");  writer.String("t");
+        }
+        writer.Key("pid");   writer.Int(processId);
+        writer.Key("tid");   writer.Int(threadId_);
+        if (itr->handle_ != 0 || !itr->detail_.empty())
+        {
+            writer.Key("args");
+            writer.StartObject();
+            if (itr->handle_ != 0)
+            {
+                writer.Key("handle");  writer.Int(itr->handle_);
+            }
+            if (!itr->detail_.empty())
+            {
+                writer.Key("detail");  writer.String(itr->detail_.c_str(), itr->detail_.size());
+            }
+            writer.EndObject();
+        }
+        writer.EndObject();
+    }
+}
+
+#endif // __trace_h__
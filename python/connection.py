@@ -8,9 +8,34 @@ per-database connections
 
 from __future__ import print_function
 from collections import namedtuple
+import struct
+import zlib
 
 import mysql.connector as MYSQL
 
+ZLIB_PAYLOAD = 1
+PAYLOAD_HEADER_SIZE = 5
+
+def decode_audit_payload(value):
+    """
+    Expand an audit payload that was stored compressed: a codec marker
+    byte and the uncompressed length (4 bytes, little-endian), followed
+    by the compressed JSON. Uncompressed payloads in BLOB columns are
+    returned as text; other values are returned as they are
+    """
+    if not isinstance(value, (bytes, bytearray)):
+        return value
+    value = bytearray(value)
+    if len(value) >= PAYLOAD_HEADER_SIZE and value[0] == ZLIB_PAYLOAD:
+        length, = struct.unpack("<I", bytes(value[1:PAYLOAD_HEADER_SIZE]))
+        value = bytearray(zlib.decompress(bytes(value[PAYLOAD_HEADER_SIZE:])))
+        if len(value) != length:
+            raise ValueError("Corrupt audit payload: expected {} bytes, got {}".format(length, len(value)))
+    try:
+        return value.decode("utf-8")
+    except UnicodeDecodeError:
+        return value
+
 class MySqlConnection(object):
 
     connections = {}
@@ -50,7 +75,8 @@ class MySqlConnection(object):
         Execute the fully expanded statement and return a tuple containing
         the number of affected rows (for non SELECT), the number of rows
         returned (for SELECT), and a list of sequences, starting with the
-        column names and followed by the row values
+        column names and followed by the row values. Compressed audit
+        payloads are expanded
         """
         cls = type(self)
         if not self.is_connected:
@@ -64,7 +90,7 @@ class MySqlConnection(object):
             rows_affected = self.cursor.rowcount
         else:
             rows.append(self.cursor.column_names)
-            rows += list(self.cursor)
+            rows += [tuple(decode_audit_payload(value) for value in row) for row in self.cursor]
         return cls.ExecuteResults(len(rows), rows_affected, rows)
 
     @classmethod
@@ -33,6 +33,8 @@ class MySqlStatement(object):
             raise ValueError("Statement {} in {} is incomplete".
                              format(self.statement_name, self.sql_dictionary_path))
         self.statement_text = '\n'.join(statement_dict["statement_text"])
+        if "row_text" in statement_dict: # multi-row statement: the explorer runs it with one row
+            self.statement_text += '\n' + '\n'.join(statement_dict["row_text"])
         self.description = '\n'.join(statement_dict["description"]) if "description" in statement_dict else None
         self.parameters = statement_dict.get("parameters", None)
             
@@ -135,7 +137,9 @@ class MySqlStatementParameter(object):
         INT = 1,
         STRING = 2,
         FLOAT = 3,
-        DATE = 4
+        DATE = 4,
+        TIMESTAMP = 5,
+        BLOB = 6
 
     def __init__(self, param_dict):
         cls = type(self)
@@ -159,7 +163,7 @@ class MySqlStatementParameter(object):
             except ValueError:
                 raise ValueError("Attempt to assign non-integer '{!s}' to integer parameter {p.name}".
                                  format(value, p=self))
-        elif self.data_type == cls.DataType.STRING:
+        elif self.data_type in (cls.DataType.STRING, cls.DataType.BLOB):
             if self.regex is not None:
                 matchesPattern = re.search(self.regex, value)
                 if not matchesPattern:
@@ -181,6 +185,19 @@ class MySqlStatementParameter(object):
                 except ValueError:
                     raise ValueError("Unable to assign '{!s}' to date parameter {p.name}. Expect yyyy-mm-dd".
                                      format(value, p=self))
+        elif self.data_type == cls.DataType.TIMESTAMP:
+            if isinstance(value, datetime):
+                self.value = value
+            else:
+                for time_format in ("%Y-%m-%d %H:%M:%S", "%Y-%m-%d"):
+                    try:
+                        self.value = datetime.strptime(value, time_format)
+                        break
+                    except ValueError:
+                        continue
+                else:
+                    raise ValueError("Unable to assign '{!s}' to timestamp parameter {p.name}. Expect yyyy-mm-dd [hh:mm:ss]".
+                                     format(value, p=self))
 
     def __format__(self, _):
         """
@@ -194,10 +211,12 @@ class MySqlStatementParameter(object):
             return str(self.value)
         elif self.data_type == cls.DataType.FLOAT:
             return str(self.value)
-        elif self.data_type == cls.DataType.STRING:
+        elif self.data_type in (cls.DataType.STRING, cls.DataType.BLOB):
             return "'{}'".format(self.value)
         elif self.data_type == cls.DataType.DATE:
             return "'{}'".format(datetime.strftime(self.value, "%Y-%m-%d"))
+        elif self.data_type == cls.DataType.TIMESTAMP:
+            return "'{}'".format(datetime.strftime(self.value, "%Y-%m-%d %H:%M:%S"))
             
     def __repr__(self):
         logstrings = [self.name]
@@ -0,0 +1,78 @@
+#include <zlib.h>
+
+#include "audit_codec.h"
+
+using namespace std;
+
+
+//                                      A U D I T  C O D E C
+
+bool
+AuditCodec::getCodec(const string & codecName, Codec & codec)
+{
+    if (codecName == "none")
+        codec = NO_CODEC;
+    else if (codecName == "zlib")
+        codec = ZLIB_CODEC;
+    else
+        return false;
+    return true;
+}
+
+bool
+AuditCodec::isEncoded(const char * data, size_t length)
+{
+    return length >= HEADER_SIZE && data[0] == ZLIB_CODEC;
+}
+
+// Compress a payload. Returns false, leaving 'encoded' empty, if the payload
+// couldn't be compressed, or didn't get smaller; the caller stores it as is.
+bool
+AuditCodec::encode(Codec codec, const char * data, size_t length, string & encoded)
+{
+    encoded.clear();
+    if (codec != ZLIB_CODEC || length > 0xffffffffUL) return false;
+
+    uLongf compressedLength = compressBound(length);
+    encoded.resize(HEADER_SIZE + compressedLength);
+    encoded[0] = static_cast<char>(codec);
+    for (size_t i = 0; i < 4; i++)
+        encoded[1 + i] = static_cast<char>((length >> (8 * i)) & 0xff);
+
+    int rc = compress2(reinterpret_cast<Bytef *>(&encoded[HEADER_SIZE]), &compressedLength,
+                       reinterpret_cast<const Bytef *>(data), length, Z_DEFAULT_COMPRESSION);
+    if (rc != Z_OK || HEADER_SIZE + compressedLength >= length)
+    {
+        encoded.clear();
+        return false;
+    }
+    encoded.resize(HEADER_SIZE + compressedLength);
+    return true;
+}
+
+// Expand a payload read from an audit table. Payloads that weren't
+// compressed are copied. Returns false if a compressed payload is corrupt.
+bool
+AuditCodec::decode(const char * data, size_t length, string & decoded)
+{
+    if (!isEncoded(data, length))
+    {
+        decoded.assign(data, length);
+        return true;
+    }
+
+    uLongf decodedLength = 0;
+    for (size_t i = 0; i < 4; i++)
+        decodedLength |= static_cast<uLongf>(static_cast<unsigned char>(data[1 + i])) << (8 * i);
+    decoded.resize(decodedLength);
+    if (decodedLength == 0) return true;
+
+    int rc = uncompress(reinterpret_cast<Bytef *>(&decoded[0]), &decodedLength,
+                        reinterpret_cast<const Bytef *>(data + HEADER_SIZE), length - HEADER_SIZE);
+    if (rc != Z_OK || decodedLength != decoded.size())
+    {
+        decoded.clear();
+        return false;
+    }
+    return true;
+}
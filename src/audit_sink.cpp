@@ -0,0 +1,296 @@
+#include <map>
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/weak_ptr.hpp>
+
+#include "audit_sink.h"
+
+using namespace std;
+using namespace boost;
+
+typedef std::map<string, boost::weak_ptr<AuditSink> > SinkMap;
+
+static boost::mutex auditSinksMutex;
+static SinkMap      auditSinks;  // by audit database, dictionary and credentials
+
+static bool
+isEarlierTarget(const AuditSink::Record * left, const AuditSink::Record * right)
+{
+    return left->target_.get() < right->target_.get();
+}
+
+
+//                                      A U D I T  S I N K
+
+AuditSink::Target::Target(const string & insertStatement, const string & batchStatement)
+:   insertStatement_(insertStatement),
+    batchStatement_(batchStatement),
+    queued_(0),
+    writtenThrough_(0)
+{
+}
+
+// Find the sink for an audit database, creating it if this is the first
+// observer to audit there. The writer count, batch size and flush interval
+// are those of the observer that creates the sink. The writers connect
+// through the given backend, so a sink can run without a server.
+boost::shared_ptr<AuditSink>
+AuditSink::getSink(const char *               databaseName,
+                   const char *               statementPath,
+                   MySqlConnection *          conn,
+                   int                        writers,
+                   int                        batchSize,
+                   posix_time::time_duration  flushInterval,
+                   BackendType                backendType)
+{
+    stringstream key;
+    key << backendType << ":" << conn->getUser() << "@" << conn->getHost() << ":" << conn->getPort()
+        << ":" << (conn->getSocket() == NULL ? "" : conn->getSocket())
+        << "/" << databaseName << " " << statementPath;
+
+    boost::lock_guard<boost::mutex> lock(auditSinksMutex);
+    boost::shared_ptr<AuditSink> sink = auditSinks[key.str()].lock();
+    if (sink) return sink;
+
+    sink.reset(new AuditSink(batchSize, flushInterval));
+    if (sink->open(databaseName, statementPath, conn, writers, backendType) != 0)
+        return boost::shared_ptr<AuditSink>();
+    auditSinks[key.str()] = sink;
+    return sink;
+}
+
+AuditSink::AuditSink(int batchSize, posix_time::time_duration flushInterval)
+:   batchSize_(std::max(batchSize, 1)),
+    flushInterval_(flushInterval),
+    queue_(1024),
+    pending_(0),
+    urgent_(0),
+    isFlushing_(false),
+    isRunning_(false)
+{
+}
+
+AuditSink::~AuditSink()
+{
+    close();
+}
+
+// Connect the writers, using the credentials of the observed connection
+int
+AuditSink::open(const char * databaseName, const char * statementPath, MySqlConnection * conn, int writers,
+                BackendType backendType)
+{
+    for (int i = 0; i < std::max(writers, 1); i++)
+    {
+        stringstream connectionName;
+        connectionName << "audit_" << databaseName << "_" << i;
+        boost::shared_ptr<Writer> writer(new Writer);
+        writer->conn_ = MySqlConnection::createConnection(connectionName.str().c_str(),
+                                                          databaseName,
+                                                          statementPath,
+                                                          conn->getUser(),
+                                                          conn->getPassword(),
+                                                          conn->getHost(),
+                                                          conn->getPort(),
+                                                          conn->getSocket());
+        writer->conn_->setBackend(backendType);
+        if (writer->conn_->open() != 0)
+        {
+            CONN_LOG(writer->conn_, error) << "Error connecting to audit database " << databaseName
+                                           << ": " << writer->conn_->getErrorMessage();
+            close();
+            return -1;
+        }
+        writers_.push_back(writer);
+    }
+
+    isRunning_ = true;
+    for (size_t i = 0; i < writers_.size(); i++)
+        writers_[i]->thread_ = boost::thread(boost::bind(&AuditSink::runWriter, this, writers_[i].get()));
+    return 0;
+}
+
+// Stop the writers once they have written what's queued
+void
+AuditSink::close()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(idleMutex_);
+        isRunning_ = false;
+    }
+    idleCv_.notify_all();
+    for (size_t i = 0; i < writers_.size(); i++)
+        if (writers_[i]->thread_.joinable()) writers_[i]->thread_.join();
+    writers_.clear();
+
+    Record * record;
+    while (queue_.pop(record)) delete record;
+}
+
+// Queue a record, and wake a writer if the record starts a batch (so that the
+// writer can time it), completes one, or is being waited for. The sink takes
+// ownership of the record. Returns the record's position in its target's
+// records, which is what to wait for to be sure the record is written.
+uint64_t
+AuditSink::push(Record * record)
+{
+    uint64_t count = ++record->target_->queued_;
+    record->position_ = count;
+    bool isUrgent = record->isUrgent_;
+    int pending = ++pending_;
+    if (isUrgent) ++urgent_;
+    queue_.push(record);  // a writer may delete the record from here on
+
+    if (pending == 1 || pending % batchSize_ == 0 || isUrgent)
+    {
+        boost::lock_guard<boost::mutex> lock(idleMutex_);
+        if (pending == 1) oldestTime_ = posix_time::microsec_clock::universal_time();
+        idleCv_.notify_one();
+    }
+    return count;
+}
+
+bool
+AuditSink::Target::isWritten(uint64_t position)
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    return position <= writtenThrough_ || writtenAhead_.count(position) > 0;
+}
+
+// Wait until the target's records up to the given position are written
+void
+AuditSink::waitForWritten(Target & target, uint64_t count)
+{
+    boost::unique_lock<boost::mutex> lock(target.mutex_);
+    while (target.writtenThrough_ < count)
+        target.writtenCv_.wait(lock);
+}
+
+// Write what's queued now, without waiting for a full batch
+void
+AuditSink::flush()
+{
+    boost::lock_guard<boost::mutex> lock(idleMutex_);
+    if (pending_ == 0) return;
+    isFlushing_ = true;
+    idleCv_.notify_all();
+}
+
+// The first writer's connection, for observers to prepare their audit tables
+MySqlConnection *
+AuditSink::lockSetupConnection(boost::unique_lock<boost::mutex> & lock)
+{
+    boost::unique_lock<boost::mutex> writerLock(writers_[0]->mutex_);
+    lock.swap(writerLock);
+    return writers_[0]->conn_.get();
+}
+
+// Wait until there is a batch's worth of records, the oldest record has waited
+// the flush interval, someone is waiting for a record, or there is a flush;
+// then write up to a batch. When the sink is closed, write what's left.
+void
+AuditSink::runWriter(Writer * writer)
+{
+    std::vector<Record *> records;
+    records.reserve(batchSize_);
+    while (true)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(idleMutex_);
+            while (isRunning_ && !isFlushing_ && urgent_ == 0 && pending_ < batchSize_)
+            {
+                if (pending_ == 0)
+                    idleCv_.wait(lock);
+                else if (!idleCv_.timed_wait(lock, oldestTime_ + flushInterval_))
+                    break;
+            }
+            if (!isRunning_ && pending_ <= 0) return;
+        }
+
+        Record * record;
+        while (static_cast<int>(records.size()) < batchSize_ && queue_.pop(record))
+        {
+            records.push_back(record);
+            --pending_;
+            if (record->isUrgent_) --urgent_;
+        }
+        {
+            boost::lock_guard<boost::mutex> lock(idleMutex_);
+            if (pending_ <= 0)
+                isFlushing_ = false;
+            else
+                oldestTime_ = posix_time::microsec_clock::universal_time();
+        }
+
+        if (records.empty()) continue;
+        write(writer, records);
+        records.clear();
+    }
+}
+
+// Write the records, grouped by target: a multi-row insert per target, if it
+// has a batch statement, or an insert per record. Records are counted as
+// written even if the insert fails (the error is logged), so that no one
+// waits forever. With more than one writer, records finish out of order, so
+// a target is written through a position only once every record up to it
+// is; each group that moves that position wakes the target's waiters, as
+// the records a waiter needs may be finished by a group that has none of
+// the urgent ones.
+void
+AuditSink::write(Writer * writer, std::vector<Record *> & records)
+{
+    std::stable_sort(records.begin(), records.end(), isEarlierTarget);
+
+    boost::lock_guard<boost::mutex> lock(writer->mutex_);
+    std::vector<Record *>::iterator begin = records.begin();
+    while (begin != records.end())
+    {
+        Target * target = (*begin)->target_.get();
+        std::vector<Record *>::iterator end = begin;
+        while (end != records.end() && (*end)->target_.get() == target)
+            ++end;
+
+        if (target->batchStatement_.empty() || end - begin == 1)
+        {
+            for (std::vector<Record *>::iterator itr = begin; itr != end; ++itr)
+            {
+                writer->conn_->executeJson(target->insertStatement_.c_str(), "", &(*itr)->row_);
+                if (writer->conn_->getReturnCode() != 0)
+                    CONN_LOG(writer->conn_, error) << "Error writing audit record: " << writer->conn_->getErrorMessage();
+            }
+        }
+        else
+        {
+            rapidjson::Document rows;
+            rows.SetArray();
+            for (std::vector<Record *>::iterator itr = begin; itr != end; ++itr)
+            {
+                Value row;
+                row.CopyFrom((*itr)->row_, rows.GetAllocator());
+                rows.PushBack(row, rows.GetAllocator());
+            }
+            writer->conn_->executeJson(target->batchStatement_.c_str(), "", &rows);
+            if (writer->conn_->getReturnCode() != 0)
+                CONN_LOG(writer->conn_, error) << "Error writing audit records: " << writer->conn_->getErrorMessage();
+        }
+
+        bool isAdvanced = false;
+        {
+            boost::lock_guard<boost::mutex> targetLock(target->mutex_);
+            for (std::vector<Record *>::iterator itr = begin; itr != end; ++itr)
+                target->writtenAhead_.insert((*itr)->position_);
+            std::set<uint64_t>::iterator next = target->writtenAhead_.begin();
+            while (next != target->writtenAhead_.end() && *next == target->writtenThrough_ + 1)
+            {
+                target->writtenThrough_++;
+                target->writtenAhead_.erase(next++);
+                isAdvanced = true;
+            }
+        }
+        if (isAdvanced) target->writtenCv_.notify_all();
+        for (std::vector<Record *>::iterator itr = begin; itr != end; ++itr)
+            delete *itr;
+        begin = end;
+    }
+}
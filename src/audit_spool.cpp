@@ -0,0 +1,481 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+
+#include "audit_spool.h"
+
+using namespace std;
+using namespace boost;
+
+static const char SPOOL_MAGIC[8] = { 'A', 'U', 'D', 'S', 'P', 'O', 'O', 'L' };
+
+
+//                                      A U D I T  F I E L D
+
+void
+AuditField::setInt(int64_t value)
+{
+    type_ = INT_FIELD;
+    value_ = value;
+}
+
+void
+AuditField::setString(const char * data, size_t length)
+{
+    type_ = STRING_FIELD;
+    data_ = data;
+    length_ = static_cast<uint32_t>(length);
+}
+
+void
+AuditField::setTime(const posix_time::ptime & time)
+{
+    if (time.is_not_a_date_time()) return;
+    type_ = TIME_FIELD;
+    value_ = (time - posix_time::ptime(gregorian::date(1970, 1, 1))).total_microseconds();
+}
+
+void
+AuditField::toValue(Value & value, Document::AllocatorType & allocator) const
+{
+    switch (type_)
+    {
+        case INT_FIELD:
+            value.SetInt64(value_);
+            break;
+        case STRING_FIELD:
+            value.SetString(data_, length_, allocator);
+            break;
+        case TIME_FIELD:
+        {
+            posix_time::ptime time = posix_time::ptime(gregorian::date(1970, 1, 1)) + posix_time::microseconds(value_);
+            const string timeString = posix_time::to_iso_extended_string(time);
+            value.SetString(timeString.c_str(), timeString.size(), allocator);
+            break;
+        }
+        default:
+            value.SetNull();
+            break;
+    }
+}
+
+
+//                                      A U D I T  S P O O L
+
+AuditSpool::AuditSpool(const string &               directory,
+                       const string &               name,
+                       size_t                       segmentSize,
+                       const std::vector<string> &  columnNames,
+                       MySqlConnection *            auditConn,
+                       const string &               insertStatement,
+                       int                          batchSize,
+                       posix_time::time_duration    shipInterval)
+:   directory_(directory),
+    name_(name),
+    segmentSize_(segmentSize),
+    columnNames_(columnNames),
+    auditConn_(auditConn),
+    insertStatement_(insertStatement),
+    batchSize_(batchSize),
+    shipInterval_(shipInterval),
+    lockFd_(-1),
+    pendingRecords_(0),
+    isShipperRunning_(false)
+{
+}
+
+AuditSpool::~AuditSpool()
+{
+    close();
+}
+
+// Take the spool directory for this process, pick up the segments left by an
+// earlier run (they are sealed, and shipped first), start a new segment, and
+// start the shipper
+int
+AuditSpool::open()
+{
+    stringstream errorMessage;
+
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(directory_, ec);
+    if (ec)
+    {
+        errorMessage << "Cannot create audit spool directory " << directory_ << ": " << ec.message();
+        return reportError(errorMessage);
+    }
+
+    const string lockPath = directory_ + "/" + name_ + ".lock";
+    lockFd_ = ::open(lockPath.c_str(), O_RDWR | O_CREAT, 0644);
+    if (lockFd_ < 0 || flock(lockFd_, LOCK_EX | LOCK_NB) != 0)
+    {
+        errorMessage << "Audit spool " << lockPath << " is in use by another process";
+        return reportError(errorMessage);
+    }
+
+    std::vector<unsigned> numbers;
+    const string prefix = name_ + ".";
+    const string suffix = ".spool";
+    for (boost::filesystem::directory_iterator itr(directory_, ec); !ec && itr != boost::filesystem::directory_iterator(); ++itr)
+    {
+        const string fileName = itr->path().filename().string();
+        if (   fileName.size() <= prefix.size() + suffix.size()
+            || fileName.compare(0, prefix.size(), prefix) != 0
+            || fileName.compare(fileName.size() - suffix.size(), suffix.size(), suffix) != 0)
+            continue;
+        numbers.push_back(strtoul(fileName.c_str() + prefix.size(), NULL, 10));
+    }
+    std::sort(numbers.begin(), numbers.end());
+
+    for (std::vector<unsigned>::const_iterator itr = numbers.begin(); itr != numbers.end(); ++itr)
+    {
+        Segment segment;
+        if (openSegment(*itr, false, segment) != 0) continue;  // left in place, for inspection
+        segment.header()->isSealed_ = 1;
+        segments_.push_back(segment);
+    }
+    if (!segments_.empty())
+        CONN_LOG(auditConn_, info) << "Audit spool " << name_ << " recovered " << segments_.size() << " segments";
+
+    Segment current;
+    if (openSegment(numbers.empty() ? 1 : numbers.back() + 1, true, current) != 0) return -1;
+    segments_.push_back(current);
+
+    isShipperRunning_ = true;
+    shipThread_ = boost::thread(boost::bind(&AuditSpool::runShipper, this));
+    return 0;
+}
+
+// Map a segment file. A new segment's space is allocated up front, so that a
+// full disk is reported here instead of faulting on a write to the mapping.
+int
+AuditSpool::openSegment(unsigned number, bool isNew, Segment & segment)
+{
+    stringstream errorMessage;
+    char fileName[32];
+    snprintf(fileName, sizeof(fileName), ".%08u.spool", number);
+    segment.number_ = number;
+    segment.path_ = directory_ + "/" + name_ + fileName;
+
+    segment.fd_ = ::open(segment.path_.c_str(), isNew ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0644);
+    if (segment.fd_ < 0)
+    {
+        errorMessage << "Cannot open audit spool segment " << segment.path_ << ": " << strerror(errno);
+        return reportError(errorMessage);
+    }
+
+    if (isNew)
+    {
+        segment.size_ = segmentSize_;
+        int rc = posix_fallocate(segment.fd_, 0, segment.size_);
+        if (rc != 0)
+        {
+            errorMessage << "Cannot allocate audit spool segment " << segment.path_ << ": " << strerror(rc);
+            closeSegment(segment, true);
+            return reportError(errorMessage);
+        }
+    }
+    else
+    {
+        struct stat fileStat;
+        if (fstat(segment.fd_, &fileStat) != 0 || static_cast<size_t>(fileStat.st_size) < DATA_OFFSET)
+        {
+            errorMessage << "Audit spool segment " << segment.path_ << " is truncated";
+            closeSegment(segment, false);
+            return reportError(errorMessage);
+        }
+        segment.size_ = fileStat.st_size;
+    }
+
+    void * base = mmap(NULL, segment.size_, PROT_READ | PROT_WRITE, MAP_SHARED, segment.fd_, 0);
+    if (base == MAP_FAILED)
+    {
+        errorMessage << "Cannot map audit spool segment " << segment.path_ << ": " << strerror(errno);
+        closeSegment(segment, isNew);
+        return reportError(errorMessage);
+    }
+    segment.base_ = static_cast<char *>(base);
+
+    SegmentHeader * header = segment.header();
+    if (isNew)
+    {
+        memcpy(header->magic_, SPOOL_MAGIC, sizeof(SPOOL_MAGIC));
+        header->fieldCount_ = columnNames_.size();
+        header->isSealed_ = 0;
+        header->writeOffset_ = DATA_OFFSET;
+        header->shippedOffset_ = DATA_OFFSET;
+        return 0;
+    }
+
+    if (   memcmp(header->magic_, SPOOL_MAGIC, sizeof(SPOOL_MAGIC)) != 0
+        || header->writeOffset_ > segment.size_
+        || header->shippedOffset_ > header->writeOffset_)
+        errorMessage << "Audit spool segment " << segment.path_ << " is corrupt";
+    else if (header->fieldCount_ != columnNames_.size())
+        errorMessage << "Audit spool segment " << segment.path_ << " has " << header->fieldCount_
+                     << " fields per record, the audit table has " << columnNames_.size();
+    if (!errorMessage.str().empty())
+    {
+        closeSegment(segment, false);
+        return reportError(errorMessage);
+    }
+    return 0;
+}
+
+void
+AuditSpool::closeSegment(Segment & segment, bool isRemove)
+{
+    if (segment.base_ != NULL) munmap(segment.base_, segment.size_);
+    if (segment.fd_ >= 0) ::close(segment.fd_);
+    if (isRemove) unlink(segment.path_.c_str());
+    segment.base_ = NULL;
+    segment.fd_ = -1;
+}
+
+// Copy a record to the end of the current segment, starting a new segment if
+// it doesn't fit. The record becomes visible to the shipper when the write
+// offset moves past it, after it has been completely copied.
+int
+AuditSpool::append(const FieldList & fields)
+{
+    size_t length = sizeof(RecordHeader) + fields.size() * sizeof(FieldSlot);
+    for (FieldList::const_iterator itr = fields.begin(); itr != fields.end(); ++itr)
+        if ((*itr).type_ == AuditField::STRING_FIELD) length += (*itr).length_;
+    length = (length + 7) & ~static_cast<size_t>(7);
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    if (segments_.empty()) return -1;
+
+    Segment * segment = &segments_.back();
+    if (segment->header()->writeOffset_ + length > segment->size_)
+    {
+        if (DATA_OFFSET + length > segmentSize_)
+        {
+            stringstream errorMessage;
+            errorMessage << "Audit record of " << length << " bytes is larger than an audit spool segment";
+            return reportError(errorMessage);
+        }
+        if (rotate() != 0) return -1;
+        segment = &segments_.back();
+    }
+
+    char * record = segment->base_ + segment->header()->writeOffset_;
+    RecordHeader * recordHeader = reinterpret_cast<RecordHeader *>(record);
+    recordHeader->length_ = length;
+    recordHeader->fieldCount_ = fields.size();
+    FieldSlot * slot = reinterpret_cast<FieldSlot *>(record + sizeof(RecordHeader));
+    char * data = reinterpret_cast<char *>(slot + fields.size());
+    for (FieldList::const_iterator itr = fields.begin(); itr != fields.end(); ++itr, ++slot)
+    {
+        slot->type_ = (*itr).type_;
+        slot->length_ = (*itr).type_ == AuditField::STRING_FIELD ? (*itr).length_ : 0;
+        slot->value_ = (*itr).value_;
+        if (slot->length_ == 0) continue;
+        memcpy(data, (*itr).data_, slot->length_);
+        data += slot->length_;
+    }
+    segment->header()->writeOffset_ += length;
+
+    if (++pendingRecords_ >= batchSize_) shipCv_.notify_one();
+    return 0;
+}
+
+// Start a new segment, and seal the current one
+int
+AuditSpool::rotate()
+{
+    Segment & current = segments_.back();
+    Segment next;
+    if (openSegment(current.number_ + 1, true, next) != 0) return -1;
+    current.header()->isSealed_ = 1;
+    msync(current.base_, current.header()->writeOffset_, MS_ASYNC);
+    segments_.push_back(next);
+    return 0;
+}
+
+int
+AuditSpool::sync()
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    if (segments_.empty()) return -1;
+    const Segment & segment = segments_.back();
+    if (msync(segment.base_, segment.header()->writeOffset_, MS_SYNC) != 0)
+    {
+        stringstream errorMessage;
+        errorMessage << "Cannot sync audit spool segment " << segment.path_ << ": " << strerror(errno);
+        return reportError(errorMessage);
+    }
+    return 0;
+}
+
+bool
+AuditSpool::hasUnshipped() const
+{
+    if (segments_.empty()) return false;
+    const SegmentHeader * header = segments_.front().header();
+    return header->shippedOffset_ < header->writeOffset_ || segments_.size() > 1;
+}
+
+// Write the unshipped records of the oldest segment to the audit table, a
+// batch at a time, moving the shipped offset past each batch once its insert
+// succeeds. The oldest segment is removed once it is sealed and fully shipped.
+// Returns the number of records shipped, or -1 if an insert failed.
+int
+AuditSpool::shipOldest()
+{
+    Segment * segment;
+    uint64_t offset, writeOffset;
+    bool isSealed;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        if (segments_.empty()) return 0;
+        segment = &segments_.front();  // only the shipper removes segments
+        offset = segment->header()->shippedOffset_;
+        writeOffset = segment->header()->writeOffset_;
+        isSealed = segments_.size() > 1;
+        pendingRecords_ = 0;
+    }
+
+    int shipped = 0;
+    while (offset < writeOffset)
+    {
+        rapidjson::Document rows;
+        rows.SetArray();
+        Document::AllocatorType & allocator = rows.GetAllocator();
+        uint64_t batchEnd = offset;
+        while (batchEnd < writeOffset && static_cast<int>(rows.Size()) < std::max(batchSize_, 1))
+        {
+            const char * record = segment->base_ + batchEnd;
+            const RecordHeader * recordHeader = reinterpret_cast<const RecordHeader *>(record);
+            if (   recordHeader->length_ < sizeof(RecordHeader)
+                || recordHeader->length_ > writeOffset - batchEnd
+                || recordHeader->fieldCount_ != columnNames_.size())
+            {
+                CONN_LOG(auditConn_, error) << "Audit spool segment " << segment->path_ << " is corrupt at offset "
+                                            << batchEnd << ", skipping the rest of the segment";
+                batchEnd = writeOffset;
+                break;
+            }
+
+            Value row(kObjectType);
+            const FieldSlot * slot = reinterpret_cast<const FieldSlot *>(record + sizeof(RecordHeader));
+            const char * data = reinterpret_cast<const char *>(slot + recordHeader->fieldCount_);
+            for (size_t i = 0; i < recordHeader->fieldCount_; i++, slot++)
+            {
+                AuditField field;
+                field.type_ = static_cast<AuditField::FieldType>(slot->type_);
+                field.length_ = slot->length_;
+                field.value_ = slot->value_;
+                field.data_ = data;
+                data += slot->length_;
+                if (field.isNull()) continue;
+                Value columnValue;
+                field.toValue(columnValue, allocator);
+                Value columnName(columnNames_[i].c_str(), columnNames_[i].size(), allocator);
+                row.AddMember(columnName, columnValue, allocator);
+            }
+            rows.PushBack(row, allocator);
+            batchEnd += recordHeader->length_;
+        }
+
+        if (!rows.Empty())
+        {
+            MySqlConnection::ExecutionHandle xh;
+            if (batchSize_ <= 1)
+            {
+                rapidjson::Document insertArgs;
+                insertArgs.CopyFrom(rows[0], insertArgs.GetAllocator());
+                xh = auditConn_->executeJson(insertStatement_.c_str(), "", &insertArgs);
+            }
+            else
+                xh = auditConn_->executeJson(insertStatement_.c_str(), "", &rows);
+            if (auditConn_->getReturnCode(xh) != 0)
+            {
+                CONN_LOG(auditConn_, error) << "Error shipping audit records from " << segment->path_
+                                            << ": " << auditConn_->getErrorMessage();
+                return -1;
+            }
+        }
+        shipped += rows.Size();
+        offset = batchEnd;
+        segment->header()->shippedOffset_ = offset;
+    }
+    msync(segment->base_, DATA_OFFSET, MS_ASYNC);
+
+    if (isSealed && offset == writeOffset)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        closeSegment(segments_.front(), true);
+        segments_.pop_front();
+    }
+    return shipped;
+}
+
+// Ship records when a batch has built up, or every ship interval. After a
+// failed insert, wait an interval before trying again. When stopped, make a
+// last attempt to ship what's left; anything unshipped stays in the spool.
+void
+AuditSpool::runShipper()
+{
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    while (isShipperRunning_)
+    {
+        if (pendingRecords_ < batchSize_ || !hasUnshipped())
+        {
+            shipCv_.timed_wait(lock, shipInterval_);
+            if (!hasUnshipped()) continue;
+        }
+        lock.unlock();
+        int rc = shipOldest();
+        lock.lock();
+        if (rc < 0 && isShipperRunning_) shipCv_.timed_wait(lock, shipInterval_);
+    }
+    while (hasUnshipped())
+    {
+        lock.unlock();
+        int rc = shipOldest();
+        lock.lock();
+        if (rc < 0) break;  // 0 when a sealed, fully shipped segment was removed
+    }
+}
+
+// Stop the shipper, and unmap the segments, removing those that have been
+// fully shipped
+void
+AuditSpool::close()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        if (!isShipperRunning_ && segments_.empty()) return;
+        isShipperRunning_ = false;
+    }
+    shipCv_.notify_one();
+    if (shipThread_.joinable()) shipThread_.join();
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    for (SegmentList::iterator itr = segments_.begin(); itr != segments_.end(); ++itr)
+    {
+        const SegmentHeader * header = (*itr).header();
+        bool isShipped = header->shippedOffset_ == header->writeOffset_;
+        if (!isShipped) msync((*itr).base_, header->writeOffset_, MS_SYNC);
+        closeSegment(*itr, isShipped);
+    }
+    segments_.clear();
+    if (lockFd_ >= 0) ::close(lockFd_);
+    lockFd_ = -1;
+}
+
+int
+AuditSpool::reportError(const stringstream & errorMessage)
+{
+    CONN_LOG(auditConn_, error) << errorMessage.str();
+    return -1;
+}
@@ -0,0 +1,119 @@
+#include <cstdio>
+#include <vector>
+
+#include "audit_table.h"
+
+using namespace std;
+using namespace boost;
+
+
+//                                      A U D I T  T A B L E
+
+AuditTable::AuditTable(const string & tableName, int partitionsAhead, int retentionDays)
+:   tableName_(tableName),
+    partitionsAhead_(partitionsAhead),
+    retentionDays_(retentionDays),
+    isPartitioned_(true)
+{
+}
+
+string
+AuditTable::getPartitionName(const gregorian::date & day)
+{
+    return "p" + gregorian::to_iso_string(day);
+}
+
+gregorian::date
+AuditTable::getPartitionDay(const string & partitionName)
+{
+    if (partitionName.size() != 9 || partitionName[0] != 'p') return gregorian::date(date_time::not_a_date_time);
+    try
+    {
+        return gregorian::from_undelimited_string(partitionName.substr(1));
+    }
+    catch (const std::exception &)
+    {
+        return gregorian::date(date_time::not_a_date_time);
+    }
+}
+
+// List the table's partitions, add the days from the last partition (or
+// today) through the days ahead, and drop the days past retention. A failure
+// to add or drop a partition is logged, and maintenance carries on; it is
+// retried at the next maintenance.
+int
+AuditTable::maintain(MySqlConnection * auditConn, const gregorian::date & today)
+{
+    MySqlConnection::ExecutionHandle xh = auditConn->execute("list_audit_partitions", "", "table_name", tableName_.c_str());
+    int rc = auditConn->getReturnCode(xh);
+    if (rc != 0)
+    {
+        CONN_LOG(auditConn, error) << "Error listing partitions of audit table " << tableName_
+                                   << ": " << auditConn->getErrorMessage();
+        return rc;
+    }
+
+    std::vector<gregorian::date> days;
+    const Document * results = auditConn->getResults(xh);
+    if (results != NULL && results->IsObject() && results->HasMember("rows"))
+    {
+        const Value & rows = (*results)["rows"];
+        for (Value::ConstValueIterator itrrow = rows.Begin(); itrrow != rows.End(); ++itrrow)
+        {
+            Value::ConstMemberIterator itrname = itrrow->FindMember("partition_name");
+            if (itrname == itrrow->MemberEnd() || !itrname->value.IsString())
+            {
+                CONN_LOG(auditConn, warning) << "Audit table " << tableName_ << " is not partitioned, "
+                                             << "partitions and retention are not managed";
+                isPartitioned_ = false;
+                return 0;
+            }
+            gregorian::date day = getPartitionDay(itrname->value.GetString());
+            if (!day.is_not_a_date()) days.push_back(day);
+        }
+    }
+
+    gregorian::date lastDay = today + gregorian::days(partitionsAhead_);
+    gregorian::date day = days.empty() ? today : days.back() + gregorian::days(1);
+    for (; day <= lastDay; day += gregorian::days(1))
+        addPartition(auditConn, day);
+
+    if (retentionDays_ <= 0) return 0;
+    gregorian::date firstKeptDay = today - gregorian::days(retentionDays_);
+    for (std::vector<gregorian::date>::const_iterator itr = days.begin(); itr != days.end() && *itr < firstKeptDay; ++itr)
+        dropPartition(auditConn, getPartitionName(*itr));
+    return 0;
+}
+
+int
+AuditTable::addPartition(MySqlConnection * auditConn, const gregorian::date & day)
+{
+    const string partitionName = getPartitionName(day);
+    const string partitionEnd = gregorian::to_iso_extended_string(day + gregorian::days(1));
+    MySqlConnection::ExecutionHandle xh = auditConn->execute("add_audit_partition", "",
+                                                             "table_name", tableName_.c_str(),
+                                                             "partition_name", partitionName.c_str(),
+                                                             "partition_end", partitionEnd.c_str());
+    int rc = auditConn->getReturnCode(xh);
+    if (rc != 0)
+        CONN_LOG(auditConn, warning) << "Error adding partition " << partitionName << " to audit table " << tableName_
+                                     << ": " << auditConn->getErrorMessage();
+    else
+        CONN_LOG(auditConn, info) << "Added partition " << partitionName << " to audit table " << tableName_;
+    return rc;
+}
+
+int
+AuditTable::dropPartition(MySqlConnection * auditConn, const string & partitionName)
+{
+    MySqlConnection::ExecutionHandle xh = auditConn->execute("drop_audit_partition", "",
+                                                             "table_name", tableName_.c_str(),
+                                                             "partition_name", partitionName.c_str());
+    int rc = auditConn->getReturnCode(xh);
+    if (rc != 0)
+        CONN_LOG(auditConn, warning) << "Error dropping partition " << partitionName << " from audit table " << tableName_
+                                     << ": " << auditConn->getErrorMessage();
+    else
+        CONN_LOG(auditConn, info) << "Dropped partition " << partitionName << " from audit table " << tableName_;
+    return rc;
+}
@@ -0,0 +1,242 @@
+#include <sstream>
+#include <stdexcept>
+
+#include "backend.h"
+
+using namespace std;
+
+
+//                                   M Y S Q L  B A C K E N D
+
+unique_ptr<MySqlBackend>
+MySqlBackend::createBackend(BackendType                 backendType,
+                            const rapidjson::Document * params,
+                            MySqlConnection *           conn)
+{
+    stringstream errorMessage;
+
+    switch (backendType)
+    {
+        case MYSQL_BACKEND:
+        {
+            unique_ptr<MySqlBackend> clientBackend(new MySqlClientBackend());
+            return boost::move(clientBackend);
+        }
+        case LOOPBACK_BACKEND:
+        {
+            unique_ptr<MySqlBackend> loopbackBackend(new LoopbackBackend(params, conn));
+            return boost::move(loopbackBackend);
+        }
+        case LATENCY_BACKEND:
+        {
+            unique_ptr<MySqlBackend> latencyBackend(new LatencyBackend(params, conn));
+            return boost::move(latencyBackend);
+        }
+        default:
+            errorMessage << "Invalid backend type " << backendType;
+            throw std::invalid_argument(errorMessage.str());
+    }
+}
+
+
+//                            M Y S Q L  C L I E N T  B A C K E N D
+
+MySqlClientBackend::MySqlClientBackend()
+:   db_(NULL),
+    initialDb_(NULL)
+{}
+
+MySqlClientBackend::~MySqlClientBackend()
+{
+    close();
+}
+
+int
+MySqlClientBackend::connect(const char *  host,
+                            const char *  user,
+                            const char *  password,
+                            const char *  databaseName,
+                            int           port,
+                            const char *  socket,
+                            unsigned long flags,
+                            unsigned int  readTimeout)
+{
+    close();
+    initialDb_ = mysql_init(NULL);
+    if (initialDb_ == NULL) return 1;
+    if (readTimeout > 0)
+        mysql_options(initialDb_, MYSQL_OPT_READ_TIMEOUT, &readTimeout);
+    db_ = mysql_real_connect(initialDb_, host, user, password, databaseName, port, socket, flags);
+    return db_ == NULL ? 1 : 0;
+}
+
+void
+MySqlClientBackend::close()
+{
+    if (initialDb_ != NULL) mysql_close(initialDb_);
+    initialDb_ = NULL;
+    db_ = NULL;
+}
+
+int
+MySqlClientBackend::setAutoCommit(bool isAutoCommit)
+{
+    return mysql_autocommit(db_, isAutoCommit) ? 1 : 0;
+}
+
+int
+MySqlClientBackend::commit()
+{
+    return mysql_commit(db_) ? 1 : 0;
+}
+
+int
+MySqlClientBackend::rollback()
+{
+    return mysql_rollback(db_) ? 1 : 0;
+}
+
+unsigned long
+MySqlClientBackend::getThreadId()
+{
+    return mysql_thread_id(db_);
+}
+
+int
+MySqlClientBackend::query(const char * sql)
+{
+    return mysql_query(db_, sql);
+}
+
+BackendStatement *
+MySqlClientBackend::createStatement()
+{
+    MYSQL_STMT * statementHandle = mysql_stmt_init(db_);
+    if (statementHandle == NULL) return NULL;
+    return new MySqlClientStatement(statementHandle);
+}
+
+// Before connect succeeds, the error is on the handle connect was given
+unsigned int
+MySqlClientBackend::getErrorNo()
+{
+    return initialDb_ == NULL ? 0 : mysql_errno(initialDb_);
+}
+
+const char *
+MySqlClientBackend::getError()
+{
+    return initialDb_ == NULL ? "" : mysql_error(initialDb_);
+}
+
+void
+MySqlClientBackend::startThread()
+{
+    mysql_thread_init();
+}
+
+void
+MySqlClientBackend::endThread()
+{
+    mysql_thread_end();
+}
+
+
+//                          M Y S Q L  C L I E N T  S T A T E M E N T
+
+MySqlClientStatement::MySqlClientStatement(MYSQL_STMT * statementHandle)
+:   statementHandle_(statementHandle),
+    resultsMetadata_(NULL),
+    isMetadataFetched_(false)
+{}
+
+MySqlClientStatement::~MySqlClientStatement()
+{
+    if (resultsMetadata_ != NULL) mysql_free_result(resultsMetadata_);
+    mysql_stmt_close(statementHandle_);
+}
+
+int
+MySqlClientStatement::prepare(const char * statementText, size_t length)
+{
+    return mysql_stmt_prepare(statementHandle_, statementText, length);
+}
+
+unsigned long
+MySqlClientStatement::getParamCount()
+{
+    return mysql_stmt_param_count(statementHandle_);
+}
+
+// The result metadata is fetched once, and kept while the statement is
+// re-used
+unsigned int
+MySqlClientStatement::getColumnCount()
+{
+    if (!isMetadataFetched_)
+    {
+        resultsMetadata_ = mysql_stmt_result_metadata(statementHandle_);
+        isMetadataFetched_ = true;
+    }
+    return resultsMetadata_ == NULL ? 0 : mysql_num_fields(resultsMetadata_);
+}
+
+const MYSQL_FIELD *
+MySqlClientStatement::getColumn(unsigned int icol)
+{
+    return mysql_fetch_field_direct(resultsMetadata_, icol);
+}
+
+int
+MySqlClientStatement::bindParameters(MYSQL_BIND * parameterBinds)
+{
+    return mysql_stmt_bind_param(statementHandle_, parameterBinds) ? 1 : 0;
+}
+
+int
+MySqlClientStatement::execute()
+{
+    return mysql_stmt_execute(statementHandle_);
+}
+
+uint64_t
+MySqlClientStatement::getAffectedRows()
+{
+    return mysql_stmt_affected_rows(statementHandle_);
+}
+
+int
+MySqlClientStatement::bindResults(MYSQL_BIND * columnBinds)
+{
+    return mysql_stmt_bind_result(statementHandle_, columnBinds) ? 1 : 0;
+}
+
+int
+MySqlClientStatement::fetch()
+{
+    return mysql_stmt_fetch(statementHandle_);
+}
+
+int
+MySqlClientStatement::fetchColumn(MYSQL_BIND * columnBind, unsigned int icol)
+{
+    return mysql_stmt_fetch_column(statementHandle_, columnBind, icol, 0);
+}
+
+void
+MySqlClientStatement::freeResult()
+{
+    mysql_stmt_free_result(statementHandle_);
+}
+
+unsigned int
+MySqlClientStatement::getErrorNo()
+{
+    return mysql_stmt_errno(statementHandle_);
+}
+
+const char *
+MySqlClientStatement::getError()
+{
+    return mysql_stmt_error(statementHandle_);
+}
@@ -2,6 +2,7 @@
 #include <cassert>
 #include <iostream>
 #include <fstream>
+#include <set>
 #include <sstream>
 
 #include <boost/move/make_unique.hpp>
@@ -16,6 +17,8 @@
 #include <boost/log/sources/record_ostream.hpp>
 #include <boost/log/support/date_time.hpp>
 
+#include <errmsg.h>
+
 #include "connection.h"
 #include "connection_impl.h"
 #include "execution.h"
@@ -65,6 +68,15 @@ MySqlConnection::MySqlConnection(const char *  name,
                                  bool          async)
 :  name_(name),
    databaseName_(databaseName),
+   maxExecutions_(0),
+   rejectedCount_(0),
+   shedCount_(0),
+   circuitOpenCount_(0),
+   transactionId_(0),
+   abortedTransactionId_(0),
+   submittedTransactionId_(0),
+   nextTransactionId_(1),
+   lastRequest_(0),
    isTransactions_(true),
    async_(async),
    errorNo_(0),
@@ -106,6 +118,19 @@ MySqlConnection::flushExecutionThread(RequestType requestType, int iparam, const
     executionThread_->waitForRequest(seq);
 }
 
+// Wait until the execution thread has processed a queued transaction or
+// program request (by default the last one queued) and return its return
+// code. Lets an async caller queue a whole transaction without blocking and
+// wait only for the outcome of the commit.
+int
+MySqlConnection::waitForRequest(RequestHandle rh)
+{
+    if (rh == 0) rh = lastRequest_.load();
+    if (!async_ || rh == 0) return 0;
+    ExecutionThread::Request request = executionThread_->waitForRequest(rh);
+    return request.rc_;
+}
+
 void
 MySqlConnection::addObserver(const char * observerName, ObserverType type, const rapidjson::Document * params)
 {
@@ -113,6 +138,18 @@ MySqlConnection::addObserver(const char * observerName, ObserverType type, const
     observers_.push_back(boost::move(observer)); 
 }
 
+MySqlObserver *
+MySqlConnection::getObserver(const char * observerName) const
+{
+    for (ObserverList::const_iterator itrobs = observers_.begin();
+         itrobs != observers_.end();
+         ++itrobs)
+    {
+        if (strcmp((*itrobs)->getName(), observerName) == 0) return itrobs->get();
+    }
+    return NULL;
+}
+
 bool
 MySqlConnection::isReplay() const
 {
@@ -125,11 +162,39 @@ MySqlConnection::isReplay() const
     return false;
 }
 
+// In async mode program boundaries are queued in order with the executions
+// and applied by the execution thread, so the caller doesn't wait for the
+// thread to drain.
 void
 MySqlConnection::startProgram(const char * programName) 
 {
-    if (async_) flushExecutionThread(START_PROGRAM_REQUEST, 0, programName);
-    currentProgram_.push_back(programName);
+    if (!async_) return applyStartProgram(programName);
+    {
+        boost::lock_guard<boost::mutex> lock(contextMutex_);
+        submittedPrograms_.push_back(programName);
+    }
+    lastRequest_ = executionThread_->putRequest(START_PROGRAM_REQUEST, 0, programName);
+}
+
+void
+MySqlConnection::endProgram(const char * programName) 
+{
+    if (!async_) return applyEndProgram(programName);
+    {
+        boost::lock_guard<boost::mutex> lock(contextMutex_);
+        std::vector<string>::iterator itr = std::find(submittedPrograms_.begin(), submittedPrograms_.end(), programName);
+        if (itr != submittedPrograms_.end()) submittedPrograms_.erase(itr);
+    }
+    lastRequest_ = executionThread_->putRequest(END_PROGRAM_REQUEST, 0, programName);
+}
+
+void
+MySqlConnection::applyStartProgram(const char * programName) 
+{
+    {
+        boost::lock_guard<boost::mutex> lock(contextMutex_);
+        currentProgram_.push_back(programName);
+    }
     for (ObserverList::const_iterator itrobs = observers_.begin();
          itrobs != observers_.end();
          ++itrobs)
@@ -139,15 +204,15 @@ MySqlConnection::startProgram(const char * programName)
 }
 
 void
-MySqlConnection::endProgram(const char * programName) 
+MySqlConnection::applyEndProgram(const char * programName) 
 {
-    if (async_) flushExecutionThread(END_PROGRAM_REQUEST, 0, programName);
     for (ObserverList::iterator itrobs = observers_.begin();
          itrobs != observers_.end();
          ++itrobs)
     {
         (*itrobs)->endProgram(programName);
     }
+    boost::lock_guard<boost::mutex> lock(contextMutex_);
     for (std::vector<string>::iterator itr = currentProgram_.begin();
          itr != currentProgram_.end();
          ++itr)
@@ -163,6 +228,7 @@ MySqlConnection::endProgram(const char * programName)
 string
 MySqlConnection::getCurrentProgram() const
 {
+    boost::lock_guard<boost::mutex> lock(contextMutex_);
     string currentProgram;
     for (std::vector<string>::const_iterator itr = currentProgram_.begin();
          itr != currentProgram_.end();
@@ -184,6 +250,30 @@ MySqlConnection::execute(const char * statementName, const char * comment,  ...)
     return doExecute(execution);
 }
 
+MySqlConnection::ExecutionHandle
+MySqlConnection::executeWithPriority(ExecutionPriority priority, const char * statementName, const char * comment,  ...)
+{
+    va_list args;
+    va_start(args, comment);
+
+    MySqlExecution * execution = new MySqlExecution(statementName, comment, args, this, impl_.get());
+    execution->setPriority(priority);
+    return doExecute(execution);
+}
+
+// Fail the execution with MySqlExecution::TIMEOUT_ERROR if it hasn't completed
+// within 'timeoutMs' of being submitted. Overrides the dictionary 'timeout_ms'
+MySqlConnection::ExecutionHandle
+MySqlConnection::executeWithTimeout(unsigned int timeoutMs, const char * statementName, const char * comment,  ...)
+{
+    va_list args;
+    va_start(args, comment);
+
+    MySqlExecution * execution = new MySqlExecution(statementName, comment, args, this, impl_.get());
+    execution->setTimeout(timeoutMs);
+    return doExecute(execution);
+}
+
 MySqlConnection::ExecutionHandle
 MySqlConnection::executeJson(const char * statementName, const char * comment,  const Document * paramSettings ...)
 {
@@ -208,63 +298,146 @@ MySqlConnection::doExecute(MySqlExecution * execution)
 {
     stringstream errorMessage;
 
-    executions_.push_back(shared_ptr<MySqlExecution>(execution));
+    executions_.add(execution);
     int rc = execution->prepareToExecute(); 
     if (rc != 0) return execution->getHandle();
 
     // If the connection is asynchronous, queue the prepared statement to the execution thread and return
     if (async_)
     {
-        ExecutionThread::RequestSequence seq = executionThread_->putRequest(EXECUTION_REQUEST, execution->getHandle());
+        if (breaker_.isOpen())
+            return rejectExecution(execution, CIRCUIT_OPEN_ERROR, "circuit breaker open");
+        {
+            boost::lock_guard<boost::mutex> lock(contextMutex_);
+            execution->setTransactionId(submittedTransactionId_);
+        }
+        ExecutionThread::RequestSequence seq = executionThread_->putExecutionRequest(execution, getTenant());
+        if (seq == 0)
+            return rejectExecution(execution, QUEUE_FULL_ERROR, "execution queue full");
         execution->setRequestSequence(seq);
     }
     // ... else the connection is synchronous: send to MySql and wait for results
     else
+    {
+        if (!breaker_.allow())
+            return rejectExecution(execution, CIRCUIT_OPEN_ERROR, "circuit breaker open");
         execution->execute();
+        if (breaker_.record(execution->getReturnCode()))
+            CONN_LOG(this, warning) << "Circuit breaker opened after error " << execution->getReturnCode();
+        trimExecutions();
+    }
+
+    return execution->getHandle();
+}
 
+// Fail an execution turned away under overload, without sending it to the server
+MySqlConnection::ExecutionHandle
+MySqlConnection::rejectExecution(MySqlExecution * execution, int errorNo, const char * reason)
+{
+    switch (errorNo)
+    {
+        case QUEUE_FULL_ERROR:   rejectedCount_++;    break;
+        case CIRCUIT_OPEN_ERROR: circuitOpenCount_++; break;
+        case REQUEST_SHED_ERROR: shedCount_++;        break;
+    }
+    stringstream errorMessage;
+    errorMessage << "Rejected " << *execution << ": " << reason;
+    execution->reportError(errorMessage, errorNo);
     return execution->getHandle();
 }
+
+// Drop the oldest completed executions once the registry passes its limit.
+// Executions still queued, and those holding a statement handle for re-use,
+// are kept. Called on the thread that runs executions.
+void
+MySqlConnection::trimExecutions()
+{
+    if (maxExecutions_ == 0) return;
+    size_t removed = executions_.trim(maxExecutions_, MySqlConnectionImpl::isRetiredExecution);
+    if (removed > 0)
+        CONN_LOG(this, trace) << "Released " << removed << " completed executions";
+}
+
+void
+MySqlConnection::setQueueLimit(size_t maxQueueDepth, OverloadPolicy policy)
+{
+    if (executionThread_) executionThread_->setQueueLimit(maxQueueDepth, policy);
+}
+
+void
+MySqlConnection::setCircuitBreaker(int failureThreshold, unsigned int cooldownMs)
+{
+    breaker_.configure(failureThreshold, cooldownMs);
+}
+
+void
+MySqlConnection::setExecutionRetention(size_t maxExecutions)
+{
+    maxExecutions_ = maxExecutions;
+}
+
+MySqlConnection::OverloadStats
+MySqlConnection::getOverloadStats() const
+{
+    OverloadStats stats;
+    stats.rejected_ = rejectedCount_;
+    stats.shed_ = shedCount_;
+    stats.circuitOpen_ = circuitOpenCount_;
+    return stats;
+}
     
 // Using the execution handle, look up the execution. If the connection is async
 // wait until it is complete (i.e. wait until the execution thread's completed 
 // request counter exceeds the execution's request id).
-MySqlExecution *  
+shared_ptr<MySqlExecution>
 MySqlConnection::getCompletedExecution(ExecutionHandle xh)
 {
-    MySqlExecution * execution = findExecution(xh);
-    assert(execution != NULL);
-    if (async_ && !executionThread_->isCompleted(execution->getRequestSequence()))
-       executionThread_->waitForRequest(execution->getRequestSequence());
+    shared_ptr<MySqlExecution> execution = findExecution(xh);
+    if (!execution)
+    {
+        stringstream errorMessage;
+        if (executions_.isRetired(xh))
+        {
+            errorMessage << "Execution " << xh << " has been retired: it's older than the executions kept";
+            reportError(errorMessage, RETIRED_HANDLE_ERROR);
+        }
+        else
+        {
+            errorMessage << "No execution with handle " << xh;
+            reportError(errorMessage);
+        }
+        return execution;
+    }
+    ExecutionThread::RequestSequence seq = execution->getRequestSequence();  // 0 if never queued (failed or rejected)
+    if (async_ && seq != 0)
+       executionThread_->waitForExecution(*execution);
     return execution;
 }
 
-MySqlExecution *
+// A zero handle means the last execution submitted by the calling thread,
+// so that several threads can share an async connection and each still
+// check the return code of its own latest execution.
+shared_ptr<MySqlExecution>
 MySqlConnection::findExecution(ExecutionHandle xh)
 {
-    if (executions_.empty()) return NULL;
-    if (xh == 0) return executions_.back().get();
-    for (ExecutionList::iterator itr = executions_.begin();
-         itr != executions_.end();
-         ++itr)
-    {
-        if ((*itr)->getHandle() == xh) return (*itr).get();
-    }
-    return NULL;
+    if (xh == 0) return executions_.findLast();
+    return executions_.find(xh);
 }
 
 int
 MySqlConnection::getReturnCode(ExecutionHandle xh) 
 {
-    MySqlExecution * execution = getCompletedExecution(xh);
-    EX_LOG(this, execution, trace) << "rc " << execution->getReturnCode();
+    shared_ptr<MySqlExecution> execution = getCompletedExecution(xh);
+    if (!execution) return errorNo_;
+    EX_LOG(this, execution.get(), trace) << "rc " << execution->getReturnCode();
     return execution->getReturnCode();
 }
 
 const Document *
 MySqlConnection::getResults(ExecutionHandle xh) 
 {
-    MySqlExecution * execution = getCompletedExecution(xh);
-    if (execution != NULL)
+    shared_ptr<MySqlExecution> execution = getCompletedExecution(xh);
+    if (execution)
         return &execution->getResults();
     else
         return NULL;
@@ -273,8 +446,8 @@ MySqlConnection::getResults(ExecutionHandle xh)
 int      
 MySqlConnection::getRowCount(ExecutionHandle xh) 
 {
-    MySqlExecution * execution = getCompletedExecution(xh);
-    if (execution != NULL)
+    shared_ptr<MySqlExecution> execution = getCompletedExecution(xh);
+    if (execution)
         return execution->getRowCount();
     else
         return 0;
@@ -282,8 +455,8 @@ MySqlConnection::getRowCount(ExecutionHandle xh)
 int      
 MySqlConnection::getRowsAffected(ExecutionHandle xh) 
 {
-    MySqlExecution * execution = getCompletedExecution(xh);
-    if (execution != NULL)
+    shared_ptr<MySqlExecution> execution = getCompletedExecution(xh);
+    if (execution)
         return execution->getRowsAffected();
     else
         return 0;
@@ -296,7 +469,8 @@ bool
 MySqlConnection::assertRowsReturned(int expectedRowsReturned, ExecutionHandle xh)
 {
     stringstream errorMessage;
-    MySqlExecution * execution = getCompletedExecution(xh);
+    shared_ptr<MySqlExecution> execution = getCompletedExecution(xh);
+    if (!execution) return false;
     int rowsReturned = execution->getRowCount();
     if (rowsReturned == expectedRowsReturned) return true;
     errorMessage << *execution << " returned " << rowsReturned << (rowsReturned == 1 ? " row. " : " rows. ")
@@ -312,7 +486,8 @@ MySqlConnection::assertRowsAffected(int expectedRowsAffected, ExecutionHandle xh
 {
     stringstream errorMessage;
 
-    MySqlExecution * execution = getCompletedExecution(xh);
+    shared_ptr<MySqlExecution> execution = getCompletedExecution(xh);
+    if (!execution) return false;
     int rowsAffected = execution->getRowsAffected();
     if (rowsAffected == expectedRowsAffected) return true;
     errorMessage << *execution << " affected " << rowsAffected << (rowsAffected == 1 ? " row. " : " rows. ")
@@ -321,12 +496,142 @@ MySqlConnection::assertRowsAffected(int expectedRowsAffected, ExecutionHandle xh
     return false;
 }
 
+// In async mode transaction boundaries are queued as ordinary requests and
+// applied by the execution thread in order with the executions around them.
+// The caller is checked against the transaction state as queued, and can
+// wait for the outcome with waitForRequest.
 int 
 MySqlConnection::startTransaction(const char * transactionName)
 {
     if (!isTransactions()) return 0;
-    if (async_) flushExecutionThread(START_TRANSACTION_REQUEST, 0, transactionName);
+    if (!async_) return applyStartTransaction(0, transactionName);
+
+    stringstream errorMessage;
+    int transactionId = 0;
+    {
+        boost::lock_guard<boost::mutex> lock(contextMutex_);
+        if (submittedTransaction_.empty())
+        {
+            transactionId = nextTransactionId_++;
+            submittedTransaction_ = transactionName;
+            submittedTransactionId_ = transactionId;
+        }
+        else
+        {
+            errorMessage << "Attempt to start transaction " << transactionName
+                         << " while " << submittedTransaction_ << " in progress";
+        }
+    }
+    if (transactionId == 0) return reportError(errorMessage);
+
+    lastRequest_ = executionThread_->putRequest(START_TRANSACTION_REQUEST, transactionId, transactionName);
+    return 0;
+}
+
+int 
+MySqlConnection::commitTransaction()
+{
+    if (!isTransactions()) return 0;
+    if (!async_) return applyCommitTransaction(0);
+
+    stringstream errorMessage;
+    int transactionId = endSubmittedTransaction();
+    if (transactionId == 0)
+    {
+        errorMessage << "Commit called with no transaction in progress";
+        return reportError(errorMessage);         
+    }
+    lastRequest_ = executionThread_->putRequest(COMMIT_TRANSACTION_REQUEST, transactionId);
+    return 0;
+}
+
+int
+MySqlConnection::rollbackTransaction(const stringstream & reason)
+{
+    if (!isTransactions()) return 0;
+    if (!async_) return applyRollbackTransaction(0, reason.str());
+
+    // An execution failed on the execution thread: roll back at once. The
+    // transaction stays submitted until the caller ends it, so executions
+    // queued for it, before or after the failure, are discarded as they are
+    // dequeued (rather than run in autocommit), and its commit fails.
+    if (executionThread_->isExecutionThread())
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(contextMutex_);
+            if (transactionId_ == 0) return 0;
+            abortedTransactionId_ = transactionId_;
+        }
+        return applyRollbackTransaction(0, reason.str());
+    }
+
+    int transactionId = endSubmittedTransaction();
+    if (transactionId == 0) return 0;
+    lastRequest_ = executionThread_->putRequest(ROLLBACK_TRANSACTION_REQUEST, transactionId, reason.str().c_str());
+    return 0;
+}
+
+string
+MySqlConnection::getCurrentTransaction() const
+{
+    boost::lock_guard<boost::mutex> lock(contextMutex_);
+    return transactionName_;
+}
+
+// Executions queued by this thread are scheduled as the tenant's flow. By
+// default the flow is the outermost program queued on the connection.
+void
+MySqlConnection::setTenant(const char * tenant)
+{
+    boost::lock_guard<boost::mutex> lock(contextMutex_);
+    if (tenant == NULL)
+        tenants_.erase(boost::this_thread::get_id());
+    else
+        tenants_[boost::this_thread::get_id()] = tenant;
+}
+
+string
+MySqlConnection::getTenant() const
+{
+    boost::lock_guard<boost::mutex> lock(contextMutex_);
+    std::map<boost::thread::id, string>::const_iterator itr = tenants_.find(boost::this_thread::get_id());
+    if (itr != tenants_.end()) return itr->second;
+    return submittedPrograms_.empty() ? string() : submittedPrograms_.front();
+}
+
+void
+MySqlConnection::setPriorityWeight(ExecutionPriority priority, double weight)
+{
+    if (executionThread_) executionThread_->setPriorityWeight(priority, weight);
+}
+
+void
+MySqlConnection::setTenantWeight(const char * tenant, double weight)
+{
+    if (executionThread_) executionThread_->setTenantWeight(tenant, weight);
+}
+
+// Clear the transaction as queued by the caller, returning its id (0 if none)
+int
+MySqlConnection::endSubmittedTransaction()
+{
+    boost::lock_guard<boost::mutex> lock(contextMutex_);
+    int transactionId = submittedTransactionId_;
+    submittedTransaction_.clear();
+    submittedTransactionId_ = 0;
+    return transactionId;
+}
+
+bool
+MySqlConnection::isAbortedTransaction(int transactionId) const
+{
+    boost::lock_guard<boost::mutex> lock(contextMutex_);
+    return transactionId != 0 && transactionId == abortedTransactionId_;
+}
 
+int
+MySqlConnection::applyStartTransaction(int transactionId, const char * transactionName)
+{
     CONN_LOG(this, info) << "Starting transaction " << transactionName;
 
     stringstream errorMessage;
@@ -334,25 +639,37 @@ MySqlConnection::startTransaction(const char * transactionName)
     if (!impl_->isAutoCommit())
     {
         errorMessage << "Attempt to start transaction " << transactionName
-                     << " while " << transactionName_ << " in progress";
+                     << " while " << getCurrentTransaction() << " in progress";
         return reportError(errorMessage);         
     }
     int rc = impl_->setAutoCommit(false);
     if (rc == 0) 
     {
-        transactionName_ = transactionName;
+        {
+            boost::lock_guard<boost::mutex> lock(contextMutex_);
+            transactionName_ = transactionName;
+            transactionId_ = transactionId;
+        }
+        for (MySqlConnection::ObserverList::iterator itrobs = observers_.begin();
+             itrobs != observers_.end();
+             ++itrobs)
+        {
+            (*itrobs)->onEvent(AUDIT_START_TRANSACTION, transactionName);
+        }
     }
     return rc;
 }
 
 int 
-MySqlConnection::commitTransaction()
+MySqlConnection::applyCommitTransaction(int transactionId)
 {
-    if (!isTransactions()) return 0;
-    if (async_) flushExecutionThread(COMMIT_TRANSACTION_REQUEST);
-
     stringstream errorMessage;
 
+    if (isAbortedTransaction(transactionId))
+    {
+        errorMessage << "Commit failed: transaction was rolled back after an earlier error";
+        return reportError(errorMessage);         
+    }
     if (impl_->isAutoCommit())
     {
         errorMessage << "Commit called with no transaction in progress";
@@ -367,20 +684,20 @@ MySqlConnection::commitTransaction()
         {
             (*itrobs)->onEvent(AUDIT_COMMIT);
         }
-        CONN_LOG(this, info) << "Committed transaction " << transactionName_;
+        CONN_LOG(this, info) << "Committed transaction " << getCurrentTransaction();
+        boost::lock_guard<boost::mutex> lock(contextMutex_);
         transactionName_.clear();
+        transactionId_ = 0;
     }
     return rc;
 }
 
 int
-MySqlConnection::rollbackTransaction(const stringstream & reason)
+MySqlConnection::applyRollbackTransaction(int transactionId, const string & reason)
 {
-    if (!isTransactions()) return 0;
     if (impl_ == NULL || impl_->isAutoCommit()) return 0;
-    if (async_) flushExecutionThread(ROLLBACK_TRANSACTION_REQUEST);
+    if (isAbortedTransaction(transactionId)) return 0;
 
-    stringstream errorMessage;
     int rc = impl_->rollback();
     if (rc == 0) 
     {
@@ -388,12 +705,14 @@ MySqlConnection::rollbackTransaction(const stringstream & reason)
              itrobs != observers_.end();
              ++itrobs)
         {
-	    (*itrobs)->onEvent(AUDIT_ROLLBACK, reason.str().c_str());
+	    (*itrobs)->onEvent(AUDIT_ROLLBACK, reason.c_str());
         }
         
-        CONN_LOG(this, info) << "Rolled back transaction " << transactionName_ 
-                             << ": " << reason.str();
+        CONN_LOG(this, info) << "Rolled back transaction " << getCurrentTransaction() 
+                             << ": " << reason;
+        boost::lock_guard<boost::mutex> lock(contextMutex_);
         transactionName_.clear();
+        transactionId_ = 0;
     }
     return rc;
 }
@@ -412,6 +731,18 @@ MySqlConnection::close()
     impl_->close();
 }
 
+void
+MySqlConnection::setReadTimeout(unsigned int seconds)
+{
+    impl_->setReadTimeout(seconds);
+}
+
+int
+MySqlConnection::setBackend(BackendType type, const rapidjson::Document * params)
+{
+    return impl_->setBackend(type, params);
+}
+
 bool
 MySqlConnection::isOpen() const
 {
@@ -541,13 +872,132 @@ MySqlConnection::setFileLoglevel(loglevel::severity_level loglevel)
 }
 
 
+//                              E X E C U T I O N  R E G I S T R Y
+
+ExecutionRegistry::ExecutionRegistry()
+:  lastHandle_(0),
+   lastRetiredHandle_(0)
+{
+}
+
+ExecutionRegistry::~ExecutionRegistry()
+{
+}
+
+void
+ExecutionRegistry::add(MySqlExecution * execution)
+{
+    shared_ptr<MySqlExecution> sharedExecution(execution);
+    ExecutionHandle xh = execution->getHandle();
+    {
+        boost::unique_lock<boost::shared_mutex> lock(mutex_);
+        executions_.push_back(sharedExecution);
+        index_[xh] = sharedExecution;
+        lastHandle_ = xh;
+        threadLastHandles_[boost::this_thread::get_id()] = xh;
+    }
+}
+
+shared_ptr<MySqlExecution>
+ExecutionRegistry::find(ExecutionHandle xh) const
+{
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
+    ExecutionMap::const_iterator itr = index_.find(xh);
+    if (itr == index_.end()) return shared_ptr<MySqlExecution>();
+    return (*itr).second;
+}
+
+// Threads that have never submitted an execution on this connection
+// get the last execution submitted by anyone
+shared_ptr<MySqlExecution>
+ExecutionRegistry::findLast() const
+{
+    ExecutionHandle xh;
+    {
+        boost::shared_lock<boost::shared_mutex> lock(mutex_);
+        ThreadHandleMap::const_iterator itr = threadLastHandles_.find(boost::this_thread::get_id());
+        xh = itr != threadLastHandles_.end() ? itr->second : lastHandle_;
+    }
+    return xh == 0 ? shared_ptr<MySqlExecution>() : find(xh);
+}
+
+// Search from newest to oldest for an execution accepted by the caller's matcher
+MySqlExecution *
+ExecutionRegistry::findLatest(const ExecutionMatcher & matcher) const
+{
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
+    for (ExecutionList::const_reverse_iterator itr = executions_.rbegin();
+         itr != executions_.rend();
+         ++itr)
+    {
+        if (matcher((*itr).get())) return (*itr).get();
+    }
+    return NULL;
+}
+
+// Remove the oldest executions accepted by the caller's predicate, down to 
+// 7/8 of the limit, so that trimming doesn't happen on every addition. An
+// execution the caller hasn't released is kept: one held by a lookup (the
+// registry itself holds two references), or the last one a thread added,
+// which a zero handle refers to.
+size_t
+ExecutionRegistry::trim(size_t maxExecutions, const ExecutionMatcher & isRemovable)
+{
+    boost::unique_lock<boost::shared_mutex> lock(mutex_);
+    if (executions_.size() <= maxExecutions) return 0;
+    size_t excess = executions_.size() - (maxExecutions - maxExecutions / 8);
+    size_t removed = 0;
+    std::set<ExecutionHandle> threadLastHandles;
+    for (ThreadHandleMap::const_iterator itr = threadLastHandles_.begin(); itr != threadLastHandles_.end(); ++itr)
+        threadLastHandles.insert(itr->second);
+    ExecutionList kept;
+    kept.reserve(executions_.size());
+    for (ExecutionList::iterator itr = executions_.begin(); itr != executions_.end(); ++itr)
+    {
+        ExecutionHandle xh = (*itr)->getHandle();
+        if (   removed < excess
+            && (*itr).use_count() <= 2
+            && threadLastHandles.count(xh) == 0
+            && isRemovable((*itr).get()))
+        {
+            index_.erase(xh);
+            lastRetiredHandle_ = std::max(lastRetiredHandle_, xh);
+            removed++;
+        }
+        else
+            kept.push_back(*itr);
+    }
+    executions_.swap(kept);
+    return removed;
+}
+
+// Handles only grow, so an unknown handle below the newest retired one was
+// retired too (or belongs to another connection)
+bool
+ExecutionRegistry::isRetired(ExecutionHandle xh) const
+{
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
+    return xh != 0 && xh <= lastRetiredHandle_ && index_.find(xh) == index_.end();
+}
+
+bool
+ExecutionRegistry::empty() const
+{
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
+    return executions_.empty();
+}
+
+
 //                              E X E C U T I O N  T H R E A D
 
-int ExecutionThread::Request::nextRequestSequence_ = 1;
+boost::atomic<ExecutionThread::RequestSequence> ExecutionThread::Request::nextRequestSequence_(1);
 
 ExecutionThread::ExecutionThread(MySqlConnection * conn)
 :  conn_(conn),
-   lastCompletedRequest_(0),
+   requestQueue_(new RequestScheduler()),
+   maxQueueDepth_(0),
+   overloadPolicy_(MySqlConnection::FAIL_FAST),
+   retiredThrough_(0),
    running_(false)
 {
 }
@@ -577,68 +1027,183 @@ void
 ExecutionThread::run()
 {
     CONN_LOG(conn_, info) << "Execution thread running";
-    conn_->impl_->startMySqlThread();
+    // The backend can be set until the connection is first used, which is
+    // after the thread starts; the first request, taken from the queue under
+    // its lock, is when the backend type can safely be read
+    bool isStarted = false;
+    bool isMySqlThread = false;
     running_ = true;
     while (running_)
     {
         Request request = getRequest(); // blocks if queue is empty
+        if (!isStarted)
+        {
+            isMySqlThread = conn_->impl_->startMySqlThread();
+            isStarted = true;
+        }
         CONN_LOG(conn_, info) << "Received request " << request;
+        shared_ptr<MySqlExecution> requestExecution;   // held until the request is done, so trimming can't free it
+        if (request.type_ == MySqlConnection::EXECUTION_REQUEST)
+            requestExecution = conn_->findExecution(request.iparam_);
+        notifyObservers(request, REQUEST_STARTED, requestExecution.get());
         switch (request.type_)
         {
-            // Retrieve the prapared statement and send it to MySql
+            // Retrieve the prapared statement and send it to MySql, unless it
+            // belongs to a transaction that has already been rolled back
             case MySqlConnection::EXECUTION_REQUEST:
             {
-                MySqlExecution * execution = conn_->findExecution(request.iparam_);
+                MySqlExecution * execution = requestExecution.get();
                 assert(execution != NULL);
-                execution->execute();
+                if (request.isShed_)
+                    conn_->rejectExecution(execution, MySqlConnection::REQUEST_SHED_ERROR, "shed for higher-priority work");
+                else if (conn_->isAbortedTransaction(execution->getTransactionId()))
+                {
+                    stringstream errorMessage;
+                    errorMessage << "Transaction rolled back before " << *execution << " was executed";
+                    execution->reportError(errorMessage);
+                }
+                else if (!conn_->breaker_.allow())
+                    conn_->rejectExecution(execution, MySqlConnection::CIRCUIT_OPEN_ERROR, "circuit breaker open");
+                else
+                {
+                    execution->execute();  // fails at once if the deadline passed while queued
+                    if (conn_->breaker_.record(execution->getReturnCode()))
+                        CONN_LOG(conn_, warning) << "Circuit breaker opened after error " << execution->getReturnCode();
+                }
                 EX_LOG(conn_, execution, info) << "Request " << request.sequence_ << ": async execution complete ";
                 request.rc_ = execution->rc_;
                 request.errorNo_ = execution->errorNo_;
                 request.errorMessage_ = execution->errorMessage_;
+                conn_->trimExecutions();
                 break;
             }
 
-            // Transactions and programs are handled synchronously.
-            // These requests are used by the thread flusher to make sure
-            // all prior executions are complete.
+            // Transaction and program boundaries are applied in order with
+            // the executions queued before and after them
             case MySqlConnection::START_TRANSACTION_REQUEST:
+                request.rc_ = conn_->applyStartTransaction(request.iparam_, request.strparam_.c_str());
+                break;
+
             case MySqlConnection::COMMIT_TRANSACTION_REQUEST:
+                request.rc_ = conn_->applyCommitTransaction(request.iparam_);
+                break;
+
             case MySqlConnection::ROLLBACK_TRANSACTION_REQUEST:
+                request.rc_ = conn_->applyRollbackTransaction(request.iparam_, request.strparam_);
+                break;
+
             case MySqlConnection::START_PROGRAM_REQUEST:
+                conn_->applyStartProgram(request.strparam_.c_str());
+                break;
+
             case MySqlConnection::END_PROGRAM_REQUEST:
+                conn_->applyEndProgram(request.strparam_.c_str());
                 break;
 
             case MySqlConnection::KILL_THREAD_REQUEST:
                 running_ = false;
                 break;
         }
+        if (request.rc_ != 0 && request.type_ != MySqlConnection::EXECUTION_REQUEST)
+        {
+            request.errorNo_ = conn_->getErrorNo();
+            request.errorMessage_ = conn_->getErrorMessage();
+        }
 
-	// update last-completed sequence and notify any threads awaiting completion of a request
+        notifyObservers(request, REQUEST_COMPLETED, requestExecution.get());
+
+	// record the completed request and notify any threads awaiting completion of a request.
+        // An execution's outcome is in the execution, so only the fact that it completed is
+        // recorded there; other requests are kept until there are too many, oldest dropped first
         {
             boost::lock_guard<mutex> lock(completionMutex_);
-            lastCompletedRequest_ = request.sequence_;
-            completedRequests_[request.sequence_] = boost::move(request);
+            if (request.type_ == MySqlConnection::EXECUTION_REQUEST)
+                requestExecution->setRequestCompleted();
+            else
+            {
+                completionOrder_.push_back(request.sequence_);
+                completedRequests_[request.sequence_] = boost::move(request);
+                if (completionOrder_.size() > MAX_COMPLETED_REQUESTS)
+                {
+                    retiredThrough_ = completionOrder_.front();
+                    completedRequests_.erase(retiredThrough_);
+                    completionOrder_.pop_front();
+                }
+            }
         }
         completionCv_.notify_all();
     }  
-    conn_->impl_->endMySqlThread();
+    if (isMySqlThread) conn_->impl_->endMySqlThread();
     CONN_LOG(conn_, info) << "Execution thread terminated" << endl;  
 }
 
-// The main thread queues a request and notifies the request condition-variable,
+// A caller queues a request and notifies the request condition-variable,
 // which will wake up the execution thread if it's waiting. Returns the sequence
-// number assigned to the request
+// number assigned to the request. Everything but an execution is ordered.
 ExecutionThread::RequestSequence
 ExecutionThread::putRequest(RequestType type, int iparam, const char * strparam)
 {
-    RequestSequence seq;
+    Request request(type, iparam, strparam);
+    RequestSequence seq = queueRequest(request);
+    notifyObservers(request, REQUEST_QUEUED, NULL);
+    return seq;
+}
+
+// Executions are scheduled by priority class and tenant, except within a
+// transaction, where they must reach the server in the order they were queued
+ExecutionThread::RequestSequence
+ExecutionThread::putExecutionRequest(const MySqlExecution * execution, const string & tenant)
+{
+    Request request(MySqlConnection::EXECUTION_REQUEST, execution->getHandle(), NULL);
+    request.priority_ = execution->getPriority();
+    request.tenant_ = tenant;
+    request.isOrdered_ = execution->getTransactionId() != 0;
+    RequestSequence seq = queueRequest(request);
+    if (seq != 0) notifyObservers(request, REQUEST_QUEUED, execution);
+    return seq;
+}
+
+// Sequence numbers are assigned under the queue lock, so they follow the order
+// in which requests were queued. If the queue holds its limit of executions, 
+// a new execution is admitted according to the overload policy; transaction
+// and program boundaries are always admitted. Returns 0 if the execution
+// is rejected.
+ExecutionThread::RequestSequence
+ExecutionThread::queueRequest(Request & request)
+{
     {
-        boost::lock_guard<mutex> lock(requestMutex_);
-        requestQueue_.push_front(Request(type, iparam, strparam));
-        seq = requestQueue_.front().sequence_;
+        boost::unique_lock<mutex> lock(requestMutex_);
+        if (request.type_ == MySqlConnection::EXECUTION_REQUEST && maxQueueDepth_ > 0)
+        {
+            if (overloadPolicy_ == MySqlConnection::BLOCK_WHEN_FULL && !isExecutionThread())
+            {
+                while (maxQueueDepth_ > 0 && requestQueue_->executionCount() >= maxQueueDepth_)
+                    spaceCv_.wait(lock);
+            }
+            else if (requestQueue_->executionCount() >= maxQueueDepth_)
+            {
+                if (   overloadPolicy_ != MySqlConnection::DROP_LOWEST_PRIORITY 
+                    || !requestQueue_->shedLowest(request.priority_))
+                    return 0;
+            }
+        }
+        request.sequence_ = Request::nextRequestSequence_++;
+        request.queueTick_ = PhaseClock::now();
+        requestQueue_->put(request);
     }
     requestCv_.notify_one();
-    return seq;
+    return request.sequence_;
+}
+
+void
+ExecutionThread::notifyObservers(const Request & request, RequestEvent event, const MySqlExecution * execution)
+{
+    for (MySqlConnection::ObserverList::const_iterator itrobs = conn_->observers_.begin();
+         itrobs != conn_->observers_.end();
+         ++itrobs)
+    {
+        (*itrobs)->onRequest(request, event, execution);
+    }
 }
 
 // The execution thread waits until there is a request in the queue.
@@ -646,38 +1211,88 @@ ExecutionThread::Request
 ExecutionThread::getRequest()
 {
     boost::unique_lock<boost::mutex> lock(requestMutex_);
-    while (requestQueue_.empty())
+    while (requestQueue_->empty())
         requestCv_.wait(lock);
-    Request request = boost::move(requestQueue_.back());
-    requestQueue_.pop_back();
-    return boost::move(request);
+    Request request = requestQueue_->get();
+    spaceCv_.notify_all();
+    return request;
 }
 
-// The main thread waits until the execution thread processes 
-// a specific request. The caller passes in the sequence number
-// assigned to the request, and blocks as long as 'lastCompletedRequest_'
-// is less than request. It waits on the condition variable that
-// is notified each time a request is processed.
+// A caller waits until the execution thread processes a specific
+// transaction or program request. Requests can complete out of order, so it
+// waits on the condition variable that is notified each time a request is
+// processed until the request shows up in the completed-request map. These
+// requests complete in the order they were queued, so one at or before the
+// last dropped from the map was dropped, and its outcome is lost.
 ExecutionThread::Request
 ExecutionThread::waitForRequest(RequestSequence seq)
 {
-    if (seq > lastCompletedRequest_)
+    boost::unique_lock<boost::mutex> lock(completionMutex_);
+    RequestMap::iterator itr;
+    while ((itr = completedRequests_.find(seq)) == completedRequests_.end())
     {
-        boost::unique_lock<boost::mutex> lock(completionMutex_);
-        while (seq > lastCompletedRequest_)
-            completionCv_.wait(lock);
+        if (seq <= retiredThrough_)
+        {
+            stringstream errorMessage;
+            errorMessage << "Request " << seq << " has been retired: it's older than the "
+                         << static_cast<size_t>(MAX_COMPLETED_REQUESTS) << " completed requests kept";
+            Request retired;
+            retired.sequence_ = seq;
+            retired.rc_ = MySqlConnection::RETIRED_HANDLE_ERROR;
+            retired.errorNo_ = MySqlConnection::RETIRED_HANDLE_ERROR;
+            retired.errorMessage_ = errorMessage.str();
+            return retired;
+        }
+        completionCv_.wait(lock);
     }
-    RequestMap::iterator itr = completedRequests_.find(seq);
-    assert(itr != completedRequests_.end());
     return (*itr).second;
 }
 
+// A caller waits until the execution thread is done with a queued execution
+void
+ExecutionThread::waitForExecution(const MySqlExecution & execution)
+{
+    boost::unique_lock<boost::mutex> lock(completionMutex_);
+    while (!execution.isRequestCompleted())
+        completionCv_.wait(lock);
+}
+
+void
+ExecutionThread::setPriorityWeight(ExecutionPriority priority, double weight)
+{
+    boost::lock_guard<mutex> lock(requestMutex_);
+    requestQueue_->setPriorityWeight(priority, weight);
+}
+
+void
+ExecutionThread::setTenantWeight(const string & tenant, double weight)
+{
+    boost::lock_guard<mutex> lock(requestMutex_);
+    requestQueue_->setTenantWeight(tenant, weight);
+}
+
+void
+ExecutionThread::setQueueLimit(size_t maxQueueDepth, MySqlConnection::OverloadPolicy policy)
+{
+    {
+        boost::lock_guard<mutex> lock(requestMutex_);
+        maxQueueDepth_ = maxQueueDepth;
+        overloadPolicy_ = policy;
+    }
+    spaceCv_.notify_all();
+}
+
 
 
 ExecutionThread::Request::Request(RequestType type, int iparam=0, const char * strparam=NULL)
 :  type_(type),
-   sequence_(nextRequestSequence_++),
+   sequence_(0),
    iparam_(iparam),
+   priority_(NORMAL_PRIORITY),
+   submitter_(boost::this_thread::get_id()),
+   isOrdered_(type != MySqlConnection::EXECUTION_REQUEST),
+   isShed_(false),
+   cost_(0),
    rc_(0),
    errorNo_(0)
 {
@@ -688,6 +1303,10 @@ ExecutionThread::Request::Request()
 :  type_(MySqlConnection::NO_REQUEST),
    sequence_(0),
    iparam_(0),
+   priority_(NORMAL_PRIORITY),
+   isOrdered_(true),
+   isShed_(false),
+   cost_(0),
    rc_(0),
    errorNo_(0)
 {
@@ -719,6 +1338,267 @@ ostream & operator<<(ostream & o, const ExecutionThread::Request & request)
     }
 }
 
+
+//                              R E Q U E S T  S C H E D U L E R
+
+RequestScheduler::RequestScheduler()
+:  virtualTime_(0),
+   size_(0),
+   executionCount_(0)
+{
+    priorityWeights_[DEFAULT_PRIORITY] = 4;
+    priorityWeights_[INTERACTIVE_PRIORITY] = 16;
+    priorityWeights_[NORMAL_PRIORITY] = 4;
+    priorityWeights_[BACKGROUND_PRIORITY] = 1;
+}
+
+RequestScheduler::~RequestScheduler()
+{
+}
+
+// An ordered request closes the current epoch. An execution joins the last
+// epoch if it is still open, stamped with its flow's start tag.
+void
+RequestScheduler::put(const Request & request)
+{
+    if (epochs_.empty() || epochs_.back().hasBarrier_)
+        epochs_.push_back(Epoch());
+    Epoch & epoch = epochs_.back();
+    if (request.isOrdered_)
+    {
+        epoch.barrier_ = request;
+        epoch.hasBarrier_ = true;
+    }
+    else
+    {
+        double & flowFinishTag = flowFinishTags_[FlowKey(request.priority_, request.tenant_)];
+        double flowStartTag = std::max(virtualTime_, flowFinishTag);
+        double cost = 1.0 / getWeight(request);
+        flowFinishTag = flowStartTag + cost;
+        double & submitterStartTag = submitterStartTags_[request.submitter_];
+        double startTag = std::max(flowStartTag, submitterStartTag);
+        submitterStartTag = startTag;
+        Request & queued = epoch.requests_.insert(std::make_pair(StartTag(startTag, request.sequence_), request)).first->second;
+        queued.cost_ = cost;
+    }
+    size_++;
+    if (request.type_ == MySqlConnection::EXECUTION_REQUEST) executionCount_++;
+}
+
+// Serve the execution with the smallest start tag in the first epoch, or 
+// if there are none left, the barrier that ends it
+RequestScheduler::Request
+RequestScheduler::get()
+{
+    Request request;
+    if (!shed_.empty())
+    {
+        request = shed_.front();
+        shed_.pop_front();
+        size_--;
+        return request;
+    }
+
+    assert(!epochs_.empty());
+    Epoch & epoch = epochs_.front();
+    if (!epoch.requests_.empty())
+    {
+        std::map<StartTag, Request>::iterator itr = epoch.requests_.begin();
+        virtualTime_ = (*itr).first.first;
+        request = (*itr).second;
+        epoch.requests_.erase(itr);
+        if (epoch.requests_.empty() && !epoch.hasBarrier_)
+            epochs_.pop_front();
+    }
+    else
+    {
+        assert(epoch.hasBarrier_);
+        request = epoch.barrier_;
+        epochs_.pop_front();
+    }
+    size_--;
+    if (request.type_ == MySqlConnection::EXECUTION_REQUEST) executionCount_--;
+
+    // forget flows and submitters that have gone idle: all of them once the
+    // queue drains, or those whose tags virtual time has passed
+    if (size_ == 0)
+    {
+        flowFinishTags_.clear();
+        submitterStartTags_.clear();
+    }
+    if (flowFinishTags_.size() > 1024)
+    {
+        for (FlowMap::iterator itr = flowFinishTags_.begin(); itr != flowFinishTags_.end(); )
+        {
+            if ((*itr).second <= virtualTime_)
+                itr = flowFinishTags_.erase(itr);
+            else
+                ++itr;
+        }
+    }
+    if (submitterStartTags_.size() > 1024)
+    {
+        for (SubmitterMap::iterator itr = submitterStartTags_.begin(); itr != submitterStartTags_.end(); )
+        {
+            if ((*itr).second <= virtualTime_)
+                submitterStartTags_.erase(itr++);
+            else
+                ++itr;
+        }
+    }
+    return request;
+}
+
+// Make room for an execution of class 'priority' by shedding the newest queued
+// execution of the lowest class below it. Only executions that may be 
+// reordered can be shed; the shed request is handed back to the execution 
+// thread ahead of everything else, so its caller learns at once. Being its
+// flow's newest request, its cost is the last added to the flow's finish
+// tag, and is taken off again: the flow isn't charged for work it never got.
+bool
+RequestScheduler::shedLowest(ExecutionPriority priority)
+{
+    EpochQueue::iterator victimEpoch = epochs_.end();
+    std::map<StartTag, Request>::iterator victim;
+    for (EpochQueue::iterator itrepoch = epochs_.begin(); itrepoch != epochs_.end(); ++itrepoch)
+    {
+        for (std::map<StartTag, Request>::iterator itr = (*itrepoch).requests_.begin(); 
+             itr != (*itrepoch).requests_.end(); 
+             ++itr)
+        {
+            const Request & request = (*itr).second;
+            if (request.priority_ <= priority) continue;
+            if (   victimEpoch == epochs_.end() 
+                || request.priority_ > (*victim).second.priority_
+                || (request.priority_ == (*victim).second.priority_ && request.sequence_ > (*victim).second.sequence_))
+            {
+                victimEpoch = itrepoch;
+                victim = itr;
+            }
+        }
+    }
+    if (victimEpoch == epochs_.end()) return false;
+
+    Request request = (*victim).second;
+    FlowMap::iterator flow = flowFinishTags_.find(FlowKey(request.priority_, request.tenant_));
+    if (flow != flowFinishTags_.end()) (*flow).second -= request.cost_;
+    (*victimEpoch).requests_.erase(victim);
+    if ((*victimEpoch).requests_.empty() && !(*victimEpoch).hasBarrier_)
+        epochs_.erase(victimEpoch);
+    request.isShed_ = true;
+    shed_.push_back(request);
+    executionCount_--;
+    return true;
+}
+
+void
+RequestScheduler::setPriorityWeight(ExecutionPriority priority, double weight)
+{
+    if (weight > 0) priorityWeights_[priority] = weight;
+}
+
+void
+RequestScheduler::setTenantWeight(const string & tenant, double weight)
+{
+    if (weight > 0) tenantWeights_[tenant] = weight;
+}
+
+double
+RequestScheduler::getWeight(const Request & request) const
+{
+    double weight = priorityWeights_[request.priority_];
+    WeightMap::const_iterator itr = tenantWeights_.find(request.tenant_);
+    if (itr != tenantWeights_.end()) weight *= (*itr).second;
+    return weight;
+}
+
+RequestScheduler::Epoch::Epoch()
+:  hasBarrier_(false)
+{
+}
+
+
+//                              C I R C U I T  B R E A K E R
+
+CircuitBreaker::CircuitBreaker()
+:  state_(CLOSED),
+   failureThreshold_(0),
+   failures_(0),
+   isTrialRunning_(false)
+{
+}
+
+void
+CircuitBreaker::configure(int failureThreshold, unsigned int cooldownMs)
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    failureThreshold_ = failureThreshold;
+    cooldown_ = posix_time::milliseconds(cooldownMs);
+    state_ = CLOSED;
+    failures_ = 0;
+    isTrialRunning_ = false;
+}
+
+bool
+CircuitBreaker::isOpen() const
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    if (state_ == OPEN)
+        return posix_time::microsec_clock::universal_time() < openedAt_ + cooldown_;
+    return state_ == HALF_OPEN && isTrialRunning_;
+}
+
+bool
+CircuitBreaker::allow()
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    if (failureThreshold_ <= 0) return true;
+    if (state_ == OPEN)
+    {
+        if (posix_time::microsec_clock::universal_time() < openedAt_ + cooldown_) return false;
+        state_ = HALF_OPEN;
+        isTrialRunning_ = false;
+    }
+    if (state_ == HALF_OPEN)
+    {
+        if (isTrialRunning_) return false;
+        isTrialRunning_ = true;
+    }
+    return true;
+}
+
+bool
+CircuitBreaker::record(int errorNo)
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    if (failureThreshold_ <= 0) return false;
+    isTrialRunning_ = false;
+    if (!isConnectionError(errorNo))
+    {
+        state_ = CLOSED;
+        failures_ = 0;
+        return false;
+    }
+    failures_++;
+    if (state_ == HALF_OPEN || failures_ >= failureThreshold_)
+    {
+        bool isOpening = state_ != OPEN;
+        state_ = OPEN;
+        openedAt_ = posix_time::microsec_clock::universal_time();
+        return isOpening;
+    }
+    return false;
+}
+
+bool
+CircuitBreaker::isConnectionError(int errorNo)
+{
+    return    errorNo == CR_CONNECTION_ERROR 
+           || errorNo == CR_CONN_HOST_ERROR
+           || errorNo == CR_SERVER_GONE_ERROR
+           || errorNo == CR_SERVER_LOST;
+}
+
 // Performs setup before any other statics are initialized. 
 // Sets up locale so that file log sinks can be cleaned up properly.
 // http://www.boost.org/doc/libs/1_56_0/libs/log/doc/html/log/rationale/why_crash_on_term.html
@@ -4,6 +4,8 @@
 #include <sstream>
 #include <fstream>
 
+#include <boost/bind.hpp>
+
 #include <rapidjson/error/error.h>
 #include <rapidjson/error/en.h>
 #include <rapidjson/filereadstream.h>
@@ -33,7 +35,7 @@ MySqlConnectionImpl::MySqlConnectionImpl(MySqlConnection * conn,
                                          unsigned long     flags)
 
 :   conn_(conn),
-    db_(NULL),
+    backendType_(MYSQL_BACKEND),
     databaseName_(databaseName),
     statementPath_(statementPath),
     user_(user),
@@ -44,12 +46,19 @@ MySqlConnectionImpl::MySqlConnectionImpl(MySqlConnection * conn,
     flags_(flags),
     isAutoCommit_(true),
     statementsLoaded_(false),
-    isOpen_(false)
+    isOpen_(false),
+    readTimeout_(0),
+    watchdogRunning_(false),
+    watchedExecution_(0),
+    watchedThreadId_(0),
+    cancelledExecution_(0),
+    isKilling_(false)
 {}
 
 MySqlConnectionImpl::~MySqlConnectionImpl()
 {
     close();
+    stopWatchdog();
 }
 
 const Document &
@@ -60,11 +69,26 @@ MySqlConnectionImpl::getStatements()
     return statementDict_;
 }
 
-MYSQL *
-MySqlConnectionImpl::getdb()
+MySqlBackend *
+MySqlConnectionImpl::getBackend()
 {
-    if (db_ == NULL) open();
-    return db_;
+    if (!backend_) open();
+    return backend_.get();
+}
+
+// The backend is created when the connection opens, so it can be changed
+// only until then
+int
+MySqlConnectionImpl::setBackend(BackendType type, const rapidjson::Document * params)
+{
+    if (backend_)
+        return conn_->reportError("The backend of an open connection can't be changed");
+    if (params != NULL)
+        backendParams_.CopyFrom(*params, backendParams_.GetAllocator());
+    else
+        backendParams_.SetNull();
+    backendType_ = type;
+    return 0;
 }
 
 int
@@ -100,49 +124,62 @@ MySqlConnectionImpl::loadStatements()
 int
 MySqlConnectionImpl::open()
 {
-    if (db_ != NULL) return 0;
+    if (backend_) return 0;
 
     stringstream errorMessage;
 
     CONN_LOG(conn_, info) << "Creating " << (conn_->isAsync() ? "async " : "")
+                          << (backendType_ == LOOPBACK_BACKEND ? "loopback " : "")
+                          << (backendType_ == LATENCY_BACKEND ? "latency-injecting " : "")
                           << "MySql connection to " << databaseName_
                           << ": SQL dictionary " << statementPath_
                           << ", user " << user_
                           << ", host " << host_;
-    MYSQL * initialConn = mysql_init(NULL);
-    if (initialConn == NULL)
-    {
-        errorMessage << "Failed to create connection to MySql server";
-	return conn_->reportError(errorMessage);
-    }
-    db_ = mysql_real_connect(initialConn,
-	                     host_,   
-			     user_,     
-			     password_, 
-			     databaseName_,
-			     port_,    
-			     socket_,  
-			     flags_);  
-    if (db_ == NULL)
+    unique_ptr<MySqlBackend> backend = MySqlBackend::createBackend(backendType_, &backendParams_, conn_);
+    if (backend->connect(host_,   
+			 user_,     
+			 password_, 
+			 databaseName_,
+			 port_,    
+			 socket_,  
+			 flags_,
+                         readTimeout_) != 0)
     {
-	errorMessage << "Failed to connect: " << mysql_error(initialConn);
-	return conn_->reportError(errorMessage);
+        if (backend->getErrorNo() == 0)
+            errorMessage << "Failed to create connection to MySql server";
+        else
+            errorMessage << "Failed to connect: " << backend->getError();
+	return conn_->reportError(errorMessage, backend->getErrorNo() == 0 ? 1 : backend->getErrorNo());
     }
+    backend_ = boost::move(backend);
     setAutoCommit(true);
     isOpen_ = true;
     return 0;
 }
 
-void
+bool
+MySqlConnectionImpl::isClientBackend() const
+{
+    return    backendType_ == MYSQL_BACKEND
+           || (backendType_ == LATENCY_BACKEND && LatencyBackend::getInnerType(&backendParams_) == MYSQL_BACKEND);
+}
+
+// A thread that uses libmysqlclient initializes it for the thread, and ends
+// it when the thread is done. The thread records whether it initialized the
+// library and ends it only if it did, so the two calls pair up even if the
+// backend type changes in between.
+bool
 MySqlConnectionImpl::startMySqlThread()
 {
-    mysql_thread_init();
+    if (!isClientBackend()) return false;
+    MySqlClientBackend::startThread();
+    return true;
 }
 
 void
 MySqlConnectionImpl::endMySqlThread()
 {
-    mysql_thread_end();
+    MySqlClientBackend::endThread();
 }
 
 // Look for a previous execution that matches the caller's, and that is 'live',
@@ -151,18 +188,24 @@ MySqlConnectionImpl::endMySqlThread()
 MySqlExecution *
 MySqlConnectionImpl::findLivePriorExecution(MySqlExecution * execution) const
 {
-    for (MySqlConnection::ExecutionList::reverse_iterator itr = conn_->executions_.rbegin();
-         itr != conn_->executions_.rend();
-         ++itr)
-    {
-        shared_ptr<MySqlExecution> & previousExecution = *itr;
-        if (   previousExecution->statementHandle_ != NULL
-	    && execution->isSameStatementAs(previousExecution.get()))
-        {
-            return previousExecution.get();
-        }
-    }
-    return NULL;
+    return conn_->executions_.findLatest(boost::bind(&MySqlConnectionImpl::isLivePriorExecution, execution, _1));
+}
+
+bool
+MySqlConnectionImpl::isLivePriorExecution(const MySqlExecution * execution, const MySqlExecution * previousExecution)
+{
+    return    previousExecution != execution
+           && previousExecution->statementHandle_ != NULL
+           && execution->isSameStatementAs(previousExecution);
+}
+
+// A completed execution that isn't holding a statement handle for re-use
+// can be released
+bool
+MySqlConnectionImpl::isRetiredExecution(const MySqlExecution * execution)
+{
+    return    execution->isTerminalState(execution->getState())
+           && execution->statementHandle_ == NULL;
 }
 
 // Turn off auto-commit to start a transaction, turn it back on after commit or rollback.
@@ -170,9 +213,9 @@ MySqlConnectionImpl::findLivePriorExecution(MySqlExecution * execution) const
 int
 MySqlConnectionImpl::setAutoCommit(bool isAutoCommit)
 {
-    MYSQL * db = getdb();  // can create initial connection
-    if (db == NULL) return 1;
-    mysql_autocommit(db, isAutoCommit);
+    MySqlBackend * backend = getBackend();  // can create initial connection
+    if (backend == NULL) return 1;
+    backend->setAutoCommit(isAutoCommit);
     isAutoCommit_ = isAutoCommit;
     return 0;
 }
@@ -184,7 +227,7 @@ MySqlConnectionImpl::commit()
     CONN_LOG(conn_, trace) << "committing transaction ";
 
     stringstream errorMessage;
-    if (db_ == NULL)
+    if (!backend_)
     {
         errorMessage << "commit called with no MySQL connection";
         return conn_->reportError(errorMessage);
@@ -194,7 +237,7 @@ MySqlConnectionImpl::commit()
         errorMessage << "commit called with no transaction in progress";
         return conn_->reportError(errorMessage);
     }    
-    int rc = mysql_commit(db_);
+    int rc = backend_->commit();
     if (rc != 0)
     {
         errorMessage << "committing transaction";
@@ -209,12 +252,12 @@ MySqlConnectionImpl::commit()
 int
 MySqlConnectionImpl::rollback()
 {
-    if (db_ == NULL) return 0;
+    if (!backend_) return 0;
     if (isAutoCommit()) return 0;
 
     stringstream errorMessage;
 
-    int rc = mysql_rollback(db_);
+    int rc = backend_->rollback();
     if (rc != 0)
     {
         errorMessage << "rolling back transaction";
@@ -230,12 +273,146 @@ MySqlConnectionImpl::close()
 {
     isOpen_ = false;
     rollback();
-    if (db_)
+    if (backend_)
     {
-        mysql_close(db_);
+        backend_->close();
 	CONN_LOG(conn_, info) << "Closed MySQL connection to " << databaseName_;
-	db_ = NULL;
+	backend_.reset();
+    }
+}
+
+
+//                              D E A D L I N E  W A T C H D O G
+
+// Called before an execution with a deadline talks to the server. Starts
+// the watchdog thread the first time through.
+void
+MySqlConnectionImpl::armDeadline(const MySqlExecution * execution)
+{
+    MySqlBackend * backend = getBackend();
+    if (backend == NULL) return;
+    {
+        boost::lock_guard<boost::mutex> lock(watchdogMutex_);
+        if (!watchdogRunning_)
+        {
+            watchdogRunning_ = true;
+            watchdogThread_ = boost::thread(boost::bind(&MySqlConnectionImpl::runWatchdog, this));
+        }
+        deadline_ = execution->getDeadline();
+        watchedExecution_ = execution->getHandle();
+        watchedThreadId_ = backend->getThreadId();
+    }
+    watchdogCv_.notify_one();
+}
+
+// Called when the execution is done with the server. If the watchdog is
+// sending the KILL for it right now, this waits for the KILL to complete, 
+// so it can't land on the next statement
+void
+MySqlConnectionImpl::disarmDeadline(const MySqlExecution * execution)
+{
+    boost::unique_lock<boost::mutex> lock(watchdogMutex_);
+    if (watchedExecution_ != execution->getHandle()) return;
+    while (isKilling_)
+        killedCv_.wait(lock);
+    deadline_ = PhaseClock::Tick();
+    watchedExecution_ = 0;
+}
+
+bool
+MySqlConnectionImpl::isCancelled(const MySqlExecution * execution)
+{
+    boost::lock_guard<boost::mutex> lock(watchdogMutex_);
+    return cancelledExecution_ == execution->getHandle();
+}
+
+// Sleep until the armed deadline passes, then kill the query running on 
+// the connection's server thread. The side connection is opened without
+// holding the watchdog mutex, so arming and disarming aren't held up by a
+// connect. Only then is the execution checked to still be the one running:
+// if it has been disarmed meanwhile, there's nothing to cancel.
+void
+MySqlConnectionImpl::runWatchdog()
+{
+    bool isMySqlThread = startMySqlThread();
+    boost::unique_lock<boost::mutex> lock(watchdogMutex_);
+    while (watchdogRunning_)
+    {
+        if (!PhaseClock::isSet(deadline_))
+        {
+            watchdogCv_.wait(lock);
+            continue;
+        }
+        if (PhaseClock::now() < deadline_)
+        {
+            watchdogCv_.wait_until(lock, deadline_);
+            continue;
+        }
+        int execution = watchedExecution_;
+        unsigned long threadId = watchedThreadId_;
+        deadline_ = PhaseClock::Tick();
+
+        lock.unlock();
+        bool isOpen = openKillBackend();
+        lock.lock();
+        if (!isOpen || watchedExecution_ != execution) continue;
+
+        CONN_LOG(conn_, warning) << "Execution " << execution << " passed its deadline: "
+                                 << "cancelling query on MySQL thread " << threadId;
+        cancelledExecution_ = execution;
+        isKilling_ = true;
+        lock.unlock();
+        killQuery(threadId);
+        lock.lock();
+        isKilling_ = false;
+        killedCv_.notify_all();
+    }
+    lock.unlock();
+    killBackend_.reset();
+    if (isMySqlThread) endMySqlThread();
+}
+
+void
+MySqlConnectionImpl::stopWatchdog()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(watchdogMutex_);
+        if (!watchdogRunning_) return;
+        watchdogRunning_ = false;
+    }
+    watchdogCv_.notify_one();
+    watchdogThread_.join();
+}
+
+// KILL QUERY has to come from another connection, since the execution's 
+// own connection is busy. The side connection is opened on first use.
+bool
+MySqlConnectionImpl::openKillBackend()
+{
+    if (killBackend_) return true;
+    killBackend_ = MySqlBackend::createBackend(backendType_, &backendParams_, conn_);
+    if (killBackend_->connect(host_, user_, password_, databaseName_, port_, socket_, flags_, 0) != 0)
+    {
+        CONN_LOG(conn_, error) << "Unable to open connection to cancel query: " << killBackend_->getError();
+        killBackend_.reset();
+        return false;
     }
+    return true;
+}
+
+int
+MySqlConnectionImpl::killQuery(unsigned long threadId)
+{
+    stringstream killStatement;
+    killStatement << "KILL QUERY " << threadId;
+    if (killBackend_->query(killStatement.str().c_str()) != 0)
+    {
+        CONN_LOG(conn_, error) << "Unable to cancel query on MySQL thread " << threadId 
+                               << ": " << killBackend_->getError() << " (" << killBackend_->getErrorNo() << ")";
+        killBackend_.reset();
+        return 1;
+    }
+    return 0;
 }
 
 // Caller passes in a context (e.g. "committing transaction"). We extract
@@ -246,9 +423,9 @@ MySqlConnectionImpl::reportMySqlError(const stringstream & context)
 {
     stringstream errorMessage;
     errorMessage << "MySql error " << context.str()
-                 << ": " << mysql_error(db_)
-                 << " (" << mysql_errno(db_) << ")";
-    return conn_->reportError(errorMessage, mysql_errno(db_));
+                 << ": " << backend_->getError()
+                 << " (" << backend_->getErrorNo() << ")";
+    return conn_->reportError(errorMessage, backend_->getErrorNo());
 }
 
 // Serialize a value from a rapidjson DOM into a stream
@@ -1,6 +1,8 @@
 #include <boost/bind.hpp>
 #include <boost/regex.hpp>
 
+#include <errmsg.h>
+
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 
@@ -29,7 +31,7 @@
 
 
 MySqlExecution::StateFunctionMap MySqlExecution::stateFunctionMap_ = MySqlExecution::createStateFunctionMap();
-int MySqlExecution::nextExecutionHandle_= 1;
+boost::atomic<int> MySqlExecution::nextExecutionHandle_(1);
 my_bool MySqlExecution::mysqlTrue_ = true;
 my_bool MySqlExecution::mysqlFalse_ = false;
 
@@ -40,19 +42,24 @@ MySqlExecution::MySqlExecution(const char *          statementName,
                                MySqlConnectionImpl * connImpl)
 :   executionHandle_(nextExecutionHandle_++),
     requestSequence_(0),
+    isRequestCompleted_(false),
+    transactionId_(0),
+    priority_(DEFAULT_PRIORITY),
+    timeoutMs_(0),
     statementName_(statementName),
     comment_(comment),
     args_(args),
     argDoc_(NULL),
+    batchSize_(0),
     statementHandle_(NULL),
-    isAutoCommit_(conn->impl_->isAutoCommit()),
+    isAutoCommit_(true),
     rc_(-1),
     errorNo_(0),
     parameterBindArray_(NULL),
     paramCount_(0),
     paramBuffer_(NULL),
     paramBufferLen_(0),
-    resultsMetadata_(NULL),
+    returnsRows_(false),
     columnBindArray_(NULL),
     columnCount_(0),
     rowBuffer_(NULL),
@@ -97,16 +104,24 @@ MySqlExecution::prepareToExecute()
     rowsAffected_ = 0;
     conn_->errorMessage_.clear();
     conn_->errorNo_ = 0;
-    startTime_ = posix_time::microsec_clock::local_time();
+    startTick_ = PhaseClock::now();
     rc = crankStateMachine(SQL_GENERATED_STATE);
     return rc;
 }
 
-// Send the prepared statement to the server and process the response
+// Send the prepared statement to the server and process the response. If the
+// execution has a deadline, the connection's watchdog cancels the query on the
+// server when the deadline passes. 
 int
 MySqlExecution::execute()
 {
+    if (isPastDeadline())
+        return reportTimeout("before it was sent to the server");
+    if (PhaseClock::isSet(deadline_))
+        connImpl_->armDeadline(this);
     int rc = crankStateMachine();
+    if (PhaseClock::isSet(deadline_))
+        connImpl_->disarmDeadline(this);
     close(true); // allow re-use
     return rc;
 }
@@ -132,14 +147,53 @@ MySqlExecution::crankStateMachine(MySqlExecution::ExecutionState exitState)
     return rc;
 }
 
+const char *
+MySqlExecution::getStateName(ExecutionState state)
+{
+    switch (state)
+    {
+        case NO_STATE:                 return "NO_STATE";
+        case INITIAL_STATE:            return "INITIAL_STATE";
+        case STATEMENT_VALID_STATE:    return "STATEMENT_VALID_STATE";
+        case SETTINGS_CREATED_STATE:   return "SETTINGS_CREATED_STATE";
+        case SQL_GENERATED_STATE:      return "SQL_GENERATED_STATE";
+        case MYSQL_STMT_CREATED_STATE: return "MYSQL_STMT_CREATED_STATE";
+        case BINDINGS_PREPARED_STATE:  return "BINDINGS_PREPARED_STATE";
+        case STATEMENT_PREPARED_STATE: return "STATEMENT_PREPARED_STATE";
+        case EXECUTION_COMPLETE_STATE: return "EXECUTION_COMPLETE_STATE";
+        case RESULTS_RETRIEVED_STATE:  return "RESULTS_RETRIEVED_STATE";
+        case STATEMENT_COMPLETE_STATE: return "STATEMENT_COMPLETE_STATE";
+        case ERROR_STATE:              return "ERROR_STATE";
+    }
+    return "UNKNOWN_STATE";
+}
+
 bool
-MySqlExecution::isTerminalState(ExecutionState state)
+MySqlExecution::isTerminalState(ExecutionState state) const
 {
     StateFunctionMap::iterator itr = stateFunctionMap_.find(state);
     if (itr != stateFunctionMap_.end()) return false;
     return true;
 }
 
+// Phase durations from the steady-clock ticks. A write has no retrieve phase:
+// its execute phase runs to completion.
+PhaseDurations
+MySqlExecution::getPhaseDurations() const
+{
+    PhaseDurations durations;
+    durations.prepareUs_ = PhaseClock::getMicroseconds(startTick_, executeTick_);
+    if (PhaseClock::isSet(retrieveTick_))
+    {
+        durations.executeUs_ = PhaseClock::getMicroseconds(executeTick_, retrieveTick_);
+        durations.fetchUs_ = PhaseClock::getMicroseconds(retrieveTick_, completeTick_);
+    }
+    else
+        durations.executeUs_ = PhaseClock::getMicroseconds(executeTick_, completeTick_);
+    durations.totalUs_ = PhaseClock::getMicroseconds(startTick_, completeTick_);
+    return durations;
+}
+
 // Read the SQL statement text from the JSON SQL dictionary specfied
 // when the connection was created
 int 
@@ -160,6 +214,42 @@ MySqlExecution::validateStatement()
        errorMessage << "Unknown statement \'" << statementName_ << "\'"; 
        return reportError(errorMessage);
     }
+
+    // Unless the caller specified a timeout, take it from the dictionary. The
+    // clock starts now, so time spent in the async queue counts
+    const Value & statement = statementDict["statements"][statementName_.c_str()];
+    if (timeoutMs_ == 0 && statement.HasMember("timeout_ms"))
+    {
+        if (!statement["timeout_ms"].IsUint())
+        {
+            errorMessage << "Invalid timeout_ms for statement " << statementName_;
+            return reportError(errorMessage);
+        }
+        timeoutMs_ = statement["timeout_ms"].GetUint();
+    }
+    deadline_ = PhaseClock::Tick();
+    if (timeoutMs_ > 0)
+        deadline_ = PhaseClock::now() + boost::chrono::milliseconds(timeoutMs_);
+
+    // Unless the caller specified a priority, take it from the dictionary
+    if (priority_ == DEFAULT_PRIORITY)
+    {
+        priority_ = NORMAL_PRIORITY;
+        if (statement.HasMember("priority"))
+        {
+            const string & priority = statement["priority"].GetString();
+            if (priority == "interactive")
+                priority_ = INTERACTIVE_PRIORITY;
+            else if (priority == "background")
+                priority_ = BACKGROUND_PRIORITY;
+            else if (priority != "normal")
+            {
+                errorMessage << "Unknown priority \'" << priority << "\'"
+                             << " for statement " << statementName_;
+                return reportError(errorMessage);
+            }
+        }
+    }
     return changeState(STATEMENT_VALID_STATE);
 }
 
@@ -260,6 +350,8 @@ MySqlExecution::createSettings()
             dataTypeCode = MYSQL_TYPE_DATETIME;
         else if (dataType == "timestamp")
             dataTypeCode = MYSQL_TYPE_TIMESTAMP;
+        else if (dataType == "blob")
+            dataTypeCode = MYSQL_TYPE_BLOB;
         else
         {
             errorMessage << "Unsupported parameter datatype \'" << dataType << "\'"
@@ -276,6 +368,9 @@ MySqlExecution::createSettings()
 
     }  // end loop through parameters
 
+    if (argDoc_ != NULL && argDoc_->IsArray())
+        return createBatchSettings();
+
     // Add the values passed by caller to the settings doc. 
     // The arguments can either be in a C va_list or in a json doc.
     // Arguments may be omitted. If the va_list is incomplete,
@@ -327,6 +422,16 @@ MySqlExecution::createSettings()
                 setting.AddMember("param_value", stringValue, settings_.GetAllocator());
                 break;
             }
+            case MYSQL_TYPE_BLOB:
+            {
+                // binary: a JSON argument keeps its length, a va_list argument ends at a NUL
+                const char * blobArg = argDoc_ ? itrarg->value.GetString() : va_arg(args_, char *);
+                size_t blobLength = argDoc_ ? itrarg++->value.GetStringLength() : strlen(blobArg);
+	        Value blobValue(kStringType);
+	        blobValue.SetString(blobArg, blobLength, settings_.GetAllocator());
+                setting.AddMember("param_value", blobValue, settings_.GetAllocator());
+                break;
+            }
             case MYSQL_TYPE_DATE:
             case MYSQL_TYPE_TIME:
             case MYSQL_TYPE_DATETIME:
@@ -349,6 +454,99 @@ MySqlExecution::createSettings()
     return changeState(SETTINGS_CREATED_STATE);
 }
 
+// A batch is a JSON array of rows, each an object of name/value pairs, for
+// a statement with a 'row_text' (e.g. "(?, ?, ?)") that is repeated once per
+// row. Substitution parameters are taken from the first row. Marker parameters
+// get one setting per row, named "<parameter>[<row>]", in row order, so that
+// the bindings line up with the markers in the generated text.
+int
+MySqlExecution::createBatchSettings()
+{
+    stringstream errorMessage;
+    const rapidjson::Value & statement =  conn_->getStatements()["statements"][statementName_.c_str()];
+    if (!statement.HasMember("row_text"))
+    {
+        errorMessage << "Statement " << statementName_ << " has no row_text, so can't be executed as a batch";
+        return reportError(errorMessage);
+    }
+    if (argDoc_->Empty())
+    {
+        errorMessage << "Empty batch passed for statement " << statementName_;
+        return reportError(errorMessage);
+    }
+    batchSize_ = argDoc_->Size();
+
+    Document declarations;
+    declarations.CopyFrom(settings_, declarations.GetAllocator());
+    settings_.SetObject();
+    for (int row = -1; row < batchSize_; row++)
+    {
+        const Value & rowArgs = (*argDoc_)[static_cast<SizeType>(row < 0 ? 0 : row)];
+        if (!rowArgs.IsObject())
+        {
+            errorMessage << "Row " << (row < 0 ? 0 : row) << " of batch for statement " << statementName_ << " is not an object";
+            return reportError(errorMessage);
+        }
+        for (Value::ConstMemberIterator itrdecl = declarations.MemberBegin();
+             itrdecl != declarations.MemberEnd();
+             ++itrdecl)
+        {
+            // substitutions first (row -1), then the markers for each row
+            bool isMarker = itrdecl->value["param_type"] == MARKER;
+            if (isMarker != (row >= 0)) continue;
+
+            Value setting;
+            setting.CopyFrom(itrdecl->value, settings_.GetAllocator());
+            Value::ConstMemberIterator itrarg = rowArgs.FindMember(itrdecl->name.GetString());
+            if (itrarg != rowArgs.MemberEnd())
+            {
+                int rc = setParameterValue(setting, itrarg->value);
+                if (rc != 0) return rc;
+            }
+            stringstream settingName;
+            settingName << itrdecl->name.GetString();
+            if (isMarker) settingName << "[" << row << "]";
+            Value settingNameValue(settingName.str().c_str(), settingName.str().size(), settings_.GetAllocator());
+            settings_.AddMember(settingNameValue, setting, settings_.GetAllocator());
+        }
+    }
+    args_ = NULL;
+    return changeState(SETTINGS_CREATED_STATE);
+}
+
+// Store a JSON argument in a setting, converted to the parameter's datatype
+int
+MySqlExecution::setParameterValue(Value & setting, const Value & argValue)
+{
+    enum enum_field_types dataTypeCode = static_cast<enum enum_field_types>(setting["param_data_type"].GetInt());
+    switch (dataTypeCode)
+    {
+        case MYSQL_TYPE_LONG:
+            setting.AddMember("param_value", argValue.GetInt(), settings_.GetAllocator());
+            break;
+        case MYSQL_TYPE_DOUBLE:
+            setting.AddMember("param_value", argValue.GetDouble(), settings_.GetAllocator());
+            break;
+        case MYSQL_TYPE_DATE:
+        case MYSQL_TYPE_TIME:
+        case MYSQL_TYPE_DATETIME:
+        case MYSQL_TYPE_TIMESTAMP:
+        {
+            int rc = stringToMySqlTime(argValue.GetString(), dataTypeCode, NULL);
+            if (rc > 0) return rc;
+        }
+        // fall through: times are kept as strings
+        default:
+        {
+            Value stringValue(kStringType);
+            stringValue.SetString(argValue.GetString(), argValue.GetStringLength(), settings_.GetAllocator());
+            setting.AddMember("param_value", stringValue, settings_.GetAllocator());
+            break;
+        }
+    }
+    return 0;
+}
+
 // Replace any substitution parameters in the SQL text
 // with the parameter values in the settings list
 int
@@ -370,6 +568,23 @@ MySqlExecution::generateStatementText()
     {
     	statementStream << itrtext->GetString();
     }
+
+    // a multi-row statement repeats its row text once per row of the batch
+    if (statement.HasMember("row_text"))
+    {
+        const Value & rowTextLines = statement["row_text"];
+        int rowCount = batchSize_ > 0 ? batchSize_ : 1;
+        for (int row = 0; row < rowCount; row++)
+        {
+            if (row > 0) statementStream << ", ";
+            for (Value::ConstValueIterator itrtext = rowTextLines.Begin();
+                 itrtext != rowTextLines.End();
+                 ++itrtext)
+            {
+                statementStream << itrtext->GetString();
+            }
+        }
+    }
     string statementText(statementStream.str());
 
     // perform substitutions
@@ -411,18 +626,27 @@ MySqlExecution::createPreparedStatement()
     stringstream errorMessage;
     int rc;
 
-    MYSQL * db = NULL;
+    MySqlBackend * backend = NULL;
 
     // can throw if this the first attempt to connect to the database
     try
     {
-        db = connImpl_->getdb();
+        backend = connImpl_->getBackend();
     }
     catch (std::exception e)
     {
         errorMessage << "Error connecting to MySql: " << e.what();
         return reportError(errorMessage);
     }
+    if (backend == NULL)
+    {
+        errorMessage << "No connection to MySql for " << statementName_ << ": " << conn_->getErrorMessage();
+        return reportError(errorMessage, conn_->getErrorNo());
+    }
+
+    // Record whether we are in a transaction now rather than when the execution
+    // was created: in async mode the transaction may have been queued after it
+    isAutoCommit_ = connImpl_->isAutoCommit();
 
     // If there is a live prior execution of the same statement (texts identical)
     // then reuse the statement handle and buffers allocated for that execution
@@ -435,15 +659,15 @@ MySqlExecution::createPreparedStatement()
     }
 
     // send the statement to MySql 
-    statementHandle_ = mysql_stmt_init(db);
-    rc = mysql_stmt_prepare(statementHandle_, statementText_.c_str(), statementText_.size());
+    statementHandle_ = backend->createStatement();
+    rc = statementHandle_ == NULL ? 1 : statementHandle_->prepare(statementText_.c_str(), statementText_.size());
     if (rc != 0) 
     {
         errorMessage << "preparing statement " << statementName_;
         return conn_->impl_->reportMySqlError(errorMessage);
     }
 
-    paramCount_ = mysql_stmt_param_count(statementHandle_);
+    paramCount_ = statementHandle_->getParamCount();
 
     // if mysql found no params, confirm that the user didn't pass any
     if (paramCount_ == 0 && settings_.MemberCount() > 0)
@@ -539,10 +763,10 @@ MySqlExecution::prepareToBind()
     }
 
     // if the statement returns a result set, allocate column binds and a row buffer
-    resultsMetadata_ = mysql_stmt_result_metadata(statementHandle_);
-    if (resultsMetadata_ != NULL)
+    returnsRows_ = statementHandle_->getColumnCount() > 0;
+    if (returnsRows_)
     {
-        columnCount_ = mysql_num_fields(resultsMetadata_);
+        columnCount_ = statementHandle_->getColumnCount();
         assert(columnCount_ > 0);
         assert(columnBindArray_ == NULL);
         columnBindArray_ = new MYSQL_BIND[columnCount_];
@@ -554,7 +778,7 @@ MySqlExecution::prepareToBind()
         // first loop through columns to determine row buffer length
         for (unsigned int icol = 0; icol < columnCount_; icol++)
         {
-            MYSQL_FIELD * fieldDescriptor = mysql_fetch_field_direct(resultsMetadata_, icol);
+            const MYSQL_FIELD * fieldDescriptor = statementHandle_->getColumn(icol);
             rowBufferLen_ += bindColumn(fieldDescriptor, columnBind++, rowBuffer_);
         }
         rowBuffer_ = new char[rowBufferLen_];
@@ -564,7 +788,7 @@ MySqlExecution::prepareToBind()
         columnBind = columnBindArray_;
         for (unsigned int icol = 0; icol < columnCount_; icol++)
         {
-            MYSQL_FIELD * fieldDescriptor = mysql_fetch_field_direct(resultsMetadata_, icol);
+            const MYSQL_FIELD * fieldDescriptor = statementHandle_->getColumn(icol);
             bindColumn(fieldDescriptor, columnBind++, valuePtr);
         }
     }
@@ -580,11 +804,10 @@ MySqlExecution::bindParameters()
 
     if (paramCount_ != 0) 
     {
-        my_bool result = mysql_stmt_bind_param(statementHandle_, parameterBindArray_);
-        if (!result && mysql_stmt_errno(statementHandle_) != 0)
+        if (statementHandle_->bindParameters(parameterBindArray_) != 0)
         {
             errorMessage << "binding parameters for statement " << statementName_;
-            return reportMySqlError(statementHandle_, errorMessage);
+            return reportMySqlError(errorMessage);
         }
     }
 
@@ -600,17 +823,17 @@ int
 MySqlExecution::executeStatement()
 {
     stringstream errorMessage;
-    executeTime_ = posix_time::microsec_clock::local_time();
-    int rc = mysql_stmt_execute(statementHandle_);
+    executeTick_ = PhaseClock::now();
+    int rc = statementHandle_->execute();
     if (rc != 0)
     {
         errorMessage << "executing statement (" << rc << ") " << statementName_;
-        return reportMySqlError(statementHandle_, errorMessage);
+        return reportMySqlError(errorMessage);
     }
     rowsAffected_ = 0;
-    if (resultsMetadata_ == NULL)
+    if (!returnsRows_)
     {
-        rowsAffected_ = mysql_stmt_affected_rows(statementHandle_);
+        rowsAffected_ = statementHandle_->getAffectedRows();
         return changeState(STATEMENT_COMPLETE_STATE);
     }
     else
@@ -623,20 +846,18 @@ MySqlExecution::executeStatement()
 // a second buffer, the blob buffer, has been allocated, and
 // the pointer in the MYSQL_BIND strut has been set to null.
 // Values for these columns are retrieved one at a time by
-// calling mysql_stmt_fetch_column. (See storeResultRow.)
+// calling the statement's fetchColumn. (See storeResultRow.)
 int
 MySqlExecution::retrieveResults()
 {
     stringstream errorMessage;
-    retrieveTime_ = posix_time::microsec_clock::local_time();
-    
-    MYSQL * db = connImpl_->getdb();
+    retrieveTick_ = PhaseClock::now();
 
-    int rc = mysql_stmt_bind_result(statementHandle_, columnBindArray_);
+    int rc = statementHandle_->bindResults(columnBindArray_);
     if (rc != 0)
     {
         errorMessage << "binding results of statement " << statementName_;
-        return reportMySqlError(statementHandle_, errorMessage);
+        return reportMySqlError(errorMessage);
     }
     if (blobBufferLen_ > 0)
         blobBuffer_ = new char[blobBufferLen_];
@@ -651,7 +872,7 @@ MySqlExecution::retrieveResults()
         Value columns(kObjectType);
         for (unsigned int icol = 0; icol < columnCount_; icol++)
         {
-            MYSQL_FIELD * fieldDescriptor = mysql_fetch_field_direct(resultsMetadata_, icol);
+            const MYSQL_FIELD * fieldDescriptor = statementHandle_->getColumn(icol);
             Value fieldName(kStringType);
             fieldName.SetString(fieldDescriptor->name, fieldDescriptor->name_length, results_.GetAllocator());
             Value dataType(kNumberType);
@@ -671,7 +892,7 @@ MySqlExecution::retrieveResults()
     rowCount_ = 0;
     while (more)
     {
-        rc = mysql_stmt_fetch(statementHandle_);
+        rc = statementHandle_->fetch();
         switch (rc)
         {
             case 0:
@@ -684,7 +905,7 @@ MySqlExecution::retrieveResults()
             }
             case 1:
                 errorMessage << "fetching row for statement " << statementName_;
-                return reportMySqlError(statementHandle_, errorMessage);
+                return reportMySqlError(errorMessage);
             case MYSQL_NO_DATA:
                 more = false;
                 break;
@@ -704,7 +925,7 @@ int
 MySqlExecution::changeState(ExecutionState newState)
 {
     if (newState == STATEMENT_COMPLETE_STATE || newState == ERROR_STATE)
-        completeTime_ = posix_time::microsec_clock::local_time();
+        completeTick_ = PhaseClock::now();
     ExecutionState realNewState = newState;
     for (MySqlConnection::ObserverList::iterator itrobs = conn_->observers_.begin();
          itrobs != conn_->observers_.end();
@@ -725,14 +946,14 @@ MySqlExecution::close(bool isReusable)
 {
     if (statementHandle_ != NULL)
     {
-        if (resultsMetadata_ != NULL)
+        if (returnsRows_)
         {
-            mysql_stmt_free_result(statementHandle_);
-            resultsMetadata_ = NULL;
+            statementHandle_->freeResult();
+            returnsRows_ = false;
         }
         if (!isReusable)
         {
-            mysql_stmt_close(statementHandle_);
+            delete statementHandle_;
             statementHandle_ = NULL;
             cleanup();
         }
@@ -855,6 +1076,26 @@ MySqlExecution::bindParameter(const Value & setting, MYSQL_BIND * parameterBind,
             break;
         }
 
+        case MYSQL_TYPE_BLOB:
+        {
+            bufferSpaceRequired = 0;
+            parameterBind->length = NULL;
+            if (hasValue)
+            {
+                const Value & paramValue = setting["param_value"];
+                parameterBind->buffer = const_cast<char *>(paramValue.GetString());
+                parameterBind->buffer_length = paramValue.GetStringLength();
+                parameterBind->is_null = &mysqlFalse_;
+            }
+            else
+            {
+                parameterBind->buffer = NULL;
+                parameterBind->buffer_length = 0;
+                parameterBind->is_null = &mysqlTrue_;
+            }
+            break;
+        }
+
         case MYSQL_TYPE_DATE:
         case MYSQL_TYPE_TIME:
         case MYSQL_TYPE_DATETIME:
@@ -894,7 +1135,7 @@ MySqlExecution::bindParameter(const Value & setting, MYSQL_BIND * parameterBind,
 // For columns whose size is unpredictable (string, text and blob), update the estimated
 // size of the of the buffer that will received these columns ('blobBufferSize')
 int 
-MySqlExecution::bindColumn(MYSQL_FIELD * fieldDescriptor, MYSQL_BIND * columnBind, char *& buffer)
+MySqlExecution::bindColumn(const MYSQL_FIELD * fieldDescriptor, MYSQL_BIND * columnBind, char *& buffer)
 {
     int bufferSpaceRequired = 0;
     int blobSpaceRequired = 0;
@@ -923,6 +1164,20 @@ MySqlExecution::bindColumn(MYSQL_FIELD * fieldDescriptor, MYSQL_BIND * columnBin
             }
             break;
 
+        // BLOB and TEXT columns can be far longer than any value in them, so the
+        // blob buffer is only grown as needed
+        case FIELD_TYPE_BLOB:
+            bufferSpaceRequired = sizeof(long);
+            if (buffer != NULL)
+            {
+                columnBind->buffer = NULL;
+                columnBind->buffer_length = 0;
+                unsigned long * lengthPtr = reinterpret_cast<unsigned long *>(buffer);
+                columnBind->length = lengthPtr;
+                blobSpaceRequired = fieldDescriptor->max_length;
+            }
+            break;
+
         case FIELD_TYPE_DATE:
         case FIELD_TYPE_TIME:
         case FIELD_TYPE_DATETIME:
@@ -957,7 +1212,7 @@ MySqlExecution::storeResultRow()
     MYSQL_BIND * columnBind = columnBindArray_;
     for (int icol = 0; icol < columnCount_; ++icol, ++columnBind)
     {
-        MYSQL_FIELD * fieldDescriptor = mysql_fetch_field_direct(resultsMetadata_, icol);
+        const MYSQL_FIELD * fieldDescriptor = statementHandle_->getColumn(icol);
         Value fieldName(fieldDescriptor->name, fieldDescriptor->name_length, results_.GetAllocator());
         if (*columnBind->is_null)
         {
@@ -981,16 +1236,17 @@ MySqlExecution::storeResultRow()
             case FIELD_TYPE_STRING:
             case FIELD_TYPE_VAR_STRING:
             case FIELD_TYPE_ENUM:
+            case FIELD_TYPE_BLOB:
             {
                 int actualLength = *columnBind->length;
                 columnBind->buffer = getBlobBuffer(actualLength);
                 columnBind->buffer_length = actualLength;
-                int rc = mysql_stmt_fetch_column(statementHandle_, columnBind, icol, 0);
+                int rc = statementHandle_->fetchColumn(columnBind, icol);
                 if (rc != 0)
                 {
                    errorMessage << "fetching string column " << fieldName.GetString()
                                 << " in statement " << statementName_;
-                   return reportMySqlError(statementHandle_, errorMessage);
+                   return reportMySqlError(errorMessage);
                 }
                 row.AddMember(fieldName, 
                               Value(static_cast<char *>(columnBind->buffer), actualLength, results_.GetAllocator()).Move(), 
@@ -1173,7 +1429,7 @@ MySqlExecution::toJson()
     }
 
     // transaction(used for audit filtering)
-    const string & transaction = conn_->getCurrentTransaction();
+    const string transaction = conn_->getCurrentTransaction();
     if (!transaction.empty())
     {
         Value transactionValue(transaction.c_str(), transaction.size(), dom_.GetAllocator());
@@ -1200,22 +1456,22 @@ MySqlExecution::toJson()
     dom_.AddMember("error_no", errorNo_, dom_.GetAllocator());
 
     // start_time: when the execution was created (yyyy-mm-ddThh:mm:ss.fffff)
-    string startTimeString = posix_time::to_iso_extended_string(startTime_);
+    string startTimeString = posix_time::to_iso_extended_string(getStartTime());
     Value startTimeValue(startTimeString.c_str(), startTimeString.size(), dom_.GetAllocator());
     dom_.AddMember("start_time", startTimeValue, dom_.GetAllocator());
 
     // execute_time: when the statement was submitted to MySql
-    string executeTimeString = posix_time::to_iso_extended_string(executeTime_);
+    string executeTimeString = posix_time::to_iso_extended_string(getExecuteTime());
     Value executeTimeValue(executeTimeString.c_str(), executeTimeString.size(), dom_.GetAllocator());
     dom_.AddMember("execute_time", executeTimeValue, dom_.GetAllocator());
 
     // retrieve_time: when results retrieval started
-    string retrieveTimeString = posix_time::to_iso_extended_string(retrieveTime_);
+    string retrieveTimeString = posix_time::to_iso_extended_string(getRetrieveTime());
     Value retrieveTimeValue(retrieveTimeString.c_str(), retrieveTimeString.size(), dom_.GetAllocator());
     dom_.AddMember("retrieve_time", retrieveTimeValue, dom_.GetAllocator());
 
     // complete time: when the execution was complete
-    string completeTimeString = posix_time::to_iso_extended_string(completeTime_);
+    string completeTimeString = posix_time::to_iso_extended_string(getCompleteTime());
     Value completeTimeValue(completeTimeString.c_str(), completeTimeString.size(), dom_.GetAllocator());
     dom_.AddMember("complete_time", completeTimeValue, dom_.GetAllocator());
 
@@ -1279,13 +1535,23 @@ MySqlExecution::moveFrom(MySqlExecution * previousExecution)
 bool
 MySqlExecution::isSameAs(const Value & dom, stringstream & errorMessage) const
 {
-    if (dom["statement_name"] != statementName_.c_str())
+    return isSameAs(dom["statement_name"].GetString(), dom["statement_name"].GetStringLength(),
+                    dom["statement_text"].GetString(), dom["statement_text"].GetStringLength(),
+                    errorMessage);
+}
+
+bool
+MySqlExecution::isSameAs(const char * statementName, size_t statementNameLength,
+                         const char * statementText, size_t statementTextLength,
+                         stringstream & errorMessage) const
+{
+    if (statementName_.compare(0, string::npos, statementName, statementNameLength) != 0)
     {
         errorMessage << "Statement names don\'t match: " 
-                     << dom["statement_name"].GetString() << " NE " << statementName_;
+                     << string(statementName, statementNameLength) << " NE " << statementName_;
         return false;
     }
-    if (dom["statement_text"] != statementText_.c_str())
+    if (statementText_.compare(0, string::npos, statementText, statementTextLength) != 0)
     {
         errorMessage << "Statement texts don\'t match"; 
         return false;
@@ -1293,14 +1559,21 @@ MySqlExecution::isSameAs(const Value & dom, stringstream & errorMessage) const
     return true;
 }
 
+// A query cancelled by the deadline watchdog (or cut off by the client read
+// timeout after the deadline) fails with TIMEOUT_ERROR rather than the 
+// server's interrupted/lost-connection error
 int
-MySqlExecution::reportMySqlError(MYSQL_STMT * statementHandle, const stringstream & context)
+MySqlExecution::reportMySqlError(const stringstream & context)
 {
+    if (   connImpl_->isCancelled(this) 
+        || (statementHandle_->getErrorNo() == CR_SERVER_LOST && isPastDeadline()))
+        return reportTimeout(context.str().c_str());
+
     stringstream errorMessage;
     errorMessage << "MySql error " << context.str()
-                 << ": " << mysql_stmt_error(statementHandle)
-                 << " (" << mysql_stmt_errno(statementHandle) << ")";
-    return reportError(errorMessage, mysql_stmt_errno(statementHandle));
+                 << ": " << statementHandle_->getError()
+                 << " (" << statementHandle_->getErrorNo() << ")";
+    return reportError(errorMessage, statementHandle_->getErrorNo());
 }
 
 int
@@ -1322,6 +1595,21 @@ MySqlExecution::reportError(const string & errorMessage, int errorNo)
     return conn_->reportError(errorMessage, errorNo, executionHandle_);
 }
 
+int
+MySqlExecution::reportTimeout(const char * context)
+{
+    stringstream errorMessage;
+    errorMessage << "Deadline of " << timeoutMs_ << "ms exceeded " << context 
+                 << " (" << statementName_ << ")";
+    return reportError(errorMessage, TIMEOUT_ERROR);
+}
+
+bool
+MySqlExecution::isPastDeadline() const
+{
+    return PhaseClock::isSet(deadline_) && PhaseClock::now() >= deadline_;
+}
+
 // Render an execution as "f(arg1 [,arg2....])" where f is the statement name
 // and argN is the value assigned to the Nth parameter
 ostream & operator<<(ostream & o, const MySqlExecution & execution)
@@ -0,0 +1,802 @@
+#include <cstring>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/make_shared.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+#include "fixture.h"
+#include "replay_index.h"
+
+using namespace std;
+using namespace rapidjson;
+
+const char Fixture::MAGIC[8] = { 'M', 'C', 'A', 'T', 'F', 'I', 'X', '\0' };
+
+static const int MAX_NESTING = 64;
+
+static void
+putUint32(string & record, uint32_t value)
+{
+    for (size_t i = 0; i < 4; i++)
+        record.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+}
+
+static void
+putUint64(string & record, uint64_t value)
+{
+    for (size_t i = 0; i < 8; i++)
+        record.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+}
+
+static void
+putString(string & record, const char * str, size_t length)
+{
+    putUint32(record, static_cast<uint32_t>(length));
+    record.append(str, length);
+    record.push_back('\0');
+}
+
+// Reads the values of a record, or of the string table, checking that
+// they don't run past its end
+class FixtureCursor
+{
+public:
+    FixtureCursor(const char * data, size_t length) : pos_(data), end_(data + length), ok_(true) {}
+
+    bool          isOk() const  {  return ok_; }
+    bool          atEnd() const  {  return pos_ == end_; }
+    size_t        getRemaining() const  {  return end_ - pos_; }
+
+    const char *  getBytes(size_t length)
+    {
+        if (!ok_ || static_cast<size_t>(end_ - pos_) < length)
+        {
+            ok_ = false;
+            return NULL;
+        }
+        const char * bytes = pos_;
+        pos_ += length;
+        return bytes;
+    }
+
+    uint8_t       getByte()
+    {
+        const char * bytes = getBytes(1);
+        return bytes ? static_cast<uint8_t>(bytes[0]) : 0;
+    }
+
+    uint32_t      getUint32()
+    {
+        const char * bytes = getBytes(4);
+        uint32_t value = 0;
+        for (size_t i = 0; bytes && i < 4; i++)
+            value |= static_cast<uint32_t>(static_cast<unsigned char>(bytes[i])) << (8 * i);
+        return value;
+    }
+
+    uint64_t      getUint64()
+    {
+        const char * bytes = getBytes(8);
+        uint64_t value = 0;
+        for (size_t i = 0; bytes && i < 8; i++)
+            value |= static_cast<uint64_t>(static_cast<unsigned char>(bytes[i])) << (8 * i);
+        return value;
+    }
+
+    const char *  getString(size_t & length)
+    {
+        length = getUint32();
+        const char * str = getBytes(length + 1);
+        if (str != NULL && str[length] != '\0')
+        {
+            ok_ = false;
+            return NULL;
+        }
+        return str;
+    }
+
+private:
+    const char *  pos_;
+    const char *  end_;
+    bool          ok_;
+};
+
+
+//                                 F I X T U R E  W R I T E R
+
+FixtureWriter::FixtureWriter()
+:   file_(NULL),
+    executionCount_(0),
+    offset_(0)
+{
+}
+
+// A fixture that was never closed is incomplete: remove it
+FixtureWriter::~FixtureWriter()
+{
+    if (file_ != NULL)
+    {
+        fclose(file_);
+        remove(tmpPath_.c_str());
+    }
+}
+
+bool
+FixtureWriter::open(const string & path, string & errorMessage)
+{
+    path_ = path;
+    tmpPath_ = path + ".tmp";
+    stringIds_.clear();
+    strings_.clear();
+    executionCount_ = 0;
+    file_ = fopen(tmpPath_.c_str(), "wb");
+    if (file_ == NULL)
+    {
+        errorMessage = "Unable to open " + tmpPath_ + " for writing";
+        return false;
+    }
+
+    // the header is written again, complete, by close()
+    string header(Fixture::HEADER_SIZE, '\0');
+    offset_ = 0;
+    if (!writeBytes(header.data(), header.size()))
+    {
+        errorMessage = "Unable to write " + tmpPath_;
+        return false;
+    }
+    return true;
+}
+
+uint32_t
+FixtureWriter::internString(const char * str, size_t length)
+{
+    std::pair<map<string, uint32_t>::iterator, bool> inserted =
+        stringIds_.insert(make_pair(string(str, length), static_cast<uint32_t>(strings_.size())));
+    if (inserted.second)
+        strings_.push_back(&inserted.first->first);
+    return inserted.first->second;
+}
+
+void
+FixtureWriter::encodeValue(const Value & value, string & record)
+{
+    switch (value.GetType())
+    {
+        case kNullType:
+            record.push_back(Fixture::NULL_TAG);
+            break;
+
+        case kFalseType:
+            record.push_back(Fixture::FALSE_TAG);
+            break;
+
+        case kTrueType:
+            record.push_back(Fixture::TRUE_TAG);
+            break;
+
+        case kNumberType:
+            if (value.IsInt64())
+            {
+                record.push_back(Fixture::INT64_TAG);
+                putUint64(record, static_cast<uint64_t>(value.GetInt64()));
+            }
+            else if (value.IsUint64())
+            {
+                record.push_back(Fixture::UINT64_TAG);
+                putUint64(record, value.GetUint64());
+            }
+            else
+            {
+                double number = value.GetDouble();
+                uint64_t bits;
+                memcpy(&bits, &number, sizeof(bits));
+                record.push_back(Fixture::DOUBLE_TAG);
+                putUint64(record, bits);
+            }
+            break;
+
+        case kStringType:
+            record.push_back(Fixture::STRING_TAG);
+            putString(record, value.GetString(), value.GetStringLength());
+            break;
+
+        case kArrayType:
+            record.push_back(Fixture::ARRAY_TAG);
+            putUint32(record, value.Size());
+            for (Value::ConstValueIterator itr = value.Begin(); itr != value.End(); ++itr)
+                encodeValue(*itr, record);
+            break;
+
+        case kObjectType:
+            record.push_back(Fixture::OBJECT_TAG);
+            putUint32(record, value.MemberCount());
+            for (Value::ConstMemberIterator itr = value.MemberBegin(); itr != value.MemberEnd(); ++itr)
+            {
+                putUint32(record, internString(itr->name.GetString(), itr->name.GetStringLength()));
+                encodeValue(itr->value, record);
+            }
+            break;
+    }
+}
+
+// Results as captured (a "columns" object of column names and types, and
+// "rows" of objects with one member per column, in column order) are stored
+// as a table. Returns false, writing nothing, for results of any other shape.
+bool
+FixtureWriter::encodeResults(const Value & results, string & record)
+{
+    if (!results.IsObject() || results.MemberCount() != 2) return false;
+    Value::ConstMemberIterator columnsItr = results.FindMember("columns");
+    Value::ConstMemberIterator rowsItr = results.FindMember("rows");
+    if (columnsItr == results.MemberEnd() || !columnsItr->value.IsObject()) return false;
+    if (rowsItr == results.MemberEnd() || !rowsItr->value.IsArray()) return false;
+    const Value & columns = columnsItr->value;
+    const Value & rows = rowsItr->value;
+
+    for (Value::ConstMemberIterator itr = columns.MemberBegin(); itr != columns.MemberEnd(); ++itr)
+        if (!itr->value.IsInt()) return false;
+    for (Value::ConstValueIterator row = rows.Begin(); row != rows.End(); ++row)
+    {
+        if (!row->IsObject() || row->MemberCount() != columns.MemberCount()) return false;
+        Value::ConstMemberIterator column = columns.MemberBegin();
+        for (Value::ConstMemberIterator itr = row->MemberBegin(); itr != row->MemberEnd(); ++itr, ++column)
+            if (itr->name != column->name) return false;
+    }
+
+    putUint32(record, columns.MemberCount());
+    for (Value::ConstMemberIterator itr = columns.MemberBegin(); itr != columns.MemberEnd(); ++itr)
+    {
+        putUint32(record, internString(itr->name.GetString(), itr->name.GetStringLength()));
+        putUint32(record, static_cast<uint32_t>(itr->value.GetInt()));
+    }
+    putUint32(record, rows.Size());
+    for (Value::ConstValueIterator row = rows.Begin(); row != rows.End(); ++row)
+        for (Value::ConstMemberIterator itr = row->MemberBegin(); itr != row->MemberEnd(); ++itr)
+            encodeValue(itr->value, record);
+    return true;
+}
+
+bool
+FixtureWriter::write(const Value & execution, string & errorMessage)
+{
+    if (file_ == NULL)
+    {
+        errorMessage = "Fixture is not open";
+        return false;
+    }
+    if (   !execution.IsObject()
+        || !execution.HasMember("statement_name") || !execution["statement_name"].IsString()
+        || !execution.HasMember("statement_text") || !execution["statement_text"].IsString()
+        || !execution.HasMember("state") || !execution["state"].IsInt()
+        || !execution.HasMember("rc") || !execution["rc"].IsInt())
+    {
+        stringstream message;
+        message << "Execution " << executionCount_ + 1 << " lacks a statement name, statement text, state or rc";
+        errorMessage = message.str();
+        return false;
+    }
+
+    uint8_t flags = 0;
+    if (execution.HasMember("rows_returned")) flags |= Fixture::HAS_ROWS_RETURNED;
+    if (execution.HasMember("rows_affected")) flags |= Fixture::HAS_ROWS_AFFECTED;
+    if (execution.HasMember("error_no")) flags |= Fixture::HAS_ERROR;
+    if (execution.HasMember("results")) flags |= Fixture::HAS_RESULTS;
+    else if (execution.HasMember("results_ref") && execution["results_ref"].IsString()) flags |= Fixture::RESULTS_REF;
+
+    string body;
+    const Value & statementName = execution["statement_name"];
+    const Value & statementText = execution["statement_text"];
+    putUint32(body, internString(statementName.GetString(), statementName.GetStringLength()));
+    putUint32(body, internString(statementText.GetString(), statementText.GetStringLength()));
+    putUint32(body, static_cast<uint32_t>(execution["state"].GetInt()));
+    putUint32(body, static_cast<uint32_t>(execution["rc"].GetInt()));
+    Value::ConstMemberIterator parameters = execution.FindMember("parameters");
+    putUint64(body, ReplayKey::hashParameters(parameters == execution.MemberEnd() ? NULL : &parameters->value));
+    if (flags & Fixture::HAS_ROWS_RETURNED)
+        putUint64(body, static_cast<uint64_t>(execution["rows_returned"].GetInt64()));
+    if (flags & Fixture::HAS_ROWS_AFFECTED)
+        putUint64(body, static_cast<uint64_t>(execution["rows_affected"].GetInt64()));
+    if (flags & Fixture::HAS_ERROR)
+    {
+        putUint32(body, static_cast<uint32_t>(execution["error_no"].GetInt()));
+        if (execution.HasMember("error_message") && execution["error_message"].IsString())
+            putString(body, execution["error_message"].GetString(), execution["error_message"].GetStringLength());
+        else
+            putString(body, "", 0);
+    }
+    if (flags & Fixture::HAS_RESULTS)
+    {
+        string results;
+        if (encodeResults(execution["results"], results))
+            flags |= Fixture::TABULAR_RESULTS;
+        else
+            encodeValue(execution["results"], results);
+        body.append(results);
+    }
+    else if (flags & Fixture::RESULTS_REF)
+        putString(body, execution["results_ref"].GetString(), execution["results_ref"].GetStringLength());
+
+    string record;
+    putUint32(record, static_cast<uint32_t>(body.size() + 1));
+    record.push_back(static_cast<char>(flags));
+    record.append(body);
+    if (!writeBytes(record.data(), record.size()))
+    {
+        errorMessage = "Unable to write " + tmpPath_;
+        return false;
+    }
+    executionCount_++;
+    return true;
+}
+
+// Write the string table, complete the header, and rename the fixture
+bool
+FixtureWriter::close(string & errorMessage)
+{
+    if (file_ == NULL) return true;
+
+    uint64_t stringTableOffset = offset_;
+    string strings;
+    for (vector<const string *>::const_iterator itr = strings_.begin(); itr != strings_.end(); ++itr)
+        putString(strings, (*itr)->data(), (*itr)->size());
+
+    string header(Fixture::MAGIC, sizeof(Fixture::MAGIC));
+    putUint32(header, Fixture::VERSION);
+    putUint32(header, executionCount_);
+    putUint32(header, static_cast<uint32_t>(strings_.size()));
+    putUint64(header, stringTableOffset);
+
+    bool ok =    writeBytes(strings.data(), strings.size())
+              && fseek(file_, 0, SEEK_SET) == 0
+              && fwrite(header.data(), 1, header.size(), file_) == header.size();
+    ok = fclose(file_) == 0 && ok;
+    file_ = NULL;
+    if (!ok || rename(tmpPath_.c_str(), path_.c_str()) != 0)
+    {
+        remove(tmpPath_.c_str());
+        errorMessage = "Unable to write " + path_;
+        return false;
+    }
+    return true;
+}
+
+bool
+FixtureWriter::writeBytes(const char * data, size_t length)
+{
+    if (fwrite(data, 1, length, file_) != length) return false;
+    offset_ += length;
+    return true;
+}
+
+
+//                                 F I X T U R E  R E A D E R
+
+typedef vector<pair<const char *, size_t> > StringTable;
+
+// Strings are decoded as references into the fixture, not copied
+static bool
+decodeValue(FixtureCursor &                    cursor,
+            const StringTable &                strings,
+            Value &                            value,
+            Document::AllocatorType &          allocator,
+            int                                depth)
+{
+    if (depth > MAX_NESTING) return false;
+    switch (cursor.getByte())
+    {
+        case Fixture::NULL_TAG:
+            value.SetNull();
+            break;
+
+        case Fixture::FALSE_TAG:
+            value.SetBool(false);
+            break;
+
+        case Fixture::TRUE_TAG:
+            value.SetBool(true);
+            break;
+
+        case Fixture::INT64_TAG:
+            value.SetInt64(static_cast<int64_t>(cursor.getUint64()));
+            break;
+
+        case Fixture::UINT64_TAG:
+            value.SetUint64(cursor.getUint64());
+            break;
+
+        case Fixture::DOUBLE_TAG:
+        {
+            uint64_t bits = cursor.getUint64();
+            double number;
+            memcpy(&number, &bits, sizeof(number));
+            value.SetDouble(number);
+            break;
+        }
+
+        case Fixture::STRING_TAG:
+        {
+            size_t length;
+            const char * str = cursor.getString(length);
+            if (str == NULL) return false;
+            value.SetString(StringRef(str, length));
+            break;
+        }
+
+        case Fixture::ARRAY_TAG:
+        {
+            uint32_t size = cursor.getUint32();
+            value.SetArray();
+            for (uint32_t i = 0; i < size && cursor.isOk(); i++)
+            {
+                Value element;
+                if (!decodeValue(cursor, strings, element, allocator, depth + 1)) return false;
+                value.PushBack(element, allocator);
+            }
+            break;
+        }
+
+        case Fixture::OBJECT_TAG:
+        {
+            uint32_t memberCount = cursor.getUint32();
+            value.SetObject();
+            for (uint32_t i = 0; i < memberCount && cursor.isOk(); i++)
+            {
+                uint32_t nameId = cursor.getUint32();
+                if (nameId >= strings.size()) return false;
+                Value member;
+                if (!decodeValue(cursor, strings, member, allocator, depth + 1)) return false;
+                value.AddMember(Value(StringRef(strings[nameId].first, strings[nameId].second)).Move(), member, allocator);
+            }
+            break;
+        }
+
+        default:
+            return false;
+    }
+    return cursor.isOk();
+}
+
+static bool
+decodeResults(FixtureCursor &                    cursor,
+              const StringTable &                strings,
+              Value &                            results,
+              Document::AllocatorType &          allocator)
+{
+    uint32_t columnCount = cursor.getUint32();
+    vector<uint32_t> columnNames;
+    Value columns(kObjectType);
+    for (uint32_t i = 0; i < columnCount && cursor.isOk(); i++)
+    {
+        uint32_t nameId = cursor.getUint32();
+        int dataType = static_cast<int>(cursor.getUint32());
+        if (nameId >= strings.size()) return false;
+        columnNames.push_back(nameId);
+        columns.AddMember(Value(StringRef(strings[nameId].first, strings[nameId].second)).Move(),
+                          Value(dataType).Move(), allocator);
+    }
+
+    uint32_t rowCount = cursor.getUint32();
+    Value rows(kArrayType);
+    if (cursor.isOk())
+        rows.Reserve(rowCount, allocator);
+    for (uint32_t irow = 0; irow < rowCount && cursor.isOk(); irow++)
+    {
+        Value row(kObjectType);
+        for (vector<uint32_t>::const_iterator itr = columnNames.begin(); itr != columnNames.end(); ++itr)
+        {
+            Value field;
+            if (!decodeValue(cursor, strings, field, allocator, 1)) return false;
+            row.AddMember(Value(StringRef(strings[*itr].first, strings[*itr].second)).Move(), field, allocator);
+        }
+        rows.PushBack(row, allocator);
+    }
+
+    results.SetObject();
+    results.AddMember("columns", columns, allocator);
+    results.AddMember("rows", rows, allocator);
+    return cursor.isOk();
+}
+
+FixtureExecution::FixtureExecution()
+:   statementName_(""),
+    statementNameLength_(0),
+    statementText_(""),
+    statementTextLength_(0),
+    state_(0),
+    rc_(0),
+    parameterHash_(0),
+    flags_(0),
+    rowsReturned_(0),
+    rowsAffected_(0),
+    errorNo_(0),
+    errorMessage_(""),
+    errorMessageLength_(0),
+    resultsOffset_(0),
+    resultsLength_(0),
+    resultsRef_(NULL),
+    resultsRefLength_(0)
+{
+}
+
+FixtureReader::FixtureReader()
+:   data_(NULL),
+    size_(0)
+{
+}
+
+FixtureReader::~FixtureReader()
+{
+    close();
+}
+
+void
+FixtureReader::close()
+{
+    if (data_ != NULL)
+        munmap(const_cast<char *>(data_), size_);
+    data_ = NULL;
+    size_ = 0;
+    strings_.clear();
+    records_.clear();
+}
+
+bool
+FixtureReader::open(const string & path, string & errorMessage)
+{
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        errorMessage = "Unable to open " + path + " for reading";
+        return false;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == 0 && fileStat.st_size >= static_cast<off_t>(Fixture::HEADER_SIZE))
+    {
+        void * mapping = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED)
+        {
+            data_ = static_cast<const char *>(mapping);
+            size_ = fileStat.st_size;
+        }
+    }
+    ::close(fd);
+    if (data_ == NULL || memcmp(data_, Fixture::MAGIC, sizeof(Fixture::MAGIC)) != 0)
+    {
+        close();
+        errorMessage = path + " is not a replay fixture";
+        return false;
+    }
+
+    FixtureCursor header(data_ + sizeof(Fixture::MAGIC), Fixture::HEADER_SIZE - sizeof(Fixture::MAGIC));
+    uint32_t version = header.getUint32();
+    uint32_t executionCount = header.getUint32();
+    uint32_t stringCount = header.getUint32();
+    uint64_t stringTableOffset = header.getUint64();
+    if (version < Fixture::MIN_VERSION || version > Fixture::VERSION || stringTableOffset < Fixture::HEADER_SIZE || stringTableOffset > size_)
+    {
+        close();
+        errorMessage = path + " is an unsupported or truncated replay fixture";
+        return false;
+    }
+
+    FixtureCursor stringTable(data_ + stringTableOffset, size_ - stringTableOffset);
+    strings_.reserve(stringCount);
+    for (uint32_t i = 0; i < stringCount && stringTable.isOk(); i++)
+    {
+        size_t length;
+        const char * str = stringTable.getString(length);
+        if (str != NULL)
+            strings_.push_back(make_pair(str, length));
+    }
+
+    FixtureCursor records(data_ + Fixture::HEADER_SIZE, stringTableOffset - Fixture::HEADER_SIZE);
+    records_.reserve(executionCount);
+    while (records.isOk() && !records.atEnd())
+    {
+        size_t length = records.getUint32();
+        const char * record = records.getBytes(length);
+        if (record != NULL)
+            records_.push_back(make_pair(static_cast<size_t>(record - data_), length));
+    }
+
+    if (!stringTable.isOk() || !records.isOk() || records_.size() != executionCount)
+    {
+        close();
+        errorMessage = path + " is a corrupt replay fixture";
+        return false;
+    }
+    return true;
+}
+
+// Decode the members of an execution record, other than its results
+bool
+FixtureReader::getExecution(size_t executionIndex, FixtureExecution & execution, string & errorMessage) const
+{
+    stringstream message;
+    if (executionIndex >= records_.size())
+    {
+        message << "No execution " << executionIndex + 1 << " in fixture of " << records_.size();
+        errorMessage = message.str();
+        return false;
+    }
+
+    FixtureCursor cursor(data_ + records_[executionIndex].first, records_[executionIndex].second);
+    execution = FixtureExecution();
+    execution.flags_ = cursor.getByte();
+    uint32_t statementNameId = cursor.getUint32();
+    uint32_t statementTextId = cursor.getUint32();
+    execution.state_ = static_cast<int>(cursor.getUint32());
+    execution.rc_ = static_cast<int>(cursor.getUint32());
+    execution.parameterHash_ = cursor.getUint64();
+    if (execution.flags_ & Fixture::HAS_ROWS_RETURNED)
+        execution.rowsReturned_ = static_cast<int64_t>(cursor.getUint64());
+    if (execution.flags_ & Fixture::HAS_ROWS_AFFECTED)
+        execution.rowsAffected_ = static_cast<int64_t>(cursor.getUint64());
+    if (execution.flags_ & Fixture::HAS_ERROR)
+    {
+        execution.errorNo_ = static_cast<int>(cursor.getUint32());
+        execution.errorMessage_ = cursor.getString(execution.errorMessageLength_);
+    }
+    if (   !cursor.isOk()
+        || statementNameId >= strings_.size() || statementTextId >= strings_.size())
+    {
+        message << "Execution " << executionIndex + 1 << " of the fixture is corrupt";
+        errorMessage = message.str();
+        return false;
+    }
+
+    execution.statementName_ = strings_[statementNameId].first;
+    execution.statementNameLength_ = strings_[statementNameId].second;
+    execution.statementText_ = strings_[statementTextId].first;
+    execution.statementTextLength_ = strings_[statementTextId].second;
+    if (execution.flags_ & Fixture::HAS_RESULTS)
+    {
+        size_t recordEnd = records_[executionIndex].first + records_[executionIndex].second;
+        execution.resultsLength_ = cursor.getRemaining();
+        execution.resultsOffset_ = recordEnd - execution.resultsLength_;
+    }
+    else if (execution.flags_ & Fixture::RESULTS_REF)
+    {
+        execution.resultsRef_ = cursor.getString(execution.resultsRefLength_);
+        if (execution.resultsRef_ == NULL)
+        {
+            message << "Execution " << executionIndex + 1 << " of the fixture is corrupt";
+            errorMessage = message.str();
+            return false;
+        }
+    }
+    return true;
+}
+
+// Decode the results of an execution record, in the form they have in a
+// capture file
+bool
+FixtureReader::getResults(const FixtureExecution &   execution,
+                          Value &                    results,
+                          Document::AllocatorType &  allocator,
+                          string &                   errorMessage) const
+{
+    if (!(execution.flags_ & Fixture::HAS_RESULTS))
+    {
+        results.SetObject();
+        return true;
+    }
+    FixtureCursor cursor(data_ + execution.resultsOffset_, execution.resultsLength_);
+    bool ok;
+    if (execution.flags_ & Fixture::TABULAR_RESULTS)
+        ok = decodeResults(cursor, strings_, results, allocator);
+    else
+        ok = decodeValue(cursor, strings_, results, allocator, 0);
+    if (!ok)
+    {
+        errorMessage = string("The results of ") + execution.statementName_ + " in the fixture are corrupt";
+        return false;
+    }
+    return true;
+}
+
+
+//                                 C A P T U R E  R E A D E R
+
+// Read a whole file, NUL-terminated for an in-situ parse
+bool
+CaptureReader::readFile(const string & path, vector<char> & buffer, string & errorMessage)
+{
+    FILE * fp = fopen(path.c_str(), "rb");
+    if (fp == NULL)
+    {
+        errorMessage = "Unable to open " + path + " for reading";
+        return false;
+    }
+    bool ok = fseek(fp, 0, SEEK_END) == 0;
+    long size = ok ? ftell(fp) : -1;
+    ok = size >= 0 && fseek(fp, 0, SEEK_SET) == 0;
+    if (ok)
+    {
+        buffer.resize(size + 1);
+        ok = size == 0 || fread(&buffer[0], 1, size, fp) == static_cast<size_t>(size);
+        buffer[size] = '\0';
+    }
+    fclose(fp);
+    if (!ok)
+    {
+        errorMessage = "Unable to read " + path;
+        return false;
+    }
+    return true;
+}
+
+bool
+CaptureReader::open(const string & path, string & errorMessage)
+{
+    if (!readFile(path, buffer_, errorMessage)) return false;
+    document_.ParseInsitu(&buffer_[0]);
+    if (   document_.HasParseError() || !document_.IsObject()
+        || !document_.HasMember("executions") || !document_["executions"].IsArray())
+    {
+        errorMessage = path + " is not a capture file";
+        return false;
+    }
+    return true;
+}
+
+
+//                                   R E P L A Y  C A C H E
+
+boost::mutex            ReplayCache::mutex_;
+ReplayCache::FixtureMap ReplayCache::fixtures_;
+ReplayCache::CaptureMap ReplayCache::captures_;
+
+bool
+ReplayCache::getKey(const string & path, string & key)
+{
+    struct stat fileStat;
+    if (stat(path.c_str(), &fileStat) != 0) return false;
+    stringstream keyStream;
+    keyStream << path << '|' << fileStat.st_size << '|' << fileStat.st_mtime;
+    key = keyStream.str();
+    return true;
+}
+
+boost::shared_ptr<const FixtureReader>
+ReplayCache::getFixture(const string & path, string & errorMessage)
+{
+    string key;
+    if (!getKey(path, key))
+    {
+        errorMessage = "Unable to open " + path + " for reading";
+        return boost::shared_ptr<const FixtureReader>();
+    }
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    FixtureMap::const_iterator itr = fixtures_.find(key);
+    if (itr != fixtures_.end()) return itr->second;
+    boost::shared_ptr<FixtureReader> fixture = boost::make_shared<FixtureReader>();
+    if (!fixture->open(path, errorMessage)) return boost::shared_ptr<const FixtureReader>();
+    fixtures_[key] = fixture;
+    return fixture;
+}
+
+boost::shared_ptr<const CaptureReader>
+ReplayCache::getCapture(const string & path, string & errorMessage)
+{
+    string key;
+    if (!getKey(path, key))
+    {
+        errorMessage = "Unable to open " + path + " for reading";
+        return boost::shared_ptr<const CaptureReader>();
+    }
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    CaptureMap::const_iterator itr = captures_.find(key);
+    if (itr != captures_.end()) return itr->second;
+    boost::shared_ptr<CaptureReader> capture = boost::make_shared<CaptureReader>();
+    if (!capture->open(path, errorMessage)) return boost::shared_ptr<const CaptureReader>();
+    captures_[key] = capture;
+    return capture;
+}
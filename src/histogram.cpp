@@ -0,0 +1,109 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include "histogram.h"
+
+using namespace std;
+
+
+//                                L A T E N C Y  H I S T O G R A M
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+void
+LatencyHistogram::reset()
+{
+    memset(counts_, 0, sizeof(counts_));
+    count_ = 0;
+    min_ = numeric_limits<uint64_t>::max();
+    max_ = 0;
+    sum_ = 0;
+}
+
+// Values below SUB_BUCKET_COUNT index their own bucket. Above that, the
+// value's top SUB_BUCKET_BITS bits pick one of the HALF_BUCKET_COUNT buckets
+// for its power of two.
+size_t
+LatencyHistogram::getBucketIndex(uint64_t value)
+{
+    if (value < SUB_BUCKET_COUNT) return static_cast<size_t>(value);
+    if (value >> MAX_VALUE_BITS) return BUCKET_COUNT - 1;
+
+    int topBit = SUB_BUCKET_BITS;
+    while (value >> (topBit + 1)) topBit++;
+    int shift = topBit - SUB_BUCKET_BITS + 1;
+    size_t subBucket = static_cast<size_t>(value >> shift);
+    return SUB_BUCKET_COUNT + (shift - 1) * HALF_BUCKET_COUNT + (subBucket - HALF_BUCKET_COUNT);
+}
+
+uint64_t
+LatencyHistogram::getBucketLimit(size_t index)
+{
+    if (index < SUB_BUCKET_COUNT) return index;
+    size_t offset = index - SUB_BUCKET_COUNT;
+    int shift = static_cast<int>(offset / HALF_BUCKET_COUNT) + 1;
+    uint64_t subBucket = HALF_BUCKET_COUNT + offset % HALF_BUCKET_COUNT;
+    return ((subBucket + 1) << shift) - 1;
+}
+
+void
+LatencyHistogram::record(uint64_t value)
+{
+    counts_[getBucketIndex(value)]++;
+    count_++;
+    sum_ += value;
+    if (value < min_) min_ = value;
+    if (value > max_) max_ = value;
+}
+
+void
+LatencyHistogram::merge(const LatencyHistogram & other)
+{
+    if (other.count_ == 0) return;
+    for (size_t i = 0; i < BUCKET_COUNT; i++)
+        counts_[i] += other.counts_[i];
+    count_ += other.count_;
+    sum_ += other.sum_;
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+}
+
+// The highest value of the bucket holding the percentile's value, within the
+// range of values recorded
+uint64_t
+LatencyHistogram::getValueAtPercentile(double percentile) const
+{
+    if (count_ == 0) return 0;
+    percentile = std::min(std::max(percentile, 0.0), 100.0);
+    uint64_t rank = static_cast<uint64_t>(ceil(percentile / 100.0 * count_));
+    if (rank == 0) rank = 1;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKET_COUNT; i++)
+    {
+        seen += counts_[i];
+        if (seen >= rank)
+            return std::max(min_, std::min(max_, getBucketLimit(i)));
+    }
+    return max_;
+}
+
+// The count, and the mean, extremes and percentiles in microseconds
+void
+LatencyHistogram::toJson(rapidjson::Value & json, rapidjson::Document::AllocatorType & allocator) const
+{
+    json.SetObject();
+    json.AddMember("count", count_, allocator);
+    json.AddMember("min_us", getMin(), allocator);
+    json.AddMember("mean_us", getMean(), allocator);
+    json.AddMember("p50_us", getValueAtPercentile(50.0), allocator);
+    json.AddMember("p90_us", getValueAtPercentile(90.0), allocator);
+    json.AddMember("p99_us", getValueAtPercentile(99.0), allocator);
+    json.AddMember("p999_us", getValueAtPercentile(99.9), allocator);
+    json.AddMember("max_us", max_, allocator);
+}
@@ -0,0 +1,279 @@
+#include <cmath>
+#include <cstring>
+
+#include <boost/atomic.hpp>
+#include <boost/random/exponential_distribution.hpp>
+#include <boost/random/normal_distribution.hpp>
+#include <boost/random/uniform_01.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <errmsg.h>
+
+#include "backend.h"
+
+using namespace std;
+using namespace rapidjson;
+
+static boost::atomic<unsigned long> nextLatencySeed(1);
+
+static double
+getDouble(const Value & spec, const char * name, double defaultValue)
+{
+    Value::ConstMemberIterator itr = spec.FindMember(name);
+    return itr != spec.MemberEnd() && itr->value.IsNumber() ? itr->value.GetDouble() : defaultValue;
+}
+
+
+//                                  L A T E N C Y  S P E C
+
+LatencyBackend::LatencySpec::LatencySpec()
+:   distribution_(FIXED),
+    meanUs_(0),
+    stddevUs_(0),
+    minUs_(0),
+    maxUs_(0),
+    jitterUs_(0),
+    errorRate_(0),
+    errorNo_(CR_SERVER_LOST)
+{}
+
+// Settings missing from the spec keep their current values, so a statement's
+// spec starts from the top-level one
+void
+LatencyBackend::LatencySpec::load(const Value & spec)
+{
+    if (!spec.IsObject()) return;
+    Value::ConstMemberIterator itr = spec.FindMember("match");
+    if (itr != spec.MemberEnd() && itr->value.IsString())
+        match_ = itr->value.GetString();
+    itr = spec.FindMember("distribution");
+    if (itr != spec.MemberEnd() && itr->value.IsString())
+    {
+        const char * distribution = itr->value.GetString();
+        if (strcmp(distribution, "uniform") == 0)           distribution_ = UNIFORM;
+        else if (strcmp(distribution, "normal") == 0)       distribution_ = NORMAL;
+        else if (strcmp(distribution, "lognormal") == 0)    distribution_ = LOGNORMAL;
+        else if (strcmp(distribution, "exponential") == 0)  distribution_ = EXPONENTIAL;
+        else                                                 distribution_ = FIXED;
+    }
+    meanUs_ = getDouble(spec, "mean_us", meanUs_);
+    stddevUs_ = getDouble(spec, "stddev_us", stddevUs_);
+    minUs_ = getDouble(spec, "min_us", minUs_);
+    maxUs_ = getDouble(spec, "max_us", maxUs_);
+    jitterUs_ = getDouble(spec, "jitter_us", jitterUs_);
+    errorRate_ = getDouble(spec, "error_rate", errorRate_);
+    itr = spec.FindMember("error_no");
+    if (itr != spec.MemberEnd() && itr->value.IsUint())
+        errorNo_ = itr->value.GetUint();
+}
+
+
+//                                L A T E N C Y  B A C K E N D
+
+boost::mutex               LatencyBackend::serversMutex_;
+LatencyBackend::ServerMap  LatencyBackend::servers_;
+
+LatencyBackend::LatencyBackend(const rapidjson::Document * params, MySqlConnection * conn)
+:   inner_(MySqlBackend::createBackend(getInnerType(params), params, conn))
+{
+    string serverName("default");
+    double maxQps = 0;
+    int maxConcurrent = 0;
+    unsigned long seed = nextLatencySeed++;
+    if (params != NULL && params->IsObject())
+    {
+        defaultSpec_.load(*params);
+        defaultSpec_.match_.clear();
+        Value::ConstMemberIterator itr = params->FindMember("statements");
+        if (itr != params->MemberEnd() && itr->value.IsArray())
+        {
+            for (Value::ConstValueIterator spec = itr->value.Begin(); spec != itr->value.End(); ++spec)
+            {
+                statementSpecs_.push_back(defaultSpec_);
+                statementSpecs_.back().load(*spec);
+            }
+        }
+        itr = params->FindMember("server");
+        if (itr != params->MemberEnd() && itr->value.IsString())
+            serverName = itr->value.GetString();
+        maxQps = getDouble(*params, "max_qps", 0);
+        itr = params->FindMember("max_concurrent");
+        if (itr != params->MemberEnd() && itr->value.IsInt())
+            maxConcurrent = itr->value.GetInt();
+        // a seed makes the draws repeatable; each connection still gets its own sequence
+        itr = params->FindMember("seed");
+        if (itr != params->MemberEnd() && itr->value.IsUint())
+            seed += itr->value.GetUint();
+    }
+    generator_.seed(static_cast<boost::uint32_t>(seed));
+    server_ = getServer(serverName, maxQps, maxConcurrent);
+}
+
+BackendType
+LatencyBackend::getInnerType(const rapidjson::Document * params)
+{
+    if (params == NULL || !params->IsObject()) return LOOPBACK_BACKEND;
+    Value::ConstMemberIterator itr = params->FindMember("inner");
+    if (itr != params->MemberEnd() && itr->value.IsString() && strcmp(itr->value.GetString(), "mysql") == 0)
+        return MYSQL_BACKEND;
+    return LOOPBACK_BACKEND;
+}
+
+boost::shared_ptr<LatencyBackend::Server>
+LatencyBackend::getServer(const string & name, double maxQps, int maxConcurrent)
+{
+    boost::lock_guard<boost::mutex> lock(serversMutex_);
+    boost::shared_ptr<Server> & server = servers_[name];
+    if (!server)
+    {
+        server.reset(new Server());
+        server->maxQps_ = maxQps;
+        server->maxConcurrent_ = maxConcurrent;
+    }
+    return server;
+}
+
+int
+LatencyBackend::connect(const char *  host,
+                        const char *  user,
+                        const char *  password,
+                        const char *  databaseName,
+                        int           port,
+                        const char *  socket,
+                        unsigned long flags,
+                        unsigned int  readTimeout)
+{
+    return inner_->connect(host, user, password, databaseName, port, socket, flags, readTimeout);
+}
+
+BackendStatement *
+LatencyBackend::createStatement()
+{
+    BackendStatement * innerStatement = inner_->createStatement();
+    if (innerStatement == NULL) return NULL;
+    return new LatencyStatement(this, innerStatement);
+}
+
+const LatencyBackend::LatencySpec &
+LatencyBackend::getSpec(const string & statementText) const
+{
+    for (vector<LatencySpec>::const_iterator itr = statementSpecs_.begin(); itr != statementSpecs_.end(); ++itr)
+    {
+        if (statementText.find(itr->match_) != string::npos) return *itr;
+    }
+    return defaultSpec_;
+}
+
+// The lognormal draw is parameterized by the mean and standard deviation of
+// the latency itself, not of its logarithm
+unsigned long
+LatencyBackend::drawLatency(const LatencySpec & spec)
+{
+    double latencyUs = spec.meanUs_;
+    switch (spec.distribution_)
+    {
+        case LatencySpec::UNIFORM:
+            latencyUs = spec.minUs_ + boost::random::uniform_01<double>()(generator_) * (spec.maxUs_ - spec.minUs_);
+            break;
+        case LatencySpec::NORMAL:
+            latencyUs = boost::random::normal_distribution<double>(spec.meanUs_, spec.stddevUs_)(generator_);
+            break;
+        case LatencySpec::LOGNORMAL:
+            if (spec.meanUs_ > 0)
+            {
+                double variance = spec.stddevUs_ * spec.stddevUs_;
+                double sigma = std::sqrt(std::log(1 + variance / (spec.meanUs_ * spec.meanUs_)));
+                double mu = std::log(spec.meanUs_) - sigma * sigma / 2;
+                latencyUs = std::exp(boost::random::normal_distribution<double>(mu, sigma)(generator_));
+            }
+            break;
+        case LatencySpec::EXPONENTIAL:
+            if (spec.meanUs_ > 0)
+                latencyUs = boost::random::exponential_distribution<double>(1 / spec.meanUs_)(generator_);
+            break;
+        default:
+            break;
+    }
+    if (spec.jitterUs_ > 0)
+        latencyUs += (2 * boost::random::uniform_01<double>()(generator_) - 1) * spec.jitterUs_;
+    if (latencyUs < spec.minUs_) latencyUs = spec.minUs_;
+    if (spec.maxUs_ > 0 && latencyUs > spec.maxUs_) latencyUs = spec.maxUs_;
+    return latencyUs > 0 ? static_cast<unsigned long>(latencyUs) : 0;
+}
+
+bool
+LatencyBackend::drawError(const LatencySpec & spec)
+{
+    return spec.errorRate_ > 0 && boost::random::uniform_01<double>()(generator_) < spec.errorRate_;
+}
+
+// Waits for a free execution slot, and then for the next start time the qps
+// cap allows. Start times are handed out in order, so executions waiting on
+// the cap start at even intervals.
+void
+LatencyBackend::startExecution()
+{
+    posix_time::ptime startTime;
+    {
+        boost::unique_lock<boost::mutex> lock(server_->mutex_);
+        while (server_->maxConcurrent_ > 0 && server_->inFlight_ >= server_->maxConcurrent_)
+            server_->slotCv_.wait(lock);
+        server_->inFlight_++;
+        if (server_->maxQps_ <= 0) return;
+
+        posix_time::ptime now = posix_time::microsec_clock::universal_time();
+        startTime = server_->nextStart_.is_not_a_date_time() || server_->nextStart_ < now ? now : server_->nextStart_;
+        server_->nextStart_ = startTime + posix_time::microseconds(static_cast<int64_t>(1e6 / server_->maxQps_));
+    }
+    boost::this_thread::sleep(startTime);
+}
+
+void
+LatencyBackend::endExecution()
+{
+    boost::lock_guard<boost::mutex> lock(server_->mutex_);
+    server_->inFlight_--;
+    server_->slotCv_.notify_one();
+}
+
+
+//                              L A T E N C Y  S T A T E M E N T
+
+LatencyStatement::LatencyStatement(LatencyBackend * backend, BackendStatement * inner)
+:   backend_(backend),
+    inner_(inner),
+    spec_(NULL),
+    errorNo_(0)
+{}
+
+int
+LatencyStatement::prepare(const char * statementText, size_t length)
+{
+    spec_ = &backend_->getSpec(string(statementText, length));
+    return inner_->prepare(statementText, length);
+}
+
+// The injected latency is slept before the inner execution, while holding
+// the server's slot; an injected error replaces the inner execution. The
+// sleep can't be interrupted, so a query timeout fires only once it's over.
+int
+LatencyStatement::execute()
+{
+    errorNo_ = 0;
+    errorMessage_.clear();
+    backend_->startExecution();
+    unsigned long latencyUs = backend_->drawLatency(*spec_);
+    if (latencyUs > 0)
+        boost::this_thread::sleep(posix_time::microseconds(latencyUs));
+    int rc = 1;
+    if (backend_->drawError(*spec_))
+    {
+        errorNo_ = spec_->errorNo_;
+        errorMessage_ = "Injected error";
+    }
+    else
+        rc = inner_->execute();
+    backend_->endExecution();
+    return rc;
+}
@@ -0,0 +1,561 @@
+#include <cctype>
+#include <cstring>
+#include <sstream>
+
+#include <boost/atomic.hpp>
+
+#include "backend.h"
+
+using namespace std;
+using namespace rapidjson;
+
+static boost::atomic<unsigned long> nextLoopbackThreadId(1);
+
+// The display length MySQL reports for a column of the type. MySqlExecution
+// sizes a scalar column's buffer by it.
+static unsigned long
+getDisplayLength(enum_field_types type)
+{
+    switch (type)
+    {
+        case MYSQL_TYPE_LONG:       return 11;
+        case MYSQL_TYPE_LONGLONG:   return 20;
+        case MYSQL_TYPE_DOUBLE:     return 22;
+        case MYSQL_TYPE_DATE:       return 10;
+        case MYSQL_TYPE_TIME:       return 10;
+        case MYSQL_TYPE_DATETIME:
+        case MYSQL_TYPE_TIMESTAMP:  return 19;
+        case MYSQL_TYPE_BLOB:       return 65535;
+        default:                    return 255;
+    }
+}
+
+// The number of parameter markers: question marks outside quotes
+static unsigned long
+countMarkers(const string & statementText)
+{
+    unsigned long markers = 0;
+    char quote = 0;
+    for (size_t i = 0; i < statementText.size(); i++)
+    {
+        char c = statementText[i];
+        if (quote != 0)
+        {
+            if (c == '\\') i++;
+            else if (c == quote) quote = 0;
+        }
+        else if (c == '\'' || c == '"' || c == '`') quote = c;
+        else if (c == '?') markers++;
+    }
+    return markers;
+}
+
+// Whether the statement is one that returns rows
+static bool
+isQuery(const string & statementText)
+{
+    static const char * queryVerbs[] = { "SELECT", "SHOW", "WITH", "DESCRIBE", "EXPLAIN", NULL };
+    size_t start = 0;
+    while (start < statementText.size() && (isspace(statementText[start]) || statementText[start] == '(')) start++;
+    for (const char ** verb = queryVerbs; *verb != NULL; verb++)
+    {
+        size_t length = strlen(*verb);
+        if (statementText.size() - start < length) continue;
+        size_t i = 0;
+        while (i < length && toupper(statementText[start + i]) == (*verb)[i]) i++;
+        if (i == length) return true;
+    }
+    return false;
+}
+
+// A captured MySQL error message is the framework's, "MySql error <context>:
+// <server message> (<error number>)"; the statement fails with the server's
+static string
+getServerMessage(const string & errorMessage)
+{
+    size_t start = errorMessage.find(": ");
+    if (errorMessage.compare(0, 12, "MySql error ") != 0 || start == string::npos) return errorMessage;
+    start += 2;
+    size_t end = errorMessage.rfind(" (");
+    if (end == string::npos || end < start) end = errorMessage.size();
+    return errorMessage.substr(start, end - start);
+}
+
+
+//                               L O O P B A C K  B A C K E N D
+
+LoopbackBackend::LoopbackBackend(const rapidjson::Document * params, MySqlConnection * conn)
+:   conn_(conn),
+    isConnected_(false),
+    isAutoCommit_(true),
+    threadId_(nextLoopbackThreadId++),
+    errorNo_(0)
+{
+    if (params != NULL && params->IsObject())
+    {
+        Value::ConstMemberIterator itr = params->FindMember("rows");
+        if (itr != params->MemberEnd() && itr->value.IsInt())
+            synthetic_.rows_ = itr->value.GetInt();
+        itr = params->FindMember("rows_affected");
+        if (itr != params->MemberEnd() && itr->value.IsUint64())
+            synthetic_.rowsAffected_ = itr->value.GetUint64();
+        itr = params->FindMember("columns");
+        if (itr != params->MemberEnd() && itr->value.IsObject())
+        {
+            for (Value::ConstMemberIterator column = itr->value.MemberBegin(); column != itr->value.MemberEnd(); ++column)
+            {
+                if (!column->value.IsInt()) continue;
+                synthetic_.columnNames_.push_back(string(column->name.GetString(), column->name.GetStringLength()));
+                synthetic_.columnTypes_.push_back(getColumnType(column->value.GetInt()));
+            }
+        }
+        itr = params->FindMember("result_store");
+        if (itr != params->MemberEnd() && itr->value.IsString())
+            resultStore_ = itr->value.GetString();
+        itr = params->FindMember("captures");
+        if (itr != params->MemberEnd() && itr->value.IsArray())
+        {
+            for (Value::ConstValueIterator path = itr->value.Begin(); path != itr->value.End(); ++path)
+                if (path->IsString()) loadCapture(path->GetString());
+        }
+    }
+    if (synthetic_.columnNames_.empty())
+    {
+        synthetic_.columnNames_.push_back("id");
+        synthetic_.columnTypes_.push_back(MYSQL_TYPE_LONG);
+        synthetic_.columnNames_.push_back("name");
+        synthetic_.columnTypes_.push_back(MYSQL_TYPE_VAR_STRING);
+    }
+}
+
+LoopbackBackend::~LoopbackBackend()
+{
+    close();
+}
+
+// Add the executions of a capture file to the responses. An execution that
+// failed with a MySQL error (error numbers 1000 and up) is answered with
+// the error; errors the framework raised itself never reached the server.
+void
+LoopbackBackend::loadCapture(const string & path)
+{
+    string errorMessage;
+    boost::shared_ptr<const CaptureReader> capture = ReplayCache::getCapture(path, errorMessage);
+    if (!capture)
+    {
+        CONN_LOG(conn_, error) << "Loopback backend: " << errorMessage;
+        return;
+    }
+    captures_.push_back(capture);
+
+    const Value & executions = capture->getExecutions();
+    for (Value::ConstValueIterator execution = executions.Begin(); execution != executions.End(); ++execution)
+    {
+        Value::ConstMemberIterator text = execution->FindMember("statement_text");
+        if (text == execution->MemberEnd() || !text->value.IsString()) continue;
+
+        Response response;
+        Value::ConstMemberIterator itr = execution->FindMember("error_no");
+        if (itr != execution->MemberEnd() && itr->value.IsInt() && itr->value.GetInt() >= 1000)
+        {
+            response.errorNo_ = itr->value.GetInt();
+            itr = execution->FindMember("error_message");
+            if (itr != execution->MemberEnd() && itr->value.IsString())
+                response.errorMessage_ = getServerMessage(itr->value.GetString());
+        }
+        itr = execution->FindMember("rows_affected");
+        if (itr != execution->MemberEnd() && itr->value.IsInt() && itr->value.GetInt() > 0)
+            response.rowsAffected_ = itr->value.GetInt();
+        itr = execution->FindMember("results");
+        if (itr != execution->MemberEnd() && itr->value.IsObject())
+            response.results_ = &itr->value;
+        itr = execution->FindMember("results_ref");
+        if (itr != execution->MemberEnd() && itr->value.IsString())
+        {
+            boost::shared_ptr<const StoredResults> storedResults = ResultStore::get(resultStore_, itr->value.GetString(), errorMessage);
+            if (!storedResults)
+            {
+                CONN_LOG(conn_, error) << "Loopback backend: " << errorMessage;
+                continue;
+            }
+            storedResults_.push_back(storedResults);
+            response.results_ = &storedResults->getResults();
+        }
+        if (   response.results_ != NULL
+            && (   !response.results_->HasMember("columns") || !(*response.results_)["columns"].IsObject()
+                || !response.results_->HasMember("rows") || !(*response.results_)["rows"].IsArray()))
+            response.results_ = NULL;
+
+        responses_[string(text->value.GetString(), text->value.GetStringLength())].responses_.push_back(response);
+    }
+    CONN_LOG(conn_, info) << "Loopback backend loaded " << executions.Size() << " executions from " << path;
+}
+
+int
+LoopbackBackend::connect(const char *  host,
+                         const char *  user,
+                         const char *  password,
+                         const char *  databaseName,
+                         int           port,
+                         const char *  socket,
+                         unsigned long flags,
+                         unsigned int  readTimeout)
+{
+    isConnected_ = true;
+    return 0;
+}
+
+void
+LoopbackBackend::close()
+{
+    isConnected_ = false;
+}
+
+int
+LoopbackBackend::setAutoCommit(bool isAutoCommit)
+{
+    isAutoCommit_ = isAutoCommit;
+    return 0;
+}
+
+int
+LoopbackBackend::commit()
+{
+    return 0;
+}
+
+int
+LoopbackBackend::rollback()
+{
+    return 0;
+}
+
+BackendStatement *
+LoopbackBackend::createStatement()
+{
+    return new LoopbackStatement(this);
+}
+
+const LoopbackBackend::Response *
+LoopbackBackend::getFirstResponse(const string & statementText) const
+{
+    ResponseMap::const_iterator itr = responses_.find(statementText);
+    if (itr == responses_.end() || itr->second.responses_.empty()) return NULL;
+    const std::vector<Response> & responses = itr->second.responses_;
+    for (size_t i = 0; i < responses.size(); i++)
+        if (responses[i].results_ != NULL) return &responses[i];
+    return &responses[0];
+}
+
+// The captured executions of a text are served in order, starting over
+// after the last, so a benchmark can run a captured program any number of
+// times
+const LoopbackBackend::Response *
+LoopbackBackend::getNextResponse(const string & statementText)
+{
+    ResponseMap::iterator itr = responses_.find(statementText);
+    if (itr == responses_.end() || itr->second.responses_.empty()) return NULL;
+    ResponseQueue & queue = itr->second;
+    const Response * response = &queue.responses_[queue.next_ % queue.responses_.size()];
+    queue.next_++;
+    return response;
+}
+
+// Map a captured column type to one MySqlExecution stores: integers as
+// LONG, ENUM and SET as STRING, and anything it doesn't know as VAR_STRING
+enum_field_types
+LoopbackBackend::getColumnType(int capturedType)
+{
+    switch (capturedType)
+    {
+        case MYSQL_TYPE_TINY:
+        case MYSQL_TYPE_SHORT:
+        case MYSQL_TYPE_INT24:
+        case MYSQL_TYPE_YEAR:
+        case MYSQL_TYPE_LONG:
+            return MYSQL_TYPE_LONG;
+        case MYSQL_TYPE_LONGLONG:
+            return MYSQL_TYPE_LONGLONG;
+        case MYSQL_TYPE_FLOAT:
+        case MYSQL_TYPE_DOUBLE:
+            return MYSQL_TYPE_DOUBLE;
+        case MYSQL_TYPE_DATE:
+        case MYSQL_TYPE_TIME:
+        case MYSQL_TYPE_DATETIME:
+        case MYSQL_TYPE_TIMESTAMP:
+            return static_cast<enum_field_types>(capturedType);
+        case MYSQL_TYPE_TINY_BLOB:
+        case MYSQL_TYPE_MEDIUM_BLOB:
+        case MYSQL_TYPE_LONG_BLOB:
+        case MYSQL_TYPE_BLOB:
+            return MYSQL_TYPE_BLOB;
+        case MYSQL_TYPE_STRING:
+        case MYSQL_TYPE_ENUM:
+        case MYSQL_TYPE_SET:
+            return MYSQL_TYPE_STRING;
+        default:
+            return MYSQL_TYPE_VAR_STRING;
+    }
+}
+
+
+//                             L O O P B A C K  S T A T E M E N T
+
+LoopbackStatement::LoopbackStatement(LoopbackBackend * backend)
+:   backend_(backend),
+    paramCount_(0),
+    columnBinds_(NULL),
+    rows_(NULL),
+    rowCount_(0),
+    currentRow_(-1),
+    rowsAffected_(0),
+    errorNo_(0)
+{}
+
+// Find the statement's columns: those of its captured results, or for a
+// query that wasn't captured, the synthetic columns
+int
+LoopbackStatement::prepare(const char * statementText, size_t length)
+{
+    statementText_.assign(statementText, length);
+    paramCount_ = countMarkers(statementText_);
+    columnNames_.clear();
+    columns_.clear();
+
+    std::vector<enum_field_types> columnTypes;
+    const LoopbackBackend::Response * response = backend_->getFirstResponse(statementText_);
+    if (response != NULL && response->results_ != NULL)
+    {
+        const Value & columns = (*response->results_)["columns"];
+        for (Value::ConstMemberIterator itr = columns.MemberBegin(); itr != columns.MemberEnd(); ++itr)
+        {
+            columnNames_.push_back(string(itr->name.GetString(), itr->name.GetStringLength()));
+            columnTypes.push_back(LoopbackBackend::getColumnType(itr->value.IsInt() ? itr->value.GetInt() : 0));
+        }
+    }
+    else if (response == NULL && isQuery(statementText_))
+    {
+        columnNames_ = backend_->getSynthetic().columnNames_;
+        columnTypes = backend_->getSynthetic().columnTypes_;
+    }
+
+    // the fields point to the names, so they're made once the names are in place
+    columns_.resize(columnNames_.size());
+    for (size_t icol = 0; icol < columns_.size(); icol++)
+    {
+        MYSQL_FIELD & field = columns_[icol];
+        memset(&field, 0, sizeof(field));
+        field.name = const_cast<char *>(columnNames_[icol].c_str());
+        field.name_length = columnNames_[icol].size();
+        field.type = columnTypes[icol];
+        field.length = getDisplayLength(field.type);
+    }
+    rowStrings_.assign(columns_.size(), string());
+    return 0;
+}
+
+int
+LoopbackStatement::execute()
+{
+    freeResult();
+    errorNo_ = 0;
+    errorMessage_.clear();
+    rowsAffected_ = 0;
+
+    const LoopbackBackend::Response * response = backend_->getNextResponse(statementText_);
+    if (response != NULL && response->errorNo_ != 0)
+    {
+        errorNo_ = response->errorNo_;
+        errorMessage_ = response->errorMessage_;
+        return 1;
+    }
+    if (columns_.empty())
+    {
+        rowsAffected_ = response != NULL ? response->rowsAffected_ : backend_->getSynthetic().rowsAffected_;
+    }
+    else if (response == NULL)
+    {
+        rowCount_ = backend_->getSynthetic().rows_;
+    }
+    else if (response->results_ != NULL)
+    {
+        rows_ = &(*response->results_)["rows"];
+        rowCount_ = static_cast<int>(rows_->Size());
+    }
+    return 0;
+}
+
+int
+LoopbackStatement::bindResults(MYSQL_BIND * columnBinds)
+{
+    columnBinds_ = columnBinds;
+    return 0;
+}
+
+// Store the next row's values in the column binds, as libmysqlclient does:
+// scalars in their buffers, and for strings only the length, the value
+// being fetched with fetchColumn
+int
+LoopbackStatement::fetch()
+{
+    if (currentRow_ + 1 >= rowCount_) return MYSQL_NO_DATA;
+    currentRow_++;
+    for (unsigned int icol = 0; icol < columns_.size(); icol++)
+    {
+        if (rows_ != NULL)
+            storeValue(icol, &columnBinds_[icol]);
+        else
+            storeSyntheticValue(icol, &columnBinds_[icol]);
+    }
+    return 0;
+}
+
+int
+LoopbackStatement::fetchColumn(MYSQL_BIND * columnBind, unsigned int icol)
+{
+    const char * data = "";
+    size_t length = 0;
+    if (rows_ != NULL)
+    {
+        const Value * value = getValue(icol);
+        if (value != NULL && value->IsString())
+        {
+            data = value->GetString();
+            length = value->GetStringLength();
+        }
+    }
+    else
+    {
+        data = rowStrings_[icol].data();
+        length = rowStrings_[icol].size();
+    }
+    if (columnBind->length != NULL) *columnBind->length = length;
+    if (columnBind->buffer != NULL)
+        memcpy(columnBind->buffer, data, min(length, static_cast<size_t>(columnBind->buffer_length)));
+    return 0;
+}
+
+void
+LoopbackStatement::freeResult()
+{
+    rows_ = NULL;
+    rowCount_ = 0;
+    currentRow_ = -1;
+}
+
+const Value *
+LoopbackStatement::getValue(unsigned int icol) const
+{
+    const Value & row = (*rows_)[static_cast<SizeType>(currentRow_)];
+    if (!row.IsObject()) return NULL;
+    Value::ConstMemberIterator itr = row.FindMember(columnNames_[icol].c_str());
+    if (itr == row.MemberEnd() || itr->value.IsNull()) return NULL;
+    return &itr->value;
+}
+
+static void
+storeTime(const Value * value, enum_field_types type, MYSQL_TIME * mysqlTime)
+{
+    memset(mysqlTime, 0, sizeof(MYSQL_TIME));
+    mysqlTime->time_type =   type == MYSQL_TYPE_DATE ? MYSQL_TIMESTAMP_DATE
+                           : type == MYSQL_TYPE_TIME ? MYSQL_TIMESTAMP_TIME
+                           : MYSQL_TIMESTAMP_DATETIME;
+    if (value == NULL)
+    {
+        mysqlTime->year = 2000;
+        mysqlTime->month = 1;
+        mysqlTime->day = 1;
+        return;
+    }
+    if (!value->IsObject()) return;
+    for (Value::ConstMemberIterator itr = value->MemberBegin(); itr != value->MemberEnd(); ++itr)
+    {
+        if (!itr->value.IsUint()) continue;
+        unsigned int part = itr->value.GetUint();
+        const char * name = itr->name.GetString();
+        if      (strcmp(name, "year") == 0)        mysqlTime->year = part;
+        else if (strcmp(name, "month") == 0)       mysqlTime->month = part;
+        else if (strcmp(name, "day") == 0)         mysqlTime->day = part;
+        else if (strcmp(name, "hour") == 0)        mysqlTime->hour = part;
+        else if (strcmp(name, "minute") == 0)      mysqlTime->minute = part;
+        else if (strcmp(name, "second") == 0)      mysqlTime->second = part;
+        else if (strcmp(name, "second_part") == 0) mysqlTime->second_part = part;
+    }
+}
+
+void
+LoopbackStatement::storeValue(unsigned int icol, MYSQL_BIND * columnBind)
+{
+    const Value * value = getValue(icol);
+    *columnBind->is_null = value == NULL;
+    if (value == NULL)
+    {
+        if (columnBind->length != NULL) *columnBind->length = 0;
+        return;
+    }
+    switch (columns_[icol].type)
+    {
+        case MYSQL_TYPE_LONG:
+            *static_cast<int *>(columnBind->buffer) = value->IsInt() ? value->GetInt() : 0;
+            break;
+
+        case MYSQL_TYPE_LONGLONG:
+            *static_cast<int64_t *>(columnBind->buffer) = value->IsInt64() ? value->GetInt64() : 0;
+            break;
+
+        case MYSQL_TYPE_DOUBLE:
+            *static_cast<double *>(columnBind->buffer) = value->IsNumber() ? value->GetDouble() : 0;
+            break;
+
+        case MYSQL_TYPE_DATE:
+        case MYSQL_TYPE_TIME:
+        case MYSQL_TYPE_DATETIME:
+        case MYSQL_TYPE_TIMESTAMP:
+            storeTime(value, columns_[icol].type, static_cast<MYSQL_TIME *>(columnBind->buffer));
+            break;
+
+        default:
+            if (columnBind->length != NULL)
+                *columnBind->length = value->IsString() ? value->GetStringLength() : 0;
+            break;
+    }
+}
+
+// Synthetic row n (from 1) has n in integer columns, n + 0.5 in doubles,
+// <column name>-<n> in strings, and 2000-01-01 in dates and times
+void
+LoopbackStatement::storeSyntheticValue(unsigned int icol, MYSQL_BIND * columnBind)
+{
+    int rowNumber = currentRow_ + 1;
+    *columnBind->is_null = 0;
+    switch (columns_[icol].type)
+    {
+        case MYSQL_TYPE_LONG:
+            *static_cast<int *>(columnBind->buffer) = rowNumber;
+            break;
+
+        case MYSQL_TYPE_LONGLONG:
+            *static_cast<int64_t *>(columnBind->buffer) = rowNumber;
+            break;
+
+        case MYSQL_TYPE_DOUBLE:
+            *static_cast<double *>(columnBind->buffer) = rowNumber + 0.5;
+            break;
+
+        case MYSQL_TYPE_DATE:
+        case MYSQL_TYPE_TIME:
+        case MYSQL_TYPE_DATETIME:
+        case MYSQL_TYPE_TIMESTAMP:
+            storeTime(NULL, columns_[icol].type, static_cast<MYSQL_TIME *>(columnBind->buffer));
+            break;
+
+        default:
+        {
+            stringstream value;
+            value << columnNames_[icol] << "-" << rowNumber;
+            rowStrings_[icol] = value.str();
+            if (columnBind->length != NULL) *columnBind->length = rowStrings_[icol].size();
+            break;
+        }
+    }
+}
@@ -5,6 +5,8 @@
 #include <limits>
 
 #include <boost/move/unique_ptr.hpp>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
 
 #include <rapidjson/filereadstream.h>
 #include <rapidjson/filewritestream.h>
@@ -39,6 +41,11 @@ MySqlObserver::createObserver(const char *                name,
 	    unique_ptr<MySqlObserver> auditObserver(new AuditObserver(name, params, conn));
             return boost::move(auditObserver);
         }
+        case PERFORMANCE_OBS:
+        {
+	    unique_ptr<MySqlObserver> performanceObserver(new PerformanceObserver(name, params, conn));
+            return boost::move(performanceObserver);
+        }
         case CAPTURE_OBS:
         {
 	    unique_ptr<MySqlObserver> captureObserver(new CaptureObserver(name, params, conn));
@@ -54,6 +61,11 @@ MySqlObserver::createObserver(const char *                name,
 	    unique_ptr<MySqlObserver> debugObserver(new DebugObserver(name, params, conn));
             return boost::move(debugObserver);
         }
+        case TRACE_OBS:
+        {
+	    unique_ptr<MySqlObserver> traceObserver(new TraceObserver(name, params, conn));
+            return boost::move(traceObserver);
+        }
         default:
             errorMessage << "Invalid observer type " << observerType;
             throw std::invalid_argument(errorMessage.str());
@@ -110,10 +122,10 @@ MySqlObserver::getWorkingDirectory(const rapidjson::Document * params)
 }
 
 string
-MySqlObserver::getProgramPath()
+MySqlObserver::getProgramPath(const char * extension)
 {
     stringstream programPath;
-    programPath << workingDirectory_ << "/" << name_ << "." << currentProgram_ << ".json";
+    programPath << workingDirectory_ << "/" << name_ << "." << currentProgram_ << "." << extension;
     return programPath.str();
 }
 
@@ -125,9 +137,31 @@ AuditObserver::AuditObserver(const char *                name,
 		             const rapidjson::Document * params,
 		             MySqlConnection *           conn)
 :  MySqlObserver(name, params, conn),
+   createStatement_("create_audit_table"),
    insertStatement_("insert_audit_record"),
-   isAuditing_(false)
+   batchStatement_("insert_audit_records"),
+   isAuditing_(false),
+   payloadCodec_(AuditCodec::NO_CODEC),
+   compressMinBytes_(256),
+   sampleRate_(1.0),
+   isAuditingErrors_(true),
+   isAuditingWrites_(true),
+   slowerThanMs_(0),
+   auditedCount_(0),
+   skippedCount_(0),
+   partitionsAhead_(7),
+   retentionDays_(0),
+   nextMaintenance_(0),
+   batchSize_(100),
+   flushInterval_(posix_time::milliseconds(1000)),
+   durability_(ASYNC_DURABILITY),
+   isFlusherRunning_(false),
+   mode_(SHARED_MODE),
+   writers_(AuditSink::DEFAULT_WRITERS),
+   spoolDirectory_(workingDirectory_),
+   spoolSegmentSize_(AuditSpool::DEFAULT_SEGMENT_SIZE)
 {
+    batch_.SetArray();
     if (conn->isReplay()) return;  // don't audit unit tests
 
     stringstream errorMessage;
@@ -148,13 +182,119 @@ AuditObserver::AuditObserver(const char *                name,
     auditTableName_ = itr->value.GetString();
     itr = params->FindMember("sql");
     auditSqlPath_ = itr->value.GetString();
+
+    // Compressed payloads go in a table with BLOB payload columns
+    if (params->HasMember("payload_codec"))
+    {
+        itr = params->FindMember("payload_codec");
+        if (!AuditCodec::getCodec(itr->value.GetString(), payloadCodec_))
+            CONN_LOG(conn, error) << "audit observer: unknown payload codec \'" << itr->value.GetString() << "\', using none";
+    }
+    if (payloadCodec_ != AuditCodec::NO_CODEC)
+    {
+        createStatement_ = "create_compressed_audit_table";
+        insertStatement_ = "insert_compressed_audit_record";
+        batchStatement_ = "insert_compressed_audit_records";
+    }
+    if (params->HasMember("compress_min_bytes"))
+    {
+        itr = params->FindMember("compress_min_bytes");
+        compressMinBytes_ = itr->value.GetUint();
+    }
+    if (params->HasMember("create_statement"))
+    {
+        itr = params->FindMember("create_statement");
+        createStatement_ = itr->value.GetString();
+    }
     if (params->HasMember("insert_statement"))
     {
         itr = params->FindMember("insert_statement");
         insertStatement_ = itr->value.GetString();
     }
+    if (params->HasMember("batch_statement"))
+    {
+        itr = params->FindMember("batch_statement");
+        batchStatement_ = itr->value.GetString();
+    }
+    if (params->HasMember("batch_size"))
+    {
+        itr = params->FindMember("batch_size");
+        batchSize_ = itr->value.GetInt();
+    }
+    if (params->HasMember("flush_interval_ms"))
+    {
+        itr = params->FindMember("flush_interval_ms");
+        flushInterval_ = posix_time::milliseconds(itr->value.GetInt());
+    }
+    if (params->HasMember("durability"))
+    {
+        itr = params->FindMember("durability");
+        const string durability = itr->value.GetString();
+        if (durability == "commit")
+            durability_ = COMMIT_DURABILITY;
+        else if (durability == "sync")
+            durability_ = SYNC_DURABILITY;
+        else if (durability != "async")
+            CONN_LOG(conn, error) << "audit observer: unknown durability \'" << durability << "\', using async";
+    }
+    if (params->HasMember("mode"))
+    {
+        itr = params->FindMember("mode");
+        const string mode = itr->value.GetString();
+        if (mode == "connection")
+            mode_ = CONNECTION_MODE;
+        else if (mode == "spool")
+            mode_ = SPOOL_MODE;
+        else if (mode != "shared")
+            CONN_LOG(conn, error) << "audit observer: unknown mode \'" << mode << "\', using shared";
+    }
+    if (params->HasMember("writers"))
+    {
+        itr = params->FindMember("writers");
+        writers_ = itr->value.GetInt();
+    }
+    getAuditRules(params);
+    if (params->HasMember("partitions_ahead"))
+    {
+        itr = params->FindMember("partitions_ahead");
+        partitionsAhead_ = itr->value.GetInt();
+    }
+    if (params->HasMember("retention_days"))
+    {
+        itr = params->FindMember("retention_days");
+        retentionDays_ = itr->value.GetInt();
+    }
+    if (params->HasMember("spool_directory"))
+    {
+        itr = params->FindMember("spool_directory");
+        spoolDirectory_ = itr->value.GetString();
+    }
+    if (params->HasMember("spool_segment_size"))
+    {
+        itr = params->FindMember("spool_segment_size");
+        spoolSegmentSize_ = itr->value.GetUint();
+    }
 
-    // Connect to the database containing the audit table,
+    // Write through the process's sink for the audit database
+    if (mode_ == SHARED_MODE)
+    {
+        sink_ = AuditSink::getSink(auditDatabaseName_.c_str(), auditSqlPath_.c_str(), conn_,
+                                   writers_, batchSize_, flushInterval_);
+        if (!sink_)
+        {
+            CONN_LOG(conn_, error) << "Error connecting to audit database " << auditDatabaseName_;
+            return;
+        }
+        boost::unique_lock<boost::mutex> lock;
+        isAuditing_ = prepareToAudit(sink_->lockSetupConnection(lock));
+        if (isAuditing_)
+            target_.reset(new AuditSink::Target(insertStatement_, batchStatement_));
+        else
+            sink_.reset();
+        return;
+    }
+
+    // Otherwise connect to the database containing the audit table,
     // using the credentials from the main connection
     stringstream connectionName;
     connectionName << "audit_" << conn_->getConnectionName();
@@ -168,45 +308,229 @@ AuditObserver::AuditObserver(const char *                name,
                                                    conn_->getSocket(),
 						   0,
 					           true);  // async 
-    isAuditing_ = prepareToAudit();
+    if (auditConn_->open() != 0)
+        CONN_LOG(auditConn_, error) << "Error connecting to audit database " << auditDatabaseName_ 
+                                    << ": " << auditConn_->getErrorMessage();
+    else
+        isAuditing_ = prepareToAudit(auditConn_.get());
     if (!isAuditing_ && auditConn_->isOpen())
         auditConn_->close();
+    if (isAuditing_ && mode_ == SPOOL_MODE)
+        startSpool();
+    if (isAuditing_ && !spool_ && !batchStatement_.empty())
+    {
+        isFlusherRunning_ = true;
+        flushThread_ = boost::thread(boost::bind(&AuditObserver::runFlusher, this));
+    }
 }
 
+// Check the audit dictionary, work out the audit columns, and create the
+// audit table, on an open connection to the audit database
 bool
-AuditObserver::prepareToAudit()
+AuditObserver::prepareToAudit(MySqlConnection * auditConn)
 {
-    int rc = auditConn_->open();
-    if (rc != 0)
-    {
-        CONN_LOG(auditConn_, error) << "Error connecting to audit database " << auditDatabaseName_ 
-                                    << ": " << auditConn_->getErrorMessage();
-        return false; 
-    }
-
-    const rapidjson::Value & statements =  auditConn_->getStatements()["statements"];
+    const rapidjson::Value & statements =  auditConn->getStatements()["statements"];
     if (!statements.HasMember(insertStatement_.c_str()))
     {
-        CONN_LOG(auditConn_, error) << "SQL dictionary " << auditSqlPath_ 
+        CONN_LOG(auditConn, error) << "SQL dictionary " << auditSqlPath_ 
                                     << " does not include " << insertStatement_ << " statement";
         return false;
     }
 
+    // Work out once which columns the audit table has
+    const rapidjson::Value & insertParams = statements[insertStatement_.c_str()]["parameters"];
+    for (rapidjson::Value::ConstValueIterator itrparm = insertParams.Begin();
+         itrparm != insertParams.End();
+         ++itrparm)
+    {
+        const string paramName = (*itrparm)["name"].GetString();
+        AuditColumn column = getAuditColumn(paramName);
+        if (column == UNKNOWN_COLUMN)
+            CONN_LOG(auditConn, warning) << "Audit column " << paramName << " is unknown, will be NULL";
+        auditColumns_.push_back(std::make_pair(paramName, column));
+    }
+
+    // Without a multi-row insert (or with batching turned off) write records one at a time
+    if (batchSize_ <= 1 || (durability_ == SYNC_DURABILITY && mode_ == CONNECTION_MODE))
+        batchStatement_.clear();
+    else if (!batchStatement_.empty() && !statements.HasMember(batchStatement_.c_str()))
+    {
+        CONN_LOG(auditConn, warning) << "SQL dictionary " << auditSqlPath_ 
+                                      << " does not include " << batchStatement_ << " statement"
+                                      << ", audit records will not be batched";
+        batchStatement_.clear();
+    }
+
     // Create the audit table if it doesn't exist
-    auditConn_->execute("create_audit_table", "", "table_name", auditTableName_.c_str() ); 
-    rc = auditConn_->getReturnCode();
+    auditConn->execute(createStatement_.c_str(), "", "table_name", auditTableName_.c_str() ); 
+    int rc = auditConn->getReturnCode();
     if (rc != 0)
     {
-        CONN_LOG(auditConn_, error) << "Error creating audit table: " << auditConn_->getErrorMessage();
+        CONN_LOG(auditConn, error) << "Error creating audit table: " << auditConn->getErrorMessage();
         return false; 
     }
 
+    // Make sure there are partitions for today and the days ahead
+    table_.reset(new AuditTable(auditTableName_, partitionsAhead_, retentionDays_));
+    table_->maintain(auditConn, gregorian::day_clock::local_day());
+    if (table_->isPartitioned())
+        nextMaintenance_ = time(NULL) + MAINTENANCE_INTERVAL;
+    else
+        table_.reset();
+
     return true;
 }
 
+// Start table maintenance in the background once the maintenance interval
+// has passed. Called by whichever thread is auditing; only one starts it.
+void
+AuditObserver::scheduleMaintenance()
+{
+    long now = time(NULL);
+    long nextMaintenance = nextMaintenance_;
+    if (   now < nextMaintenance
+        || !nextMaintenance_.compare_exchange_strong(nextMaintenance, now + MAINTENANCE_INTERVAL))
+        return;
+    if (maintenanceThread_.joinable()) maintenanceThread_.join();
+    maintenanceThread_ = boost::thread(boost::bind(&AuditObserver::maintainTable, this));
+}
+
+void
+AuditObserver::maintainTable()
+{
+    gregorian::date today = gregorian::day_clock::local_day();
+    if (sink_)
+    {
+        boost::unique_lock<boost::mutex> lock;
+        table_->maintain(sink_->lockSetupConnection(lock), today);
+    }
+    else
+        table_->maintain(auditConn_.get(), today);
+}
+
+void
+AuditObserver::getAuditRules(const rapidjson::Document * params)
+{
+    Value::ConstMemberIterator itr = params->FindMember("slower_than_ms");
+    if (itr != params->MemberEnd())
+    {
+        slowerThanMs_ = itr->value.GetInt();
+        if (slowerThanMs_ > 0) sampleRate_ = 0.0;
+    }
+    itr = params->FindMember("sample_rate");
+    if (itr != params->MemberEnd())
+        sampleRate_ = itr->value.GetDouble();
+    itr = params->FindMember("sample_rates");
+    if (itr != params->MemberEnd() && itr->value.IsObject())
+    {
+        for (Value::ConstMemberIterator itrrate = itr->value.MemberBegin();
+             itrrate != itr->value.MemberEnd();
+             ++itrrate)
+            sampleRates_[itrrate->name.GetString()] = itrrate->value.GetDouble();
+    }
+    itr = params->FindMember("audit_errors");
+    if (itr != params->MemberEnd())
+        isAuditingErrors_ = itr->value.GetBool();
+    itr = params->FindMember("audit_writes");
+    if (itr != params->MemberEnd())
+        isAuditingWrites_ = itr->value.GetBool();
+}
+
+// Whether an execution reaching a terminal state is to be audited. Sampling
+// hashes the statement name and execution handle, rather than drawing a random
+// number, so a rerun of a program audits the same executions.
+bool
+AuditObserver::isAudited(const MySqlExecution * execution, ExecutionState newState) const
+{
+    bool isError = newState == MySqlExecution::ERROR_STATE;
+    if (isError && isAuditingErrors_) return true;
+    if (!isError && isAuditingWrites_ && !execution->returnsRows()) return true;
+    if (   slowerThanMs_ > 0
+        && execution->getPhaseDurations().totalUs_ >= static_cast<int64_t>(slowerThanMs_) * 1000)
+        return true;
+
+    double sampleRate = sampleRate_;
+    boost::unordered_map<string, double>::const_iterator itrrate = sampleRates_.find(execution->getStatementName());
+    if (itrrate != sampleRates_.end()) sampleRate = itrrate->second;
+    if (sampleRate >= 1.0) return true;
+    if (sampleRate <= 0.0) return false;
+
+    uint64_t hash = boost::hash<string>()(execution->getStatementName())
+                  ^ (static_cast<uint64_t>(execution->getHandle()) * 0x9e3779b97f4a7c15ULL);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return (hash >> 11) * (1.0 / 9007199254740992.0) < sampleRate;  // top 53 bits, as a fraction
+}
+
+// Open the spool, named for the connection and observer, with the shipper
+// writing batches on the audit connection. If the spool can't be opened,
+// records are written on the audit connection.
+void
+AuditObserver::startSpool()
+{
+    std::vector<string> columnNames;
+    for (AuditColumnList::const_iterator itrcol = auditColumns_.begin(); itrcol != auditColumns_.end(); ++itrcol)
+        columnNames.push_back((*itrcol).first);
+
+    stringstream spoolName;
+    spoolName << conn_->getConnectionName() << "." << name_;
+    bool isBatched = !batchStatement_.empty();
+    spool_.reset(new AuditSpool(spoolDirectory_,
+                                spoolName.str(),
+                                spoolSegmentSize_,
+                                columnNames,
+                                auditConn_.get(),
+                                isBatched ? batchStatement_ : insertStatement_,
+                                isBatched ? batchSize_ : 1,
+                                flushInterval_));
+    if (spool_->open() == 0) return;
+
+    CONN_LOG(conn_, warning) << "Audit spool unavailable, writing audit records on the audit connection";
+    spool_.reset();
+    mode_ = CONNECTION_MODE;
+    if (durability_ == SYNC_DURABILITY) batchStatement_.clear();
+}
+
+AuditObserver::AuditColumn
+AuditObserver::getAuditColumn(const string & paramName)
+{
+    if (paramName == "table_name")     return TABLE_NAME_COLUMN;
+    if (paramName == "event")          return EVENT_COLUMN;
+    if (paramName == "statement_name") return STATEMENT_NAME_COLUMN;
+    if (paramName == "program")        return PROGRAM_COLUMN;
+    if (paramName == "comment")        return COMMENT_COLUMN;
+    if (paramName == "transaction")    return TRANSACTION_COLUMN;
+    if (paramName == "statement_text") return STATEMENT_TEXT_COLUMN;
+    if (paramName == "parameters")     return PARAMETERS_COLUMN;
+    if (paramName == "results")        return RESULTS_COLUMN;
+    if (paramName == "state")          return STATE_COLUMN;
+    if (paramName == "rc")             return RC_COLUMN;
+    if (paramName == "rows_returned")  return ROWS_RETURNED_COLUMN;
+    if (paramName == "rows_affected")  return ROWS_AFFECTED_COLUMN;
+    if (paramName == "error_no")       return ERROR_NO_COLUMN;
+    if (paramName == "error_message")  return ERROR_MESSAGE_COLUMN;
+    if (paramName == "start_time")     return START_TIME_COLUMN;
+    if (paramName == "execute_time")   return EXECUTE_TIME_COLUMN;
+    if (paramName == "retrieve_time")  return RETRIEVE_TIME_COLUMN;
+    if (paramName == "complete_time")  return COMPLETE_TIME_COLUMN;
+    if (paramName == "user")           return USER_COLUMN;
+    if (paramName == "host")           return HOST_COLUMN;
+    return UNKNOWN_COLUMN;
+}
+
 AuditObserver::~AuditObserver()
 {
-    CONN_LOG(auditConn_, info) << "Destroying audit observer";
+    CONN_LOG(conn_, info) << "Destroying audit observer " << name_ << ", audited " << auditedCount_
+                          << " executions, skipped " << skippedCount_;
+    if (maintenanceThread_.joinable()) maintenanceThread_.join();
+    if (spool_) spool_->close();
+    stopFlusher();
+    if (isAuditing_)
+    {
+        boost::lock_guard<boost::mutex> lock(batchMutex_);
+        flush();
+    }
 }
 
 void
@@ -216,7 +540,7 @@ AuditObserver::startProgram(const char * programName)
 
 // If the execution is transitioning from a non-terminal state to a 
 // terminal state (either EXECUTION_COMPLETE or ERROR), then 
-// add an audit record.
+// add an audit record, if the audit rules select the execution.
 MySqlExecution::ExecutionState   
 AuditObserver::onEvent(MySqlExecution * execution, ExecutionState newState)
 {
@@ -226,9 +550,15 @@ AuditObserver::onEvent(MySqlExecution * execution, ExecutionState newState)
         || execution->isTerminalState(execution->getState())
         || !execution->isTerminalState(newState))
         return newState;
-    
-    const rapidjson::Document & dom = execution->asJson();
-    insertRecord("EXECUTE", &dom);
+
+    if (table_) scheduleMaintenance();
+    if (!isAudited(execution, newState))
+    {
+        ++skippedCount_;
+        return newState;
+    }
+    ++auditedCount_;
+    insertRecord("EXECUTE", execution);
 
     return newState;
 }
@@ -240,166 +570,763 @@ AuditObserver::onEvent(AuditEventType event, const char * comment, MySqlExecutio
 {
     if (!isAuditing_) return;
     if (event != AUDIT_COMMIT && event != AUDIT_ROLLBACK) return;
-    insertRecord(event == AUDIT_COMMIT ? "COMMIT" : "ROLLBACK", NULL, comment);
+    insertRecord(event == AUDIT_COMMIT ? "COMMIT" : "ROLLBACK", NULL, comment, true);
 }
 
-// Construct a json object containing the arguments for the 
-// insert-record statement from statement parameters and the json doc
-// representing the execution. Each parameter name should correspond 
-// to a member of the doc.
+// Build an audit record: a field for each of the audit table's columns (as
+// listed in auditColumns_), taken from the execution, if there is one, and the
+// connection. Only the columns the table has are computed; the parameter
+// settings and results are serialized straight from the execution, and
+// compressed if there is a payload codec and they are long enough. In spool
+// mode the record is appended to the spool. Otherwise it becomes the arguments
+// of the insert-record statement, an object with a member for each non-NULL
+// field: in shared mode it's queued on the sink, and in connection mode it's
+// added to the current batch, which is flushed if it's full, or if the record
+// ends a transaction.
 void
-AuditObserver::insertRecord(const char * event, const rapidjson::Document * executionDom, const char * comment)
+AuditObserver::insertRecord(const char * event, const MySqlExecution * execution, const char * comment, bool isEndOfTransaction)
 {
-    rapidjson::Document insertArgs;
-    insertArgs.SetObject();
-    Value eventValue(event, strlen(event), insertArgs.GetAllocator());
-    insertArgs.AddMember("event", eventValue, insertArgs.GetAllocator());
-    if (comment != NULL)
+    AuditSpool::FieldList fields(auditColumns_.size());
+    const string program = conn_->getCurrentProgram();
+    const string transaction = conn_->getCurrentTransaction();
+    rapidjson::StringBuffer parameters;
+    rapidjson::StringBuffer results;
+    string encodedParameters;
+    string encodedResults;
+
+    for (size_t i = 0; i < auditColumns_.size(); i++)
     {
-        Value commentValue(comment, strlen(comment), insertArgs.GetAllocator());
-        insertArgs.AddMember("comment", commentValue, insertArgs.GetAllocator());
+        AuditField & field = fields[i];
+        switch (auditColumns_[i].second)
+        {
+            case TABLE_NAME_COLUMN:
+                field.setString(auditTableName_.c_str(), auditTableName_.size());
+                break;
+            case EVENT_COLUMN:
+                field.setString(event, strlen(event));
+                break;
+            case PROGRAM_COLUMN:
+                if (!program.empty()) field.setString(program.c_str(), program.size());
+                break;
+            case TRANSACTION_COLUMN:
+                if (!transaction.empty()) field.setString(transaction.c_str(), transaction.size());
+                break;
+            case COMMENT_COLUMN:
+                if (comment != NULL)
+                    field.setString(comment, strlen(comment));
+                else if (execution != NULL && !execution->getComment().empty())
+                    field.setString(execution->getComment().c_str(), execution->getComment().size());
+                break;
+            case START_TIME_COLUMN:  // of the commit or rollback (the table is partitioned on it)
+                field.setTime(posix_time::microsec_clock::local_time());
+                break;
+            case USER_COLUMN:
+                field.setString(conn_->getUser(), strlen(conn_->getUser()));
+                break;
+            case HOST_COLUMN:
+                field.setString(conn_->getHost(), strlen(conn_->getHost()));
+                break;
+            default:
+                break;
+        }
+
+        if (execution == NULL) continue;
+        switch (auditColumns_[i].second)
+        {
+            case STATEMENT_NAME_COLUMN:
+                field.setString(execution->getStatementName().c_str(), execution->getStatementName().size());
+                break;
+            case STATEMENT_TEXT_COLUMN:
+                field.setString(execution->getStatementText().c_str(), execution->getStatementText().size());
+                break;
+            case PARAMETERS_COLUMN:
+            case RESULTS_COLUMN:
+            {
+                bool isParameters = auditColumns_[i].second == PARAMETERS_COLUMN;
+                const Document & dom = isParameters ? execution->getSettings() : execution->getResults();
+                if (!dom.IsObject() || dom.ObjectEmpty()) break;
+                rapidjson::StringBuffer & buffer = isParameters ? parameters : results;
+                rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+                dom.Accept(writer);
+                string & encoded = isParameters ? encodedParameters : encodedResults;
+                if (   payloadCodec_ != AuditCodec::NO_CODEC
+                    && buffer.GetSize() >= compressMinBytes_
+                    && AuditCodec::encode(payloadCodec_, buffer.GetString(), buffer.GetSize(), encoded))
+                    field.setString(encoded.data(), encoded.size());
+                else
+                    field.setString(buffer.GetString(), buffer.GetSize());
+                break;
+            }
+            case STATE_COLUMN:         field.setInt(execution->getState());        break;
+            case RC_COLUMN:            field.setInt(execution->getReturnCode());   break;
+            case ROWS_RETURNED_COLUMN: field.setInt(execution->getRowCount());     break;
+            case ROWS_AFFECTED_COLUMN: field.setInt(execution->getRowsAffected()); break;
+            case ERROR_NO_COLUMN:      field.setInt(execution->getErrorNo());      break;
+            case ERROR_MESSAGE_COLUMN:
+                field.setString(execution->getErrorMessage().c_str(), execution->getErrorMessage().size());
+                break;
+            case START_TIME_COLUMN:    field.setTime(execution->getStartTime());    break;
+            case EXECUTE_TIME_COLUMN:  field.setTime(execution->getExecuteTime());  break;
+            case RETRIEVE_TIME_COLUMN: field.setTime(execution->getRetrieveTime()); break;
+            case COMPLETE_TIME_COLUMN: field.setTime(execution->getCompleteTime()); break;
+            default:
+                break;
+        }
     }
 
-    const rapidjson::Value & statements =  auditConn_->getStatements()["statements"];
-    const rapidjson::Value & insertStatement = statements[insertStatement_.c_str()];
-    const rapidjson::Value & insertParams = insertStatement["parameters"];
+    if (spool_)
+    {
+        if (spool_->append(fields) != 0)
+            CONN_LOG(conn_, error) << "Error spooling audit record";
+        else if (   durability_ == SYNC_DURABILITY 
+                 || (durability_ == COMMIT_DURABILITY && isEndOfTransaction))
+            spool_->sync();
+        return;
+    }
 
-    for (rapidjson::Value::ConstValueIterator itrparm = insertParams.Begin();
-         itrparm != insertParams.End();
-         ++itrparm)
+    bool isDurable =    durability_ == SYNC_DURABILITY 
+                     || (durability_ == COMMIT_DURABILITY && isEndOfTransaction);
+    if (sink_)
+    {
+        AuditSink::Record * record = new AuditSink::Record(target_, isDurable);
+        record->row_.SetObject();
+        toInsertArgs(fields, record->row_, record->row_.GetAllocator());
+        uint64_t count = sink_->push(record);
+        if (isDurable) 
+            sink_->waitForWritten(*target_, count);
+        else if (isEndOfTransaction)
+            sink_->flush();
+        return;
+    }
+
+    boost::unique_lock<boost::mutex> lock(batchMutex_);
+    Value insertArgs(kObjectType);
+    Document::AllocatorType & allocator = batch_.GetAllocator();
+    toInsertArgs(fields, insertArgs, allocator);
+    batch_.PushBack(insertArgs, allocator);
+    if (batch_.Size() == 1) 
+    {
+        batchStartTime_ = posix_time::microsec_clock::universal_time();
+        flushCv_.notify_one();
+    }
+    if (   batchStatement_.empty()
+        || static_cast<int>(batch_.Size()) >= batchSize_
+        || isEndOfTransaction)
+    {
+        MySqlConnection::ExecutionHandle xh = flush();
+        lock.unlock();
+
+        // wait for the insert if the audit trail must be durable at this point
+        if (xh != 0 && isDurable && auditConn_->getReturnCode(xh) != 0)
+            CONN_LOG(conn_, error) << "Error writing audit records: " << auditConn_->getErrorMessage();
+    }
+}
+
+// The arguments of the insert-record statement: a member for each field,
+// except that columns with no value are left out, and inserted as NULL
+void
+AuditObserver::toInsertArgs(const AuditSpool::FieldList & fields, Value & insertArgs, Document::AllocatorType & allocator) const
+{
+    for (size_t i = 0; i < auditColumns_.size(); i++)
     {
-        const rapidjson::Value & paramAttrs = *itrparm;
-        const string & paramName = paramAttrs["name"].GetString();
+        if (fields[i].isNull()) continue;
+        Value columnValue;
+        fields[i].toValue(columnValue, allocator);
+        Value columnName(auditColumns_[i].first.c_str(), auditColumns_[i].first.size(), allocator);
+        insertArgs.AddMember(columnName, columnValue, allocator);
+    }
+}
 
-        if (paramName == "table_name") 
+// Write the buffered records, and start a new batch. Without a batch statement
+// there is just the one record, written with the single-row insert. Returns the
+// handle of the insert, or 0 if there was nothing to write.
+MySqlConnection::ExecutionHandle
+AuditObserver::flush()
+{
+    if (batch_.Empty()) return 0;
+    MySqlConnection::ExecutionHandle xh;
+    if (batchStatement_.empty())
+    {
+        rapidjson::Document insertArgs;
+        insertArgs.CopyFrom(batch_[0], insertArgs.GetAllocator());
+        xh = auditConn_->executeJson(insertStatement_.c_str(), "", &insertArgs);
+    }
+    else
+        xh = auditConn_->executeJson(batchStatement_.c_str(), "", &batch_);
+
+    // the arguments have been copied into the execution's settings, so the
+    // batch can be released (swapping frees the allocator's memory)
+    rapidjson::Document emptyBatch;
+    emptyBatch.SetArray();
+    batch_.Swap(emptyBatch);
+    return xh;
+}
+
+// Flush a batch once its oldest record has waited for the flush interval
+void
+AuditObserver::runFlusher()
+{
+    boost::unique_lock<boost::mutex> lock(batchMutex_);
+    while (isFlusherRunning_)
+    {
+        if (batch_.Empty())
         {
-            Value tableName(auditTableName_.c_str(), auditTableName_.size(), insertArgs.GetAllocator());
-            insertArgs.AddMember("table_name", tableName, insertArgs.GetAllocator());
+            flushCv_.wait(lock);
             continue;
         }
-        else if (paramName == "program")
+        posix_time::ptime flushTime = batchStartTime_ + flushInterval_;
+        if (posix_time::microsec_clock::universal_time() < flushTime)
         {
-            const string program = conn_->getCurrentProgram();
-            if (!program.empty())
-            {
-                Value programValue(program.c_str(), program.size(), insertArgs.GetAllocator());
-                insertArgs.AddMember("program", programValue, insertArgs.GetAllocator());
-            }
+            flushCv_.timed_wait(lock, flushTime);
             continue;
         }
-        else if (paramName == "transaction")
+        flush();
+    }
+}
+
+void
+AuditObserver::stopFlusher()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(batchMutex_);
+        if (!isFlusherRunning_) return;
+        isFlusherRunning_ = false;
+    }
+    flushCv_.notify_one();
+    flushThread_.join();
+}
+
+void
+AuditObserver::endProgram(const char * programName)
+{
+    if (!isAuditing_) return;
+    if (sink_) sink_->flush();
+    boost::lock_guard<boost::mutex> lock(batchMutex_);
+    flush();
+}
+
+//                             P E R F O R M A N C E  O B S E R V E R
+
+PerformanceObserver::PerformanceObserver(const char *                name,
+                                         const rapidjson::Document * params,
+                                         MySqlConnection *           conn)
+:  MySqlObserver(name, params, conn),
+   isRecording_(!conn->isReplay()),  // replayed executions aren't timed
+   dumpIntervalSec_(60),
+   nextDump_(0)
+{
+    stringstream dumpPath;
+    dumpPath << workingDirectory_ << "/" << name_ << ".performance.json";
+    dumpPath_ = dumpPath.str();
+    if (params != NULL && params->IsObject())
+    {
+        Value::ConstMemberIterator itr = params->FindMember("dump_file");
+        if (itr != params->MemberEnd()) dumpPath_ = itr->value.GetString();
+        itr = params->FindMember("dump_interval_s");
+        if (itr != params->MemberEnd()) dumpIntervalSec_ = itr->value.GetInt();
+        itr = params->FindMember("record_replay");
+        if (itr != params->MemberEnd() && itr->value.GetBool()) isRecording_ = true;
+    }
+    if (dumpIntervalSec_ > 0 && !dumpPath_.empty()) nextDump_ = time(NULL) + dumpIntervalSec_;
+}
+
+PerformanceObserver::~PerformanceObserver()
+{
+    if (isRecording_ && !dumpPath_.empty()) dump();
+}
+
+// Record an execution when it reaches a terminal state, and dump the stats
+// if the dump interval has passed
+MySqlExecution::ExecutionState
+PerformanceObserver::onEvent(MySqlExecution * execution, ExecutionState newState)
+{
+    if (   !isRecording_
+        || execution == NULL
+        || execution->isTerminalState(execution->getState())
+        || !execution->isTerminalState(newState))
+        return newState;
+
+    PerformanceSample sample;
+    sample.isError_ = newState == MySqlExecution::ERROR_STATE;
+    sample.durations_ = execution->getPhaseDurations();
+    sample.rowsReturned_ = execution->getRowCount();
+    sample.rowsAffected_ = execution->getRowsAffected();
+
+    bool isDumpDue = false;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        snapshot_.record(execution->getStatementName(), conn_->getCurrentProgram(), sample);
+        if (nextDump_ != 0 && time(NULL) >= nextDump_)
         {
-            const string transaction = conn_->getCurrentTransaction();
-            if (!transaction.empty())
-            {
-                Value transactionValue(transaction.c_str(), transaction.size(), insertArgs.GetAllocator());
-                insertArgs.AddMember("transaction", transactionValue, insertArgs.GetAllocator());
-            }
-            continue;
+            nextDump_ = time(NULL) + dumpIntervalSec_;
+            isDumpDue = true;
+        }
+    }
+    if (isDumpDue) dump();
+    return newState;
+}
+
+void
+PerformanceObserver::getSnapshot(PerformanceSnapshot & snapshot) const
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    snapshot = snapshot_;
+}
+
+void
+PerformanceObserver::reset()
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    snapshot_.clear();
+}
+
+// Write the stats to a temporary file and rename it over the dump file, so
+// readers never see a partial dump
+int
+PerformanceObserver::dump()
+{
+    rapidjson::Document stats;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        snapshot_.toJson(stats);
+    }
+    const string connectionName = conn_->getConnectionName();
+    stats.AddMember("connection", Value(connectionName.c_str(), connectionName.size(), stats.GetAllocator()).Move(),
+                    stats.GetAllocator());
+    const string dumpTime = posix_time::to_iso_extended_string(posix_time::microsec_clock::local_time());
+    stats.AddMember("time", Value(dumpTime.c_str(), dumpTime.size(), stats.GetAllocator()).Move(), stats.GetAllocator());
+
+    const string tempPath = dumpPath_ + ".tmp";
+    FILE * fp = fopen(tempPath.c_str(), "w");
+    if (!fp)
+    {
+        CONN_LOG(conn_, error) << "Unable to open " << tempPath << " for performance stats";
+        return -1;
+    }
+    char writeBuffer[65536];
+    FileWriteStream os(fp, writeBuffer, sizeof(writeBuffer));
+    Writer<FileWriteStream> writer(os);
+    stats.Accept(writer);
+    os.Flush();
+    if (fclose(fp) != 0 || rename(tempPath.c_str(), dumpPath_.c_str()) != 0)
+    {
+        CONN_LOG(conn_, error) << "Unable to write performance stats to " << dumpPath_;
+        return -1;
+    }
+    return 0;
+}
+
+
+//                                     T R A C E  O B S E R V E R
+
+static const PhaseClock::Tick traceOrigin = PhaseClock::now();
+
+static string
+getRequestName(const ExecutionThread::Request & request, const MySqlExecution * execution)
+{
+    switch (request.type_)
+    {
+        case MySqlConnection::EXECUTION_REQUEST:
+            return execution != NULL ? execution->getStatementName() : string("execution");
+        case MySqlConnection::START_TRANSACTION_REQUEST:    return "start transaction";
+        case MySqlConnection::COMMIT_TRANSACTION_REQUEST:   return "commit";
+        case MySqlConnection::ROLLBACK_TRANSACTION_REQUEST: return "rollback";
+        case MySqlConnection::START_PROGRAM_REQUEST:        return "start program";
+        case MySqlConnection::END_PROGRAM_REQUEST:          return "end program";
+        case MySqlConnection::KILL_THREAD_REQUEST:          return "kill thread";
+        default:                                            return "request";
+    }
+}
+
+TraceObserver::TraceObserver(const char *                name,
+                             const rapidjson::Document * params,
+                             MySqlConnection *           conn)
+:  MySqlObserver(name, params, conn),
+   threadBuffer_(&TraceObserver::keepThreadBuffer),
+   maxEvents_(1000000)
+{
+    stringstream tracePath;
+    tracePath << workingDirectory_ << "/" << name_ << ".trace.json";
+    tracePath_ = tracePath.str();
+    if (params != NULL && params->IsObject())
+    {
+        Value::ConstMemberIterator itr = params->FindMember("trace_file");
+        if (itr != params->MemberEnd()) tracePath_ = itr->value.GetString();
+        itr = params->FindMember("max_events");
+        if (itr != params->MemberEnd()) maxEvents_ = itr->value.GetUint();
+    }
+}
+
+TraceObserver::~TraceObserver()
+{
+    writeTrace();
+}
+
+int64_t
+TraceObserver::getTimestamp(const PhaseClock::Tick & tick)
+{
+    return PhaseClock::getMicroseconds(traceOrigin, tick);
+}
+
+// The calling thread's buffer, created the first time the thread records
+TraceBuffer *
+TraceObserver::getThreadBuffer()
+{
+    TraceBuffer * buffer = threadBuffer_.get();
+    if (buffer != NULL) return buffer;
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    int threadId = static_cast<int>(buffers_.size()) + 1;
+    stringstream threadName;
+    threadName << conn_->getConnectionName() << " thread " << threadId;
+    boost::shared_ptr<TraceBuffer> newBuffer = boost::make_shared<TraceBuffer>(threadId, threadName.str(), maxEvents_);
+    buffers_.push_back(newBuffer);
+    threadBuffer_.reset(newBuffer.get());
+    return newBuffer.get();
+}
+
+void
+TraceObserver::addSlice(const char *             category,
+                        const string &           name,
+                        const PhaseClock::Tick & startTick,
+                        const PhaseClock::Tick & endTick,
+                        int                      handle,
+                        const string &           detail)
+{
+    TraceEvent event('X', category, name, getTimestamp(startTick));
+    event.duration_ = PhaseClock::getMicroseconds(startTick, endTick);
+    event.handle_ = handle;
+    event.detail_ = detail;
+    getThreadBuffer()->add(event);
+}
+
+void
+TraceObserver::startProgram(const char * programName)
+{
+    MySqlObserver::startProgram(programName);
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    programs_.push_back(std::make_pair(string(programName), PhaseClock::now()));
+}
+
+void
+TraceObserver::endProgram(const char * programName)
+{
+    PhaseClock::Tick endTick = PhaseClock::now();
+    PhaseClock::Tick startTick;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        for (ProgramStack::reverse_iterator itr = programs_.rbegin(); itr != programs_.rend(); ++itr)
+        {
+            if (itr->first != programName) continue;
+            startTick = itr->second;
+            programs_.erase(--itr.base());
+            break;
+        }
+    }
+    if (PhaseClock::isSet(startTick)) addSlice("program", programName, startTick, endTick);
+    MySqlObserver::endProgram(programName);
+}
+
+// Each transition ends a slice named for the state reached, which starts at
+// the previous transition (or when the execution started, or, for a queued
+// execution, when the execution thread dequeued it). Reaching a terminal
+// state ends the execution's slice.
+MySqlExecution::ExecutionState
+TraceObserver::onEvent(MySqlExecution * execution, ExecutionState newState)
+{
+    if (execution == NULL) return newState;
+    PhaseClock::Tick tick = PhaseClock::now();
+    bool isEnd = !execution->isTerminalState(execution->getState()) && execution->isTerminalState(newState);
+    ExecutionTicks ticks;
+    ticks.stateTick_ = ticks.sliceTick_ = PhaseClock::isSet(execution->getStartTick()) ? execution->getStartTick() : tick;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        ExecutionTickMap::iterator itr = executions_.find(execution->getHandle());
+        if (itr != executions_.end())
+        {
+            ticks = itr->second;
+            if (isEnd)
+                executions_.erase(itr);
+            else
+                itr->second.stateTick_ = tick;
         }
-        
-        if (executionDom == NULL) continue;
-        rapidjson::Value::ConstMemberIterator itrvalue = executionDom->FindMember(paramName.c_str());
-        if (itrvalue == executionDom->MemberEnd()) continue;  
-
-        Value parameterName;
-        parameterName.CopyFrom(itrvalue->name, insertArgs.GetAllocator());
-        Value parameterValue;
-        parameterValue.CopyFrom(itrvalue->value, insertArgs.GetAllocator());
-
-        // If it's a scalar value, write it out as is
-        if (!parameterValue.IsObject() && !parameterValue.IsArray())
-            insertArgs.AddMember(parameterName, parameterValue, insertArgs.GetAllocator());
-        // If it's an object or array, serialize it to json and write it as a string field
-	else
+        else if (!isEnd)
         {
-            stringstream valueStream;
-            MySqlConnectionImpl::printValue(parameterValue, valueStream);
-            Value complexValue(valueStream.str().c_str(), valueStream.str().size(), insertArgs.GetAllocator());
-            insertArgs.AddMember(parameterName, complexValue, insertArgs.GetAllocator());
+            executions_[execution->getHandle()] = ticks;
+            executions_[execution->getHandle()].stateTick_ = tick;
         }
     }
 
-    // insert the record
-    auditConn_->executeJson(insertStatement_.c_str(), "", &insertArgs);
+    addSlice("state", MySqlExecution::getStateName(newState), ticks.stateTick_, tick, execution->getHandle());
+    if (isEnd)
+        addSlice("execution", execution->getStatementName(), ticks.sliceTick_, tick, execution->getHandle(),
+                 newState == MySqlExecution::ERROR_STATE ? execution->getErrorMessage() : string());
+    return newState;
 }
 
+// Transactions are slices from start to commit or rollback
 void
-AuditObserver::endProgram(const char * programName)
+TraceObserver::onEvent(AuditEventType event, const char * comment, MySqlExecution * execution)
 {
+    PhaseClock::Tick tick = PhaseClock::now();
+    string transactionName;
+    PhaseClock::Tick startTick;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        if (event == AUDIT_START_TRANSACTION)
+        {
+            transactionName_ = comment != NULL ? comment : "";
+            transactionTick_ = tick;
+            return;
+        }
+        if (event != AUDIT_COMMIT && event != AUDIT_ROLLBACK) return;
+        transactionName = transactionName_;
+        startTick = transactionTick_;
+        transactionTick_ = PhaseClock::Tick();
+    }
+
+    const string outcome = event == AUDIT_COMMIT ? "commit" : "rollback";
+    TraceEvent instant('i', "transaction", outcome, getTimestamp(tick));
+    if (comment != NULL) instant.detail_ = comment;
+    getThreadBuffer()->add(instant);
+    if (PhaseClock::isSet(startTick))
+        addSlice("transaction", transactionName.empty() ? "transaction" : transactionName, startTick, tick, 0, outcome);
 }
 
+// A request's wait in the queue is an asynchronous span, begun on the caller's
+// thread and ended on the execution thread, which then records a slice for
+// serving the request. A queued execution's slice is split likewise: the
+// caller's part ends when it's queued, and the execution thread's part starts
+// when it's dequeued.
+void
+TraceObserver::onRequest(const ExecutionThread::Request & request, RequestEvent event, const MySqlExecution * execution)
+{
+    PhaseClock::Tick tick = PhaseClock::now();
+    const string name = getRequestName(request, execution);
+    int handle = execution != NULL ? execution->getHandle() : 0;
+    switch (event)
+    {
+        case REQUEST_QUEUED:
+        {
+            if (execution != NULL)
+            {
+                PhaseClock::Tick sliceTick;
+                {
+                    boost::lock_guard<boost::mutex> lock(mutex_);
+                    ExecutionTickMap::const_iterator itr = executions_.find(handle);
+                    if (itr != executions_.end()) sliceTick = itr->second.sliceTick_;
+                }
+                if (PhaseClock::isSet(sliceTick) && sliceTick <= request.queueTick_)  // not yet dequeued
+                    addSlice("execution", name, sliceTick, request.queueTick_, handle, "queued");
+            }
+            TraceEvent begin('b', "queue", name, getTimestamp(request.queueTick_));
+            begin.id_ = request.sequence_;
+            begin.handle_ = handle;
+            getThreadBuffer()->add(begin);
+            break;
+        }
+        case REQUEST_STARTED:
+        {
+            TraceBuffer * buffer = getThreadBuffer();
+            TraceEvent end('e', "queue", name, getTimestamp(tick));
+            end.id_ = request.sequence_;
+            end.handle_ = handle;
+            buffer->add(end);
+
+            boost::lock_guard<boost::mutex> lock(mutex_);
+            if (requestTick_ == PhaseClock::Tick())
+                buffer->setThreadName(string(conn_->getConnectionName()) + " execution thread");
+            requestTick_ = tick;
+            ExecutionTickMap::iterator itr = executions_.find(handle);
+            if (execution != NULL && itr != executions_.end())
+                itr->second.stateTick_ = itr->second.sliceTick_ = tick;
+            break;
+        }
+        case REQUEST_COMPLETED:
+        {
+            PhaseClock::Tick startTick;
+            {
+                boost::lock_guard<boost::mutex> lock(mutex_);
+                startTick = requestTick_;
+            }
+            addSlice("request", name, startTick, tick, handle);
+            break;
+        }
+    }
+}
+
+// Write every thread's events as one JSON trace
+int
+TraceObserver::writeTrace()
+{
+    std::vector<boost::shared_ptr<TraceBuffer> > buffers;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        buffers = buffers_;
+    }
+    if (buffers.empty()) return 0;
+
+    FILE * fp = fopen(tracePath_.c_str(), "w");
+    if (!fp)
+    {
+        CONN_LOG(conn_, error) << "Unable to open " << tracePath_ << " for trace";
+        return -1;
+    }
+    char writeBuffer[65536];
+    FileWriteStream os(fp, writeBuffer, sizeof(writeBuffer));
+    Writer<FileWriteStream> writer(os);
+    writer.StartObject();
+    writer.Key("traceEvents");
+    writer.StartArray();
+    for (size_t i = 0; i < buffers.size(); i++)
+        buffers[i]->write(writer, getpid());
+    writer.EndArray();
+    writer.Key("displayTimeUnit");
+    writer.String("ms");
+    writer.EndObject();
+    os.Flush();
+    if (fclose(fp) != 0)
+    {
+        CONN_LOG(conn_, error) << "Unable to write trace to " << tracePath_;
+        return -1;
+    }
+    CONN_LOG(conn_, info) << "Wrote trace to " << tracePath_;
+    return 0;
+}
+
+
 //                                  C A P T U R E  O B S E R V E R
 
 CaptureObserver::CaptureObserver(const char *                name,
 				 const rapidjson::Document * params,
 				 MySqlConnection *           conn)
-:  MySqlObserver(name, params, conn)
+:  MySqlObserver(name, params, conn),
+   writeBuffer_(65536),
+   captureFile_(NULL)
 {
+    if (params != NULL && params->IsObject())
+    {
+        Value::ConstMemberIterator itr = params->FindMember("buffer_size");
+        if (itr != params->MemberEnd()) writeBuffer_.resize(std::max(itr->value.GetUint(), 256u));
+        itr = params->FindMember("result_store");
+        if (itr != params->MemberEnd()) resultStore_ = itr->value.GetString();
+    }
 }
 
 CaptureObserver::~CaptureObserver()
 {
+    closeCapture();
 }
 
 void
 CaptureObserver::startProgram(const char * programName)
 {
+    closeCapture();
     MySqlObserver::startProgram(programName);
-
-    if (capturedExecutions_.IsObject())
-        capturedExecutions_.RemoveAllMembers();
-    else
-        capturedExecutions_.SetObject();
-    Value executions(kArrayType);
-    capturedExecutions_.AddMember("executions", executions, capturedExecutions_.GetAllocator());
+    capturePath_ = getProgramPath();
+    stringstream tempPath;
+    tempPath << capturePath_ << "." << getpid() << ".tmp";
+    captureTempPath_ = tempPath.str();
 }  
 
+// Start the program's capture file: { "executions" : [ 
+bool
+CaptureObserver::openCapture()
+{
+    if (captureFile_ != NULL) return true;
+    stringstream errorMessage;
+    captureFile_ = fopen(captureTempPath_.c_str(), "w");
+    if (!captureFile_)
+    {
+        errorMessage << "Unable to open " << captureTempPath_;
+        perror(errorMessage.str().c_str());
+        return false;
+    }
+    captureStream_.reset(new FileWriteStream(captureFile_, &writeBuffer_[0], writeBuffer_.size()));
+    captureWriter_.reset(new Writer<FileWriteStream>(*captureStream_));
+    captureWriter_->StartObject();
+    captureWriter_->Key("executions");
+    captureWriter_->StartArray();
+    return true;
+}
+
+// Finish the capture file, and give it its real name
+void
+CaptureObserver::closeCapture()
+{
+    if (captureFile_ == NULL) return;
+    captureWriter_->EndArray();
+    captureWriter_->EndObject();
+    captureStream_->Flush();
+    captureWriter_.reset();
+    captureStream_.reset();
+    if (fclose(captureFile_) != 0 || rename(captureTempPath_.c_str(), capturePath_.c_str()) != 0)
+    {
+        stringstream errorMessage;
+        errorMessage << "Unable to write " << capturePath_;
+        perror(errorMessage.str().c_str());
+    }
+    captureFile_ = NULL;
+}
+
 // If we're in a program (client has called startProgram), and 
 // the execution is transitioning from a non-terminal state to a 
 // terminal state (either EXECUTION_COMPLETE or ERROR), then 
-// serialize to JSON and save it to the executions DOM
+// serialize it to JSON and append it to the capture file
 MySqlExecution::ExecutionState   
 CaptureObserver::onEvent(MySqlExecution * execution, ExecutionState newState)
 {
     if (   !currentProgram_.empty()
         && execution != NULL
         && !execution->isTerminalState(execution->getState())
-        && execution->isTerminalState(newState))
+        && execution->isTerminalState(newState)
+        && openCapture())
     {
         // save with the target state
         ExecutionState save = execution->getState();
         execution->setState(newState); 
-        const rapidjson::Value & dom =  execution->asJson();
-        rapidjson::Value domCopy;
-        domCopy.CopyFrom(dom, capturedExecutions_.GetAllocator());
-        capturedExecutions_["executions"].PushBack(domCopy, capturedExecutions_.GetAllocator());
+        writeExecution(execution->asJson());
         execution->setState(save);
     }
     return newState;
 }
 
+// Append an execution to the capture file. With a result store, its results
+// are stored there, and the execution refers to them by digest; results that
+// can't be stored are written inline.
 void
-CaptureObserver::endProgram(const char * programName)
+CaptureObserver::writeExecution(const rapidjson::Value & execution)
 {
-    stringstream errorMessage;
-    string capturePath = getProgramPath();
-    MySqlObserver::endProgram(programName);
-
-    if (!capturedExecutions_.IsObject() || capturedExecutions_["executions"].Empty()) return;
-    FILE * fp = fopen(capturePath.c_str(), "w");
-    if (!fp)
+    if (resultStore_.empty() || !execution.HasMember("results"))
     {
-        errorMessage << "Unable to open " << capturePath;
-        perror(errorMessage.str().c_str());
+        execution.Accept(*captureWriter_);
         return;
     }
-    char writeBuffer[65536];
-    FileWriteStream os(fp, writeBuffer, sizeof(writeBuffer));
-    Writer<FileWriteStream> writer(os);
-    capturedExecutions_.Accept(writer);
-    fclose(fp); 
-    capturedExecutions_.RemoveAllMembers();   
+
+    captureWriter_->StartObject();
+    for (Value::ConstMemberIterator itr = execution.MemberBegin(); itr != execution.MemberEnd(); ++itr)
+    {
+        string digest;
+        string errorMessage;
+        if (itr->name == "results" && ResultStore::put(resultStore_, itr->value, digest, errorMessage))
+        {
+            captureWriter_->Key("results_ref");
+            captureWriter_->String(digest.c_str(), digest.size());
+            continue;
+        }
+        if (!errorMessage.empty())
+            CONN_LOG(conn_, error) << errorMessage;
+        captureWriter_->Key(itr->name.GetString(), itr->name.GetStringLength());
+        itr->value.Accept(*captureWriter_);
+    }
+    captureWriter_->EndObject();
+}
+
+void
+CaptureObserver::endProgram(const char * programName)
+{
+    closeCapture();
+    MySqlObserver::endProgram(programName);
 }  
 
 
@@ -410,45 +1337,77 @@ ReplayObserver::ReplayObserver(const char *                name,
 			       const rapidjson::Document * params,
 			       MySqlConnection *           conn)
 :  MySqlObserver(name, params, conn),
-   executionNumber_(0)
+   executionNumber_(0),
+   isKeyed_(false),
+   resultStore_(workingDirectory_ + "/results")
 {
     conn_->setTransactions(false);
+    if (params != NULL && params->IsObject())
+    {
+        Value::ConstMemberIterator itr = params->FindMember("match");
+        if (itr != params->MemberEnd()) isKeyed_ = string(itr->value.GetString()) == "keyed";
+        itr = params->FindMember("result_store");
+        if (itr != params->MemberEnd()) resultStore_ = itr->value.GetString();
+    }
 }
 
 ReplayObserver::~ReplayObserver() 
 {
 }
 
+// Fixtures and capture files come from the replay cache, so each is read
+// only once however many tests replay it. A fixture that can't be read falls
+// back to the capture file; if neither can be read, the error is reported
+// on the connection, and again by each of the program's executions, so that
+// the test fails.
 void              
 ReplayObserver::startProgram(const char * programName)
 {
     stringstream errorMessage;
+    string loadError;
     MySqlObserver::startProgram(programName);
 
-    if (replayExecutions_.IsObject())
-        replayExecutions_.RemoveAllMembers();
-    else
-        replayExecutions_.SetObject();
+    fixture_.reset();
+    capture_.reset();
+    loadError_.clear();
     executionNumber_ = 0;
 
-    string replayPath = getProgramPath();
+    string fixturePath = getProgramPath("fix");
+    if (access(fixturePath.c_str(), F_OK) == 0)
+    {
+        fixture_ = ReplayCache::getFixture(fixturePath, loadError);
+        if (!fixture_)
+        {
+            CONN_LOG(conn_, warning) << loadError << ", replaying the capture file instead";
+            errorMessage << loadError << "; ";
+        }
+    }
+    if (!fixture_)
+    {
+        capture_ = ReplayCache::getCapture(getProgramPath(), loadError);
+        if (!capture_)
+        {
+            errorMessage << loadError;
+            loadError_ = errorMessage.str();
+            conn_->reportError(loadError_);
+        }
+    }
 
-    FILE * fp = fopen(replayPath.c_str(), "r");
-    if (!fp)
+    if (isKeyed_)
     {
-        errorMessage << "Unable to open " << replayPath << " for reading";
-        perror(errorMessage.str().c_str());
-        return;
+        boost::lock_guard<boost::mutex> lock(indexMutex_);
+        if (fixture_)
+            index_.build(*fixture_);
+        else if (capture_)
+            index_.build(*capture_);
+        else
+            index_.clear();
     }
-    char readBuffer[65536];
-    FileReadStream is(fp, readBuffer, sizeof(readBuffer));
-    ParseResult ok = replayExecutions_.ParseStream(is);
-    fclose(fp); 
 }
 
-// If the SQL text has been generated, find the matching json doc 
-// in the list of prior executions, confirm that SQL matches, then
-// copy the state from the json doc into the current execution. 
+// If the SQL text has been generated, find the matching execution 
+// in the fixture or capture file, confirm that SQL matches, then
+// copy its state into the current execution. 
 MySqlExecution::ExecutionState    
 ReplayObserver::onEvent(MySqlExecution * execution, ExecutionState newState)
 {
@@ -457,29 +1416,70 @@ ReplayObserver::onEvent(MySqlExecution * execution, ExecutionState newState)
     if (execution->getState() == MySqlExecution::INITIAL_STATE) 
         executionNumber_++;
     if (newState != MySqlExecution::SQL_GENERATED_STATE) return newState;
-    if (!replayExecutions_.IsObject() || replayExecutions_.ObjectEmpty()) return newState;
+    if (!fixture_ && !capture_)
+    {
+        if (loadError_.empty()) return newState;
+        conn_->reportError(loadError_);
+        return MySqlExecution::ERROR_STATE;
+    }
 
     // The SQL text and parameter bindings have been generated for the current execution.
     // Match against the corresponding execution in the replay doc
-    const rapidjson::Value & replayExecutions = replayExecutions_["executions"];
-    if (replayExecutions.Size() < executionNumber_)
+    size_t replayIndex = executionNumber_ - 1;
+    if (isKeyed_)
     {
-        errorMessage << "Test executes more statements than expected. Expected " << replayExecutions.Size();
-        conn_->reportError(errorMessage);
-        return MySqlExecution::ERROR_STATE;
+        int keyedIndex = findKeyedExecution(execution);
+        if (keyedIndex < 0)
+        {
+            errorMessage << "No captured execution of " << execution->statementName_
+                         << " with this SQL text and these parameters remains";
+            conn_->reportError(errorMessage);
+            return MySqlExecution::ERROR_STATE;
+        }
+        replayIndex = keyedIndex;
     }
-    const rapidjson::Value & replayExecution = replayExecutions[executionNumber_-1];
+    else
+    {
+        size_t replayCount = fixture_ ? fixture_->getExecutionCount() : capture_->getExecutionCount();
+        if (replayCount < executionNumber_)
+        {
+            errorMessage << "Test executes more statements than expected. Expected " << replayCount;
+            conn_->reportError(errorMessage);
+            return MySqlExecution::ERROR_STATE;
+        }
+    }
+    return fixture_ ? replayFixtureExecution(execution, replayIndex) : replayCaptureExecution(execution, replayIndex);
+}
+
+// The index of the next captured execution with the same key as the
+// execution, or -1 if there is none
+int
+ReplayObserver::findKeyedExecution(MySqlExecution * execution)
+{
+    ReplayKey key(execution->statementName_,
+                  ReplayKey::hashBytes(execution->statementText_.data(), execution->statementText_.size()),
+                  ReplayKey::hashParameters(&execution->getSettings()));
+    boost::lock_guard<boost::mutex> lock(indexMutex_);
+    return index_.take(key);
+}
+
+// Executions match: we will switch to the state in the replay execution
+// which could either be ERROR or EXECUTION_COMPLETE. If the original
+// execution succeeded, copy row-count, rows-affected and results to
+// the current execution. If the original execution failed, copy the
+// error message and error number to the current execution. Strings in
+// the results refer to the cached capture file, which outlives them.
+MySqlExecution::ExecutionState    
+ReplayObserver::replayCaptureExecution(MySqlExecution * execution, size_t replayIndex)
+{
+    stringstream errorMessage;
+    const rapidjson::Value & replayExecution = capture_->getExecutions()[static_cast<SizeType>(replayIndex)];
     if (!execution->isSameAs(replayExecution, errorMessage))
     {
         conn_->reportError(errorMessage);
         return MySqlExecution::ERROR_STATE;
     }
     
-    // Executions match: we will switch to the state in the replay execution
-    // which could either be ERROR or EXECUTION_COMPLETE. If the original
-    // execution succeeded, copy row-count, rows-affected and results to
-    // the current execution. If the original execution failed, copy the
-    // error message and error number to the current execution
     execution->rc_ = replayExecution["rc"].GetInt();
     if (replayExecution.HasMember("rows_returned"))
         execution->rowCount_ = replayExecution["rows_returned"].GetInt();
@@ -490,6 +1490,11 @@ ReplayObserver::onEvent(MySqlExecution * execution, ExecutionState newState)
         const Value & replayResults = replayExecution["results"];
         execution->getResults().CopyFrom(replayResults, execution->getResults().GetAllocator());
     }
+    else if (replayExecution.HasMember("results_ref"))
+    {
+        if (!copyStoredResults(execution, replayExecution["results_ref"].GetString()))
+            return MySqlExecution::ERROR_STATE;
+    }
     if (replayExecution.HasMember("error_no"))
     {
         int replayErrorNo = replayExecution["error_no"].GetInt();
@@ -505,6 +1510,70 @@ ReplayObserver::onEvent(MySqlExecution * execution, ExecutionState newState)
     return static_cast<MySqlExecution::ExecutionState>(exitState);
 }
 
+// As above, but the results are decoded from the fixture straight into the
+// execution's results, with strings referring to the mapped fixture
+MySqlExecution::ExecutionState    
+ReplayObserver::replayFixtureExecution(MySqlExecution * execution, size_t replayIndex)
+{
+    stringstream errorMessage;
+    string fixtureError;
+    FixtureExecution replayExecution;
+    if (!fixture_->getExecution(replayIndex, replayExecution, fixtureError))
+    {
+        conn_->reportError(fixtureError);
+        return MySqlExecution::ERROR_STATE;
+    }
+    if (!execution->isSameAs(replayExecution.statementName_, replayExecution.statementNameLength_,
+                             replayExecution.statementText_, replayExecution.statementTextLength_, errorMessage))
+    {
+        conn_->reportError(errorMessage);
+        return MySqlExecution::ERROR_STATE;
+    }
+
+    execution->rc_ = replayExecution.rc_;
+    if (replayExecution.flags_ & Fixture::HAS_ROWS_RETURNED)
+        execution->rowCount_ = static_cast<int>(replayExecution.rowsReturned_);
+    if (replayExecution.flags_ & Fixture::HAS_ROWS_AFFECTED)
+        execution->rowsAffected_ = static_cast<int>(replayExecution.rowsAffected_);
+    if (replayExecution.flags_ & Fixture::HAS_RESULTS)
+    {
+        if (!fixture_->getResults(replayExecution, execution->getResults(), execution->getResults().GetAllocator(), fixtureError))
+        {
+            conn_->reportError(fixtureError);
+            return MySqlExecution::ERROR_STATE;
+        }
+    }
+    else if (replayExecution.flags_ & Fixture::RESULTS_REF)
+    {
+        if (!copyStoredResults(execution, string(replayExecution.resultsRef_, replayExecution.resultsRefLength_)))
+            return MySqlExecution::ERROR_STATE;
+    }
+    if (replayExecution.errorNo_)
+    {
+        string replayErrorMessage(replayExecution.errorMessage_, replayExecution.errorMessageLength_);
+        execution->errorMessage_ = replayErrorMessage;
+        execution->errorNo_ = replayExecution.errorNo_;
+        conn_->reportError(replayErrorMessage, replayExecution.errorNo_, execution->getHandle());
+    }
+    return static_cast<MySqlExecution::ExecutionState>(replayExecution.state_);
+}
+
+// Copy results captured by reference. The stored result set is kept by the
+// result store, so the copy refers to its strings.
+bool
+ReplayObserver::copyStoredResults(MySqlExecution * execution, const string & digest)
+{
+    string errorMessage;
+    boost::shared_ptr<const StoredResults> results = ResultStore::get(resultStore_, digest, errorMessage);
+    if (!results)
+    {
+        conn_->reportError(errorMessage);
+        return false;
+    }
+    execution->getResults().CopyFrom(results->getResults(), execution->getResults().GetAllocator());
+    return true;
+}
+
 void              
 ReplayObserver::endProgram(const char * programName)
 {
@@ -572,7 +1641,7 @@ DebugObserver::onEvent(MySqlExecution * execution, ExecutionState newState)
             colsMsg << "  Returns columns ";
             for (int icol = 0; icol < execution->columnCount_; icol++)
             {
-                MYSQL_FIELD * fieldDescriptor = mysql_fetch_field_direct(execution->resultsMetadata_, icol);
+                const MYSQL_FIELD * fieldDescriptor = execution->statementHandle_->getColumn(icol);
                 colsMsg << fieldDescriptor->name << " ";
             }
             EX_LOG(conn_, execution, trace) << colsMsg.str();
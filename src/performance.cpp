@@ -0,0 +1,115 @@
+#include "performance.h"
+
+using namespace std;
+
+
+//                               P E R F O R M A N C E  S T A T S
+
+PerformanceSample::PerformanceSample()
+:   rowsReturned_(0),
+    rowsAffected_(0),
+    isError_(false)
+{
+}
+
+PerformanceStats::PerformanceStats()
+:   executions_(0),
+    errors_(0),
+    rowsReturned_(0),
+    rowsAffected_(0)
+{
+}
+
+void
+PerformanceStats::record(const PerformanceSample & sample)
+{
+    const PhaseDurations & durations = sample.durations_;
+    if (durations.prepareUs_ >= 0) prepare_.record(durations.prepareUs_);
+    if (durations.executeUs_ >= 0) execute_.record(durations.executeUs_);
+    if (durations.fetchUs_ >= 0)   fetch_.record(durations.fetchUs_);
+    if (durations.totalUs_ >= 0)   total_.record(durations.totalUs_);
+    executions_++;
+    if (sample.isError_) errors_++;
+    if (sample.rowsReturned_ > 0) rowsReturned_ += sample.rowsReturned_;
+    if (sample.rowsAffected_ > 0) rowsAffected_ += sample.rowsAffected_;
+}
+
+void
+PerformanceStats::merge(const PerformanceStats & other)
+{
+    prepare_.merge(other.prepare_);
+    execute_.merge(other.execute_);
+    fetch_.merge(other.fetch_);
+    total_.merge(other.total_);
+    executions_ += other.executions_;
+    errors_ += other.errors_;
+    rowsReturned_ += other.rowsReturned_;
+    rowsAffected_ += other.rowsAffected_;
+}
+
+void
+PerformanceStats::toJson(rapidjson::Value & json, rapidjson::Document::AllocatorType & allocator) const
+{
+    json.SetObject();
+    json.AddMember("executions", executions_, allocator);
+    json.AddMember("errors", errors_, allocator);
+    json.AddMember("rows_returned", rowsReturned_, allocator);
+    json.AddMember("rows_affected", rowsAffected_, allocator);
+    rapidjson::Value histogram;
+    prepare_.toJson(histogram, allocator);
+    json.AddMember("prepare", histogram, allocator);
+    execute_.toJson(histogram, allocator);
+    json.AddMember("execute", histogram, allocator);
+    fetch_.toJson(histogram, allocator);
+    json.AddMember("fetch", histogram, allocator);
+    total_.toJson(histogram, allocator);
+    json.AddMember("total", histogram, allocator);
+}
+
+
+//                            P E R F O R M A N C E  S N A P S H O T
+
+void
+PerformanceSnapshot::record(const string & statementName, const string & programName, const PerformanceSample & sample)
+{
+    statements_[statementName].record(sample);
+    if (!programName.empty()) programs_[programName].record(sample);
+}
+
+void
+PerformanceSnapshot::merge(const PerformanceSnapshot & other)
+{
+    for (StatsMap::const_iterator itr = other.statements_.begin(); itr != other.statements_.end(); ++itr)
+        statements_[itr->first].merge(itr->second);
+    for (StatsMap::const_iterator itr = other.programs_.begin(); itr != other.programs_.end(); ++itr)
+        programs_[itr->first].merge(itr->second);
+}
+
+void
+PerformanceSnapshot::clear()
+{
+    statements_.clear();
+    programs_.clear();
+}
+
+// { "statements" : { <name> : <stats>, ... }, "programs" : { <name> : <stats>, ... } }
+void
+PerformanceSnapshot::toJson(rapidjson::Document & json) const
+{
+    rapidjson::Document::AllocatorType & allocator = json.GetAllocator();
+    json.SetObject();
+    const StatsMap * maps[] = { &statements_, &programs_ };
+    const char * mapNames[] = { "statements", "programs" };
+    for (int i = 0; i < 2; i++)
+    {
+        rapidjson::Value statsByName(rapidjson::kObjectType);
+        for (StatsMap::const_iterator itr = maps[i]->begin(); itr != maps[i]->end(); ++itr)
+        {
+            rapidjson::Value name(itr->first.c_str(), itr->first.size(), allocator);
+            rapidjson::Value stats;
+            itr->second.toJson(stats, allocator);
+            statsByName.AddMember(name, stats, allocator);
+        }
+        json.AddMember(rapidjson::StringRef(mapNames[i]), statsByName, allocator);
+    }
+}
@@ -0,0 +1,40 @@
+#include <algorithm>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+#include "phase_clock.h"
+
+using namespace std;
+using namespace boost;
+
+static boost::mutex      anchorMutex;
+static PhaseClock::Tick  anchorTick;
+static posix_time::ptime anchorTime;
+
+
+//                                    P H A S E  C L O C K
+
+int64_t
+PhaseClock::getMicroseconds(const Tick & from, const Tick & to)
+{
+    if (!isSet(from) || !isSet(to)) return -1;
+    int64_t microseconds = chrono::duration_cast<chrono::microseconds>(to - from).count();
+    return std::max(microseconds, static_cast<int64_t>(0));
+}
+
+posix_time::ptime
+PhaseClock::toLocalTime(const Tick & tick)
+{
+    if (!isSet(tick)) return posix_time::ptime(posix_time::not_a_date_time);
+
+    Tick nowTick = now();
+    boost::lock_guard<boost::mutex> lock(anchorMutex);
+    if (!isSet(anchorTick) || nowTick - anchorTick >= chrono::seconds(ANCHOR_REFRESH_SEC))
+    {
+        anchorTick = nowTick;
+        anchorTime = posix_time::microsec_clock::local_time();
+    }
+    int64_t offset = chrono::duration_cast<chrono::microseconds>(tick - anchorTick).count();
+    return anchorTime + posix_time::microseconds(offset);
+}
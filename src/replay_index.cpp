@@ -0,0 +1,153 @@
+#include <cstring>
+
+#include "replay_index.h"
+
+using namespace std;
+using namespace rapidjson;
+
+static const uint64_t FNV_PRIME = 1099511628211ULL;
+
+static uint64_t
+hashByte(uint8_t byte, uint64_t hash)
+{
+    return (hash ^ byte) * FNV_PRIME;
+}
+
+static uint64_t
+hashUint64(uint64_t value, uint64_t hash)
+{
+    for (size_t i = 0; i < 8; i++)
+        hash = hashByte(static_cast<uint8_t>((value >> (8 * i)) & 0xff), hash);
+    return hash;
+}
+
+
+//                                     R E P L A Y  K E Y
+
+bool
+ReplayKey::operator<(const ReplayKey & other) const
+{
+    if (textHash_ != other.textHash_) return textHash_ < other.textHash_;
+    if (parameterHash_ != other.parameterHash_) return parameterHash_ < other.parameterHash_;
+    return statementName_ < other.statementName_;
+}
+
+uint64_t
+ReplayKey::hashBytes(const char * data, size_t length, uint64_t hash)
+{
+    for (size_t i = 0; i < length; i++)
+        hash = hashByte(static_cast<uint8_t>(data[i]), hash);
+    return hash;
+}
+
+// Each value is hashed with a type tag (and strings, arrays and objects with
+// their length), so that values of different types or shapes hash apart
+uint64_t
+ReplayKey::hashValue(const Value & value, uint64_t hash)
+{
+    switch (value.GetType())
+    {
+        case kNullType:
+            return hashByte('n', hash);
+
+        case kFalseType:
+            return hashByte('f', hash);
+
+        case kTrueType:
+            return hashByte('t', hash);
+
+        case kNumberType:
+            if (value.IsInt64())
+                return hashUint64(static_cast<uint64_t>(value.GetInt64()), hashByte('i', hash));
+            if (value.IsUint64())
+                return hashUint64(value.GetUint64(), hashByte('u', hash));
+            {
+                double number = value.GetDouble();
+                uint64_t bits;
+                memcpy(&bits, &number, sizeof(bits));
+                return hashUint64(bits, hashByte('d', hash));
+            }
+
+        case kStringType:
+            hash = hashUint64(value.GetStringLength(), hashByte('s', hash));
+            return hashBytes(value.GetString(), value.GetStringLength(), hash);
+
+        case kArrayType:
+            hash = hashUint64(value.Size(), hashByte('a', hash));
+            for (Value::ConstValueIterator itr = value.Begin(); itr != value.End(); ++itr)
+                hash = hashValue(*itr, hash);
+            return hash;
+
+        case kObjectType:
+            hash = hashUint64(value.MemberCount(), hashByte('o', hash));
+            for (Value::ConstMemberIterator itr = value.MemberBegin(); itr != value.MemberEnd(); ++itr)
+            {
+                hash = hashValue(itr->name, hash);
+                hash = hashValue(itr->value, hash);
+            }
+            return hash;
+    }
+    return hash;
+}
+
+// An execution without parameters is captured without a "parameters" member,
+// so no parameters and an empty object hash alike
+uint64_t
+ReplayKey::hashParameters(const Value * parameters)
+{
+    if (parameters == NULL || (parameters->IsObject() && parameters->ObjectEmpty()))
+        return HASH_SEED;
+    return hashValue(*parameters);
+}
+
+
+//                                   R E P L A Y  I N D E X
+
+void
+ReplayIndex::clear()
+{
+    executions_.clear();
+}
+
+void
+ReplayIndex::build(const FixtureReader & fixture)
+{
+    clear();
+    string errorMessage;
+    for (size_t i = 0; i < fixture.getExecutionCount(); i++)
+    {
+        FixtureExecution execution;
+        if (!fixture.getExecution(i, execution, errorMessage)) continue;
+        ReplayKey key(string(execution.statementName_, execution.statementNameLength_),
+                      ReplayKey::hashBytes(execution.statementText_, execution.statementTextLength_),
+                      execution.parameterHash_);
+        executions_[key].executions_.push_back(i);
+    }
+}
+
+void
+ReplayIndex::build(const CaptureReader & capture)
+{
+    clear();
+    const Value & executions = capture.getExecutions();
+    for (SizeType i = 0; i < executions.Size(); i++)
+    {
+        const Value & execution = executions[i];
+        if (   !execution.HasMember("statement_name") || !execution["statement_name"].IsString()
+            || !execution.HasMember("statement_text") || !execution["statement_text"].IsString())
+            continue;
+        Value::ConstMemberIterator parameters = execution.FindMember("parameters");
+        ReplayKey key(string(execution["statement_name"].GetString(), execution["statement_name"].GetStringLength()),
+                      ReplayKey::hashBytes(execution["statement_text"].GetString(), execution["statement_text"].GetStringLength()),
+                      ReplayKey::hashParameters(parameters == execution.MemberEnd() ? NULL : &parameters->value));
+        executions_[key].executions_.push_back(i);
+    }
+}
+
+int
+ReplayIndex::take(const ReplayKey & key)
+{
+    QueueMap::iterator itr = executions_.find(key);
+    if (itr == executions_.end() || itr->second.next_ >= itr->second.executions_.size()) return -1;
+    return static_cast<int>(itr->second.executions_[itr->second.next_++]);
+}
@@ -0,0 +1,118 @@
+#include <cstdio>
+#include <sstream>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/uuid/detail/sha1.hpp>
+
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include "fixture.h"
+#include "result_store.h"
+
+using namespace std;
+using namespace rapidjson;
+
+
+//                                   S T O R E D  R E S U L T S
+
+bool
+StoredResults::open(const string & path, string & errorMessage)
+{
+    if (!CaptureReader::readFile(path, buffer_, errorMessage)) return false;
+    document_.ParseInsitu(&buffer_[0]);
+    if (document_.HasParseError() || !document_.IsObject())
+    {
+        errorMessage = path + " is not a stored result set";
+        return false;
+    }
+    return true;
+}
+
+
+//                                    R E S U L T  S T O R E
+
+boost::mutex            ResultStore::mutex_;
+set<string>             ResultStore::stored_;
+ResultStore::ResultsMap ResultStore::results_;
+
+// boost's SHA-1 is an implementation detail: its digest is five 32-bit words
+// in some releases and twenty bytes in others. Either way the elements are
+// printed most significant first, so stored digests don't change with boost.
+BOOST_STATIC_ASSERT(sizeof(boost::uuids::detail::sha1::digest_type) == 20);
+
+string
+ResultStore::getDigest(const char * data, size_t length)
+{
+    boost::uuids::detail::sha1 sha1;
+    sha1.process_bytes(data, length);
+    boost::uuids::detail::sha1::digest_type digest;
+    sha1.get_digest(digest);
+
+    const int digits = 2 * sizeof(digest[0]);
+    char hex[41];
+    for (size_t i = 0; i < 20 / sizeof(digest[0]); i++)
+        snprintf(hex + digits * i, digits + 1, "%0*x", digits, static_cast<unsigned int>(digest[i]));
+    return string(hex, 40);
+}
+
+string
+ResultStore::getPath(const string & directory, const string & digest)
+{
+    return directory + "/" + digest.substr(0, 2) + "/" + digest + ".json";
+}
+
+// Serialize the results, and store them unless a result set with the same
+// digest is already stored. The file is written under a temporary name, so
+// processes capturing at the same time never see a partial result set.
+bool
+ResultStore::put(const string & directory, const Value & results, string & digest, string & errorMessage)
+{
+    StringBuffer buffer;
+    Writer<StringBuffer> writer(buffer);
+    results.Accept(writer);
+    digest = getDigest(buffer.GetString(), buffer.GetSize());
+    const string path = getPath(directory, digest);
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    if (stored_.count(path) != 0) return true;
+    if (access(path.c_str(), F_OK) == 0)
+    {
+        stored_.insert(path);
+        return true;
+    }
+
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(directory + "/" + digest.substr(0, 2), ec);
+    stringstream tempPath;
+    tempPath << path << "." << getpid() << ".tmp";
+    FILE * fp = fopen(tempPath.str().c_str(), "w");
+    bool ok =    fp != NULL
+              && fwrite(buffer.GetString(), 1, buffer.GetSize(), fp) == buffer.GetSize();
+    if (fp != NULL) ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tempPath.str().c_str(), path.c_str()) != 0)
+    {
+        remove(tempPath.str().c_str());
+        errorMessage = "Unable to write " + path;
+        return false;
+    }
+    stored_.insert(path);
+    return true;
+}
+
+boost::shared_ptr<const StoredResults>
+ResultStore::get(const string & directory, const string & digest, string & errorMessage)
+{
+    const string path = getPath(directory, digest);
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    ResultsMap::const_iterator itr = results_.find(path);
+    if (itr != results_.end()) return itr->second;
+    boost::shared_ptr<StoredResults> results = boost::make_shared<StoredResults>();
+    if (!results->open(path, errorMessage)) return boost::shared_ptr<const StoredResults>();
+    results_[path] = results;
+    return results;
+}
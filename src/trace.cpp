@@ -0,0 +1,57 @@
+#include "trace.h"
+
+using namespace std;
+
+
+//                                     T R A C E  E V E N T
+
+TraceEvent::TraceEvent()
+:   phase_('i'),
+    category_(""),
+    timestamp_(0),
+    duration_(0),
+    id_(0),
+    handle_(0)
+{
+}
+
+TraceEvent::TraceEvent(char phase, const char * category, const string & name, int64_t timestamp)
+:   phase_(phase),
+    category_(category),
+    name_(name),
+    timestamp_(timestamp),
+    duration_(0),
+    id_(0),
+    handle_(0)
+{
+}
+
+
+//                                    T R A C E  B U F F E R
+
+TraceBuffer::TraceBuffer(int threadId, const string & threadName, size_t maxEvents)
+:   threadId_(threadId),
+    threadName_(threadName),
+    maxEvents_(maxEvents),
+    dropped_(0)
+{
+}
+
+void
+TraceBuffer::add(const TraceEvent & event)
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    if (events_.size() >= maxEvents_)
+    {
+        dropped_++;
+        return;
+    }
+    events_.push_back(event);
+}
+
+void
+TraceBuffer::setThreadName(const string & threadName)
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    threadName_ = threadName;
+}
@@ -0,0 +1,860 @@
+#include <cstring>
+
+#include <errmsg.h>
+
+#include <gtest/gtest.h>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <rapidjson/error/en.h>
+#include <rapidjson/filereadstream.h>
+
+#include "mysql_client_at/include/audit_sink.h"
+#include "mysql_client_at/include/connection.h"
+#include "mysql_client_at/include/execution.h"
+#include "mysql_client_at/include/fixture.h"
+#include "mysql_client_at/include/gtest.h"
+#include "mysql_client_at/include/replay_index.h"
+#include "mysql_client_at/include/result_store.h"
+
+// Checks of the framework's own machinery -- scheduling, registries,
+// batching, audit writing, fixtures and replay, the result store, sharding --
+// that need no MySQL server: they drive the classes directly, or run
+// connections on the loopback backend.
+
+namespace
+{
+
+//                              R E Q U E S T  S C H E D U L E R
+
+typedef ExecutionThread::Request Request;
+
+Request
+makeExecution(ExecutionThread::RequestSequence sequence, ExecutionPriority priority, boost::thread::id submitter)
+{
+    Request request(MySqlConnection::EXECUTION_REQUEST, sequence, NULL);
+    request.sequence_ = sequence;
+    request.priority_ = priority;
+    request.submitter_ = submitter;
+    return request;
+}
+
+void
+getThreadId(boost::thread::id * id)
+{
+    *id = boost::this_thread::get_id();
+}
+
+boost::thread::id
+getOtherThreadId()
+{
+    boost::thread::id id;
+    boost::thread thread(boost::bind(getThreadId, &id));
+    thread.join();
+    return id;
+}
+
+// A thread's interactive read queued after its own normal write must not
+// overtake the write
+TEST(SchedulerTest, KeepsSubmitterOrder)
+{
+    RequestScheduler scheduler;
+    boost::thread::id self = boost::this_thread::get_id();
+    scheduler.put(makeExecution(1, BACKGROUND_PRIORITY, self));
+    scheduler.put(makeExecution(2, NORMAL_PRIORITY, self));
+    scheduler.put(makeExecution(3, INTERACTIVE_PRIORITY, self));
+    ASSERT_EQ(scheduler.get().sequence_, 1);
+    ASSERT_EQ(scheduler.get().sequence_, 2);
+    ASSERT_EQ(scheduler.get().sequence_, 3);
+    ASSERT_TRUE(scheduler.empty());
+}
+
+// Another thread's interactive lookup is served ahead of a backlog of
+// background work, whose own order is kept
+TEST(SchedulerTest, InterleavesSubmitters)
+{
+    RequestScheduler scheduler;
+    boost::thread::id self = boost::this_thread::get_id();
+    boost::thread::id other = getOtherThreadId();
+    for (int i = 1; i <= 4; i++)
+        scheduler.put(makeExecution(i, BACKGROUND_PRIORITY, self));
+    scheduler.put(makeExecution(5, INTERACTIVE_PRIORITY, other));
+
+    std::vector<int> order;
+    while (!scheduler.empty())
+        order.push_back(scheduler.get().sequence_);
+    ASSERT_EQ(order.size(), 5u);
+    ASSERT_EQ(order[0], 1);
+    ASSERT_EQ(order[1], 5) << "the other thread's interactive lookup waited for the background backlog";
+    for (size_t i = 2; i < order.size(); i++)
+        ASSERT_EQ(order[i], static_cast<int>(i)) << "background work was reordered";
+}
+
+// Nothing queued after a barrier is served before it
+TEST(SchedulerTest, ServesBarriersInOrder)
+{
+    RequestScheduler scheduler;
+    boost::thread::id self = boost::this_thread::get_id();
+    scheduler.put(makeExecution(1, BACKGROUND_PRIORITY, self));
+    Request barrier(MySqlConnection::START_TRANSACTION_REQUEST, 1, "t");
+    barrier.sequence_ = 2;
+    scheduler.put(barrier);
+    scheduler.put(makeExecution(3, INTERACTIVE_PRIORITY, getOtherThreadId()));
+    ASSERT_EQ(scheduler.get().sequence_, 1);
+    ASSERT_EQ(scheduler.get().sequence_, 2);
+    ASSERT_EQ(scheduler.get().sequence_, 3);
+}
+
+Request
+makeTenantExecution(ExecutionThread::RequestSequence sequence, const char * tenant, boost::thread::id submitter)
+{
+    Request request = makeExecution(sequence, BACKGROUND_PRIORITY, submitter);
+    request.tenant_ = tenant;
+    return request;
+}
+
+// A shed execution isn't charged to its flow: the flow's next execution
+// starts where the shed one would have, level with the other flow's
+TEST(SchedulerTest, RefundsShedExecutions)
+{
+    RequestScheduler scheduler;
+    boost::thread::id self = boost::this_thread::get_id();
+    boost::thread::id other = getOtherThreadId();
+    scheduler.put(makeTenantExecution(1, "a", self));
+    scheduler.put(makeTenantExecution(2, "a", self));
+    ASSERT_TRUE(scheduler.shedLowest(INTERACTIVE_PRIORITY));
+    scheduler.put(makeTenantExecution(3, "b", other));
+    scheduler.put(makeTenantExecution(4, "a", self));
+    scheduler.put(makeTenantExecution(5, "b", other));
+
+    Request shed = scheduler.get();
+    ASSERT_TRUE(shed.isShed_);
+    ASSERT_EQ(shed.sequence_, 2);
+    for (int sequence = 1; sequence <= 5; sequence++)
+    {
+        if (sequence == 2) continue;
+        ASSERT_EQ(scheduler.get().sequence_, sequence) << "tenant a was charged for its shed execution";
+    }
+}
+
+// Once the queue drains, flows start level again
+TEST(SchedulerTest, ForgetsFlowsWhenDrained)
+{
+    RequestScheduler scheduler;
+    boost::thread::id self = boost::this_thread::get_id();
+    boost::thread::id other = getOtherThreadId();
+    scheduler.put(makeTenantExecution(1, "a", self));
+    ASSERT_EQ(scheduler.get().sequence_, 1);
+    ASSERT_TRUE(scheduler.empty());
+
+    scheduler.put(makeTenantExecution(2, "a", self));
+    scheduler.put(makeTenantExecution(3, "b", other));
+    ASSERT_EQ(scheduler.get().sequence_, 2) << "tenant a was held back for work done before the queue drained";
+    ASSERT_EQ(scheduler.get().sequence_, 3);
+}
+
+
+//                              E X E C U T I O N  R E G I S T R Y
+
+// A connection to the loopback backend: lookups get one synthetic row (unless
+// the params say otherwise), other statements affect one row
+unique_ptr<MySqlConnection>
+openLoopbackConnection(const rapidjson::Document * backendParams=NULL)
+{
+    unique_ptr<MySqlConnection> conn = MySqlConnection::createConnection("framework_test", "employees", "employees.json",
+                                                                         "", "", "localhost", 3306);
+    conn->setBackend(LOOPBACK_BACKEND, backendParams);
+    return boost::move(conn);
+}
+
+// Past the retention limit the oldest executions are released, and their
+// handles fail with RETIRED_HANDLE_ERROR instead of reaching freed memory
+TEST(RegistryTest, RetiresOldHandles)
+{
+    unique_ptr<MySqlConnection> conn = openLoopbackConnection();
+    conn->setExecutionRetention(8);
+    std::vector<MySqlConnection::ExecutionHandle> handles;
+    for (int i = 0; i < 20; i++)
+        handles.push_back(conn->execute("get_employee_by_emp_no", "retention", "emp_no", 10001 + i));
+
+    ASSERT_EQ(conn->getReturnCode(handles.back()), 0) << conn->getErrorMessage();
+    ASSERT_EQ(conn->getRowCount(handles.back()), 1);
+    ASSERT_EQ(conn->getReturnCode(), 0) << "the thread's last execution was released";
+    ASSERT_EQ(conn->getReturnCode(handles.front()), MySqlConnection::RETIRED_HANDLE_ERROR);
+    ASSERT_TRUE(conn->getResults(handles.front()) == NULL);
+    ASSERT_FALSE(conn->assertRowsReturned(1, handles.front()));
+    ASSERT_NE(conn->getReturnCode(handles.back() + 1000000), 0);
+}
+
+// An execution a caller holds is kept however far it falls behind
+TEST(RegistryTest, KeepsHeldExecutions)
+{
+    unique_ptr<MySqlConnection> conn = openLoopbackConnection();
+    conn->setExecutionRetention(8);
+    MySqlConnection::ExecutionHandle held = conn->execute("get_employee_by_emp_no", "retention", "emp_no", 10001);
+    shared_ptr<MySqlExecution> execution = conn->getCompletedExecution(held);
+    ASSERT_TRUE(execution);
+    for (int i = 0; i < 20; i++)
+        conn->execute("get_employee_by_emp_no", "retention", "emp_no", 10002 + i);
+
+    ASSERT_TRUE(conn->findExecution(held) == execution);
+    ASSERT_EQ(execution->getRowCount(), 1);
+    execution.reset();
+    for (int i = 0; i < 20; i++)
+        conn->execute("get_employee_by_emp_no", "retention", "emp_no", 10002 + i);
+    ASSERT_EQ(conn->getReturnCode(held), MySqlConnection::RETIRED_HANDLE_ERROR);
+}
+
+
+//                          A S Y N C  T R A N S A C T I O N S
+
+// An async connection on the latency backend, in front of the loopback
+// backend, where every statement whose text contains failMatch fails
+unique_ptr<MySqlConnection>
+openFailingAsyncConnection(const char * failMatch)
+{
+    unique_ptr<MySqlConnection> conn = MySqlConnection::createConnection("framework_test", "employees", "employees.json",
+                                                                         "", "", "localhost", 3306, NULL, 0, true);
+    rapidjson::Document backendParams;
+    backendParams.SetObject();
+    rapidjson::Document::AllocatorType & allocator = backendParams.GetAllocator();
+    rapidjson::Value statement(rapidjson::kObjectType);
+    statement.AddMember("match", rapidjson::StringRef(failMatch), allocator);
+    statement.AddMember("error_rate", 1.0, allocator);
+    statement.AddMember("error_no", 1213, allocator);  // ER_LOCK_DEADLOCK
+    rapidjson::Value statements(rapidjson::kArrayType);
+    statements.PushBack(statement, allocator);
+    backendParams.AddMember("statements", statements, allocator);
+    conn->setBackend(LATENCY_BACKEND, &backendParams);
+    return boost::move(conn);
+}
+
+// Once an execution fails inside a transaction, the rest of the transaction,
+// queued before or after the failure, is discarded rather than run in
+// autocommit, and the caller's commit reports the rollback
+TEST(TransactionTest, DiscardsRestOfFailedTransaction)
+{
+    unique_ptr<MySqlConnection> conn = openFailingAsyncConnection("FROM departments");
+    ASSERT_EQ(conn->startTransaction("failing"), 0) << conn->getErrorMessage();
+    MySqlConnection::ExecutionHandle before = conn->execute("get_employee_by_emp_no", "transaction", "emp_no", 10001);
+    MySqlConnection::ExecutionHandle failing = conn->execute("get_dept_by_dept_no", "transaction", "dept_no", "d001");
+    MySqlConnection::ExecutionHandle queued = conn->execute("get_employee_by_emp_no", "transaction", "emp_no", 10002);
+    ASSERT_EQ(conn->getReturnCode(before), 0) << conn->getErrorMessage();
+    ASSERT_NE(conn->getReturnCode(failing), 0) << "the injected failure didn't happen";
+    ASSERT_NE(conn->getReturnCode(queued), 0) << "an execution queued behind the failure ran";
+
+    MySqlConnection::ExecutionHandle after = conn->execute("get_employee_by_emp_no", "transaction", "emp_no", 10003);
+    ASSERT_NE(conn->getReturnCode(after), 0) << "an execution submitted after the failure ran outside the transaction";
+    ASSERT_EQ(conn->commitTransaction(), 0) << "the caller's transaction was ended behind its back";
+    ASSERT_NE(conn->waitForRequest(), 0) << "the commit of a rolled-back transaction succeeded";
+
+    // the next transaction is unaffected
+    ASSERT_EQ(conn->startTransaction("next"), 0) << conn->getErrorMessage();
+    MySqlConnection::ExecutionHandle next = conn->execute("get_employee_by_emp_no", "transaction", "emp_no", 10004);
+    ASSERT_EQ(conn->commitTransaction(), 0) << conn->getErrorMessage();
+    ASSERT_EQ(conn->waitForRequest(), 0) << conn->getErrorMessage();
+    ASSERT_EQ(conn->getReturnCode(next), 0) << conn->getErrorMessage();
+}
+
+
+//                                      D E A D L I N E S
+
+// A connection on the latency backend, in front of the loopback backend,
+// where every statement takes latencyUs, and every statement whose text
+// contains failMatch (if given) fails with a lost connection
+unique_ptr<MySqlConnection>
+openLatencyConnection(bool isAsync, int latencyUs, const char * failMatch=NULL)
+{
+    unique_ptr<MySqlConnection> conn = MySqlConnection::createConnection("framework_test", "employees", "employees.json",
+                                                                         "", "", "localhost", 3306, NULL, 0, isAsync);
+    rapidjson::Document backendParams;
+    backendParams.SetObject();
+    rapidjson::Document::AllocatorType & allocator = backendParams.GetAllocator();
+    backendParams.AddMember("distribution", "fixed", allocator);
+    backendParams.AddMember("mean_us", latencyUs, allocator);
+    if (failMatch != NULL)
+    {
+        rapidjson::Value statement(rapidjson::kObjectType);
+        statement.AddMember("match", rapidjson::StringRef(failMatch), allocator);
+        statement.AddMember("error_rate", 1.0, allocator);
+        rapidjson::Value statements(rapidjson::kArrayType);
+        statements.PushBack(statement, allocator);
+        backendParams.AddMember("statements", statements, allocator);
+    }
+    conn->setBackend(LATENCY_BACKEND, &backendParams);
+    return boost::move(conn);
+}
+
+// An execution whose deadline passes while it waits in the queue fails with
+// the timeout error, without being sent
+TEST(DeadlineTest, ExpiresInQueue)
+{
+    unique_ptr<MySqlConnection> conn = openLatencyConnection(true, 200000);
+    MySqlConnection::ExecutionHandle slow = conn->execute("get_employee_by_emp_no", "deadline", "emp_no", 10001);
+    MySqlConnection::ExecutionHandle late = conn->executeWithTimeout(50, "get_employee_by_emp_no", "deadline", "emp_no", 10002);
+    MySqlConnection::ExecutionHandle patient = conn->executeWithTimeout(5000, "get_employee_by_emp_no", "deadline", "emp_no", 10003);
+    ASSERT_EQ(conn->getReturnCode(slow), 0) << conn->getErrorMessage();
+    ASSERT_EQ(conn->getReturnCode(late), MySqlExecution::TIMEOUT_ERROR);
+    ASSERT_EQ(conn->getReturnCode(patient), 0) << conn->getErrorMessage();
+}
+
+
+//                                       O V E R L O A D
+
+// Start an execution on a slow async connection, and give the execution
+// thread time to take it off the queue, so that the queue starts out empty
+MySqlConnection::ExecutionHandle
+startRunning(MySqlConnection * conn)
+{
+    MySqlConnection::ExecutionHandle running = conn->execute("get_employee_by_emp_no", "overload", "emp_no", 10001);
+    boost::this_thread::sleep(posix_time::milliseconds(50));
+    return running;
+}
+
+// A full queue rejects a new execution at once
+TEST(OverloadTest, FailsFastWhenFull)
+{
+    unique_ptr<MySqlConnection> conn = openLatencyConnection(true, 200000);
+    conn->setQueueLimit(2, MySqlConnection::FAIL_FAST);
+    MySqlConnection::ExecutionHandle running = startRunning(conn.get());
+    MySqlConnection::ExecutionHandle first = conn->execute("get_employee_by_emp_no", "overload", "emp_no", 10002);
+    MySqlConnection::ExecutionHandle second = conn->execute("get_employee_by_emp_no", "overload", "emp_no", 10003);
+    MySqlConnection::ExecutionHandle rejected = conn->execute("get_employee_by_emp_no", "overload", "emp_no", 10004);
+
+    ASSERT_EQ(conn->getReturnCode(rejected), MySqlConnection::QUEUE_FULL_ERROR);
+    ASSERT_EQ(conn->getReturnCode(running), 0) << conn->getErrorMessage();
+    ASSERT_EQ(conn->getReturnCode(first), 0) << conn->getErrorMessage();
+    ASSERT_EQ(conn->getReturnCode(second), 0) << conn->getErrorMessage();
+    ASSERT_EQ(conn->getOverloadStats().rejected_, 1UL);
+}
+
+// A full queue holds a new execution's submitter until there is room
+TEST(OverloadTest, BlocksWhenFull)
+{
+    unique_ptr<MySqlConnection> conn = openLatencyConnection(true, 200000);
+    conn->setQueueLimit(1, MySqlConnection::BLOCK_WHEN_FULL);
+    MySqlConnection::ExecutionHandle running = startRunning(conn.get());
+    MySqlConnection::ExecutionHandle queued = conn->execute("get_employee_by_emp_no", "overload", "emp_no", 10002);
+    posix_time::ptime submitted = posix_time::microsec_clock::universal_time();
+    MySqlConnection::ExecutionHandle blocked = conn->execute("get_employee_by_emp_no", "overload", "emp_no", 10003);
+    posix_time::time_duration blockedFor = posix_time::microsec_clock::universal_time() - submitted;
+
+    ASSERT_GE(blockedFor, posix_time::milliseconds(100)) << "the submitter wasn't held until the queue had room";
+    ASSERT_EQ(conn->getReturnCode(running), 0) << conn->getErrorMessage();
+    ASSERT_EQ(conn->getReturnCode(queued), 0) << conn->getErrorMessage();
+    ASSERT_EQ(conn->getReturnCode(blocked), 0) << conn->getErrorMessage();
+    ASSERT_EQ(conn->getOverloadStats().rejected_, 0UL);
+}
+
+// A full queue sheds its newest execution of a lower class to admit a
+// higher-class one, and rejects one with no lower class to shed
+TEST(OverloadTest, DropsLowestPriority)
+{
+    unique_ptr<MySqlConnection> conn = openLatencyConnection(true, 200000);
+    conn->setQueueLimit(2, MySqlConnection::DROP_LOWEST_PRIORITY);
+    MySqlConnection::ExecutionHandle running = startRunning(conn.get());
+    MySqlConnection::ExecutionHandle background = conn->executeWithPriority(BACKGROUND_PRIORITY, "get_employee_by_emp_no",
+                                                                            "overload", "emp_no", 10002);
+    MySqlConnection::ExecutionHandle normal = conn->executeWithPriority(NORMAL_PRIORITY, "get_employee_by_emp_no",
+                                                                        "overload", "emp_no", 10003);
+    MySqlConnection::ExecutionHandle interactive = conn->executeWithPriority(INTERACTIVE_PRIORITY, "get_employee_by_emp_no",
+                                                                             "overload", "emp_no", 10004);
+    MySqlConnection::ExecutionHandle rejected = conn->executeWithPriority(BACKGROUND_PRIORITY, "get_employee_by_emp_no",
+                                                                          "overload", "emp_no", 10005);
+
+    ASSERT_EQ(conn->getReturnCode(rejected), MySqlConnection::QUEUE_FULL_ERROR);
+    ASSERT_EQ(conn->getReturnCode(background), MySqlConnection::REQUEST_SHED_ERROR);
+    ASSERT_EQ(conn->getReturnCode(running), 0) << conn->getErrorMessage();
+    ASSERT_EQ(conn->getReturnCode(normal), 0) << conn->getErrorMessage();
+    ASSERT_EQ(conn->getReturnCode(interactive), 0) << conn->getErrorMessage();
+    MySqlConnection::OverloadStats stats = conn->getOverloadStats();
+    ASSERT_EQ(stats.shed_, 1UL);
+    ASSERT_EQ(stats.rejected_, 1UL);
+}
+
+// Consecutive lost connections open the breaker, which then fails executions
+// fast. After the cool-down one trial execution goes through (half-open): its
+// failure opens the breaker again, its success closes it.
+TEST(CircuitBreakerTest, OpensAndCloses)
+{
+    unique_ptr<MySqlConnection> conn = openLatencyConnection(false, 0, "FROM departments");
+    conn->setCircuitBreaker(2, 100);
+
+    // closed: a failure short of the threshold, then a success that resets the count
+    ASSERT_EQ(conn->getReturnCode(conn->execute("get_dept_by_dept_no", "breaker", "dept_no", "d001")), CR_SERVER_LOST);
+    ASSERT_EQ(conn->getReturnCode(conn->execute("get_employee_by_emp_no", "breaker", "emp_no", 10001)), 0)
+        << conn->getErrorMessage();
+    ASSERT_EQ(conn->getReturnCode(conn->execute("get_dept_by_dept_no", "breaker", "dept_no", "d001")), CR_SERVER_LOST);
+    ASSERT_EQ(conn->getReturnCode(conn->execute("get_dept_by_dept_no", "breaker", "dept_no", "d001")), CR_SERVER_LOST);
+
+    // open
+    ASSERT_EQ(conn->getReturnCode(conn->execute("get_employee_by_emp_no", "breaker", "emp_no", 10002)),
+              MySqlConnection::CIRCUIT_OPEN_ERROR);
+
+    // half-open: the trial fails, and the breaker opens again
+    boost::this_thread::sleep(posix_time::milliseconds(150));
+    ASSERT_EQ(conn->getReturnCode(conn->execute("get_dept_by_dept_no", "breaker", "dept_no", "d001")), CR_SERVER_LOST);
+    ASSERT_EQ(conn->getReturnCode(conn->execute("get_employee_by_emp_no", "breaker", "emp_no", 10003)),
+              MySqlConnection::CIRCUIT_OPEN_ERROR);
+
+    // half-open: the trial succeeds, and the breaker closes
+    boost::this_thread::sleep(posix_time::milliseconds(150));
+    ASSERT_EQ(conn->getReturnCode(conn->execute("get_employee_by_emp_no", "breaker", "emp_no", 10004)), 0)
+        << conn->getErrorMessage();
+    ASSERT_EQ(conn->getReturnCode(conn->execute("get_dept_by_dept_no", "breaker", "dept_no", "d001")), CR_SERVER_LOST);
+    ASSERT_EQ(conn->getReturnCode(conn->execute("get_employee_by_emp_no", "breaker", "emp_no", 10005)), 0)
+        << conn->getErrorMessage();
+    ASSERT_EQ(conn->getOverloadStats().circuitOpen_, 2UL);
+}
+
+// The outcomes of transaction requests nobody waits for are dropped, oldest
+// first, once there are too many to keep
+TEST(CompletionTest, DropsUncollectedOutcomes)
+{
+    unique_ptr<MySqlConnection> conn = openLatencyConnection(true, 0);
+    MySqlConnection::RequestHandle first = 0;
+    for (size_t i = 0; i < ExecutionThread::MAX_COMPLETED_REQUESTS + 10; i++)
+    {
+        ASSERT_EQ(conn->startTransaction("unwatched"), 0) << conn->getErrorMessage();
+        if (first == 0) first = conn->getLastRequest();
+        conn->execute("get_employee_by_emp_no", "unwatched", "emp_no", 10001);
+        ASSERT_EQ(conn->commitTransaction(), 0) << conn->getErrorMessage();
+    }
+    ASSERT_EQ(conn->waitForRequest(), 0) << conn->getErrorMessage();
+    ASSERT_EQ(conn->waitForRequest(first), MySqlConnection::RETIRED_HANDLE_ERROR);
+    ASSERT_EQ(conn->getReturnCode(), 0) << conn->getErrorMessage();
+}
+
+
+//                                       B A T C H I N G
+
+void
+addSalaryRows(rapidjson::Document & rows, int count)
+{
+    rows.SetArray();
+    rapidjson::Document::AllocatorType & allocator = rows.GetAllocator();
+    for (int i = 0; i < count; i++)
+    {
+        rapidjson::Value row(rapidjson::kObjectType);
+        row.AddMember("emp_no", 10001 + i, allocator);
+        row.AddMember("salary", 50000 + i, allocator);
+        row.AddMember("from_date", "2100-01-01", allocator);
+        row.AddMember("to_date", "9999-01-01", allocator);
+        rows.PushBack(row, allocator);
+    }
+}
+
+int
+countOccurrences(const string & text, const string & pattern)
+{
+    int count = 0;
+    for (size_t pos = text.find(pattern); pos != string::npos; pos = text.find(pattern, pos + pattern.size()))
+        count++;
+    return count;
+}
+
+// A batch repeats the row text once per row, and binds each row's values
+// to its own markers
+TEST(BatchTest, RepeatsRowTextPerRow)
+{
+    unique_ptr<MySqlConnection> conn = openLoopbackConnection();
+    rapidjson::Document rows;
+    addSalaryRows(rows, 3);
+    MySqlConnection::ExecutionHandle xh = conn->executeJson("set_employee_salaries", "batch", &rows);
+    ASSERT_EQ(conn->getReturnCode(xh), 0) << conn->getErrorMessage();
+
+    shared_ptr<MySqlExecution> execution = conn->findExecution(xh);
+    ASSERT_EQ(execution->getBatchSize(), 3);
+    ASSERT_EQ(countOccurrences(execution->getStatementText(), "(?, ?, ?, ?)"), 3) << execution->getStatementText();
+    const rapidjson::Document & settings = execution->getSettings();
+    ASSERT_TRUE(settings.HasMember("emp_no[2]"));
+    ASSERT_EQ(settings["emp_no[2]"]["param_value"].GetInt(), 10003);
+    ASSERT_EQ(settings["salary[0]"]["param_value"].GetInt(), 50000);
+}
+
+// Called with a plain object, a statement with row text runs as one row
+TEST(BatchTest, RunsObjectAsOneRow)
+{
+    unique_ptr<MySqlConnection> conn = openLoopbackConnection();
+    rapidjson::Document rows;
+    addSalaryRows(rows, 1);
+    rapidjson::Document row;
+    row.CopyFrom(rows[0], row.GetAllocator());
+    MySqlConnection::ExecutionHandle xh = conn->executeJson("set_employee_salaries", "one row", &row);
+    ASSERT_EQ(conn->getReturnCode(xh), 0) << conn->getErrorMessage();
+    ASSERT_EQ(countOccurrences(conn->findExecution(xh)->getStatementText(), "(?, ?, ?, ?)"), 1);
+}
+
+TEST(BatchTest, RejectsBadBatches)
+{
+    unique_ptr<MySqlConnection> conn = openLoopbackConnection();
+    rapidjson::Document rows;
+    rows.SetArray();
+    conn->executeJson("set_employee_salaries", "empty batch", &rows);
+    ASSERT_NE(conn->getReturnCode(), 0) << "an empty batch was executed";
+
+    addSalaryRows(rows, 2);
+    conn->executeJson("get_employee_by_emp_no", "no row text", &rows);
+    ASSERT_NE(conn->getReturnCode(), 0) << "a statement without row_text was executed as a batch";
+    ASSERT_NE(string(conn->getErrorMessage()).find("row_text"), string::npos) << conn->getErrorMessage();
+}
+
+
+
+//                                     A U D I T  S I N K
+
+AuditSink::Record *
+makeAuditRecord(const boost::shared_ptr<AuditSink::Target> & target, bool isUrgent)
+{
+    AuditSink::Record * record = new AuditSink::Record(target, isUrgent);
+    record->row_.SetObject();
+    record->row_.AddMember("table_name", "audit_test", record->row_.GetAllocator());
+    record->row_.AddMember("event", "EXECUTE", record->row_.GetAllocator());
+    return record;
+}
+
+// Wait for a target's records, then note whether every one of them, up to
+// and including the one waited for, had been written when the wait returned
+void
+waitForWritten(AuditSink * sink, AuditSink::Target * target, uint64_t count, bool * isAllWritten)
+{
+    sink->waitForWritten(*target, count);
+    *isAllWritten = true;
+    for (uint64_t position = 1; position <= count; position++)
+        if (!target->isWritten(position)) *isAllWritten = false;
+}
+
+// With two writers, a durable record can be written before the ordinary ones
+// queued ahead of it, or after ordinary ones queued behind it; the waiter
+// must wake once, and only once, that record and those ahead of it are written
+TEST(AuditSinkTest, WakesWaiterWithTwoWriters)
+{
+    unique_ptr<MySqlConnection> conn = openLoopbackConnection();
+    boost::shared_ptr<AuditSink> sink = AuditSink::getSink("audit_test", "audit.json", conn.get(), 2, 1,
+                                                           posix_time::milliseconds(1), LOOPBACK_BACKEND);
+    ASSERT_TRUE(sink);
+    boost::shared_ptr<AuditSink::Target> target(new AuditSink::Target("insert_audit_record", ""));
+    for (int i = 0; i < 200; i++)
+    {
+        sink->push(makeAuditRecord(target, false));
+        uint64_t count = sink->push(makeAuditRecord(target, true));
+        for (int j = 0; j < 5; j++)
+            sink->push(makeAuditRecord(target, false));
+        bool isAllWritten = false;
+        boost::thread waiter(boost::bind(waitForWritten, sink.get(), target.get(), count, &isAllWritten));
+        ASSERT_TRUE(waiter.timed_join(posix_time::seconds(10))) << "a waiter missed the write of its records";
+        ASSERT_TRUE(isAllWritten) << "a waiter woke before record " << count << " and those ahead of it were written";
+    }
+    sink->flush();
+    sink->waitForWritten(*target, target->queued_);
+    ASSERT_TRUE(target->isWritten(target->queued_));
+}
+
+
+
+//                              F I X T U R E S  A N D  R E P L A Y
+
+// A scratch directory for an observer's files, removed with everything in it
+class WorkingDirectory
+{
+public:
+    WorkingDirectory()
+    :   path_(boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("framework_test_%%%%%%%%"))
+    {
+        boost::filesystem::create_directories(path_);
+    }
+    ~WorkingDirectory()
+    {
+        boost::system::error_code ec;
+        boost::filesystem::remove_all(path_, ec);
+    }
+
+    string getPath() const                      { return path_.string(); }
+    string getProgramPath(const char * extension) const
+    {
+        return (path_ / (string("fixture_test.round_trip.") + extension)).string();
+    }
+
+private:
+    boost::filesystem::path path_;
+};
+
+// Runs the round-trip program under an observer, returning each lookup's row
+// count, or -1 if it failed
+std::vector<int>
+runRoundTrip(const WorkingDirectory & directory, ObserverType observerType, int backendRows)
+{
+    rapidjson::Document backendParams;
+    backendParams.SetObject();
+    backendParams.AddMember("rows", backendRows, backendParams.GetAllocator());
+    unique_ptr<MySqlConnection> conn = openLoopbackConnection(&backendParams);
+    rapidjson::Document observerParams;
+    observerParams.SetObject();
+    const string path = directory.getPath();
+    observerParams.AddMember("working_directory", rapidjson::Value(path.c_str(), path.size(), observerParams.GetAllocator()).Move(),
+                             observerParams.GetAllocator());
+    conn->addObserver("fixture_test", observerType, &observerParams);
+
+    std::vector<int> rowCounts;
+    conn->startProgram("round_trip");
+    for (int i = 0; i < 3; i++)
+    {
+        MySqlConnection::ExecutionHandle xh = conn->execute("get_employee_by_emp_no", "round trip", "emp_no", 10001 + i);
+        rowCounts.push_back(conn->getReturnCode(xh) == 0 ? conn->getRowCount(xh) : -1);
+    }
+    conn->endProgram("round_trip");
+    return rowCounts;
+}
+
+// Captures the program from a backend that returns three rows per lookup
+void
+captureRoundTrip(const WorkingDirectory & directory)
+{
+    runRoundTrip(directory, CAPTURE_OBS, 3);
+}
+
+// Replays the program over a backend that would return one row per lookup,
+// so three rows mean the lookup was replayed
+std::vector<int>
+replayRoundTrip(const WorkingDirectory & directory)
+{
+    return runRoundTrip(directory, REPLAY_OBS, 1);
+}
+
+bool
+writeFixture(const string & capturePath, const string & fixturePath, string & errorMessage)
+{
+    CaptureReader capture;
+    FixtureWriter writer;
+    if (!capture.open(capturePath, errorMessage) || !writer.open(fixturePath, errorMessage)) return false;
+    const rapidjson::Value & executions = capture.getExecutions();
+    for (rapidjson::Value::ConstValueIterator itr = executions.Begin(); itr != executions.End(); ++itr)
+        if (!writer.write(*itr, errorMessage)) return false;
+    return writer.close(errorMessage);
+}
+
+TEST(ReplayTest, ReplaysCapture)
+{
+    WorkingDirectory directory;
+    captureRoundTrip(directory);
+    std::vector<int> rowCounts = replayRoundTrip(directory);
+    ASSERT_EQ(rowCounts.size(), 3u);
+    for (size_t i = 0; i < rowCounts.size(); i++)
+        ASSERT_EQ(rowCounts[i], 3) << "lookup " << i << " wasn't replayed from the capture";
+}
+
+// A fixture converted from the capture replays the same results without it
+TEST(ReplayTest, ReplaysFixture)
+{
+    WorkingDirectory directory;
+    captureRoundTrip(directory);
+    string errorMessage;
+    ASSERT_TRUE(writeFixture(directory.getProgramPath("json"), directory.getProgramPath("fix"), errorMessage)) << errorMessage;
+    ASSERT_EQ(remove(directory.getProgramPath("json").c_str()), 0);
+
+    std::vector<int> rowCounts = replayRoundTrip(directory);
+    for (size_t i = 0; i < rowCounts.size(); i++)
+        ASSERT_EQ(rowCounts[i], 3) << "lookup " << i << " wasn't replayed from the fixture";
+}
+
+TEST(ReplayTest, FallsBackFromBadFixture)
+{
+    WorkingDirectory directory;
+    captureRoundTrip(directory);
+    FILE * fp = fopen(directory.getProgramPath("fix").c_str(), "w");
+    ASSERT_TRUE(fp != NULL);
+    fputs("not a fixture", fp);
+    fclose(fp);
+
+    std::vector<int> rowCounts = replayRoundTrip(directory);
+    for (size_t i = 0; i < rowCounts.size(); i++)
+        ASSERT_EQ(rowCounts[i], 3) << "lookup " << i << " wasn't replayed from the capture";
+}
+
+// With nothing to replay, every execution fails instead of reaching the backend
+TEST(ReplayTest, FailsWithNothingToReplay)
+{
+    WorkingDirectory directory;
+    std::vector<int> rowCounts = replayRoundTrip(directory);
+    for (size_t i = 0; i < rowCounts.size(); i++)
+        ASSERT_EQ(rowCounts[i], -1) << "lookup " << i << " ran without a capture";
+}
+
+
+
+//                                    K E Y E D  R E P L A Y
+
+ReplayKey
+makeReplayKey(const char * statementName, const char * statementText, const char * parameters)
+{
+    rapidjson::Document parameterDoc;
+    parameterDoc.Parse(parameters);
+    return ReplayKey(statementName, ReplayKey::hashBytes(statementText, strlen(statementText)),
+                     ReplayKey::hashParameters(&parameterDoc));
+}
+
+// Executions with the same statement, text and parameters are taken in
+// capture order; a different parameter value, name or text is another key
+TEST(ReplayIndexTest, TakesRepeatedSqlInOrder)
+{
+    WorkingDirectory directory;
+    const string capturePath = directory.getProgramPath("json");
+    FILE * fp = fopen(capturePath.c_str(), "w");
+    ASSERT_TRUE(fp != NULL);
+    fputs("{ \"executions\" : [\n"
+          "  { \"statement_name\" : \"lookup\", \"statement_text\" : \"SELECT ?\", \"parameters\" : { \"id\" : 1 } },\n"
+          "  { \"statement_name\" : \"lookup\", \"statement_text\" : \"SELECT ?\", \"parameters\" : { \"id\" : 2 } },\n"
+          "  { \"statement_name\" : \"lookup\", \"statement_text\" : \"SELECT ?\", \"parameters\" : { \"id\" : 1 } },\n"
+          "  { \"statement_name\" : \"other\", \"statement_text\" : \"SELECT ?\", \"parameters\" : { \"id\" : 1 } },\n"
+          "  { \"statement_name\" : \"lookup\", \"statement_text\" : \"SELECT ?\" }\n"
+          "] }\n", fp);
+    fclose(fp);
+
+    CaptureReader capture;
+    string errorMessage;
+    ASSERT_TRUE(capture.open(capturePath, errorMessage)) << errorMessage;
+    ReplayIndex index;
+    index.build(capture);
+
+    ASSERT_EQ(index.take(makeReplayKey("lookup", "SELECT ?", "{ \"id\" : 2 }")), 1);
+    ASSERT_EQ(index.take(makeReplayKey("lookup", "SELECT ?", "{ \"id\" : 1 }")), 0);
+    ASSERT_EQ(index.take(makeReplayKey("lookup", "SELECT ?", "{ \"id\" : 1 }")), 2);
+    ASSERT_EQ(index.take(makeReplayKey("lookup", "SELECT ?", "{ \"id\" : 1 }")), -1) << "a repeat was replayed twice";
+    ASSERT_EQ(index.take(makeReplayKey("other", "SELECT ?", "{ \"id\" : 1 }")), 3);
+    ASSERT_EQ(index.take(makeReplayKey("lookup", "SELECT ?", "{}")), 4) << "empty parameters didn't match an execution captured without any";
+    ASSERT_EQ(index.take(makeReplayKey("lookup", "SELECT ? ", "{ \"id\" : 2 }")), -1);
+}
+
+// Keyed replay serves a program whose repeated lookups come in another order,
+// but not one that repeats a lookup more often than it was captured
+TEST(ReplayIndexTest, ReplaysReorderedProgram)
+{
+    WorkingDirectory directory;
+    rapidjson::Document observerParams;
+    observerParams.SetObject();
+    const string path = directory.getPath();
+    observerParams.AddMember("working_directory", rapidjson::Value(path.c_str(), path.size(), observerParams.GetAllocator()).Move(),
+                             observerParams.GetAllocator());
+    const int captured[] = { 10001, 10002, 10001 };
+    const int replayed[] = { 10002, 10001, 10001, 10001 };
+    {
+        unique_ptr<MySqlConnection> conn = openLoopbackConnection();
+        conn->addObserver("fixture_test", CAPTURE_OBS, &observerParams);
+        conn->startProgram("round_trip");
+        for (int i = 0; i < 3; i++)
+            conn->execute("get_employee_by_emp_no", "keyed", "emp_no", captured[i]);
+        conn->endProgram("round_trip");
+    }
+
+    observerParams.AddMember("match", "keyed", observerParams.GetAllocator());
+    unique_ptr<MySqlConnection> conn = openLoopbackConnection();
+    conn->addObserver("fixture_test", REPLAY_OBS, &observerParams);
+    conn->startProgram("round_trip");
+    for (int i = 0; i < 3; i++)
+    {
+        MySqlConnection::ExecutionHandle xh = conn->execute("get_employee_by_emp_no", "keyed", "emp_no", replayed[i]);
+        ASSERT_EQ(conn->getReturnCode(xh), 0) << conn->getErrorMessage();
+    }
+    MySqlConnection::ExecutionHandle xh = conn->execute("get_employee_by_emp_no", "keyed", "emp_no", replayed[3]);
+    ASSERT_NE(conn->getReturnCode(xh), 0) << "a lookup was replayed more often than it was captured";
+    conn->endProgram("round_trip");
+}
+
+
+
+//                                    R E S U L T  S T O R E
+
+// Digests are plain SHA-1, so stores written by builds against any boost agree
+TEST(ResultStoreTest, DigestsAreSha1)
+{
+    ASSERT_EQ(ResultStore::getDigest("abc", 3), "a9993e364706816aba3e25717850c26c9cd0d89d");
+    ASSERT_EQ(ResultStore::getPath("store", "a9993e364706816aba3e25717850c26c9cd0d89d"),
+              "store/a9/a9993e364706816aba3e25717850c26c9cd0d89d.json");
+}
+
+// The same result set is stored once, under one digest; another gets its own
+TEST(ResultStoreTest, StoresEachResultSetOnce)
+{
+    WorkingDirectory directory;
+    const string store = directory.getPath() + "/results";
+    rapidjson::Document results;
+    results.Parse("{ \"columns\" : { \"id\" : 3 }, \"rows\" : [ { \"id\" : 1 }, { \"id\" : 2 } ] }");
+    rapidjson::Document otherResults;
+    otherResults.Parse("{ \"columns\" : { \"id\" : 3 }, \"rows\" : [ { \"id\" : 1 } ] }");
+
+    string digest;
+    string repeatDigest;
+    string otherDigest;
+    string errorMessage;
+    ASSERT_TRUE(ResultStore::put(store, results, digest, errorMessage)) << errorMessage;
+    ASSERT_TRUE(ResultStore::put(store, results, repeatDigest, errorMessage)) << errorMessage;
+    ASSERT_TRUE(ResultStore::put(store, otherResults, otherDigest, errorMessage)) << errorMessage;
+    ASSERT_EQ(digest, repeatDigest);
+    ASSERT_NE(digest, otherDigest);
+
+    int files = 0;
+    for (boost::filesystem::recursive_directory_iterator itr(store); itr != boost::filesystem::recursive_directory_iterator(); ++itr)
+        if (boost::filesystem::is_regular_file(itr->path())) files++;
+    ASSERT_EQ(files, 2) << "a result set was stored more than once";
+
+    boost::shared_ptr<const StoredResults> stored = ResultStore::get(store, digest, errorMessage);
+    ASSERT_TRUE(stored) << errorMessage;
+    ASSERT_TRUE(stored->getResults() == results);
+    ASSERT_TRUE(ResultStore::get(store, digest, errorMessage) == stored) << "a result set was read twice";
+}
+
+
+
+//                                        S H A R D I N G
+
+// Sets (or with a NULL value, unsets) an environment variable until the end
+// of the scope
+class EnvironmentSetting
+{
+public:
+    EnvironmentSetting(const char * name, const char * value)
+    :   name_(name),
+        wasSet_(getenv(name) != NULL),
+        oldValue_(wasSet_ ? getenv(name) : "")
+    {
+        if (value != NULL)
+            setenv(name, value, 1);
+        else
+            unsetenv(name);
+    }
+    ~EnvironmentSetting()
+    {
+        if (wasSet_)
+            setenv(name_.c_str(), oldValue_.c_str(), 1);
+        else
+            unsetenv(name_.c_str());
+    }
+
+private:
+    string name_;
+    bool   wasSet_;
+    string oldValue_;
+};
+
+// Each of several shards gets its own log and benchmark report; a lone
+// shard, or an unsharded run, keeps the path it was given
+TEST(ShardingTest, ShardsWriteTheirOwnFiles)
+{
+    {
+        EnvironmentSetting totalShards("GTEST_TOTAL_SHARDS", "4");
+        EnvironmentSetting shardIndex("GTEST_SHARD_INDEX", "2");
+        ASSERT_EQ(MySqlGtest::getWorkerPath("benchmark.json"), "benchmark.json.2");
+    }
+    {
+        EnvironmentSetting totalShards("GTEST_TOTAL_SHARDS", "1");
+        EnvironmentSetting shardIndex("GTEST_SHARD_INDEX", "0");
+        ASSERT_EQ(MySqlGtest::getWorkerPath("benchmark.json"), "benchmark.json");
+    }
+    EnvironmentSetting totalShards("GTEST_TOTAL_SHARDS", NULL);
+    EnvironmentSetting shardIndex("GTEST_SHARD_INDEX", NULL);
+    ASSERT_EQ(MySqlGtest::getWorkerPath("benchmark.json"), "benchmark.json");
+}
+
+}  // namespace
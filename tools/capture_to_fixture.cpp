@@ -0,0 +1,125 @@
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+
+#include <rapidjson/document.h>
+#include <rapidjson/filereadstream.h>
+
+#include "fixture.h"
+
+namespace po = boost::program_options;
+
+using namespace std;
+
+
+//                              C A P T U R E  T O  F I X T U R E
+
+// Converts capture files (<observer name>.<program>.json) to replay
+// fixtures. Each fixture is written next to its capture file, with the
+// extension .fix, unless an output directory is given. The replay observer
+// uses a program's fixture in preference to its capture file.
+
+static long
+getFileSize(const string & path)
+{
+    FILE * fp = fopen(path.c_str(), "rb");
+    if (!fp) return -1;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+static bool
+convert(const string & capturePath, const string & fixturePath)
+{
+    FILE * fp = fopen(capturePath.c_str(), "r");
+    if (!fp)
+    {
+        cerr << "Unable to open " << capturePath << " for reading" << endl;
+        return false;
+    }
+    char readBuffer[65536];
+    rapidjson::FileReadStream is(fp, readBuffer, sizeof(readBuffer));
+    rapidjson::Document capture;
+    capture.ParseStream(is);
+    fclose(fp);
+    if (capture.HasParseError() || !capture.IsObject() || !capture.HasMember("executions") || !capture["executions"].IsArray())
+    {
+        cerr << capturePath << " is not a capture file" << endl;
+        return false;
+    }
+
+    string errorMessage;
+    FixtureWriter writer;
+    if (!writer.open(fixturePath, errorMessage))
+    {
+        cerr << errorMessage << endl;
+        return false;
+    }
+    const rapidjson::Value & executions = capture["executions"];
+    for (rapidjson::Value::ConstValueIterator itr = executions.Begin(); itr != executions.End(); ++itr)
+    {
+        if (!writer.write(*itr, errorMessage))
+        {
+            cerr << capturePath << ": " << errorMessage << endl;
+            return false;
+        }
+    }
+    if (!writer.close(errorMessage))
+    {
+        cerr << errorMessage << endl;
+        return false;
+    }
+
+    cout << capturePath << "\t" << getFileSize(capturePath) << "\t"
+         << fixturePath << "\t" << getFileSize(fixturePath) << "\t"
+         << writer.getExecutionCount() << endl;
+    return true;
+}
+
+int
+main(int argc, char ** argv)
+{
+    vector<string> capturePaths;
+    string outputDirectory;
+
+    po::options_description desc("Capture to fixture options");
+    desc.add_options()
+        ("help", "Show options")
+        ("capture", po::value<vector<string> >(&capturePaths), "Capture file to convert (may be repeated, or given as arguments)")
+        ("output_dir", po::value<string>(&outputDirectory)->default_value(""), "Directory for the fixtures (default: next to each capture file)")
+    ;
+    po::positional_options_description positional;
+    positional.add("capture", -1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
+    po::notify(vm);
+    if (vm.count("help") || capturePaths.empty())
+    {
+        cout << desc << endl;
+        return capturePaths.empty() && !vm.count("help") ? 1 : 0;
+    }
+
+    int failures = 0;
+    cout << "capture\tbytes\tfixture\tbytes\texecutions" << endl;
+    for (vector<string>::const_iterator itr = capturePaths.begin(); itr != capturePaths.end(); ++itr)
+    {
+        string fixturePath = *itr;
+        if (boost::algorithm::ends_with(fixturePath, ".json"))
+            fixturePath.erase(fixturePath.size() - 5);
+        fixturePath += ".fix";
+        if (!outputDirectory.empty())
+        {
+            size_t slash = fixturePath.rfind('/');
+            fixturePath = outputDirectory + "/" + (slash == string::npos ? fixturePath : fixturePath.substr(slash + 1));
+        }
+        if (!convert(*itr, fixturePath)) failures++;
+    }
+    return failures == 0 ? 0 : 1;
+}
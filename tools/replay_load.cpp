@@ -0,0 +1,491 @@
+#include <algorithm>
+#include <cstdio>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <vector>
+
+#include <boost/program_options.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <rapidjson/document.h>
+
+#include "connection.h"
+#include "audit_codec.h"
+#include "fixture.h"
+#include "histogram.h"
+#include "phase_clock.h"
+
+namespace po = boost::program_options;
+
+using namespace std;
+
+
+//                              W O R K L O A D  R E P L A Y
+
+// Replays a workload recorded in capture files, or in an audit table,
+// against a live database: each recorded execution is executed again, by
+// statement name, with the parameters it had. Executions are dispatched on
+// a schedule, either with their original inter-arrival times (divided by a
+// speed-up factor), or open-loop at a fixed arrival rate, or as fast as the
+// workers can take them. A number of worker threads execute them, sharing a
+// pool of connections. For each statement, reports executions, errors and
+// percentiles of response time (from the scheduled arrival, so queueing
+// behind a slow server counts) and of service time (the execution itself).
+//
+// Statements are executed as they were recorded, including writes: point
+// the tool at a database you can afford to change.
+
+struct ReplayOptions
+{
+    string          database;
+    string          sqlPath;
+    string          user;
+    string          password;
+    string          host;
+    int             port;
+    vector<string>  capturePaths;
+    string          auditTable;
+    string          auditFilter;
+    string          auditSqlPath;
+    int             concurrency;
+    int             poolSize;
+    string          timing;
+    double          speedup;
+    double          arrivalRate;
+};
+
+struct WorkloadItem
+{
+    WorkloadItem() : startUs_(-1), offsetUs_(0) {}
+
+    string                              statementName_;
+    boost::shared_ptr<rapidjson::Document> args_;
+    int64_t                             startUs_;   // when it was recorded (microseconds since the epoch), -1 if unknown
+    int64_t                             offsetUs_;  // when to dispatch it, from the start of the replay
+};
+
+struct StatementStats
+{
+    StatementStats() : errors_(0) {}
+
+    void                  merge(const StatementStats & other)
+    {
+        response_.merge(other.response_);
+        service_.merge(other.service_);
+        errors_ += other.errors_;
+    }
+
+    LatencyHistogram      response_;
+    LatencyHistogram      service_;
+    uint64_t              errors_;
+};
+
+typedef map<string, StatementStats> StatsMap;
+
+static const posix_time::ptime epoch(gregorian::date(1970, 1, 1));
+
+// Turn the parameter settings of an execution (as captured or audited) back
+// into the arguments of executeJson: an object of parameter values, or, for
+// a batch (whose marker settings are named "<parameter>[<row>]"), an array of
+// rows, with the substitution parameters in the first row
+static void
+settingsToArgs(const rapidjson::Value & settings, rapidjson::Document & args)
+{
+    rapidjson::Document::AllocatorType & allocator = args.GetAllocator();
+    rapidjson::Value substitutions(rapidjson::kObjectType);
+    args.SetObject();
+    if (!settings.IsObject()) return;
+
+    bool isBatch = false;
+    for (rapidjson::Value::ConstMemberIterator itr = settings.MemberBegin(); itr != settings.MemberEnd(); ++itr)
+    {
+        string name(itr->name.GetString(), itr->name.GetStringLength());
+        if (!name.empty() && name[name.size() - 1] == ']' && name.find('[') != string::npos)
+            isBatch = true;
+    }
+    if (isBatch) args.SetArray();
+
+    for (rapidjson::Value::ConstMemberIterator itr = settings.MemberBegin(); itr != settings.MemberEnd(); ++itr)
+    {
+        if (!itr->value.IsObject() || !itr->value.HasMember("param_value")) continue;
+        rapidjson::Value value(itr->value["param_value"], allocator);
+        string name(itr->name.GetString(), itr->name.GetStringLength());
+        size_t bracket = name.find('[');
+        if (!isBatch || bracket == string::npos || name[name.size() - 1] != ']')
+        {
+            rapidjson::Value & target = isBatch ? substitutions : static_cast<rapidjson::Value &>(args);
+            target.AddMember(rapidjson::Value(name.c_str(), name.size(), allocator).Move(), value, allocator);
+            continue;
+        }
+        size_t row = atoi(name.substr(bracket + 1).c_str());
+        while (args.Size() <= row)
+            args.PushBack(rapidjson::Value(rapidjson::kObjectType).Move(), allocator);
+        args[static_cast<rapidjson::SizeType>(row)].AddMember(rapidjson::Value(name.c_str(), bracket, allocator).Move(), value, allocator);
+    }
+
+    if (isBatch && args.Size() > 0)
+    {
+        for (rapidjson::Value::MemberIterator itr = substitutions.MemberBegin(); itr != substitutions.MemberEnd(); ++itr)
+            args[0].AddMember(itr->name, itr->value, allocator);
+    }
+}
+
+static int64_t
+parseStartTime(const char * startTime)
+{
+    string timeString(startTime);
+    replace(timeString.begin(), timeString.end(), 'T', ' ');
+    try
+    {
+        posix_time::ptime time = posix_time::time_from_string(timeString);
+        if (time.is_not_a_date_time()) return -1;
+        return (time - epoch).total_microseconds();
+    }
+    catch (std::exception &)
+    {
+        return -1;
+    }
+}
+
+static bool
+loadCapture(const string & capturePath, vector<WorkloadItem> & workload)
+{
+    string errorMessage;
+    CaptureReader capture;
+    if (!capture.open(capturePath, errorMessage))
+    {
+        cerr << errorMessage << endl;
+        return false;
+    }
+    const rapidjson::Value & executions = capture.getExecutions();
+    for (rapidjson::Value::ConstValueIterator itr = executions.Begin(); itr != executions.End(); ++itr)
+    {
+        if (!itr->HasMember("statement_name") || !(*itr)["statement_name"].IsString()) continue;
+        WorkloadItem item;
+        item.statementName_ = (*itr)["statement_name"].GetString();
+        item.args_ = boost::make_shared<rapidjson::Document>();
+        if (itr->HasMember("parameters"))
+            settingsToArgs((*itr)["parameters"], *item.args_);
+        else
+            item.args_->SetObject();
+        if (itr->HasMember("start_time") && (*itr)["start_time"].IsString())
+            item.startUs_ = parseStartTime((*itr)["start_time"].GetString());
+        workload.push_back(item);
+    }
+    return true;
+}
+
+static bool
+loadAudit(const ReplayOptions & options, vector<WorkloadItem> & workload)
+{
+    unique_ptr<MySqlConnection> conn = MySqlConnection::createConnection("replay_audit",
+                                                                         options.database.c_str(),
+                                                                         options.auditSqlPath.c_str(),
+                                                                         options.user.c_str(),
+                                                                         options.password.c_str(),
+                                                                         options.host.c_str(),
+                                                                         options.port);
+    MySqlConnection::ExecutionHandle xh = conn->execute("audit_workload", "workload replay",
+                                                        "table_name", options.auditTable.c_str(),
+                                                        "filter", options.auditFilter.c_str());
+    if (conn->getReturnCode(xh) != 0)
+    {
+        cerr << "Unable to read " << options.auditTable << ": " << conn->getErrorMessage() << endl;
+        return false;
+    }
+
+    const rapidjson::Value & rows = (*conn->getResults(xh))["rows"];
+    for (rapidjson::Value::ConstValueIterator row = rows.Begin(); row != rows.End(); ++row)
+    {
+        WorkloadItem item;
+        item.statementName_ = (*row)["statement_name"].GetString();
+        item.args_ = boost::make_shared<rapidjson::Document>();
+        item.args_->SetObject();
+        const rapidjson::Value & parameters = (*row)["parameters"];
+        if (parameters.IsString())
+        {
+            string decoded;
+            rapidjson::Document settings;
+            if (   AuditCodec::decode(parameters.GetString(), parameters.GetStringLength(), decoded)
+                && !settings.Parse(decoded.c_str()).HasParseError())
+                settingsToArgs(settings, *item.args_);
+        }
+        if ((*row)["start_us"].IsInt64())
+            item.startUs_ = (*row)["start_us"].GetInt64();
+        workload.push_back(item);
+    }
+    return true;
+}
+
+static bool
+isEarlier(const WorkloadItem & a, const WorkloadItem & b)
+{
+    return a.startUs_ < b.startUs_;
+}
+
+// Sort the executions of several captures into the order they were
+// recorded, and schedule them
+static void
+scheduleWorkload(const ReplayOptions & options, vector<WorkloadItem> & workload)
+{
+    stable_sort(workload.begin(), workload.end(), isEarlier);
+    int64_t firstUs = -1;
+    int64_t offsetUs = 0;
+    for (size_t i = 0; i < workload.size(); i++)
+    {
+        WorkloadItem & item = workload[i];
+        if (options.timing == "rate")
+            offsetUs = static_cast<int64_t>(i * 1000000.0 / options.arrivalRate);
+        else if (options.timing == "original" && item.startUs_ >= 0)
+        {
+            if (firstUs < 0) firstUs = item.startUs_;
+            offsetUs = static_cast<int64_t>((item.startUs_ - firstUs) / options.speedup);
+        }
+        item.offsetUs_ = offsetUs;
+    }
+}
+
+
+//                              C O N N E C T I O N  P O O L
+
+// The connections the workers share. A worker takes one for each execution,
+// waiting if there is none free.
+class ConnectionPool
+{
+public:
+    ConnectionPool(const ReplayOptions & options)
+    {
+        for (int i = 0; i < options.poolSize; i++)
+        {
+            stringstream name;
+            name << "replay_" << i;
+            unique_ptr<MySqlConnection> conn = MySqlConnection::createConnection(name.str().c_str(),
+                                                                                 options.database.c_str(),
+                                                                                 options.sqlPath.c_str(),
+                                                                                 options.user.c_str(),
+                                                                                 options.password.c_str(),
+                                                                                 options.host.c_str(),
+                                                                                 options.port);
+            conn->setExecutionRetention(16);
+            connections_.push_back(boost::shared_ptr<MySqlConnection>(conn.release()));
+            free_.push_back(connections_.back().get());
+        }
+    }
+
+    MySqlConnection *     acquire()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex_);
+        while (free_.empty())
+            released_.wait(lock);
+        MySqlConnection * conn = free_.back();
+        free_.pop_back();
+        return conn;
+    }
+
+    void                  release(MySqlConnection * conn)
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(mutex_);
+            free_.push_back(conn);
+        }
+        released_.notify_one();
+    }
+
+private:
+    vector<boost::shared_ptr<MySqlConnection> > connections_;
+    vector<MySqlConnection *> free_;
+    boost::mutex              mutex_;
+    boost::condition_variable released_;
+};
+
+
+//                              W O R K L O A D  R U N N E R
+
+class WorkloadRunner
+{
+public:
+    WorkloadRunner(const vector<WorkloadItem> & workload, ConnectionPool & pool)
+    :   workload_(workload),
+        pool_(pool),
+        isDispatched_(false)
+    {
+    }
+
+    // Dispatch the workload on its schedule, on this thread, to the workers.
+    // Unless 'isScheduled', everything is queued at once.
+    void                  run(int concurrency, bool isScheduled)
+    {
+        boost::thread_group workers;
+        vector<StatsMap> workerStats(concurrency);
+        for (int i = 0; i < concurrency; i++)
+            workers.create_thread(boost::bind(&WorkloadRunner::work, this, &workerStats[i]));
+
+        startTick_ = PhaseClock::now();
+        for (size_t i = 0; i < workload_.size(); i++)
+        {
+            PhaseClock::Tick scheduledTick;
+            if (isScheduled)
+            {
+                scheduledTick = startTick_ + boost::chrono::microseconds(workload_[i].offsetUs_);
+                boost::this_thread::sleep_until(scheduledTick);
+            }
+            {
+                boost::lock_guard<boost::mutex> lock(mutex_);
+                queue_.push_back(make_pair(i, scheduledTick));
+            }
+            queued_.notify_one();
+        }
+        {
+            boost::lock_guard<boost::mutex> lock(mutex_);
+            isDispatched_ = true;
+        }
+        queued_.notify_all();
+        workers.join_all();
+        endTick_ = PhaseClock::now();
+
+        for (vector<StatsMap>::const_iterator itr = workerStats.begin(); itr != workerStats.end(); ++itr)
+            for (StatsMap::const_iterator stats = itr->begin(); stats != itr->end(); ++stats)
+            {
+                stats_[stats->first].merge(stats->second);
+                total_.merge(stats->second);
+            }
+    }
+
+    void                  report() const
+    {
+        double seconds = PhaseClock::getMicroseconds(startTick_, endTick_) / 1000000.0;
+        cout << "statement\texecutions\terrors\tresp p50 us\tresp p90 us\tresp p99 us\tresp max us\tsvc p50 us\tsvc p99 us" << endl;
+        for (StatsMap::const_iterator itr = stats_.begin(); itr != stats_.end(); ++itr)
+            reportStatement(itr->first, itr->second);
+        reportStatement("all", total_);
+        cout << "elapsed secs\t" << fixed << setprecision(3) << seconds
+             << "\texec/sec\t" << setprecision(1) << (seconds > 0 ? total_.response_.getCount() / seconds : 0.0) << endl;
+    }
+
+private:
+    void                  work(StatsMap * stats)
+    {
+        while (true)
+        {
+            pair<size_t, PhaseClock::Tick> request;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex_);
+                while (queue_.empty() && !isDispatched_)
+                    queued_.wait(lock);
+                if (queue_.empty()) return;
+                request = queue_.front();
+                queue_.pop_front();
+            }
+
+            const WorkloadItem & item = workload_[request.first];
+            MySqlConnection * conn = pool_.acquire();
+            PhaseClock::Tick startTick = PhaseClock::now();
+            MySqlConnection::ExecutionHandle xh = conn->executeJson(item.statementName_.c_str(), "workload replay", item.args_.get());
+            int rc = conn->getReturnCode(xh);
+            PhaseClock::Tick endTick = PhaseClock::now();
+            pool_.release(conn);
+
+            StatementStats & statementStats = (*stats)[item.statementName_];
+            PhaseClock::Tick arrivalTick = PhaseClock::isSet(request.second) ? request.second : startTick;
+            statementStats.response_.record(PhaseClock::getMicroseconds(arrivalTick, endTick));
+            statementStats.service_.record(PhaseClock::getMicroseconds(startTick, endTick));
+            if (rc != 0) statementStats.errors_++;
+        }
+    }
+
+    static void           reportStatement(const string & name, const StatementStats & stats)
+    {
+        cout << name << "\t" << stats.response_.getCount() << "\t" << stats.errors_
+             << "\t" << stats.response_.getValueAtPercentile(50.0)
+             << "\t" << stats.response_.getValueAtPercentile(90.0)
+             << "\t" << stats.response_.getValueAtPercentile(99.0)
+             << "\t" << stats.response_.getMax()
+             << "\t" << stats.service_.getValueAtPercentile(50.0)
+             << "\t" << stats.service_.getValueAtPercentile(99.0) << endl;
+    }
+
+private:
+    const vector<WorkloadItem> & workload_;
+    ConnectionPool &          pool_;
+    boost::mutex              mutex_;           // for the queue
+    boost::condition_variable queued_;
+    deque<pair<size_t, PhaseClock::Tick> > queue_;  // workload index, and when it was due
+    bool                      isDispatched_;
+    PhaseClock::Tick          startTick_;
+    PhaseClock::Tick          endTick_;
+    StatsMap                  stats_;
+    StatementStats            total_;
+};
+
+int
+main(int argc, char ** argv)
+{
+    ReplayOptions options;
+
+    po::options_description desc("Workload replay options");
+    desc.add_options()
+        ("help", "Show options")
+        ("database", po::value<string>(&options.database)->default_value("employees"), "Database to replay against")
+        ("sql", po::value<string>(&options.sqlPath)->default_value("employees.json"), "SQL dictionary of the recorded statements")
+        ("user", po::value<string>(&options.user)->default_value(""), "MySQL user")
+        ("password", po::value<string>(&options.password)->default_value(""), "MySQL password")
+        ("host", po::value<string>(&options.host)->default_value("localhost"), "MySQL host")
+        ("port", po::value<int>(&options.port)->default_value(3306), "MySQL port")
+        ("capture", po::value<vector<string> >(&options.capturePaths), "Capture file to replay (may be repeated, or given as arguments)")
+        ("audit_table", po::value<string>(&options.auditTable)->default_value(""), "Audit table to replay, instead of capture files")
+        ("audit_filter", po::value<string>(&options.auditFilter)->default_value("TRUE"), "Condition on the audit records to replay, e.g. a range of start_time")
+        ("audit_sql", po::value<string>(&options.auditSqlPath)->default_value("audit.json"), "SQL dictionary of the audit statements")
+        ("concurrency", po::value<int>(&options.concurrency)->default_value(4), "Worker threads")
+        ("pool_size", po::value<int>(&options.poolSize)->default_value(0), "Connections the workers share (default: one per worker)")
+        ("timing", po::value<string>(&options.timing)->default_value("original"), "Dispatch schedule: original, rate or none")
+        ("speedup", po::value<double>(&options.speedup)->default_value(1.0), "Divides the original inter-arrival times (original timing)")
+        ("arrival_rate", po::value<double>(&options.arrivalRate)->default_value(100.0), "Executions per second (rate timing)")
+    ;
+    po::positional_options_description positional;
+    positional.add("capture", -1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
+    po::notify(vm);
+    if (vm.count("help"))
+    {
+        cout << desc << endl;
+        return 0;
+    }
+    if (options.capturePaths.empty() == options.auditTable.empty())
+    {
+        cerr << "Give either capture files or an audit table" << endl;
+        return 1;
+    }
+    if (   (options.timing != "original" && options.timing != "rate" && options.timing != "none")
+        || options.speedup <= 0 || options.arrivalRate <= 0 || options.concurrency <= 0)
+    {
+        cerr << "Invalid timing, speedup, arrival rate or concurrency" << endl;
+        return 1;
+    }
+    if (options.poolSize <= 0)
+        options.poolSize = options.concurrency;
+
+    vector<WorkloadItem> workload;
+    for (vector<string>::const_iterator itr = options.capturePaths.begin(); itr != options.capturePaths.end(); ++itr)
+        if (!loadCapture(*itr, workload)) return 1;
+    if (!options.auditTable.empty() && !loadAudit(options, workload))
+        return 1;
+    scheduleWorkload(options, workload);
+
+    ConnectionPool pool(options);
+    WorkloadRunner runner(workload, pool);
+    runner.run(options.concurrency, options.timing != "none");
+    runner.report();
+    return 0;
+}